@@ -151,6 +151,102 @@ struct ptm_getstate {
 /* state_flags above : */
 #define PTM_STATE_FLAG_DECRYPTED     1 /* on input:  get decrypted state */
 #define PTM_STATE_FLAG_ENCRYPTED     2 /* on output: state is encrypted */
+#define PTM_STATE_FLAG_UNCHANGED     4 /* on output: state is unchanged since
+                                          the requested generation */
+#define PTM_STATE_FLAG_STAGE         8 /* on input:  only check the state and
+                                          keep it for a later commit */
+#define PTM_STATE_FLAG_COMMIT_STAGED 16 /* on input: set the state kept by an
+                                           earlier PTM_STATE_FLAG_STAGE */
+
+/*
+ * CMD_GET_STATEBLOB_PRECOPY: Get the permanent state blob ahead of a
+ * migration while the TPM keeps running. The response carries the
+ * generation of the permanent state, which changes whenever the TPM stores
+ * its permanent state. If the generation in the request is not 0 and still
+ * the current one, then no blob is transferred and PTM_STATE_FLAG_UNCHANGED
+ * is set in the response. All fields are in big endian byte order.
+ */
+struct ptm_getstate_precopy {
+    union {
+        struct {
+            uint32_t state_flags; /* may be: PTM_STATE_FLAG_DECRYPTED */
+            uint32_t reserved;    /* must be 0 */
+            uint64_t generation;  /* generation the client holds or 0 */
+        } req; /* request */
+        struct {
+            ptm_res tpm_result;
+            uint32_t state_flags; /* may be: PTM_STATE_FLAG_ENCRYPTED,
+                                             PTM_STATE_FLAG_UNCHANGED */
+            uint64_t generation;  /* current generation */
+            uint32_t totlength;   /* total length that will be transferred */
+            uint32_t length;      /* number of bytes in following buffer */
+            uint8_t  data[PTM_STATE_BLOB_SIZE];
+        } resp; /* response */
+    } u;
+};
+
+/*
+ * CMD_GET_STATE_BUNDLE: Get all state blobs of the TPM at one point in time
+ * as a single bundle. If a file descriptor is passed with SCM_RIGHTS, the
+ * bundle is written to it and no data follow the response; otherwise the
+ * bundle follows the response. All fields are in big endian byte order.
+ */
+struct ptm_getstate_bundle {
+    union {
+        struct {
+            uint32_t state_flags; /* may be: PTM_STATE_FLAG_DECRYPTED */
+            uint32_t reserved;    /* must be 0 */
+        } req; /* request */
+        struct {
+            ptm_res tpm_result;
+            uint32_t totlength;   /* total length of the bundle */
+            uint32_t length;      /* number of bytes in following buffer;
+                                     0 if written to the file descriptor */
+            uint8_t  data[PTM_STATE_BLOB_SIZE];
+        } resp; /* response */
+    } u;
+};
+
+/*
+ * CMD_SET_STATE_BUNDLE: Set the state blobs of a bundle that was created
+ * with CMD_GET_STATE_BUNDLE. All blobs are decrypted and checked before the
+ * first one is set so that either all or none of them are set. The bundle
+ * is read from a file descriptor passed with SCM_RIGHTS or otherwise
+ * follows the request. All fields are in big endian byte order.
+ */
+struct ptm_setstate_bundle {
+    union {
+        struct {
+            uint32_t state_flags; /* must be 0 */
+            uint32_t length;      /* length of the bundle */
+            uint8_t data[PTM_STATE_BLOB_SIZE];
+        } req; /* request */
+        struct {
+            ptm_res tpm_result;
+        } resp; /* response */
+    } u;
+};
+
+/*
+ * A state bundle starts with struct ptm_state_bundle_hdr followed by
+ * 'count' entries. Each entry is a struct ptm_state_bundle_entry followed
+ * by the state blob. A state that does not exist, such as the savestate of
+ * a TPM 2, has no entry.
+ */
+#define PTM_STATE_BUNDLE_MAGIC    0x74706d62 /* 'tpmb' */
+#define PTM_STATE_BUNDLE_VERSION  1
+
+struct ptm_state_bundle_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;       /* number of entries */
+};
+
+struct ptm_state_bundle_entry {
+    uint32_t type;        /* PTM_BLOB_TYPE_* */
+    uint32_t state_flags; /* may be: PTM_STATE_FLAG_ENCRYPTED */
+    uint32_t length;      /* length of the following state blob */
+};
 
 /*
  * The following is the data structure to set state blobs in the TPM.
@@ -250,6 +346,9 @@ struct ptm_getinfo {
 #define SWTPM_INFO_ACTIVE_PROFILE     ((uint64_t)1 << 5)
 #define SWTPM_INFO_AVAILABLE_PROFILES ((uint64_t)1 << 6)
 #define SWTPM_INFO_RUNTIME_ATTRIBUTES ((uint64_t)1 << 7)
+/* swtpm's per-ordinal command statistics; cannot be combined with the above */
+#define SWTPM_INFO_CMD_STATS          ((uint64_t)1 << 32)
+#define SWTPM_INFO_CMD_STATS_RESET    ((uint64_t)1 << 33)
 
 /*
  * PTM_LOCK_STORAGE: Lock the storage and retry n times
@@ -265,6 +364,44 @@ struct ptm_lockstorage {
     } u;
 };
 
+/*
+ * CMD_SET_DATAFD_SHM: Establish a TPM command channel over shared memory.
+ *
+ * Three file descriptors are passed with SCM_RIGHTS in this order: the
+ * shared memory (e.g., a memfd), the request doorbell eventfd that the
+ * client writes to after it queued a request, and the response doorbell
+ * eventfd that the TPM writes to after it queued a response. The shared
+ * memory starts with struct ptm_shmring_hdr, which the client must
+ * initialize before sending the command. All fields are in host byte order.
+ *
+ * Each ring holds a stream of messages consisting of a 32 bit length
+ * followed by that many bytes of a TPM request or response; messages
+ * wrap around at the end of a ring. head and tail are free running
+ * byte counters; a message becomes visible to the peer once head has
+ * been advanced past it.
+ */
+#define PTM_SHMRING_MAGIC    0x72696e67 /* 'ring' */
+#define PTM_SHMRING_VERSION  1
+
+struct ptm_shmring_idx {
+    uint32_t idx;
+    uint8_t _pad[60]; /* keep indices on separate cache lines */
+};
+
+struct ptm_shmring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t req_offset;  /* offset of the request ring */
+    uint32_t req_size;    /* size of the request ring; power of 2 */
+    uint32_t resp_offset; /* offset of the response ring */
+    uint32_t resp_size;   /* size of the response ring; power of 2 */
+    uint8_t _pad[40];
+    struct ptm_shmring_idx req_head;  /* written by client */
+    struct ptm_shmring_idx req_tail;  /* written by TPM */
+    struct ptm_shmring_idx resp_head; /* written by TPM */
+    struct ptm_shmring_idx resp_tail; /* written by client */
+};
+
 typedef uint64_t ptm_cap; /* CUSE-only; use ptm_cap_n otherwise */
 typedef struct ptm_cap_n ptm_cap_n;
 typedef struct ptm_est ptm_est;
@@ -273,7 +410,10 @@ typedef struct ptm_loc ptm_loc;
 typedef struct ptm_hdata ptm_hdata;
 typedef struct ptm_init ptm_init;
 typedef struct ptm_getstate ptm_getstate;
+typedef struct ptm_getstate_precopy ptm_getstate_precopy;
 typedef struct ptm_setstate ptm_setstate;
+typedef struct ptm_getstate_bundle ptm_getstate_bundle;
+typedef struct ptm_setstate_bundle ptm_setstate_bundle;
 typedef struct ptm_getconfig ptm_getconfig;
 typedef struct ptm_setbuffersize ptm_setbuffersize;
 typedef struct ptm_getinfo ptm_getinfo;
@@ -297,6 +437,10 @@ typedef struct ptm_lockstorage ptm_lockstorage;
 #define PTM_CAP_GET_INFO           (1 << 14)
 #define PTM_CAP_SEND_COMMAND_HEADER (1 << 15)
 #define PTM_CAP_LOCK_STORAGE       (1 << 16)
+#define PTM_CAP_SET_DATAFD_SHM     (1 << 17)
+#define PTM_CAP_GET_STATEBLOB_PRECOPY (1 << 18)
+#define PTM_CAP_STATE_BUNDLE       (1 << 19)
+#define PTM_CAP_LIVE_UPGRADE       (1 << 20)
 
 #if !defined(_WIN32)
 enum {
@@ -319,6 +463,11 @@ enum {
     PTM_SET_BUFFERSIZE     = _IOWR('P', 16, ptm_setbuffersize),
     PTM_GET_INFO           = _IOWR('P', 17, ptm_getinfo),
     PTM_LOCK_STORAGE       = _IOWR('P', 18, ptm_lockstorage),
+    PTM_SET_DATAFD_SHM     = _IOR('P', 19, ptm_res),
+    PTM_GET_STATEBLOB_PRECOPY = _IOWR('P', 20, ptm_getstate_precopy),
+    PTM_GET_STATE_BUNDLE   = _IOWR('P', 21, ptm_getstate_bundle),
+    PTM_SET_STATE_BUNDLE   = _IOWR('P', 22, ptm_setstate_bundle),
+    PTM_LIVE_UPGRADE       = _IOR('P', 23, ptm_res),
 };
 #endif
 
@@ -352,6 +501,11 @@ enum {
     CMD_SET_BUFFERSIZE,       /* 0x11 */
     CMD_GET_INFO,             /* 0x12 */
     CMD_LOCK_STORAGE,         /* 0x13 */
+    CMD_SET_DATAFD_SHM,       /* 0x14 */
+    CMD_GET_STATEBLOB_PRECOPY, /* 0x15 */
+    CMD_GET_STATE_BUNDLE,     /* 0x16 */
+    CMD_SET_STATE_BUNDLE,     /* 0x17 */
+    CMD_LIVE_UPGRADE,         /* 0x18 */
 };
 
 #endif /* _TPM_IOCTL_H_ */
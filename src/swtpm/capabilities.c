@@ -245,7 +245,20 @@ int capabilities_print_json(bool cusetpm, TPMLIB_TPMVersion tpmversion)
     const char *with_tpm2 = "";
     char *keysizecaps = NULL;
     const char *nvram_backend_dir = "\"nvram-backend-dir\", ";
-    const char *nvram_backend_file = "\"nvram-backend-file\"";
+    const char *nvram_backend_file = "\"nvram-backend-file\", ";
+    const char *nvram_backend_nbd = "\"nvram-backend-nbd\"";
+#if defined(WITH_SQLITE)
+    const char *nvram_backend_sqlite = ", \"nvram-backend-sqlite\"";
+#else
+    const char *nvram_backend_sqlite = "";
+#endif
+#if defined(WITH_ZSTD)
+    const char *tpmstate_opt_compress = ", \"tpmstate-opt-compress\"";
+    const char *migration_opt_compress = ", \"migration-opt-compress\"";
+#else
+    const char *tpmstate_opt_compress = "";
+    const char *migration_opt_compress = "";
+#endif
     g_autofree gchar *profiles = NULL;
     bool is_tpm2 = tpmversion == TPMLIB_TPM_VERSION_2;
 
@@ -271,7 +284,7 @@ int capabilities_print_json(bool cusetpm, TPMLIB_TPMVersion tpmversion)
          "{ "
          "\"type\": \"swtpm\", "
          "\"features\": [ "
-             "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s"
+             "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s"
           " ], "
          "\"profiles\": { %s}, "
          "\"version\": \"" VERSION "\" "
@@ -290,6 +303,8 @@ int capabilities_print_json(bool cusetpm, TPMLIB_TPMVersion tpmversion)
          true         ? "\"cmdarg-migration\", "       : "",
          nvram_backend_dir,
          nvram_backend_file,
+         nvram_backend_nbd,
+         nvram_backend_sqlite,
          keysizecaps  ? keysizecaps                    : "",
          is_tpm2      ? ", \"cmdarg-profile\""         : "",
          is_tpm2      ? ", \"cmdarg-print-profiles\""  : "",
@@ -300,6 +315,16 @@ int capabilities_print_json(bool cusetpm, TPMLIB_TPMVersion tpmversion)
          true         ? ", \"tpmstate-dir-backend-opt-fsync\""     : "",
          true         ? ", \"cmdarg-pcap\""            : "",
          true         ? ", \"systemd-notify\""         : "",
+         !cusetpm     ? ", \"cmdarg-metrics\""         : "",
+         true         ? ", \"tpmstate-opt-write-behind\"" : "",
+         true         ? ", \"tpmstate-file-backend-opt-page-flush\"" : "",
+         true         ? ", \"tpmstate-file-backend-opt-max-states\"" : "",
+         true         ? ", \"tpmstate-file-backend-opt-fsync\"" : "",
+         true         ? ", \"tpmstate-dir-backend-opt-batch-fsync\"" : "",
+         true         ? ", \"tpmstate-file-backend-opt-direct-io\"" : "",
+         tpmstate_opt_compress,
+         migration_opt_compress,
+         true         ? ", \"cmdarg-key-mode-aes-256-gcm\"" : "",
          profiles     ? profiles                       : ""
     );
 
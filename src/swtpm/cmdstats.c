@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * cmdstats.c -- per-ordinal TPM command statistics
+ *
+ * The statistics are updated with atomic operations so that they can be
+ * recorded from the TPM worker thread and read from the main loop without
+ * taking a lock.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "cmdstats.h"
+#include "swtpm_utils.h"
+
+/* TPM 1.2 and TPM 2 each have less than 256 commands */
+#define CMDSTATS_MAX_ORDINALS  512
+
+/* an entry is not used while its ordinal is 0 */
+static struct cmdstats_values cmdstats[CMDSTATS_MAX_ORDINALS];
+/* number of commands not recorded since the table was full */
+static uint64_t cmdstats_dropped;
+/* the JSON returned for the first chunk; later chunks are served from it */
+static char *cmdstats_snapshot;
+
+static struct cmdstats_values *cmdstats_find(uint32_t ordinal)
+{
+    uint32_t idx = (ordinal * 2654435761U) % CMDSTATS_MAX_ORDINALS;
+    uint32_t expected;
+    size_t i;
+
+    for (i = 0; i < CMDSTATS_MAX_ORDINALS; i++) {
+        expected = __atomic_load_n(&cmdstats[idx].ordinal, __ATOMIC_ACQUIRE);
+        if (expected == ordinal)
+            return &cmdstats[idx];
+        if (expected == 0 &&
+            (__atomic_compare_exchange_n(&cmdstats[idx].ordinal, &expected,
+                                         ordinal, false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE) ||
+             expected == ordinal))
+            return &cmdstats[idx];
+        idx = (idx + 1) % CMDSTATS_MAX_ORDINALS;
+    }
+    return NULL;
+}
+
+/*
+ * cmdstats_bucket: Get the histogram bucket for the given duration
+ */
+size_t cmdstats_bucket(uint64_t duration_ns)
+{
+    uint64_t us = (duration_ns + 999) / 1000;
+    size_t bucket;
+
+    if (us <= 1)
+        return 0;
+    bucket = 64 - __builtin_clzll(us - 1);
+
+    return min(bucket, CMDSTATS_NUM_BUCKETS - 1);
+}
+
+/*
+ * cmdstats_start: Get the time at which processing of a command starts
+ */
+void cmdstats_start(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*
+ * cmdstats_elapsed_ns: Get the nanoseconds elapsed since cmdstats_start()
+ */
+uint64_t cmdstats_elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+           now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * cmdstats_record: Record the processing of a TPM command
+ *
+ * @ordinal: the ordinal of the command
+ * @req_len: the size of the command
+ * @resp_len: the size of the response
+ * @start: the time returned by cmdstats_start() before processing started
+ */
+void cmdstats_record(uint32_t ordinal, uint32_t req_len, uint32_t resp_len,
+                     const struct timespec *start)
+{
+    struct cmdstats_values *ce;
+    uint64_t duration_ns, max_ns;
+
+    if (ordinal == 0)
+        return;
+
+    ce = cmdstats_find(ordinal);
+    if (!ce) {
+        __atomic_fetch_add(&cmdstats_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    duration_ns = cmdstats_elapsed_ns(start);
+
+    __atomic_fetch_add(&ce->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ce->total_ns, duration_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ce->req_bytes, req_len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ce->resp_bytes, resp_len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ce->buckets[cmdstats_bucket(duration_ns)], 1,
+                       __ATOMIC_RELAXED);
+
+    max_ns = __atomic_load_n(&ce->max_ns, __ATOMIC_RELAXED);
+    while (duration_ns > max_ns &&
+           !__atomic_compare_exchange_n(&ce->max_ns, &max_ns, duration_ns,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+static uint64_t cmdstats_get(uint64_t *counter, bool reset)
+{
+    if (reset)
+        return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * cmdstats_get_json: Get the statistics in JSON format
+ *
+ * @new_snapshot: whether to create a new snapshot of the statistics rather
+ *                than returning the previous one; a client reading the JSON
+ *                in chunks must only request a new snapshot for the first
+ *                chunk
+ * @reset: whether to reset the statistics when creating a new snapshot
+ *
+ * Returns a copy of the snapshot that the caller must free() or NULL on
+ * out of memory.
+ */
+char *cmdstats_get_json(bool new_snapshot, bool reset)
+{
+    struct cmdstats_values *ce;
+    const char *sep = "";
+    uint64_t count;
+    GString *gstr;
+    size_t i, j;
+
+    if (!new_snapshot && cmdstats_snapshot)
+        return strdup(cmdstats_snapshot);
+
+    gstr = g_string_new("{\"CommandStatistics\":{\"HistogramBoundsUs\":[");
+    for (i = 0; i < CMDSTATS_NUM_BUCKETS - 1; i++)
+        g_string_append_printf(gstr, "%s%" PRIu64, i ? "," : "",
+                               (uint64_t)1 << i);
+    g_string_append_printf(gstr, "],\"Dropped\":%" PRIu64 ",\"Commands\":[",
+                           cmdstats_get(&cmdstats_dropped, reset));
+
+    for (i = 0; i < CMDSTATS_MAX_ORDINALS; i++) {
+        ce = &cmdstats[i];
+        if (__atomic_load_n(&ce->ordinal, __ATOMIC_ACQUIRE) == 0)
+            continue;
+        count = cmdstats_get(&ce->count, reset);
+        if (count == 0)
+            continue;
+
+        g_string_append_printf(gstr,
+            "%s{\"Ordinal\":%u,\"Count\":%" PRIu64 ","
+            "\"TotalTimeUs\":%" PRIu64 ",\"MaxTimeUs\":%" PRIu64 ","
+            "\"RequestBytes\":%" PRIu64 ",\"ResponseBytes\":%" PRIu64 ","
+            "\"Histogram\":[",
+            sep, ce->ordinal, count,
+            cmdstats_get(&ce->total_ns, reset) / 1000,
+            cmdstats_get(&ce->max_ns, reset) / 1000,
+            cmdstats_get(&ce->req_bytes, reset),
+            cmdstats_get(&ce->resp_bytes, reset));
+        for (j = 0; j < CMDSTATS_NUM_BUCKETS; j++)
+            g_string_append_printf(gstr, "%s%" PRIu64, j ? "," : "",
+                                   cmdstats_get(&ce->buckets[j], reset));
+        g_string_append(gstr, "]}");
+        sep = ",";
+    }
+    g_string_append(gstr, "]}}");
+
+    free(cmdstats_snapshot);
+    cmdstats_snapshot = strdup(gstr->str);
+    g_string_free(gstr, TRUE);
+
+    if (!cmdstats_snapshot)
+        return NULL;
+
+    return strdup(cmdstats_snapshot);
+}
+
+/*
+ * cmdstats_foreach: Call a function with a copy of the statistics of each
+ *                   ordinal that was recorded
+ */
+void cmdstats_foreach(void (*cb)(const struct cmdstats_values *cv,
+                                 void *opaque),
+                      void *opaque)
+{
+    struct cmdstats_values cv;
+    size_t i, j;
+
+    for (i = 0; i < CMDSTATS_MAX_ORDINALS; i++) {
+        cv.ordinal = __atomic_load_n(&cmdstats[i].ordinal, __ATOMIC_ACQUIRE);
+        if (cv.ordinal == 0)
+            continue;
+        cv.count = cmdstats_get(&cmdstats[i].count, false);
+        cv.total_ns = cmdstats_get(&cmdstats[i].total_ns, false);
+        cv.max_ns = cmdstats_get(&cmdstats[i].max_ns, false);
+        cv.req_bytes = cmdstats_get(&cmdstats[i].req_bytes, false);
+        cv.resp_bytes = cmdstats_get(&cmdstats[i].resp_bytes, false);
+        for (j = 0; j < CMDSTATS_NUM_BUCKETS; j++)
+            cv.buckets[j] = cmdstats_get(&cmdstats[i].buckets[j], false);
+        cb(&cv, opaque);
+    }
+}
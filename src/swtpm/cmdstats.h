@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * cmdstats.h -- per-ordinal TPM command statistics
+ */
+
+#ifndef _SWTPM_CMDSTATS_H_
+#define _SWTPM_CMDSTATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* histogram bucket i counts durations up to 2^i us; the last one the rest */
+#define CMDSTATS_NUM_BUCKETS  24
+
+struct cmdstats_values {
+    uint32_t ordinal;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t req_bytes;
+    uint64_t resp_bytes;
+    uint64_t buckets[CMDSTATS_NUM_BUCKETS];
+};
+
+void cmdstats_start(struct timespec *start);
+uint64_t cmdstats_elapsed_ns(const struct timespec *start);
+size_t cmdstats_bucket(uint64_t duration_ns);
+void cmdstats_record(uint32_t ordinal, uint32_t req_len, uint32_t resp_len,
+                     const struct timespec *start);
+char *cmdstats_get_json(bool new_snapshot, bool reset);
+void cmdstats_foreach(void (*cb)(const struct cmdstats_values *cv,
+                                 void *opaque),
+                      void *opaque);
+
+#endif /* _SWTPM_CMDSTATS_H_ */
@@ -52,6 +52,7 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #ifdef WITH_SECCOMP
 # include <seccomp.h>
@@ -65,6 +66,7 @@
 #include "locality.h"
 #include "logging.h"
 #include "swtpm_nvstore.h"
+#include "swtpm_nvstore_linear.h"
 #include "pidfile.h"
 #include "tpmstate.h"
 #include "ctrlchannel.h"
@@ -74,6 +76,8 @@
 #include "mainloop.h"
 #include "pcap.h"
 #include "profile.h"
+#include "metrics.h"
+#include "upgrade.h"
 #include "swtpm_utils.h"
 #include "utils.h"
 
@@ -160,6 +164,24 @@ static const OptionDesc tpmstate_opt_desc[] = {
     }, {
         .name = "fsync",
         .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "write-behind",
+        .type = OPT_TYPE_UINT,
+    }, {
+        .name = "page-flush",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "max-states",
+        .type = OPT_TYPE_UINT,
+    }, {
+        .name = "batch-fsync",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "direct-io",
+        .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "compress",
+        .type = OPT_TYPE_BOOLEAN,
     },
     END_OPTION_DESC
 };
@@ -288,6 +310,9 @@ static const OptionDesc migration_opt_desc[] = {
     }, {
         .name = "release-lock-outgoing",
         .type = OPT_TYPE_BOOLEAN,
+    }, {
+        .name = "compress",
+        .type = OPT_TYPE_BOOLEAN,
     },
     END_OPTION_DESC
 };
@@ -333,6 +358,48 @@ static const OptionDesc pcap_opt_desc[] = {
     END_OPTION_DESC
 };
 
+/* --metrics */
+static const OptionDesc metrics_opt_desc[] = {
+    {
+        .name = "type",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "path",
+        .type = OPT_TYPE_STRING,
+    }, {
+        .name = "fd",
+        .type = OPT_TYPE_INT,
+    }, {
+        .name = "mode",
+        .type = OPT_TYPE_MODE_T,
+    }, {
+        .name = "uid",
+        .type = OPT_TYPE_UID_T,
+    }, {
+        .name = "gid",
+        .type = OPT_TYPE_GID_T,
+    },
+    END_OPTION_DESC
+};
+
+/* --hibernate */
+static const OptionDesc hibernate_opt_desc[] = {
+    {
+        .name = "idle",
+        .type = OPT_TYPE_UINT,
+    },
+    END_OPTION_DESC
+};
+
+/* --live-upgrade */
+static const OptionDesc upgrade_opt_desc[] = {
+    {
+        .name = "fd",
+        .type = OPT_TYPE_INT,
+    },
+    END_OPTION_DESC
+};
+
 /*
  * handle_log_options:
  * Parse and act upon the parsed log options. Initialize the logging.
@@ -345,7 +412,7 @@ handle_log_options(const char *options)
 {
     char *error = NULL;
     const char *logfile = NULL, *logprefix = NULL;
-    int logfd;
+    int logfd, upgradefd;
     unsigned int loglevel;
     bool logtruncate;
     OptionValues *ovs = NULL;
@@ -365,6 +432,12 @@ handle_log_options(const char *options)
     loglevel = option_get_uint(ovs, "level", 0);
     logprefix = option_get_string(ovs, "prefix", NULL);
     logtruncate = option_get_bool(ovs, "truncate", false);
+    if (logfile && strcmp(logfile, "-") &&
+        (upgradefd = upgrade_get_fd(UPGRADE_FD_LOG)) >= 0) {
+        /* keep writing to the log file before the live upgrade */
+        logfd = upgradefd;
+        logfile = NULL;
+    }
     if (logfile && (log_init(logfile, logtruncate) < 0)) {
         logprintf(STDERR_FILENO,
                   "Could not open logfile for writing: %s\n",
@@ -439,6 +512,8 @@ parse_key_options(const char *options, unsigned char *key, size_t maxkeylen,
     keyfile_fd = option_get_int(ovs, "fd", -1);
     pwdfile = option_get_string(ovs, "pwdfile", NULL);
     pwdfile_fd = option_get_int(ovs, "pwdfd", -1);
+    if (keyfile_fd >= 0 || pwdfile_fd >= 0)
+        upgrade_disable("a key passed by file descriptor");
     if (!keyfile && keyfile_fd == -1 && !pwdfile && pwdfile_fd == -1) {
         logprintf(STDERR_FILENO,
                   "Either file=, fd=, pwdfile=, or pwdfd= is required for key option\n");
@@ -617,6 +692,8 @@ parse_pid_options(const char *options, char **pidfile, int *pidfilefd)
 
     filename = option_get_string(ovs, "file", NULL);
     *pidfilefd = option_get_int(ovs, "fd", -1);
+    if (*pidfilefd >= 0)
+        upgrade_disable("a pid file passed by file descriptor");
     if (!filename && *pidfilefd < 0) {
         logprintf(STDERR_FILENO,
                   "The file or fd parameter is required for the pid option.\n");
@@ -693,13 +770,27 @@ handle_pid_options(const char *options)
  * @do_locking: whether the backend should file-lock the storage
  * @make_backup: whether a backup file should be created
  * @do_fsync: whether to call fsync on the file and its directory
+ * @write_behind_ms: the delay in milliseconds for writing the state in the
+ *                   background; 0 to write it immediately
+ * @page_flush: whether the file backend should only write and flush the pages
+ *              of the state that changed
+ * @max_states: the number of entries of the header of a new file backend;
+ *              0 for the default
+ * @batch_fsync: whether the directory backend should sync the directory once
+ *               for all states stored by a TPM command; implies @do_fsync
+ * @direct_io: whether the file backend should access the file with O_DIRECT
+ *             instead of memory-mapping it
+ * @compress: whether to compress the state before writing it
  *
  * Returns 0 on success, -1 on failure.
  */
 static int
 parse_tpmstate_options(const char *options, char **tpmstatedir, mode_t *mode,
                        bool *mode_is_default, char **tpmbackend_uri,
-                       bool *do_locking, bool *make_backup, bool *do_fsync)
+                       bool *do_locking, bool *make_backup, bool *do_fsync,
+                       unsigned int *write_behind_ms, bool *page_flush,
+                       unsigned int *max_states, bool *batch_fsync,
+                       bool *direct_io, bool *compress)
 {
     OptionValues *ovs = NULL;
     char *error = NULL;
@@ -718,7 +809,29 @@ parse_tpmstate_options(const char *options, char **tpmstatedir, mode_t *mode,
     directory = option_get_string(ovs, "dir", NULL);
     backend_uri = option_get_string(ovs, "backend-uri", NULL);
     *make_backup = option_get_bool(ovs, "backup", false);
-    *do_fsync = option_get_bool(ovs, "fsync", false);
+    *batch_fsync = option_get_bool(ovs, "batch-fsync", false);
+    *do_fsync = option_get_bool(ovs, "fsync", false) || *batch_fsync;
+    *write_behind_ms = option_get_uint(ovs, "write-behind", 0);
+    *page_flush = option_get_bool(ovs, "page-flush", false);
+    *direct_io = option_get_bool(ovs, "direct-io", false);
+    *compress = option_get_bool(ovs, "compress", false);
+#if !defined(WITH_ZSTD)
+    if (*compress) {
+        logprintf(STDERR_FILENO,
+                  "This swtpm was built without support for compression.\n");
+        goto error;
+    }
+#endif
+    *max_states = option_get_uint(ovs, "max-states", 0);
+    if (*max_states != 0 &&
+        (*max_states < SWTPM_NVSTORE_LINEAR_MAX_STATES_MIN ||
+         *max_states > SWTPM_NVSTORE_LINEAR_MAX_STATES_MAX)) {
+        logprintf(STDERR_FILENO,
+                  "The max-states parameter must be between %u and %u.\n",
+                  SWTPM_NVSTORE_LINEAR_MAX_STATES_MIN,
+                  SWTPM_NVSTORE_LINEAR_MAX_STATES_MAX);
+        goto error;
+    }
 
     /* Did user provide mode bits? User can only provide <= 0777 */
     *mode = option_get_mode_t(ovs, "mode", 01000);
@@ -738,7 +851,9 @@ parse_tpmstate_options(const char *options, char **tpmstatedir, mode_t *mode,
             logprintf(STDERR_FILENO, "Out of memory.");
             goto error;
         }
-        if (strncmp(*tpmbackend_uri, "file://", 7) == 0)
+        if (strncmp(*tpmbackend_uri, "file://", 7) == 0 ||
+            strncmp(*tpmbackend_uri, "nbd://", 6) == 0 ||
+            strncmp(*tpmbackend_uri, "nbd+unix://", 11) == 0)
             lock_default = false;
     } else {
         logprintf(STDERR_FILENO,
@@ -780,13 +895,22 @@ handle_tpmstate_options(const char *options)
     bool do_locking = false;
     bool make_backup = false;
     bool do_fsync = false;
+    unsigned int write_behind_ms = 0;
+    bool page_flush = false;
+    unsigned int max_states = 0;
+    bool batch_fsync = false;
+    bool direct_io = false;
+    bool compress = false;
 
     if (!options)
         return 0;
 
     if (parse_tpmstate_options(options, &tpmstatedir, &mode,
                                &mode_is_default, &tpmbackend_uri,
-                               &do_locking, &make_backup, &do_fsync) < 0) {
+                               &do_locking, &make_backup, &do_fsync,
+                               &write_behind_ms, &page_flush,
+                               &max_states, &batch_fsync,
+                               &direct_io, &compress) < 0) {
         ret = -1;
         goto error;
     }
@@ -816,6 +940,12 @@ handle_tpmstate_options(const char *options)
     tpmstate_set_locking(do_locking);
     tpmstate_set_make_backup(make_backup);
     tpmstate_set_do_fsync(do_fsync);
+    tpmstate_set_write_behind_ms(write_behind_ms);
+    tpmstate_set_page_flush(page_flush);
+    tpmstate_set_max_states(max_states);
+    tpmstate_set_batch_fsync(batch_fsync);
+    tpmstate_set_direct_io(direct_io);
+    tpmstate_set_compress(compress);
 
 error:
     free(tpmstatedir);
@@ -1061,7 +1191,9 @@ static int parse_ctrlchannel_options(const char *options,
 
             *cc = ctrlchannel_new(clientfd, true, NULL);
         } else if (path) {
-            fd = unixio_open_socket(path, mode, uid, gid);
+            fd = upgrade_get_fd(UPGRADE_FD_CTRL);
+            if (fd < 0)
+                fd = unixio_open_socket(path, mode, uid, gid);
             if (fd < 0)
                 goto error;
 
@@ -1093,7 +1225,9 @@ static int parse_ctrlchannel_options(const char *options,
             bindaddr = option_get_string(ovs, "bindaddr", "127.0.0.1");
             ifname = option_get_string(ovs, "ifname", NULL);
 
-            fd = tcp_open_socket(port, bindaddr, ifname);
+            fd = upgrade_get_fd(UPGRADE_FD_CTRL);
+            if (fd < 0)
+                fd = tcp_open_socket(port, bindaddr, ifname);
             if (fd < 0)
                 goto error;
 
@@ -1147,6 +1281,18 @@ int handle_ctrlchannel_options(const char *options, struct ctrlchannel **cc,
     return 0;
 }
 
+/* whether the given socket is listening for connections */
+static bool socket_is_listening(int fd)
+{
+    socklen_t len = sizeof(int);
+    int listening = 0;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0)
+        return false;
+
+    return listening != 0;
+}
+
 /*
  * parse_server_options:
  * Parse the 'server' options.
@@ -1197,7 +1343,9 @@ static int parse_server_options(const char *options, struct server **c)
 
             *c = server_new(fd, flags, NULL);
         } else if (path) {
-            fd = unixio_open_socket(path, mode, uid, gid);
+            fd = upgrade_get_fd(UPGRADE_FD_SERVER);
+            if (fd < 0)
+                fd = unixio_open_socket(path, mode, uid, gid);
             if (fd < 0)
                 goto error;
 
@@ -1217,7 +1365,9 @@ static int parse_server_options(const char *options, struct server **c)
                goto error;
             }
 
-            flags |= SERVER_FLAG_FD_GIVEN;
+            /* a listening socket may be passed by socket activation */
+            if (!socket_is_listening(fd))
+                flags |= SERVER_FLAG_FD_GIVEN;
 
             *c = server_new(fd, flags, NULL);
         } else {
@@ -1241,7 +1391,9 @@ static int parse_server_options(const char *options, struct server **c)
             bindaddr = option_get_string(ovs, "bindaddr", "127.0.0.1");
             ifname = option_get_string(ovs, "ifname", NULL);
 
-            fd = tcp_open_socket(port, bindaddr, ifname);
+            fd = upgrade_get_fd(UPGRADE_FD_SERVER);
+            if (fd < 0)
+                fd = tcp_open_socket(port, bindaddr, ifname);
             if (fd < 0)
                 goto error;
 
@@ -1461,7 +1613,7 @@ int handle_seccomp_options(const char *options, unsigned int *seccomp_action)
 #endif /* WITH_SECCOMP */
 
 static int parse_migration_options(const char *options, bool *incoming_migration,
-                                   bool *release_lock_outgoing)
+                                   bool *release_lock_outgoing, bool *compress)
 {
     OptionValues *ovs = NULL;
     char *error = NULL;
@@ -1475,6 +1627,14 @@ static int parse_migration_options(const char *options, bool *incoming_migration
     *incoming_migration = option_get_bool(ovs, "incoming", false);
     *release_lock_outgoing = option_get_bool(ovs, "release-lock-outgoing",
                                              false);
+    *compress = option_get_bool(ovs, "compress", false);
+#if !defined(WITH_ZSTD)
+    if (*compress) {
+        logprintf(STDERR_FILENO,
+                  "This swtpm was built without support for compression.\n");
+        goto error;
+    }
+#endif
 
     option_values_free(ovs);
 
@@ -1511,6 +1671,8 @@ static int parse_profile_options(const char *options, char **json_profile)
     name = option_get_string(ovs, "name", NULL);
     filename = option_get_string(ovs, "file", NULL);
     profilefd = option_get_int(ovs, "fd", -1);
+    if (profilefd >= 0)
+        upgrade_disable("a profile passed by file descriptor");
 
     if ((profile != NULL) + (name != NULL) + (filename != NULL) > 1 + (profilefd >= 0)) {
         logprintf(STDERR_FILENO, "Only one profile option parameter of 'profile', 'name', 'fd', or 'file' may be provided\n");
@@ -1599,15 +1761,19 @@ error:
 int handle_migration_options(const char *options, bool *incoming_migration,
                              bool *release_lock_outgoing)
 {
+    bool compress = false;
+
     *incoming_migration = false;
 
     if (!options)
         return 0;
 
     if (parse_migration_options(options, incoming_migration,
-                                release_lock_outgoing) < 0)
+                                release_lock_outgoing, &compress) < 0)
         return -1;
 
+    SWTPM_NVRAM_Set_MigrationCompression(compress);
+
     return 0;
 }
 
@@ -1641,6 +1807,7 @@ static int parse_pcap_options(const char *options, struct pcap_state *ps)
     char *error = NULL;
     bool checksums;
     bool truncate;
+    int upgradefd;
     mode_t mode;
     int whence;
     int flags;
@@ -1658,7 +1825,11 @@ static int parse_pcap_options(const char *options, struct pcap_state *ps)
     fd = option_get_int(ovs, "fd", -1);
     checksums = option_get_int(ovs, "checksums", false);
 
-    if (filename) {
+    /* continue the capture of the process before the live upgrade */
+    upgradefd = upgrade_get_fd(UPGRADE_FD_PCAP);
+    if (upgradefd >= 0) {
+        fd = upgradefd;
+    } else if (filename) {
         flags = O_CREAT|O_WRONLY|O_NONBLOCK;
 
         if (truncate)
@@ -1715,7 +1886,8 @@ static int parse_pcap_options(const char *options, struct pcap_state *ps)
 
     pcap_state_flags_set(ps, pcap_flags);
     pcap_state_fd_set(ps, fd);
-    pcap_file_new(ps);
+    if (upgradefd < 0)
+        pcap_file_new(ps);
 
     option_values_free(ovs);
 
@@ -1749,3 +1921,195 @@ int handle_pcap_options(const char *options, struct pcap_state *ps)
 
     return 0;
 }
+
+static int parse_metrics_options(const char *options)
+{
+    OptionValues *ovs = NULL;
+    char *error = NULL;
+    const char *type, *path;
+    struct stat stat;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    int fd;
+
+    ovs = options_parse(options, metrics_opt_desc, &error);
+    if (!ovs) {
+        logprintf(STDERR_FILENO, "Error parsing metrics options: %s\n", error);
+        goto error;
+    }
+
+    type = option_get_string(ovs, "type", "unixio");
+    if (strcmp(type, "unixio")) {
+        logprintf(STDERR_FILENO, "Unsupported metrics type: %s\n", type);
+        goto error;
+    }
+
+    path = option_get_string(ovs, "path", NULL);
+    fd = option_get_int(ovs, "fd", -1);
+    mode = option_get_mode_t(ovs, "mode", 0770);
+    uid = option_get_uid_t(ovs, "uid", -1);
+    gid = option_get_gid_t(ovs, "gid", -1);
+
+    if (fd >= 0) {
+        if (fstat(fd, &stat) < 0 || !S_ISSOCK(stat.st_mode)) {
+            logprintf(STDERR_FILENO,
+                      "Bad filedescriptor %d for UnixIO metrics socket\n", fd);
+            goto error;
+        }
+        metrics_set_fd(fd, NULL);
+    } else if (path) {
+        fd = upgrade_get_fd(UPGRADE_FD_METRICS);
+        if (fd < 0)
+            fd = unixio_open_socket(path, mode, uid, gid);
+        if (fd < 0)
+            goto error;
+        metrics_set_fd(fd, path);
+    } else {
+        logprintf(STDERR_FILENO,
+                  "Missing path and fd options for metrics socket\n");
+        goto error;
+    }
+
+    option_values_free(ovs);
+
+    return 0;
+
+error:
+    free(error);
+    option_values_free(ovs);
+
+    return -1;
+}
+
+/*
+ * handle_metrics_options:
+ * Parse the 'metrics' options and open the metrics socket.
+ *
+ * @options: the metrics options to parse
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int handle_metrics_options(const char *options)
+{
+    metrics_init();
+
+    if (!options)
+        return 0;
+
+    if (parse_metrics_options(options) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int parse_hibernate_options(const char *options,
+                                   unsigned int *hibernate_idle_ms)
+{
+    OptionValues *ovs = NULL;
+    char *error = NULL;
+    unsigned int idle;
+
+    ovs = options_parse(options, hibernate_opt_desc, &error);
+    if (!ovs) {
+        logprintf(STDERR_FILENO, "Error parsing hibernate options: %s\n",
+                  error);
+        goto error;
+    }
+
+    idle = option_get_uint(ovs, "idle", 0);
+    if (idle == 0 || idle > UINT_MAX / 1000) {
+        logprintf(STDERR_FILENO,
+                  "The idle time for hibernation must be between 1 and %u "
+                  "seconds.\n", UINT_MAX / 1000);
+        goto error;
+    }
+    *hibernate_idle_ms = idle * 1000;
+
+    option_values_free(ovs);
+
+    return 0;
+
+error:
+    free(error);
+    option_values_free(ovs);
+
+    return -1;
+}
+
+/*
+ * handle_hibernate_options:
+ * Parse the 'hibernate' options.
+ *
+ * @options: the hibernate options to parse
+ * @hibernate_idle_ms: pointer to the idle time after which to hibernate
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int handle_hibernate_options(const char *options,
+                             unsigned int *hibernate_idle_ms)
+{
+    *hibernate_idle_ms = 0;
+
+    if (!options)
+        return 0;
+
+    if (parse_hibernate_options(options, hibernate_idle_ms) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int parse_upgrade_options(const char *options)
+{
+    OptionValues *ovs = NULL;
+    char *error = NULL;
+    int fd;
+
+    ovs = options_parse(options, upgrade_opt_desc, &error);
+    if (!ovs) {
+        logprintf(STDERR_FILENO, "Error parsing live-upgrade options: %s\n",
+                  error);
+        goto error;
+    }
+
+    fd = option_get_int(ovs, "fd", -1);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "The fd parameter is required for the live-upgrade option.\n");
+        goto error;
+    }
+
+    if (upgrade_load(fd) < 0)
+        goto error;
+
+    option_values_free(ovs);
+
+    return 0;
+
+error:
+    free(error);
+    option_values_free(ovs);
+
+    return -1;
+}
+
+/*
+ * handle_upgrade_options:
+ * Parse the 'live-upgrade' options and read the state handed over by the
+ * process before the live upgrade.
+ *
+ * @options: the live-upgrade options to parse
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int handle_upgrade_options(const char *options)
+{
+    if (!options)
+        return 0;
+
+    if (parse_upgrade_options(options) < 0)
+        return -1;
+
+    return 0;
+}
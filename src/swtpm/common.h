@@ -73,4 +73,10 @@ int handle_profile_options(const char *options, char **json_profile);
 struct pcap_state;
 int handle_pcap_options(const char *options, struct pcap_state *ps);
 
+int handle_metrics_options(const char *options);
+
+int handle_hibernate_options(const char *options,
+                             unsigned int *hibernate_idle_ms);
+int handle_upgrade_options(const char *options);
+
 #endif /* _SWTPM_COMMON_H_ */
@@ -46,6 +46,8 @@
 #include <time.h>
 #include <poll.h>
 
+#include <glib.h>
+
 #include <libtpms/tpm_library.h>
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_tis.h>
@@ -62,6 +64,11 @@
 #include "utils.h"
 #include "swtpm_debug.h"
 #include "swtpm_utils.h"
+#include "shmring.h"
+#include "threadpool.h"
+#include "cmdstats.h"
+#include "metrics.h"
+#include "upgrade.h"
 
 /* local variables */
 
@@ -159,7 +166,7 @@ static int ctrlchannel_return_state(ptm_getstate *pgs, int fd,
     uint32_t blobtype = be32toh(pgs->u.req.type);
     const char *blobname;
     uint32_t tpm_number = 0;
-    unsigned char *blob = NULL;
+    struct nvram_stateblob *sb = NULL;
     uint32_t blob_length = 0, return_length;
     TPM_BOOL is_encrypted = 0;
     TPM_BOOL decrypt =
@@ -167,25 +174,22 @@ static int ctrlchannel_return_state(ptm_getstate *pgs, int fd,
     TPM_RESULT res = 0;
     uint32_t offset = be32toh(pgs->u.req.offset);
     ptm_getstate pgs_res;
+    size_t pgs_res_len = offsetof(ptm_getstate, u.resp.data);
     uint32_t state_flags;
-    struct iovec iov[2];
-    int iovcnt, n;
+    int n;
 
     blobname = tpmlib_get_blobname(blobtype);
     if (!blobname)
         res = TPM_FAIL;
 
-    if (res == 0 && blobtype == PTM_BLOB_TYPE_VOLATILE)
-        res = SWTPM_NVRAM_Store_Volatile();
-
+    /* the state must be durable before it is handed out */
     if (res == 0)
-        res = SWTPM_NVRAM_GetStateBlob(&blob, &blob_length,
-                                       tpm_number, blobname, decrypt,
-                                       &is_encrypted);
+        res = SWTPM_NVRAM_Flush();
 
-    /* make sure the volatile state file is gone */
-    if (blobtype == PTM_BLOB_TYPE_VOLATILE)
-        SWTPM_NVRAM_DeleteName(tpm_number, blobname, FALSE);
+    /* the volatile state is taken from the TPM without a state file */
+    if (res == 0)
+        res = SWTPM_NVRAM_OpenStateBlob(&sb, tpm_number, blobname, decrypt,
+                                        &is_encrypted, &blob_length);
 
     if (offset < blob_length) {
         return_length = blob_length - offset;
@@ -199,30 +203,34 @@ static int ctrlchannel_return_state(ptm_getstate *pgs, int fd,
     pgs_res.u.resp.totlength = htobe32(return_length);
     pgs_res.u.resp.length = htobe32(return_length);
 
-    iov[0].iov_base = &pgs_res;
-    iov[0].iov_len = offsetof(ptm_getstate, u.resp.data);
-    iovcnt = 1;
-
-    SWTPM_PrintAll(" Ctrl Rsp:", " ", iov[0].iov_base, iov[0].iov_len);
+    SWTPM_PrintAll(" Ctrl Rsp:", " ", (unsigned char *)&pgs_res, pgs_res_len);
 
     if (res == 0 && return_length) {
-        iov[1].iov_base = &blob[offset];
-        iov[1].iov_len = return_length;
-        iovcnt = 2;
-
-        SWTPM_PrintAll(" Ctrl Rsp Continued:", " ",
-                       iov[1].iov_base, min(iov[1].iov_len, 1024));
+        /* the blob is produced while it is written after the header */
+        if (SWTPM_NVRAM_WriteStateBlob(sb, fd, offset,
+                                       &pgs_res, pgs_res_len) != 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send the %s blob\n", blobname);
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        n = write_full(fd, &pgs_res, pgs_res_len);
+        if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send response: %s\n",
+                      strerror(errno));
+            close(fd);
+            fd = -1;
+        }
     }
 
-    n = writev_full(fd, iov, iovcnt);
-    if (n < 0) {
-        logprintf(STDERR_FILENO,
-                  "Error: Could not send response: %s\n", strerror(errno));
-        close(fd);
-        fd = -1;
-    }
+    SWTPM_NVRAM_FreeStateBlob(sb);
 
-    free(blob);
+    /* remove a volatile state file left by an earlier PTM_STORE_VOLATILE;
+       this is done after the blob was sent so as not to delay it */
+    if (blobtype == PTM_BLOB_TYPE_VOLATILE)
+        SWTPM_NVRAM_DeleteName(tpm_number, blobname, FALSE);
 
     if (fd >= 0 && blobtype == PTM_BLOB_TYPE_SAVESTATE)
         mainloop_unlock_nvram(mlp, DEFAULT_LOCKING_RETRIES);
@@ -230,25 +238,167 @@ static int ctrlchannel_return_state(ptm_getstate *pgs, int fd,
     return fd;
 }
 
+/*
+ * ctrlchannel_return_state_precopy: Send the permanent state blob along
+ * with its generation unless the client already holds that generation
+ */
+static int ctrlchannel_return_state_precopy(ptm_getstate_precopy *pgsp,
+                                            int fd)
+{
+    const char *blobname = tpmlib_get_blobname(PTM_BLOB_TYPE_PERMANENT);
+    uint64_t req_generation = be64toh(pgsp->u.req.generation);
+    uint64_t generation;
+    uint32_t tpm_number = 0;
+    struct nvram_stateblob *sb = NULL;
+    uint32_t blob_length = 0;
+    TPM_BOOL is_encrypted = 0;
+    TPM_BOOL decrypt =
+        (be32toh(pgsp->u.req.state_flags) & PTM_STATE_FLAG_DECRYPTED) != 0;
+    TPM_RESULT res;
+    ptm_getstate_precopy pgsp_res;
+    size_t pgsp_res_len = offsetof(ptm_getstate_precopy, u.resp.data);
+    uint32_t state_flags = 0;
+    int n;
+
+    /* the state must be durable before it is handed out */
+    res = SWTPM_NVRAM_Flush();
+
+    /* a store after this makes the client get the blob again */
+    generation = SWTPM_NVRAM_Get_PermanentGeneration();
+
+    if (res == 0) {
+        if (req_generation != 0 && req_generation == generation)
+            state_flags |= PTM_STATE_FLAG_UNCHANGED;
+        else
+            res = SWTPM_NVRAM_OpenStateBlob(&sb, tpm_number, blobname,
+                                            decrypt, &is_encrypted,
+                                            &blob_length);
+    }
+
+    if (is_encrypted)
+        state_flags |= PTM_STATE_FLAG_ENCRYPTED;
+    pgsp_res.u.resp.tpm_result = htobe32(res);
+    pgsp_res.u.resp.state_flags = htobe32(state_flags);
+    pgsp_res.u.resp.generation = htobe64(generation);
+    pgsp_res.u.resp.totlength = htobe32(blob_length);
+    pgsp_res.u.resp.length = htobe32(blob_length);
+
+    SWTPM_PrintAll(" Ctrl Rsp:", " ", (unsigned char *)&pgsp_res,
+                   pgsp_res_len);
+
+    if (res == 0 && blob_length) {
+        if (SWTPM_NVRAM_WriteStateBlob(sb, fd, 0,
+                                       &pgsp_res, pgsp_res_len) != 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send the %s blob\n", blobname);
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        n = write_full(fd, &pgsp_res, pgsp_res_len);
+        if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send response: %s\n",
+                      strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    SWTPM_NVRAM_FreeStateBlob(sb);
+
+    return fd;
+}
+
+/*
+ * ctrlchannel_return_state_bundle: Send all state blobs as one bundle,
+ * either following the response or written to @bundle_fd, which is closed
+ */
+static int ctrlchannel_return_state_bundle(ptm_getstate_bundle *pgsb, int fd,
+                                           int bundle_fd)
+{
+    uint32_t tpm_number = 0;
+    struct nvram_statebundle *sbu = NULL;
+    uint32_t bundle_length = 0;
+    TPM_BOOL decrypt =
+        (be32toh(pgsb->u.req.state_flags) & PTM_STATE_FLAG_DECRYPTED) != 0;
+    TPM_RESULT res;
+    ptm_getstate_bundle pgsb_res;
+    size_t pgsb_res_len = offsetof(ptm_getstate_bundle, u.resp.data);
+    int n;
+
+    /* the state must be durable before it is handed out */
+    res = SWTPM_NVRAM_Flush();
+
+    /* all blobs are taken now so that they belong together */
+    if (res == 0)
+        res = SWTPM_NVRAM_OpenStateBundle(&sbu, tpm_number, decrypt,
+                                          &bundle_length);
+
+    if (res == 0 && bundle_fd >= 0)
+        res = SWTPM_NVRAM_WriteStateBundle(sbu, bundle_fd, NULL, 0);
+
+    if (res)
+        bundle_length = 0;
+    pgsb_res.u.resp.tpm_result = htobe32(res);
+    pgsb_res.u.resp.totlength = htobe32(bundle_length);
+    pgsb_res.u.resp.length = htobe32(bundle_fd >= 0 ? 0 : bundle_length);
+
+    SWTPM_PrintAll(" Ctrl Rsp:", " ", (unsigned char *)&pgsb_res,
+                   pgsb_res_len);
+
+    if (res == 0 && bundle_fd < 0) {
+        if (SWTPM_NVRAM_WriteStateBundle(sbu, fd,
+                                         &pgsb_res, pgsb_res_len) != 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send the state bundle\n");
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        n = write_full(fd, &pgsb_res, pgsb_res_len);
+        if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: Could not send response: %s\n",
+                      strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    SWTPM_NVRAM_FreeStateBundle(sbu);
+    if (bundle_fd >= 0)
+        close(bundle_fd);
+
+    /* as with CMD_GET_STATEBLOB, a volatile state file is not needed */
+    if (res == 0)
+        SWTPM_NVRAM_DeleteName(tpm_number,
+                               tpmlib_get_blobname(PTM_BLOB_TYPE_VOLATILE),
+                               FALSE);
+
+    return fd;
+}
+
 static int ctrlchannel_receive_state(ptm_setstate_priv *pss, ssize_t n, int fd)
 {
     uint32_t blobtype = be32toh(pss->u.req.type);
     uint32_t tpm_number = 0;
     unsigned char *blob = NULL;
     uint32_t blob_length = be32toh(pss->u.req.length);
-    uint32_t remain = blob_length, offset = 0;
+    uint32_t offset;
     TPM_RESULT res;
     uint32_t flags = be32toh(pss->u.req.state_flags);
     TPM_BOOL is_encrypted = (flags & PTM_STATE_FLAG_ENCRYPTED) != 0;
 
-    if (blob_length > 512 * 1024) {
+    if (blob_length > SWTPM_NVRAM_MAX_STATEBLOB_SIZE) {
         logprintf(STDERR_FILENO,
                   "Unreasonable large state of %u bytes.\n", blob_length);
         res = TPM_FAIL;
         goto err_send_resp;
     }
 
-    blob = malloc(blob_length);
+    /* malloc(0) may return NULL */
+    blob = malloc(blob_length ? blob_length : 1);
     if (!blob) {
         logprintf(STDERR_FILENO,
                   "Could not allocate %u bytes.\n", blob_length);
@@ -258,36 +408,41 @@ static int ctrlchannel_receive_state(ptm_setstate_priv *pss, ssize_t n, int fd)
 
     n -= offsetof(ptm_setstate, u.req.data);
     /* n holds the number of available data bytes */
-    if (n < 0 || (size_t)n > sizeof(pss->u.req.data)) {
+    if (n < 0 || (size_t)n > sizeof(pss->u.req.data) ||
+        (uint32_t)n > blob_length) {
         res = TPM_BAD_PARAMETER;
         goto err_send_resp;
     }
-
-    while (true) {
-        if ((uint32_t)n > remain) {
+    memcpy(blob, pss->u.req.data, n);
+    offset = n;
+
+    /* read the rest of the blob directly into place */
+    while (offset < blob_length) {
+        n = read_eintr(fd, &blob[offset], blob_length - offset);
+        if (n < 0) {
+            close(fd);
+            fd = -1;
+            goto err_fd_broken;
+        } else if (n == 0) {
             res = TPM_BAD_PARAMETER;
             goto err_send_resp;
         }
-        memcpy(&blob[offset], pss->u.req.data, n);
         offset += n;
-        remain -= n;
-        if (remain) {
-            n = read_eintr(fd, pss->u.req.data, sizeof(pss->u.req.data));
-            if (n < 0) {
-                close(fd);
-                fd = -1;
-                goto err_fd_broken;
-            } else if (n == 0) {
-                res = TPM_BAD_PARAMETER;
-                goto err_send_resp;
-            }
-        } else {
-            break;
-        }
     }
 
-    res = SWTPM_NVRAM_SetStateBlob(blob, blob_length, is_encrypted,
-                                   tpm_number, blobtype);
+    if ((flags & PTM_STATE_FLAG_STAGE) &&
+        (flags & PTM_STATE_FLAG_COMMIT_STAGED))
+        res = TPM_BAD_PARAMETER;
+    else if (flags & PTM_STATE_FLAG_STAGE)
+        res = SWTPM_NVRAM_StageStateBlob(blob, blob_length, is_encrypted,
+                                         blobtype);
+    else if (flags & PTM_STATE_FLAG_COMMIT_STAGED)
+        res = blob_length ? TPM_BAD_PARAMETER
+                          : SWTPM_NVRAM_CommitStagedStateBlob(tpm_number,
+                                                              blobtype);
+    else
+        res = SWTPM_NVRAM_SetStateBlob(blob, blob_length, is_encrypted,
+                                       tpm_number, blobtype);
 
 err_send_resp:
     pss->u.resp.tpm_result = htobe32(res);
@@ -306,6 +461,92 @@ err_fd_broken:
     return fd;
 }
 
+/*
+ * ctrlchannel_receive_state_bundle: Receive a state bundle, which either
+ * follows the request or is read from @bundle_fd, which is closed, and set
+ * its state blobs
+ */
+static int ctrlchannel_receive_state_bundle(ptm_setstate_bundle *pssb,
+                                            ssize_t n, int fd, int bundle_fd)
+{
+    const size_t hdr_len = offsetof(ptm_setstate_bundle, u.req.data);
+    uint32_t tpm_number = 0;
+    unsigned char *bundle = NULL;
+    uint32_t bundle_length = be32toh(pssb->u.req.length);
+    uint32_t offset = 0;
+    int src_fd = fd;
+    TPM_RESULT res;
+
+    if (bundle_length > SWTPM_NVRAM_MAX_STATEBUNDLE_SIZE) {
+        logprintf(STDERR_FILENO,
+                  "Unreasonable large state bundle of %u bytes.\n",
+                  bundle_length);
+        res = TPM_FAIL;
+        goto err_send_resp;
+    }
+
+    /* malloc(0) may return NULL */
+    bundle = malloc(bundle_length ? bundle_length : 1);
+    if (!bundle) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %u bytes.\n", bundle_length);
+        res = TPM_FAIL;
+        goto err_send_resp;
+    }
+
+    n -= hdr_len;
+    /* n holds the number of data bytes that followed the request */
+    if (n < 0 || (uint32_t)n > bundle_length ||
+        (bundle_fd >= 0 && n > 0)) {
+        res = TPM_BAD_PARAMETER;
+        goto err_send_resp;
+    }
+    if (bundle_fd >= 0) {
+        src_fd = bundle_fd;
+    } else {
+        memcpy(bundle, (unsigned char *)pssb + hdr_len, n);
+        offset = n;
+    }
+
+    while (offset < bundle_length) {
+        n = read_eintr(src_fd, &bundle[offset], bundle_length - offset);
+        if (n < 0 && src_fd == fd) {
+            close(fd);
+            fd = -1;
+            goto err_fd_broken;
+        } else if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "Could not read the state bundle: %s\n",
+                      strerror(errno));
+            res = TPM_IOERROR;
+            goto err_send_resp;
+        } else if (n == 0) {
+            res = TPM_BAD_PARAMETER;
+            goto err_send_resp;
+        }
+        offset += n;
+    }
+
+    res = SWTPM_NVRAM_SetStateBundle(bundle, bundle_length, tpm_number);
+
+err_send_resp:
+    pssb->u.resp.tpm_result = htobe32(res);
+    n = write_full(fd, pssb, sizeof(pssb->u.resp.tpm_result));
+    if (n < 0) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not send response: %s\n", strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+err_fd_broken:
+    if (bundle_fd >= 0)
+        close(bundle_fd);
+    free(bundle);
+
+    return fd;
+}
+
 /* timespec_diff: calculate difference between two timespecs
  *
  * @end: end time
@@ -363,7 +604,10 @@ static ssize_t ctrlchannel_recv_cmd(int fd,
     ptm_reset_est *pre;
     ptm_hdata *phd;
     ptm_getstate *pgs;
+    ptm_getstate_precopy *pgsp;
+    ptm_getstate_bundle *pgsb;
     ptm_setstate_priv *pss;
+    ptm_setstate_bundle *pssb;
     ptm_loc *pl;
     const void *msg_iov = msg->msg_iov;
 
@@ -437,6 +681,23 @@ static ssize_t ctrlchannel_recv_cmd(int fd,
             needed = offsetof(struct input, body) +
                      sizeof(pgs->u.req);
             break;
+        case CMD_GET_STATEBLOB_PRECOPY:
+            needed = offsetof(struct input, body) +
+                     sizeof(pgsp->u.req);
+            break;
+        case CMD_GET_STATE_BUNDLE:
+            needed = offsetof(struct input, body) +
+                     sizeof(pgsb->u.req);
+            break;
+        case CMD_SET_STATE_BUNDLE:
+            needed = offsetof(struct input, body) +
+                     offsetof(struct ptm_setstate_bundle, u.req.data);
+            /* the bundle follows unless it is read from a passed fd */
+            if (recvd >= needed && !CMSG_FIRSTHDR(msg)) {
+                pssb = (struct ptm_setstate_bundle *)&input->body;
+                needed += be32toh(pssb->u.req.length);
+            }
+            break;
         case CMD_SET_STATEBLOB:
             needed = offsetof(struct input, body) +
                      offsetof(struct ptm_setstate, u.req.data);
@@ -447,6 +708,8 @@ static ssize_t ctrlchannel_recv_cmd(int fd,
             break;
         case CMD_STOP:
             break;
+        case CMD_LIVE_UPGRADE:
+            break;
         case CMD_GET_CONFIG:
             break;
         case CMD_SET_BUFFERSIZE:
@@ -478,6 +741,40 @@ wait_chunk:
     return recvd;
 }
 
+/*
+ * ctrlchannel_get_fds: Get the file descriptors passed with SCM_RIGHTS
+ *
+ * @msg: the received message
+ * @fds: array to receive the file descriptors
+ * @max_fds: the size of the fds array
+ *
+ * Returns the number of file descriptors returned in fds. Any file
+ * descriptors beyond max_fds are closed.
+ */
+static size_t ctrlchannel_get_fds(struct msghdr *msg, int *fds,
+                                  size_t max_fds)
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    size_t nfds, i;
+    int fd;
+
+    if (!cmsg || cmsg->cmsg_len < CMSG_LEN(sizeof(int)) ||
+        cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        return 0;
+
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < nfds; i++) {
+        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        if (i < max_fds)
+            fds[i] = fd;
+        else if (fd >= 0)
+            close(fd);
+    }
+
+    return min(nfds, max_fds);
+}
+
 static uint32_t get_ptm_caps_supported(TPMLIB_TPMVersion tpmversion)
 {
     uint32_t caps =
@@ -495,10 +792,14 @@ static uint32_t get_ptm_caps_supported(TPMLIB_TPMVersion tpmversion)
             | PTM_CAP_GET_CONFIG
 #ifndef __CYGWIN__
             | PTM_CAP_SET_DATAFD
+            | PTM_CAP_SET_DATAFD_SHM
 #endif
             | PTM_CAP_SET_BUFFERSIZE
             | PTM_CAP_GET_INFO
-            | PTM_CAP_LOCK_STORAGE;
+            | PTM_CAP_LOCK_STORAGE
+            | PTM_CAP_GET_STATEBLOB_PRECOPY
+            | PTM_CAP_STATE_BUNDLE
+            | PTM_CAP_LIVE_UPGRADE;
     if (tpmversion == TPMLIB_TPM_VERSION_2)
         caps |= PTM_CAP_SEND_COMMAND_HEADER;
 
@@ -518,7 +819,7 @@ static uint32_t get_ptm_caps_supported(TPMLIB_TPMVersion tpmversion)
  * @tpm_running: indicates whether the TPM is running; may be changed by
  *               this function in case TPM is stopped or started
  * @mlp: mainloop parameters used; may be altered by this function in case of
- *       CMD_SET_DATAFD
+ *       CMD_SET_DATAFD, CMD_SET_DATAFD_SHM, or CMD_LIVE_UPGRADE
  *
  * This function returns the passed file descriptor or -1 in case the
  * file descriptor was closed.
@@ -538,15 +839,19 @@ int ctrlchannel_process_fd(int fd,
         .iov_base = &input,
         .iov_len = sizeof(input),
     };
-    char control[CMSG_SPACE(sizeof(int))];
+    /* CMD_SET_DATAFD_SHM passes 3 file descriptors */
+    char control[CMSG_SPACE(3 * sizeof(int))];
     struct msghdr msg = {
         .msg_iov = &iov,
         .msg_iovlen = 1,
         .msg_control = control,
         .msg_controllen = sizeof(control),
     };
-    struct cmsghdr *cmsg = NULL;
-    int *data_fd = NULL;
+    int data_fds[3];
+    size_t nfds;
+    struct shmring *shmring;
+    uint32_t min_ring_size;
+    int bundle_fd;
 
     /* Write-only */
     ptm_cap_n *ptm_caps_n = (ptm_cap_n *)&output.body;
@@ -558,7 +863,10 @@ int ctrlchannel_process_fd(int fd,
     ptm_reset_est *re;
     ptm_hdata *data;
     ptm_getstate *pgs;
+    ptm_getstate_precopy *pgsp;
+    ptm_getstate_bundle *pgsb;
     ptm_setstate_priv *pss;
+    ptm_setstate_bundle *pssb;
     ptm_loc *pl;
     ptm_setbuffersize *psbs;
     ptm_getinfo *pgi, _pgi;
@@ -590,6 +898,32 @@ int ctrlchannel_process_fd(int fd,
 
     n -= sizeof(input.cmd);
 
+    metrics_ctrl_cmd(be32toh(input.cmd));
+
+    /*
+     * All commands except for those that neither access the TPM nor its
+     * state have to wait until the worker thread is done.
+     * CMD_GET_INFO is served from a snapshot taken when the TPM started.
+     */
+    switch (be32toh(input.cmd)) {
+    case CMD_GET_CAPABILITY:
+    case CMD_CANCEL_TPM_CMD:
+    case CMD_GET_CONFIG:
+    case CMD_GET_INFO:
+        break;
+    case CMD_INIT:
+    case CMD_STOP:
+    case CMD_SHUTDOWN:
+        /* the result of a long running command is not needed anymore */
+        if (worker_thread_is_busy())
+            TPMLIB_CancelCommand();
+        /* fall through */
+    default:
+        if (*tpm_running)
+            worker_thread_wait_done();
+        break;
+    }
+
     switch (be32toh(input.cmd)) {
     case CMD_GET_CAPABILITY:
         /* must always succeed */
@@ -643,7 +977,7 @@ int ctrlchannel_process_fd(int fd,
 
         *tpm_running = false;
 
-        *res_p = htobe32(TPM_SUCCESS);
+        *res_p = htobe32(SWTPM_NVRAM_Flush());
         out_len = sizeof(ptm_res);
         break;
 
@@ -660,7 +994,7 @@ int ctrlchannel_process_fd(int fd,
 
         *tpm_running = false;
 
-        *res_p = htobe32(TPM_SUCCESS);
+        *res_p = htobe32(SWTPM_NVRAM_Flush());
         out_len = sizeof(ptm_res);
 
         *terminate = true;
@@ -790,10 +1124,7 @@ int ctrlchannel_process_fd(int fd,
         if (n != 0) /* wo */
             goto err_bad_input;
 
-        /* for cancellation to work, the TPM would have to
-         * execute in another thread that polls on a cancel
-         * flag
-         */
+        /* cancelable commands are processed by the worker thread */
         *res_p = htobe32(TPMLIB_CancelCommand());
         out_len = sizeof(ptm_res);
         break;
@@ -819,20 +1150,96 @@ int ctrlchannel_process_fd(int fd,
 
         return ctrlchannel_return_state(pgs, fd, mlp);
 
+    case CMD_GET_STATEBLOB_PRECOPY:
+        if (!*tpm_running)
+            goto err_not_running;
+
+        pgsp = (ptm_getstate_precopy *)input.body;
+        if (n < (ssize_t)sizeof(pgsp->u.req) || /* rw */
+            pgsp->u.req.reserved != 0)
+            goto err_bad_input;
+
+        return ctrlchannel_return_state_precopy(pgsp, fd);
+
     case CMD_SET_STATEBLOB:
         if (*tpm_running)
             goto err_running;
 
+        pss = (ptm_setstate_priv *)input.body;
+        if (n < (ssize_t)offsetof(ptm_setstate_priv, u.req.data)) /* rw */
+            goto err_bad_input;
+
+        /* a staged blob may arrive while the source of a migration still
+           holds the storage */
+        if (!(be32toh(pss->u.req.state_flags) & PTM_STATE_FLAG_STAGE)) {
+            /* tpm state dir must be set */
+            SWTPM_NVRAM_Init();
+            if ((*terminate = !mainloop_ensure_locked_storage(mlp)))
+                goto err_io;
+        }
+
+        return ctrlchannel_receive_state(pss, n, fd);
+
+    case CMD_GET_STATE_BUNDLE:
+        nfds = ctrlchannel_get_fds(&msg, data_fds, 1);
+        bundle_fd = nfds ? data_fds[0] : -1;
+
+        pgsb = (ptm_getstate_bundle *)input.body;
+        if (!*tpm_running ||
+            n < (ssize_t)sizeof(pgsb->u.req) || /* rw */
+            pgsb->u.req.reserved != 0) {
+            if (bundle_fd >= 0)
+                close(bundle_fd);
+            if (!*tpm_running)
+                goto err_not_running;
+            goto err_bad_input;
+        }
+
+        return ctrlchannel_return_state_bundle(pgsb, fd, bundle_fd);
+
+    case CMD_SET_STATE_BUNDLE:
+        nfds = ctrlchannel_get_fds(&msg, data_fds, 1);
+        bundle_fd = nfds ? data_fds[0] : -1;
+
+        pssb = (ptm_setstate_bundle *)input.body;
+        if (*tpm_running ||
+            n < (ssize_t)offsetof(ptm_setstate_bundle, u.req.data) || /* rw */
+            pssb->u.req.state_flags != 0) {
+            if (bundle_fd >= 0)
+                close(bundle_fd);
+            if (*tpm_running)
+                goto err_running;
+            goto err_bad_input;
+        }
+
         /* tpm state dir must be set */
         SWTPM_NVRAM_Init();
-        if ((*terminate = !mainloop_ensure_locked_storage(mlp)))
+        if ((*terminate = !mainloop_ensure_locked_storage(mlp))) {
+            if (bundle_fd >= 0)
+                close(bundle_fd);
             goto err_io;
+        }
 
-        pss = (ptm_setstate_priv *)input.body;
-        if (n < (ssize_t)offsetof(ptm_setstate_priv, u.req.data)) /* rw */
+        return ctrlchannel_receive_state_bundle(pssb, n, fd, bundle_fd);
+
+    case CMD_LIVE_UPGRADE:
+        if (!*tpm_running)
+            goto err_not_running;
+
+        if (n != 0) /* wo */
             goto err_bad_input;
 
-        return ctrlchannel_receive_state(pss, n, fd);
+        res = upgrade_check(mlp);
+        if (res != TPM_SUCCESS) {
+            *res_p = htobe32(res);
+            out_len = sizeof(ptm_res);
+            break;
+        }
+
+        /* the new process responds once it took over */
+        mlp->live_upgrade = true;
+
+        return fd;
 
     case CMD_GET_CONFIG:
         if (n != 0) /* wo */
@@ -853,22 +1260,64 @@ int ctrlchannel_process_fd(int fd,
         if (1)
             goto err_running;
 #endif
-        if (mlp->fd != -1)
+        nfds = ctrlchannel_get_fds(&msg, data_fds, 1);
+
+        if (mlp->fd != -1 || mlp->shmring) {
+            if (nfds)
+                close(data_fds[0]);
             goto err_io;
+        }
 
-        cmsg = CMSG_FIRSTHDR(&msg);
-        if (!cmsg || cmsg->cmsg_len < CMSG_LEN(sizeof(int)) ||
-             cmsg->cmsg_level != SOL_SOCKET ||
-             cmsg->cmsg_type != SCM_RIGHTS ||
-             !(data_fd = (int *)CMSG_DATA(cmsg)) ||
-             *data_fd < 0) {
-            logprintf(STDERR_FILENO, "no valid data socket in message; cmsg = "
-                                     "%p", cmsg);
+        if (nfds != 1 || data_fds[0] < 0) {
+            logprintf(STDERR_FILENO, "no valid data socket in message\n");
             goto err_bad_input;
         }
 
         mlp->flags |= MAIN_LOOP_FLAG_USE_FD | MAIN_LOOP_FLAG_KEEP_CONNECTION;
-        mlp->fd = *data_fd;
+        mlp->fd = data_fds[0];
+
+        *res_p = htobe32(TPM_SUCCESS);
+        out_len = sizeof(ptm_res);
+        break;
+
+    case CMD_SET_DATAFD_SHM:
+#ifdef __CYGWIN__
+        if (1)
+            goto err_running;
+#endif
+        if (n != 0) /* wo */
+            goto err_bad_input;
+
+        nfds = ctrlchannel_get_fds(&msg, data_fds, ARRAY_LEN(data_fds));
+        if (nfds != ARRAY_LEN(data_fds) ||
+            data_fds[0] < 0 || data_fds[1] < 0 || data_fds[2] < 0) {
+            logprintf(STDERR_FILENO,
+                      "Expected shared memory and 2 eventfds in message\n");
+            while (nfds > 0)
+                close(data_fds[--nfds]);
+            goto err_bad_input;
+        }
+
+        /* cannot be used once a data fd was passed */
+        if (mlp->fd != -1) {
+            while (nfds > 0)
+                close(data_fds[--nfds]);
+            goto err_io;
+        }
+
+        /* each ring must be able to hold the largest message */
+        min_ring_size = sizeof(uint32_t) +
+                        tpmlib_get_tpm_property(TPMPROP_TPM_BUFFER_MAX) +
+                        sizeof(struct tpm2_send_command_prefix);
+
+        shmring = shmring_new(data_fds[0], data_fds[1], data_fds[2],
+                              min_ring_size);
+        if (!shmring)
+            goto err_bad_input;
+
+        /* a client may re-attach with a new shared memory ring */
+        shmring_free(mlp->shmring);
+        mlp->shmring = shmring;
 
         *res_p = htobe32(TPM_SUCCESS);
         out_len = sizeof(ptm_res);
@@ -908,12 +1357,16 @@ int ctrlchannel_process_fd(int fd,
         pgi = &_pgi;
 
         info_flags = be64toh(pgi->u.req.flags);
+        offset = be32toh(pgi->u.req.offset);
 
-        info_data = TPMLIB_GetInfo(info_flags);
+        if (info_flags & SWTPM_INFO_CMD_STATS)
+            info_data = cmdstats_get_json(offset == 0,
+                                          info_flags & SWTPM_INFO_CMD_STATS_RESET);
+        else
+            info_data = tpmlib_get_info(info_flags);
         if (!info_data)
             goto err_memory;
 
-        offset = be32toh(pgi->u.req.offset);
         if (offset >= strlen(info_data)) {
             free(info_data);
             goto err_bad_input;
@@ -945,7 +1398,8 @@ int ctrlchannel_process_fd(int fd,
         pls = (ptm_lockstorage *)&output.body;
         out_len = sizeof(pls->u.resp);
 
-        if (!mainloop_ensure_locked_storage(mlp))
+        if (SWTPM_NVRAM_Flush() != TPM_SUCCESS ||
+            !mainloop_ensure_locked_storage(mlp))
             pls->u.resp.tpm_result = htobe32(TPM_FAIL);
         else
             pls->u.resp.tpm_result = htobe32(TPM_SUCCESS);
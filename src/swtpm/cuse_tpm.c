@@ -87,6 +87,7 @@
 #include "swtpm_utils.h"
 #include "daemonize.h"
 #include "pcap.h"
+#include "cmdstats.h"
 
 /* maximum size of request buffer */
 #define TPM_REQ_MAX 4096
@@ -234,24 +235,24 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "-n NAME|--name=NAME :  device name (mandatory)\n"
     "-M MAJ|--maj=MAJ    :  device major number\n"
     "-m MIN|--min=MIN    :  device minor number\n"
-    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                    :  use an AES key for the encryption of the TPM's state\n"
     "                       files; use the given mode for the block encryption;\n"
     "                       the key is to be provided as a hex string or in binary\n"
     "                       format; the keyfile can be automatically removed using\n"
     "                       the remove parameter\n"
-    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                    :  provide a passphrase in a file; the AES key will be\n"
     "                       derived from this passphrase; default kdf is PBKDF2\n"
     "--locality [reject-locality-4][,allow-set-locality]\n"
     "                    :  reject-locality-4: reject any command in locality 4\n"
     "                       allow-set-locality: accept SetLocality command\n"
-    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                    :  use an AES key for the encryption of the TPM's state\n"
     "                       when it is retrieved from the TPM via ioctls;\n"
     "                       Setting this key ensures that the TPM's state will always\n"
     "                       be encrypted when migrated\n"
-    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                    :  provide a passphrase in a file; the AES key will be\n"
     "                       derived from this passphrase; default kdf is PBKDF2\n"
     "--log file=<path>|fd=<filedescriptor>[,level=n][,prefix=<prefix>][,truncate]\n"
@@ -263,6 +264,8 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "--pid file=<path>|fd=<filedescriptor>\n"
     "                    :  write the process ID into the given file\n"
     "--tpmstate dir=<dir>|backend-uri=<uri>[,mode=0...][,lock][,backup][,fsync]\n"
+    "           [,write-behind=<ms>][,page-flush][,max-states=<n>][,batch-fsync]\n"
+    "           [,direct-io][,compress]\n"
     "                    :  set the directory or uri where the TPM's state will be written\n"
     "                       into; the TPM_PATH environment variable can be used\n"
     "                       instead of dir option;\n"
@@ -271,8 +274,20 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                       lock enables file-locking by the storage backend;\n"
     "                       backup has the directory-backend create a backup of the\n"
     "                       permanent state file;\n"
-    "                       with fsync the directory-backend ensures that all data have\n"
-    "                       been transferred to disk before proceeding;\n"
+    "                       with fsync the directory-backend and the file backend ensure\n"
+    "                       that all data have been transferred to disk before proceeding;\n"
+    "                       write-behind writes the state in the background after\n"
+    "                       the given number of milliseconds and combines the\n"
+    "                       writes of the same state in that time;\n"
+    "                       page-flush has the file backend only write and flush the\n"
+    "                       pages of the state that changed;\n"
+    "                       max-states sets the number of entries in the header of a new\n"
+    "                       file backend;\n"
+    "                       batch-fsync has the directory-backend sync the directory once\n"
+    "                       for all states stored by a TPM command; implies fsync;\n"
+    "                       direct-io has the file backend access the file or block\n"
+    "                       device with O_DIRECT instead of memory-mapping it;\n"
+    "                       compress compresses the state with zstd before writing it;\n"
     "--flags [not-need-init][,startup-clear|startup-state|startup-deactivated|startup-none][,disable-auto-shutdown]\n"
     "                    :  not-need-init: commands can be sent without needing to\n"
     "                       send an INIT via control channel;\n"
@@ -292,10 +307,11 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                    :  Choose the action of the seccomp profile when a\n"
     "                       blacklisted syscall is executed; default is kill\n"
 #endif
-    "--migration [incoming][,release-lock-outgoing]\n"
+    "--migration [incoming][,release-lock-outgoing][,compress]\n"
     "                    : Incoming migration defers locking of storage backend\n"
     "                      until the TPM state is received; release-lock-outgoing\n"
-    "                      releases the storage lock on outgoing migration\n"
+    "                      releases the storage lock on outgoing migration;\n"
+    "                      compress compresses the state blobs for migration\n"
     "--print-capabilities : print capabilities and terminate\n"
     "--print-states      : print existing TPM states and terminate\n"
     "--profile name=<name>|profile=<json-profile>|file=<filename>|fd=<fd>[,remove-disabled=check|fips-host]\n"
@@ -444,16 +460,18 @@ static TPM_RESULT cached_stateblob_load(uint32_t blobtype, TPM_BOOL decrypt)
 
     cached_stateblob_free();
 
-    if (blobtype == PTM_BLOB_TYPE_VOLATILE)
-        res = SWTPM_NVRAM_Store_Volatile();
+    /* the state must be durable before it is handed out */
+    if (res == 0)
+        res = SWTPM_NVRAM_Flush();
 
+    /* the volatile state is taken from the TPM without a state file */
     if (res == 0)
         res = SWTPM_NVRAM_GetStateBlob(&cached_stateblob.data,
                                        &cached_stateblob.data_length,
                                        tpm_number, blobname, decrypt,
                                        &cached_stateblob.is_encrypted);
 
-    /* make sure the volatile state file is gone */
+    /* remove a volatile state file left by an earlier PTM_STORE_VOLATILE */
     if (blobtype == PTM_BLOB_TYPE_VOLATILE)
         SWTPM_NVRAM_DeleteName(tpm_number, blobname, FALSE);
 
@@ -509,13 +527,17 @@ static int cached_stateblob_copy(void *dest, size_t destlen,
 static void worker_thread(gpointer data, gpointer user_data SWTPM_ATTR_UNUSED)
 {
     struct thread_message *msg = (struct thread_message *)data;
+    struct timespec start;
 
     /* file_ops_lock not needed since thread_busy is set */
 
     switch (msg->type) {
     case MESSAGE_TPM_CMD:
+        cmdstats_start(&start);
         TPMLIB_Process(&ptm_response, &ptm_res_len, &ptm_res_tot,
                        ptm_request, ptm_req_len);
+        SWTPM_NVRAM_Sync();
+        cmdstats_record(g_lastCommand, ptm_req_len, ptm_res_len, &start);
         ptm_read_offset = 0;
         break;
     case MESSAGE_IOCTL:
@@ -571,6 +593,10 @@ static int tpm_start(uint32_t flags, TPMLIB_TPMVersion l_tpmversion,
         return -1;
     }
 
+    if (SWTPM_NVRAM_Start_WriteBehind() != TPM_SUCCESS ||
+        SWTPM_NVRAM_Start_LockWaiter() != TPM_SUCCESS)
+        return -1;
+
     if(!ptm_request)
         ptm_request = malloc(4096);
     if(!ptm_request) {
@@ -646,6 +672,7 @@ static int ptm_send_startup(uint16_t startupType,
 
         rc = TPMLIB_Process(&ptm_response, &ptm_res_len, &ptm_res_tot,
                            (unsigned char *)command, command_length);
+        SWTPM_NVRAM_Sync();
         ptm_read_offset = 0;
 
         pcap_packet_record_write(&g_ps, ptm_response, ptm_res_len, false);
@@ -1000,6 +1027,7 @@ static void ptm_write_cmd(fuse_req_t req, const char *buf, size_t size,
                           TPMLIB_TPMVersion l_tpmversion)
 {
     uint32_t lastCommand;
+    struct timespec start;
 
     ptm_req_len = size;
     ptm_res_len = 0;
@@ -1051,8 +1079,11 @@ static void ptm_write_cmd(fuse_req_t req, const char *buf, size_t size,
             g_thread_pool_push(pool, &g_msg, NULL);
         } else {
             /* direct processing */
+            cmdstats_start(&start);
             TPMLIB_Process(&ptm_response, &ptm_res_len, &ptm_res_tot,
                            (unsigned char *)buf, ptm_req_len);
+            SWTPM_NVRAM_Sync();
+            cmdstats_record(lastCommand, ptm_req_len, ptm_res_len, &start);
             ptm_read_offset = 0;
         }
 
@@ -1244,7 +1275,7 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
     case PTM_STOP:
         tpm_end();
 
-        res = TPM_SUCCESS;
+        res = SWTPM_NVRAM_Flush();
 
         free(ptm_response);
         ptm_response = NULL;
@@ -1256,7 +1287,7 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
     case PTM_SHUTDOWN:
         tpm_end();
 
-        res = TPM_SUCCESS;
+        res = SWTPM_NVRAM_Flush();
 
         free(ptm_response);
         ptm_response = NULL;
@@ -1462,11 +1493,16 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
             char *info_data;
             uint32_t length, offset;
 
-            info_data = TPMLIB_GetInfo(in_pgi->u.req.flags);
+            offset = in_pgi->u.req.offset;
+
+            if (in_pgi->u.req.flags & SWTPM_INFO_CMD_STATS)
+                info_data = cmdstats_get_json(offset == 0,
+                        in_pgi->u.req.flags & SWTPM_INFO_CMD_STATS_RESET);
+            else
+                info_data = tpmlib_get_info(in_pgi->u.req.flags);
             if (!info_data)
                 goto error_memory;
 
-            offset = in_pgi->u.req.offset;
             if (offset >= strlen(info_data)) {
                 free(info_data);
                 goto error_bad_input;
@@ -1496,7 +1532,8 @@ static void ptm_ioctl(fuse_req_t req, int cmd, void *arg,
 
             g_locking_retries = in_pls->u.req.retries;
 
-            if (!ensure_locked_storage())
+            if (SWTPM_NVRAM_Flush() != TPM_SUCCESS ||
+                !ensure_locked_storage())
                 out_pls.u.resp.tpm_result = TPM_FAIL;
             else
                 out_pls.u.resp.tpm_result = TPM_SUCCESS;
@@ -90,6 +90,9 @@ encryption_mode_from_string(const char *mode, size_t *keylen)
     } else if (!strcmp(mode, "aes-256-cbc")) {
         *keylen = 256/8;
         return ENCRYPTION_MODE_AES_CBC;
+    } else if (!strcmp(mode, "aes-256-gcm")) {
+        *keylen = 256/8;
+        return ENCRYPTION_MODE_AES_256_GCM;
     }
 
     return ENCRYPTION_MODE_UNKNOWN;
@@ -47,6 +47,7 @@ enum key_format {
 enum encryption_mode {
     ENCRYPTION_MODE_UNKNOWN = 0,
     ENCRYPTION_MODE_AES_CBC = 1,
+    ENCRYPTION_MODE_AES_256_GCM = 2,
 };
 
 enum kdf_identifier {
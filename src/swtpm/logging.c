@@ -131,6 +131,20 @@ int log_init_fd(int fd)
     return 0;
 }
 
+/*
+ * log_get_fd:
+ * Get the file descriptor of the log file.
+ *
+ * Returns the file descriptor or -1 if not logging to a file.
+ */
+int log_get_fd(void)
+{
+    if (logfd == STDERR_FILENO || logfd == STDOUT_FILENO || logfd < 0)
+        return -1;
+
+    return logfd;
+}
+
 /*
  * log_set_level
  * Set the log level; the higher the level, the more is printed
@@ -48,6 +48,7 @@
 
 int log_init(const char *filename, bool truncate);
 int log_init_fd(int fd);
+int log_get_fd(void);
 int log_set_level(unsigned int level);
 ssize_t logprintf(int fd, const char *format, ...) SWTPM_ATTRIBUTE_FORMAT(2, 3);
 ssize_t logprintfA(int fd, unsigned int indent, const char *format, ...)
@@ -43,19 +43,26 @@
 #include <config.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 
+#include <glib.h>
+
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_library.h>
 #include <libtpms/tpm_memory.h>
+#include <libtpms/tpm_nvfilename.h>
 
 #include "swtpm_debug.h"
 #include "swtpm_io.h"
@@ -69,6 +76,16 @@
 #include "compiler_dependencies.h"
 #include "swtpm_utils.h"
 #include "swtpm_nvstore.h"
+#include "shmring.h"
+#include "threadpool.h"
+#include "cmdstats.h"
+#include "metrics.h"
+#include "upgrade.h"
+#include "sd-notify.h"
+
+/* the names of the connected clients in the file descriptor store */
+#define FDNAME_DATA_CLIENT  "data-client"
+#define FDNAME_CTRL_CLIENT  "ctrl-client"
 
 /* local variables */
 static TPM_MODIFIER_INDICATOR g_locality;
@@ -115,10 +132,342 @@ void mainloop_unlock_nvram(struct mainLoopParams *mlp,
     mlp->locking_retries = locking_retries;
 }
 
+/*
+ * mainloop_hibernated: Check whether the TPM hibernated; it then resumes
+ * from the volatile state that it stored when it is started
+ */
+bool mainloop_hibernated(void)
+{
+    /* tpm state dir must be set */
+    return SWTPM_NVRAM_HasState(TPM_VOLATILESTATE_NAME);
+}
+
+/*
+ * mainloop_resumed: The TPM resumed from the volatile state it stored when
+ * it hibernated; remove the state so that it is only resumed once and do
+ * not send TPM_Startup.
+ */
+void mainloop_resumed(struct mainLoopParams *mlp)
+{
+    if (SWTPM_NVRAM_DeleteName(0, TPM_VOLATILESTATE_NAME, FALSE) !=
+        TPM_SUCCESS)
+        logprintf(STDERR_FILENO,
+                  "Could not remove the volatile state after resuming.\n");
+
+    mlp->startupType = _TPM_ST_NONE;
+
+    logprintf(STDOUT_FILENO, "Resumed from hibernation.\n");
+}
+
+/*
+ * mainloop_store_client: Pass a connected client to the file descriptor store
+ * of systemd so that it is handed to the next instance; returns false if it
+ * could not be stored.
+ */
+static bool mainloop_store_client(int fd, const char *fdname)
+{
+    char state[64];
+    int r;
+
+    if (fd < 0)
+        return true;
+
+    snprintf(state, sizeof(state), "FDSTORE=1\nFDNAME=%s", fdname);
+    r = sd_notify_with_fds(0, state, &fd, 1);
+    if (r <= 0) {
+        logprintf(STDERR_FILENO,
+                  "Could not pass the %s to the file descriptor store: %s\n",
+                  fdname,
+                  r < 0 ? strerror(-r) : "NOTIFY_SOCKET is not set");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * mainloop_restore_clients: Take over the connected clients that the
+ * instance that hibernated passed to the file descriptor store and remove
+ * them from there.
+ */
+static void mainloop_restore_clients(TPM_CONNECTION_FD *connection_fd,
+                                     int *ctrlclntfd)
+{
+    char **names = NULL;
+    int n, i;
+
+    n = sd_listen_fds_with_names(0, &names);
+    for (i = 0; i < n; i++) {
+        if (!strcmp(names[i], FDNAME_DATA_CLIENT) && connection_fd->fd < 0) {
+            connection_fd->fd = SD_LISTEN_FDS_START + i;
+            sd_notify(0, "FDSTOREREMOVE=1\nFDNAME=" FDNAME_DATA_CLIENT);
+        } else if (!strcmp(names[i], FDNAME_CTRL_CLIENT) && *ctrlclntfd < 0) {
+            *ctrlclntfd = SD_LISTEN_FDS_START + i;
+            sd_notify(0, "FDSTOREREMOVE=1\nFDNAME=" FDNAME_CTRL_CLIENT);
+        }
+    }
+    g_strfreev(names);
+}
+
+/*
+ * mainloop_hibernate: Store the volatile state, pass the connected clients to
+ * the file descriptor store, and release the lock on the storage so that the
+ * TPM can be resumed by the next instance; returns false if the state or the
+ * clients could not be stored.
+ */
+static bool mainloop_hibernate(struct mainLoopParams *mlp,
+                               const TPM_CONNECTION_FD *connection_fd,
+                               int ctrlclntfd)
+{
+    TPM_RESULT res;
+
+    res = SWTPM_NVRAM_Store_Volatile();
+    if (res != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Could not store the volatile state to hibernate: 0x%x\n",
+                  res);
+        return false;
+    }
+
+    if (!mainloop_store_client(connection_fd->fd, FDNAME_DATA_CLIENT))
+        goto err_delete_state;
+    if (!mainloop_store_client(ctrlclntfd, FDNAME_CTRL_CLIENT)) {
+        if (connection_fd->fd >= 0)
+            sd_notify(0, "FDSTOREREMOVE=1\nFDNAME=" FDNAME_DATA_CLIENT);
+        goto err_delete_state;
+    }
+
+    mainloop_unlock_nvram(mlp, 0);
+
+    logprintf(STDOUT_FILENO,
+              "Hibernating after %u ms without activity.\n",
+              mlp->hibernate_idle_ms);
+
+    return true;
+
+err_delete_state:
+    /* the TPM keeps running and must not resume from it later */
+    if (SWTPM_NVRAM_DeleteName(0, TPM_VOLATILESTATE_NAME, FALSE) !=
+        TPM_SUCCESS)
+        logprintf(STDERR_FILENO,
+                  "Could not remove the volatile state.\n");
+
+    return false;
+}
+
+/* a TPM command processed by the worker thread */
+struct tpm_cmd_message {
+    struct thread_message msg;
+    unsigned char **rbuffer;
+    uint32_t *rlength;
+    uint32_t *rTotal;
+    unsigned char *command;
+    uint32_t command_length;
+    uint32_t ordinal;
+    TPM_RESULT rc;
+    int done_fd;        /* written to once the response is ready */
+};
+
+/*
+ * mainloop_worker_thread: the TPM worker thread
+ *
+ * Long running TPM commands are processed by this thread so that the main
+ * loop can respond to the control channel, for example to cancel them.
+ */
+static void mainloop_worker_thread(gpointer data,
+                                   gpointer user_data SWTPM_ATTR_UNUSED)
+{
+    struct tpm_cmd_message *tcm = data;
+    struct timespec start;
+    unsigned char c = 0;
+
+    cmdstats_start(&start);
+    tcm->rc = TPMLIB_Process(tcm->rbuffer, tcm->rlength, tcm->rTotal,
+                             tcm->command, tcm->command_length);
+    SWTPM_NVRAM_Sync();
+    cmdstats_record(tcm->ordinal, tcm->command_length, *tcm->rlength, &start);
+
+    worker_thread_mark_done();
+
+    if (write_full(tcm->done_fd, &c, sizeof(c)) < 0)
+        logprintf(STDERR_FILENO,
+                  "Could not notify main loop of completed command: %s\n",
+                  strerror(errno));
+}
+
+/*
+ * mainloop_start_worker_thread: Start the TPM worker thread
+ *
+ * The thread has to be started before the seccomp profile is applied since
+ * the profile does not allow creating threads.
+ */
+int mainloop_start_worker_thread(void)
+{
+    worker_thread_init();
+
+    pool = g_thread_pool_new(mainloop_worker_thread,
+                             NULL,
+                             1,
+                             TRUE,
+                             NULL);
+    if (!pool) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not create the thread pool.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* mainloop_fdset slots */
+enum {
+    DATA_CLIENT_FD = 0,
+    NOTIFY_FD,
+    CTRL_SERVER_FD,
+    CTRL_CLIENT_FD,
+    DATA_SERVER_FD,
+    WORKER_FD,
+    METRICS_FD,
+    MAINLOOP_NUM_FDS
+};
+
+/*
+ * The set of file descriptors the main loop waits on. Where available, the
+ * set is kept in an epoll instance that is only modified when the file
+ * descriptor or the events of a slot change. poll() is used otherwise and
+ * also as fallback if a file descriptor cannot be used with epoll.
+ */
+struct mainloop_fdset {
+    struct pollfd pollfds[MAINLOOP_NUM_FDS];
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+#endif
+};
+
+static void mainloop_fdset_init(struct mainloop_fdset *fs)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(fs->pollfds); i++) {
+        fs->pollfds[i].fd = -1;
+        fs->pollfds[i].events = 0;
+        fs->pollfds[i].revents = 0;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    fs->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (fs->epfd < 0)
+        logprintf(STDERR_FILENO, "epoll_create1 failed, using poll: %s\n",
+                  strerror(errno));
+#endif
+}
+
+static void mainloop_fdset_free(struct mainloop_fdset *fs)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (fs->epfd >= 0)
+        close(fs->epfd);
+    fs->epfd = -1;
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void mainloop_fdset_epoll_update(struct mainloop_fdset *fs,
+                                        size_t slot, int fd, short events)
+{
+    struct pollfd *pfd = &fs->pollfds[slot];
+    struct epoll_event ev = {
+        .events = ((events & POLLIN) ? EPOLLIN : 0) |
+                  ((events & POLLOUT) ? EPOLLOUT : 0),
+        .data.u32 = slot,
+    };
+    int ret = 0;
+    size_t i;
+
+    if (pfd->fd >= 0 && pfd->fd != fd) {
+        /* the old fd may have been closed and reused by another slot */
+        for (i = 0; i < ARRAY_LEN(fs->pollfds); i++) {
+            if (i != slot && fs->pollfds[i].fd == pfd->fd)
+                break;
+        }
+        if (i == ARRAY_LEN(fs->pollfds))
+            epoll_ctl(fs->epfd, EPOLL_CTL_DEL, pfd->fd, NULL);
+    }
+
+    if (fd >= 0) {
+        if (pfd->fd == fd) {
+            ret = epoll_ctl(fs->epfd, EPOLL_CTL_MOD, fd, &ev);
+        } else {
+            ret = epoll_ctl(fs->epfd, EPOLL_CTL_ADD, fd, &ev);
+            if (ret < 0 && errno == EEXIST)
+                ret = epoll_ctl(fs->epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+
+    if (ret < 0) {
+        /* for example a file that does not support epoll */
+        TPM_DEBUG("epoll_ctl failed, using poll: %s\n", strerror(errno));
+        close(fs->epfd);
+        fs->epfd = -1;
+    }
+}
+#endif
+
+static void mainloop_fdset_set(struct mainloop_fdset *fs, size_t slot,
+                               int fd, short events)
+{
+    struct pollfd *pfd = &fs->pollfds[slot];
+
+    if (fd < 0)
+        events = 0;
+    if (pfd->fd == fd && pfd->events == events)
+        return;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (fs->epfd >= 0)
+        mainloop_fdset_epoll_update(fs, slot, fd, events);
+#endif
+
+    pfd->fd = fd;
+    pfd->events = events;
+}
+
+/* wait for events; the results are returned in the revents of the pollfds */
+static int mainloop_fdset_wait(struct mainloop_fdset *fs, int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[MAINLOOP_NUM_FDS];
+    struct pollfd *pfd;
+    size_t i;
+    int n;
+
+    if (fs->epfd >= 0) {
+        for (i = 0; i < ARRAY_LEN(fs->pollfds); i++)
+            fs->pollfds[i].revents = 0;
+
+        n = epoll_wait(fs->epfd, events, ARRAY_LEN(events), timeout);
+        for (i = 0; n > 0 && i < (size_t)n; i++) {
+            if (events[i].data.u32 >= ARRAY_LEN(fs->pollfds))
+                continue;
+            pfd = &fs->pollfds[events[i].data.u32];
+            if (pfd->fd < 0)
+                continue;
+            pfd->revents = ((events[i].events & EPOLLIN) ? POLLIN : 0) |
+                           ((events[i].events & EPOLLOUT) ? POLLOUT : 0) |
+                           ((events[i].events & EPOLLHUP) ? POLLHUP : 0) |
+                           ((events[i].events & EPOLLERR) ? POLLERR : 0);
+        }
+        return n;
+    }
+#endif
+    return poll(fs->pollfds, ARRAY_LEN(fs->pollfds), timeout);
+}
+
 int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
 {
     TPM_RESULT          rc = 0;
-    TPM_CONNECTION_FD   connection_fd;             /* file descriptor for read/write */
+    TPM_CONNECTION_FD   connection_fd = {
+        .fd = -1,                                  /* file descriptor for read/write */
+    };
     unsigned char       *command = NULL;           /* command buffer */
     uint32_t            command_length;            /* actual length of command bytes */
     uint32_t            max_command_length;        /* command buffer size */
@@ -131,19 +480,24 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
     int                 ctrlclntfd;
     int                 sockfd;
     int                 ready;
+    int                 datafd;
+    bool                has_command;
+    bool                tpm_busy = false;
+    int                 worker_pipe[2] = { -1, -1 };
+    struct tpm_cmd_message tpm_cmd;
+    unsigned char       c;
     struct iovec        iov[3];
     uint32_t            ack = htobe32(0);
     struct tpm2_resp_prefix respprefix;
-    uint32_t            lastCommand;
-
-    /* poolfd[] indexes */
-    enum {
-        DATA_CLIENT_FD = 0,
-        NOTIFY_FD,
-        CTRL_SERVER_FD,
-        CTRL_CLIENT_FD,
-        DATA_SERVER_FD
-    };
+    uint32_t            lastCommand = TPM_ORDINAL_NONE;
+    struct timespec     cmd_start;
+    struct mainloop_fdset fdset;
+    struct pollfd       *pollfds = fdset.pollfds;
+    bool                hibernated = false;
+    gint64              idle_deadline = 0;
+    bool                has_fdstore = getenv("NOTIFY_SOCKET") != NULL;
+    gint64              now;
+    int                 timeout;
 
     TPM_DEBUG("mainLoop:\n");
 
@@ -157,18 +511,33 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
         return TPM_FAIL;
     }
 
+    mainloop_fdset_init(&fdset);
+
+    if (pool && pipe(worker_pipe) < 0) {
+        logprintf(STDERR_FILENO, "Could not create pipe: %s\n",
+                  strerror(errno));
+        worker_pipe[0] = worker_pipe[1] = -1;
+    }
+
     /* header and trailer that we may send by setting iov_len */
     iov[0].iov_base = &respprefix;
     iov[0].iov_len = 0;
     iov[2].iov_base = &ack;
     iov[2].iov_len = 0;
 
-    connection_fd.fd = -1;
     ctrlfd = ctrlchannel_get_fd(mlp->cc);
     ctrlclntfd = ctrlchannel_get_client_fd(mlp->cc);
 
     sockfd = SWTPM_IO_GetSocketFD();
 
+    /* take over the clients of the process before a live upgrade */
+    upgrade_finish(&connection_fd, command, max_command_length,
+                   &g_locality, ctrlclntfd);
+
+    /* take over the clients of the process that hibernated */
+    if (mlp->hibernate_idle_ms)
+        mainloop_restore_clients(&connection_fd, &ctrlclntfd);
+
     if (mlp->startupType != _TPM_ST_NONE) {
         command_length = tpmlib_create_startup_cmd(
                                   mlp->startupType,
@@ -180,6 +549,7 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
             mlp->lastCommand = tpmlib_get_cmd_ordinal(command, command_length);
             rc = TPMLIB_Process(&rbuffer, &rlength, &rTotal,
                                 command, command_length);
+            SWTPM_NVRAM_Sync();
 
             pcap_packet_record_write(&mlp->ps, rbuffer, rlength, false);
         }
@@ -200,43 +570,84 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
                     connection_fd.fd = mlp->fd;
                 }
             }
+            /* the shared memory ring replaces a socket data channel */
+            if (mlp->shmring && connection_fd.fd >= 0)
+                SWTPM_IO_Disconnect(&connection_fd);
 
-            struct pollfd pollfds[] = {
-                [DATA_CLIENT_FD] = {
-                    .fd = connection_fd.fd,
-                    .events = POLLIN | POLLHUP,
-                    .revents = 0,
-                },
-                [NOTIFY_FD] = {
-                    .fd = notify_fd,
-                    .events = POLLIN,
-                    .revents = 0,
-                },
-                [CTRL_SERVER_FD] = {
-                    .fd = -1,
-                    .events = POLLIN,
-                    .revents = 0,
-                },
-                [CTRL_CLIENT_FD] = {
-                    .fd = ctrlclntfd,
-                    .events = POLLIN | POLLHUP,
-                    .revents = 0,
-                },
-                [DATA_SERVER_FD] = {
-                    /* listen socket for accepting clients */
-                    .fd = -1,
-                    .events = POLLIN,
-                    .revents = 0,
-                }
-            };
+            /* only returns if the new process could not be executed */
+            if (mlp->live_upgrade && !tpm_busy &&
+                !SWTPM_IO_WritePending(&connection_fd)) {
+                mlp->live_upgrade = false;
+                upgrade_exec(mlp, &connection_fd, command, ctrlclntfd);
+            }
 
+            /*
+             * While a response is being sent, wait for the data client to
+             * become writable and do not read the next command. A command
+             * that was received along with the previous one is processed
+             * without waiting.
+             */
+            has_command = !tpm_busy &&
+                          !SWTPM_IO_WritePending(&connection_fd) &&
+                          SWTPM_IO_HasCommand(&connection_fd, command,
+                                              max_command_length);
+
+            /* do not read the next command while the TPM is busy */
+            if (tpm_busy)
+                datafd = -1;
+            else
+                datafd = mlp->shmring ? shmring_get_fd(mlp->shmring)
+                                      : connection_fd.fd;
+            mainloop_fdset_set(&fdset, DATA_CLIENT_FD, datafd,
+                               SWTPM_IO_WritePending(&connection_fd)
+                               ? POLLOUT : POLLIN | POLLHUP);
+            mainloop_fdset_set(&fdset, NOTIFY_FD, notify_fd, POLLIN);
             /* only listen for clients if we don't have one */
-            if (connection_fd.fd < 0)
-                pollfds[DATA_SERVER_FD].fd = sockfd;
-            if (ctrlclntfd < 0)
-                pollfds[CTRL_SERVER_FD].fd = ctrlfd;
+            mainloop_fdset_set(&fdset, CTRL_SERVER_FD,
+                               ctrlclntfd < 0 ? ctrlfd : -1, POLLIN);
+            mainloop_fdset_set(&fdset, CTRL_CLIENT_FD, ctrlclntfd,
+                               POLLIN | POLLHUP);
+            mainloop_fdset_set(&fdset, DATA_SERVER_FD,
+                               connection_fd.fd < 0 && !mlp->shmring &&
+                               !tpm_busy ? sockfd : -1, POLLIN);
+            mainloop_fdset_set(&fdset, WORKER_FD, worker_pipe[0], POLLIN);
+            mainloop_fdset_set(&fdset, METRICS_FD, metrics_get_fd(), POLLIN);
+
+            /*
+             * Hibernate once no command has been received and no client has
+             * connected for a while; the listening sockets stay with the
+             * socket activation and the connected clients are passed to the
+             * file descriptor store. The locality is not stored, so connected
+             * clients must not have changed it.
+             */
+            timeout = has_command ? 0 : -1;
+            if (mlp->hibernate_idle_ms && tpm_running && mlp->storage_locked &&
+                !tpm_busy && !mlp->shmring && !has_command &&
+                !SWTPM_IO_WritePending(&connection_fd) &&
+                connection_fd.rx_len == connection_fd.rx_consumed &&
+                ((connection_fd.fd < 0 && ctrlclntfd < 0) ||
+                 (has_fdstore && g_locality == 0))) {
+                now = g_get_monotonic_time();
+                if (idle_deadline == 0)
+                    idle_deadline = now +
+                                    (gint64)mlp->hibernate_idle_ms * 1000;
+                if (now >= idle_deadline) {
+                    if (mainloop_hibernate(mlp, &connection_fd, ctrlclntfd)) {
+                        hibernated = true;
+                        g_mainloop_terminate = true;
+                        break;
+                    }
+                    /* do not try again */
+                    mlp->hibernate_idle_ms = 0;
+                } else {
+                    timeout = MIN((idle_deadline - now + 999) / 1000,
+                                  INT_MAX);
+                }
+            } else {
+                idle_deadline = 0;
+            }
 
-            ready = poll(pollfds, 5, -1);
+            ready = mainloop_fdset_wait(&fdset, timeout);
             if (ready < 0 && errno == EINTR)
                 continue;
 
@@ -257,13 +668,19 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
                 }
             }
 
-            if (pollfds[DATA_SERVER_FD].revents & POLLIN)
+            /* a new client or a command restarts the idle time */
+            if (pollfds[DATA_SERVER_FD].revents & POLLIN) {
                 connection_fd.fd = accept(pollfds[DATA_SERVER_FD].fd, NULL, 0);
+                idle_deadline = 0;
+            }
 
-            if (pollfds[CTRL_SERVER_FD].revents & POLLIN)
+            if (pollfds[CTRL_SERVER_FD].revents & POLLIN) {
                 ctrlclntfd = accept(ctrlfd, NULL, 0);
+                idle_deadline = 0;
+            }
 
             if (pollfds[CTRL_CLIENT_FD].revents & POLLIN) {
+                idle_deadline = 0;
                 ctrlclntfd = ctrlchannel_process_fd(ctrlclntfd,
                                                     &g_mainloop_terminate,
                                                     &g_locality, &tpm_running,
@@ -287,17 +704,70 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
                 }
             }
 
-            if (!(pollfds[DATA_CLIENT_FD].revents & POLLIN))
+            if (pollfds[METRICS_FD].revents & POLLIN)
+                metrics_serve_client();
+
+            if (pollfds[WORKER_FD].revents & POLLIN) {
+                if (read_eintr(worker_pipe[0], &c, sizeof(c)) < 0)
+                    logprintf(STDERR_FILENO,
+                              "Could not read from worker pipe: %s\n",
+                              strerror(errno));
+                if (tpm_busy) {
+                    tpm_busy = false;
+                    rc = tpm_cmd.rc;
+                    goto skip_process;
+                }
+            }
+
+            if (pollfds[DATA_CLIENT_FD].revents & (POLLOUT | POLLERR) &&
+                SWTPM_IO_WritePending(&connection_fd)) {
+                rc = SWTPM_IO_Flush(&connection_fd);
+                if (rc == TPM_RETRY) {
+                    rc = 0;
+                    continue;
+                }
+                if (rc != 0) {
+                    /* connection broke */
+                    SWTPM_IO_Disconnect(&connection_fd);
+                    continue;
+                }
+                if (!(mlp->flags & MAIN_LOOP_FLAG_KEEP_CONNECTION)) {
+                    SWTPM_IO_Disconnect(&connection_fd);
+                    break;
+                }
                 continue;
+            }
+
+            if (!(pollfds[DATA_CLIENT_FD].revents & POLLIN) && !has_command)
+                continue;
+
+            idle_deadline = 0;
 
             /* before processing a command ensure that the storage is locked */
             if ((g_mainloop_terminate = !mainloop_ensure_locked_storage(mlp)))
                 break;
 
             /* Read the command.  The number of bytes is determined by 'paramSize' in the stream */
-            if (rc == 0) {
+            if (rc == 0 && mlp->shmring) {
+                rc = shmring_read(mlp->shmring, command, &command_length,
+                                  max_command_length, &mlp->ps);
+                if (rc == TPM_RETRY) {
+                    /* spurious wakeup */
+                    rc = 0;
+                    continue;
+                }
+                if (rc != 0) {
+                    shmring_free(mlp->shmring);
+                    mlp->shmring = NULL;
+                }
+            } else if (rc == 0) {
                 rc = SWTPM_IO_Read(&connection_fd, command, &command_length,
                                    max_command_length, &mlp->ps);
+                if (rc == TPM_RETRY) {
+                    /* command not completely received yet */
+                    rc = 0;
+                    continue;
+                }
                 if (rc != 0) {
                     /* connection broke */
                     SWTPM_IO_Disconnect(&connection_fd);
@@ -351,13 +821,41 @@ int mainLoop(struct mainLoopParams *mlp, int notify_fd, bool tpm_running)
                     goto skip_process;
             }
 
+            if (rc == 0 && worker_pipe[0] >= 0 &&
+                tpmlib_is_request_cancelable(mlp->tpmversion,
+                                             &command[cmd_offset],
+                                             command_length - cmd_offset)) {
+                /* have command processed by the worker thread */
+                rlength = 0;                                /* clear the response buffer */
+                tpm_cmd = (struct tpm_cmd_message) {
+                    .msg.type = MESSAGE_TPM_CMD,
+                    .rbuffer = &rbuffer,
+                    .rlength = &rlength,
+                    .rTotal = &rTotal,
+                    .command = &command[cmd_offset],
+                    .command_length = command_length - cmd_offset,
+                    .ordinal = lastCommand,
+                    .done_fd = worker_pipe[1],
+                };
+                tpm_busy = true;
+
+                worker_thread_mark_busy();
+
+                g_thread_pool_push(pool, &tpm_cmd, NULL);
+                continue;
+            }
+
             if (rc == 0) {
                 rlength = 0;                                /* clear the response buffer */
+                cmdstats_start(&cmd_start);
                 rc = TPMLIB_Process(&rbuffer,
                                     &rlength,
                                     &rTotal,
                                     &command[cmd_offset],
                                     command_length - cmd_offset);
+                SWTPM_NVRAM_Sync();
+                cmdstats_record(lastCommand, command_length - cmd_offset,
+                                rlength, &cmd_start);
             }
 
 skip_process:
@@ -367,11 +865,28 @@ skip_process:
                 iov[1].iov_base = rbuffer;
                 iov[1].iov_len  = rlength;
 
-                SWTPM_IO_Write(&connection_fd, iov, ARRAY_LEN(iov),
-                               &mlp->ps);
+                if (mlp->shmring) {
+                    if (shmring_write(mlp->shmring, iov, ARRAY_LEN(iov),
+                                      &mlp->ps) != 0) {
+                        shmring_free(mlp->shmring);
+                        mlp->shmring = NULL;
+                    }
+                } else {
+                    switch (SWTPM_IO_Write(&connection_fd, iov, ARRAY_LEN(iov),
+                                           &mlp->ps)) {
+                    case 0:
+                        break;
+                    case TPM_RETRY:
+                        /* finish sending once the client is writable */
+                        continue;
+                    default:
+                        SWTPM_IO_Disconnect(&connection_fd);
+                    }
+                }
             }
 
-            if (!(mlp->flags & MAIN_LOOP_FLAG_KEEP_CONNECTION)) {
+            if (!mlp->shmring &&
+                !(mlp->flags & MAIN_LOOP_FLAG_KEEP_CONNECTION)) {
                 SWTPM_IO_Disconnect(&connection_fd);
                 break;
             }
@@ -384,10 +899,20 @@ skip_process:
             break;
     }
 
-    if (tpm_running && !mlp->disable_auto_shutdown)
+    /* let a command being processed by the worker thread finish */
+    worker_thread_end();
+
+    /* the TPM resumes from the stored volatile state */
+    if (tpm_running && !mlp->disable_auto_shutdown && !hibernated)
         tpmlib_maybe_send_tpm2_shutdown(mlp->tpmversion, &mlp->lastCommand,
                                         &mlp->ps);
 
+    mainloop_fdset_free(&fdset);
+    if (worker_pipe[0] >= 0) {
+        close(worker_pipe[0]);
+        close(worker_pipe[1]);
+    }
+
     free(rbuffer);
     free(command);
 
@@ -395,6 +920,9 @@ skip_process:
         close(ctrlclntfd);
     ctrlchannel_set_client_fd(mlp->cc, -1);
 
+    shmring_free(mlp->shmring);
+    mlp->shmring = NULL;
+
     if (connection_fd.fd >= 0 && !(mlp->flags & MAIN_LOOP_FLAG_USE_FD))
         close(connection_fd.fd);
 
@@ -45,6 +45,8 @@
 
 #include "pcap.h"
 
+struct shmring;
+
 #include <libtpms/tpm_library.h>
 
 extern bool g_mainloop_terminate;
@@ -78,6 +80,12 @@ struct mainLoopParams {
     char *json_profile;
     /* PCAP state */
     struct pcap_state ps;
+    /* shared memory command channel set via CMD_SET_DATAFD_SHM */
+    struct shmring *shmring;
+    /* hibernate after this many ms without activity; 0 to never hibernate */
+    unsigned int hibernate_idle_ms;
+    /* re-execute the binary once the TPM is idle; set by CMD_LIVE_UPGRADE */
+    bool live_upgrade;
 };
 
 int mainLoop(struct mainLoopParams *mlp,
@@ -85,7 +93,10 @@ int mainLoop(struct mainLoopParams *mlp,
 TPM_RESULT mainloop_cb_get_locality(TPM_MODIFIER_INDICATOR *loc,
                                     uint32_t tpmnum);
 bool mainloop_ensure_locked_storage(struct mainLoopParams *mlp);
+int mainloop_start_worker_thread(void);
 void mainloop_unlock_nvram(struct mainLoopParams *mlp,
                            unsigned int locking_retries);
+bool mainloop_hibernated(void);
+void mainloop_resumed(struct mainLoopParams *mlp);
 
 #endif /* _SWTPM_MAINLOOP_H_ */
@@ -0,0 +1,565 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * metrics.c -- OpenMetrics endpoint
+ *
+ * Each client connecting to the metrics socket is sent the current metrics
+ * in OpenMetrics text format and the connection is then closed. The
+ * counters are updated with atomic operations so that serving a client
+ * never has to wait for the processing of a TPM command.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "cmdstats.h"
+#include "logging.h"
+#include "metrics.h"
+#include "tpm_ioctl.h"
+#include "utils.h"
+#include "swtpm_utils.h"
+
+#define METRICS_NUM_CTRL_CMDS  32
+
+/* how long a client may take to read the metrics */
+#define METRICS_SEND_TIMEOUT_MS  1000
+
+struct metrics_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[CMDSTATS_NUM_BUCKETS];
+};
+
+static struct {
+    int fd;
+    char *sockpath;
+    struct timespec start;
+
+    uint64_t nvram_stores;
+    uint64_t nvram_store_bytes;
+    uint64_t nvram_coalesced;
+    uint64_t nvram_coalesced_bytes;
+    uint64_t nvram_elided;
+    uint64_t nvram_elided_bytes;
+    uint64_t nvram_flushed_bytes;
+    struct metrics_histogram sync;
+    uint64_t nvram_compress_in_bytes;
+    uint64_t nvram_compress_out_bytes;
+    struct metrics_histogram compress;
+    uint64_t nvram_crypto_setups_cached;
+    uint64_t nvram_crypto_setups_new;
+    uint64_t nvram_crypto_setup_ns;
+    struct metrics_histogram lock_wait;
+    uint64_t nvram_lock_timeouts;
+    uint64_t ctrl_cmds[METRICS_NUM_CTRL_CMDS];
+} metrics = {
+    .fd = -1,
+};
+
+static const char *ctrl_cmd_names[METRICS_NUM_CTRL_CMDS] = {
+    [CMD_GET_CAPABILITY] = "get_capability",
+    [CMD_INIT] = "init",
+    [CMD_SHUTDOWN] = "shutdown",
+    [CMD_GET_TPMESTABLISHED] = "get_tpmestablished",
+    [CMD_SET_LOCALITY] = "set_locality",
+    [CMD_HASH_START] = "hash_start",
+    [CMD_HASH_DATA] = "hash_data",
+    [CMD_HASH_END] = "hash_end",
+    [CMD_CANCEL_TPM_CMD] = "cancel_tpm_cmd",
+    [CMD_STORE_VOLATILE] = "store_volatile",
+    [CMD_RESET_TPMESTABLISHED] = "reset_tpmestablished",
+    [CMD_GET_STATEBLOB] = "get_stateblob",
+    [CMD_SET_STATEBLOB] = "set_stateblob",
+    [CMD_STOP] = "stop",
+    [CMD_GET_CONFIG] = "get_config",
+    [CMD_SET_DATAFD] = "set_datafd",
+    [CMD_SET_BUFFERSIZE] = "set_buffersize",
+    [CMD_GET_INFO] = "get_info",
+    [CMD_LOCK_STORAGE] = "lock_storage",
+    [CMD_SET_DATAFD_SHM] = "set_datafd_shm",
+    [CMD_GET_STATEBLOB_PRECOPY] = "get_stateblob_precopy",
+    [CMD_GET_STATE_BUNDLE] = "get_state_bundle",
+    [CMD_SET_STATE_BUNDLE] = "set_state_bundle",
+    [CMD_LIVE_UPGRADE] = "live_upgrade",
+};
+
+/*
+ * metrics_init: Initialize the metrics; this must be called at startup
+ */
+void metrics_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+}
+
+/*
+ * metrics_set_fd: Set the listening socket of the metrics endpoint
+ *
+ * @fd: the file descriptor of the socket
+ * @sockpath: the path of the UnixIO socket to remove when done; may be NULL
+ */
+void metrics_set_fd(int fd, const char *sockpath)
+{
+    metrics.fd = fd;
+    if (sockpath)
+        metrics.sockpath = g_strdup(sockpath);
+}
+
+int metrics_get_fd(void)
+{
+    return metrics.fd;
+}
+
+void metrics_free(void)
+{
+    if (metrics.fd >= 0)
+        close(metrics.fd);
+    metrics.fd = -1;
+
+    if (metrics.sockpath)
+        unlink(metrics.sockpath);
+    SWTPM_G_FREE(metrics.sockpath);
+}
+
+/*
+ * metrics_nvram_store: Record that the TPM state with the given length was
+ *                      written to the storage backend
+ */
+void metrics_nvram_store(uint32_t length)
+{
+    __atomic_fetch_add(&metrics.nvram_stores, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.nvram_store_bytes, length, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_coalesced: Record that a store of TPM state with the given
+ *                          length was replaced by a later one before it
+ *                          was written (write-behind)
+ */
+void metrics_nvram_coalesced(uint32_t length)
+{
+    __atomic_fetch_add(&metrics.nvram_coalesced, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.nvram_coalesced_bytes, length,
+                       __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_elided: Record that a store of TPM state with the given
+ *                       length was skipped since the data were unchanged
+ */
+void metrics_nvram_elided(uint32_t length)
+{
+    __atomic_fetch_add(&metrics.nvram_elided, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.nvram_elided_bytes, length, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_flush: Record that the given number of bytes of the storage
+ *                      backend were flushed to persistent storage
+ */
+void metrics_nvram_flush(uint32_t length)
+{
+    __atomic_fetch_add(&metrics.nvram_flushed_bytes, length, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_sync_record: Record the latency of syncing written data to
+ *                      persistent storage (fsync, msync)
+ *
+ * @start: the time returned by cmdstats_start() before syncing
+ */
+void metrics_sync_record(const struct timespec *start)
+{
+    uint64_t duration_ns = cmdstats_elapsed_ns(start);
+
+    __atomic_fetch_add(&metrics.sync.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.sync.sum_ns, duration_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.sync.buckets[cmdstats_bucket(duration_ns)], 1,
+                       __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_compress: Record that TPM state was compressed
+ *
+ * @in_length: the length of the uncompressed data
+ * @out_length: the length of the compressed data
+ * @start: the time returned by cmdstats_start() before compressing
+ */
+void metrics_nvram_compress(uint32_t in_length, uint32_t out_length,
+                            const struct timespec *start)
+{
+    uint64_t duration_ns = cmdstats_elapsed_ns(start);
+
+    __atomic_fetch_add(&metrics.nvram_compress_in_bytes, in_length,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.nvram_compress_out_bytes, out_length,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.compress.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.compress.sum_ns, duration_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.compress.buckets[cmdstats_bucket(duration_ns)],
+                       1, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_crypto_setup: Record that a cipher or MAC context for
+ *                             encrypting, decrypting, or authenticating TPM
+ *                             state was set up
+ *
+ * @cached: whether the context was cloned from the one of the key
+ * @start: the time returned by cmdstats_start() before setting it up
+ */
+void metrics_nvram_crypto_setup(bool cached, const struct timespec *start)
+{
+    uint64_t duration_ns = cmdstats_elapsed_ns(start);
+
+    __atomic_fetch_add(cached ? &metrics.nvram_crypto_setups_cached
+                              : &metrics.nvram_crypto_setups_new,
+                       1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.nvram_crypto_setup_ns, duration_ns,
+                       __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_lock_wait: Record that the lock on the storage was taken
+ *
+ * @start: the time returned by cmdstats_start() before trying to take it
+ */
+void metrics_nvram_lock_wait(const struct timespec *start)
+{
+    uint64_t duration_ns = cmdstats_elapsed_ns(start);
+
+    __atomic_fetch_add(&metrics.lock_wait.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.lock_wait.sum_ns, duration_ns,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics.lock_wait.buckets[cmdstats_bucket(duration_ns)],
+                       1, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_nvram_lock_timeout: Record that the lock on the storage could not
+ *                             be taken since another process held it
+ */
+void metrics_nvram_lock_timeout(void)
+{
+    __atomic_fetch_add(&metrics.nvram_lock_timeouts, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * metrics_ctrl_cmd: Record a control channel command
+ */
+void metrics_ctrl_cmd(uint32_t cmd)
+{
+    if (cmd < METRICS_NUM_CTRL_CMDS && ctrl_cmd_names[cmd])
+        __atomic_fetch_add(&metrics.ctrl_cmds[cmd], 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* append the buckets, count, and sum of a histogram in seconds */
+static void metrics_append_histogram(GString *gstr, const char *name,
+                                     const char *labels,
+                                     const uint64_t *buckets,
+                                     uint64_t sum_ns)
+{
+    const char *sep = labels[0] ? "," : "";
+    const char *lb = labels[0] ? "{" : "";
+    const char *rb = labels[0] ? "}" : "";
+    uint64_t cumulative = 0;
+    size_t i;
+
+    for (i = 0; i < CMDSTATS_NUM_BUCKETS - 1; i++) {
+        cumulative += buckets[i];
+        g_string_append_printf(gstr,
+                               "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n",
+                               name, labels, sep,
+                               (double)((uint64_t)1 << i) / 1E6, cumulative);
+    }
+    cumulative += buckets[i];
+    g_string_append_printf(gstr,
+                           "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n"
+                           "%s_count%s%s%s %" PRIu64 "\n"
+                           "%s_sum%s%s%s %.9f\n",
+                           name, labels, sep, cumulative,
+                           name, lb, labels, rb, cumulative,
+                           name, lb, labels, rb, (double)sum_ns / 1E9);
+}
+
+static void metrics_append_tpm_commands(const struct cmdstats_values *cv,
+                                        void *opaque)
+{
+    GString *gstr = opaque;
+    char labels[32];
+
+    if (cv->count == 0)
+        return;
+
+    snprintf(labels, sizeof(labels), "ordinal=\"0x%x\"", cv->ordinal);
+    metrics_append_histogram(gstr, "swtpm_tpm_command_duration_seconds",
+                             labels, cv->buckets, cv->total_ns);
+}
+
+static void metrics_append_tpm_req_bytes(const struct cmdstats_values *cv,
+                                         void *opaque)
+{
+    GString *gstr = opaque;
+
+    if (cv->count == 0)
+        return;
+
+    g_string_append_printf(gstr,
+        "swtpm_tpm_command_request_bytes_total{ordinal=\"0x%x\"} %" PRIu64 "\n",
+        cv->ordinal, cv->req_bytes);
+}
+
+static void metrics_append_tpm_resp_bytes(const struct cmdstats_values *cv,
+                                          void *opaque)
+{
+    GString *gstr = opaque;
+
+    if (cv->count == 0)
+        return;
+
+    g_string_append_printf(gstr,
+        "swtpm_tpm_command_response_bytes_total{ordinal=\"0x%x\"} %" PRIu64 "\n",
+        cv->ordinal, cv->resp_bytes);
+}
+
+/* get the resident set size of the process; returns 0 if not available */
+static uint64_t metrics_get_rss(void)
+{
+    unsigned long long size, resident;
+    uint64_t rss = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf(f, "%llu %llu", &size, &resident) == 2)
+        rss = resident * sysconf(_SC_PAGESIZE);
+    fclose(f);
+
+    return rss;
+}
+
+static GString *metrics_format(void)
+{
+    GString *gstr = g_string_new(NULL);
+    uint64_t buckets[CMDSTATS_NUM_BUCKETS];
+    struct timespec now;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    g_string_append_printf(gstr,
+        "# TYPE swtpm_uptime_seconds gauge\n"
+        "# UNIT swtpm_uptime_seconds seconds\n"
+        "# HELP swtpm_uptime_seconds Time since swtpm started.\n"
+        "swtpm_uptime_seconds %.3f\n"
+        "# TYPE swtpm_resident_memory_bytes gauge\n"
+        "# UNIT swtpm_resident_memory_bytes bytes\n"
+        "# HELP swtpm_resident_memory_bytes Resident set size of swtpm.\n"
+        "swtpm_resident_memory_bytes %" PRIu64 "\n",
+        (double)(now.tv_sec - metrics.start.tv_sec) +
+        (double)(now.tv_nsec - metrics.start.tv_nsec) / 1E9,
+        metrics_get_rss());
+
+    g_string_append(gstr,
+        "# TYPE swtpm_tpm_command_duration_seconds histogram\n"
+        "# UNIT swtpm_tpm_command_duration_seconds seconds\n"
+        "# HELP swtpm_tpm_command_duration_seconds Time spent processing TPM commands by ordinal.\n");
+    cmdstats_foreach(metrics_append_tpm_commands, gstr);
+
+    g_string_append(gstr,
+        "# TYPE swtpm_tpm_command_request_bytes counter\n"
+        "# UNIT swtpm_tpm_command_request_bytes bytes\n"
+        "# HELP swtpm_tpm_command_request_bytes Size of TPM commands by ordinal.\n");
+    cmdstats_foreach(metrics_append_tpm_req_bytes, gstr);
+
+    g_string_append(gstr,
+        "# TYPE swtpm_tpm_command_response_bytes counter\n"
+        "# UNIT swtpm_tpm_command_response_bytes bytes\n"
+        "# HELP swtpm_tpm_command_response_bytes Size of TPM responses by ordinal.\n");
+    cmdstats_foreach(metrics_append_tpm_resp_bytes, gstr);
+
+    g_string_append_printf(gstr,
+        "# TYPE swtpm_nvram_stores counter\n"
+        "# HELP swtpm_nvram_stores Number of times TPM state was written to storage.\n"
+        "swtpm_nvram_stores_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_written_bytes counter\n"
+        "# UNIT swtpm_nvram_written_bytes bytes\n"
+        "# HELP swtpm_nvram_written_bytes Number of bytes of TPM state written to storage.\n"
+        "swtpm_nvram_written_bytes_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_coalesced_stores counter\n"
+        "# HELP swtpm_nvram_coalesced_stores Number of stores of TPM state not written due to write-behind.\n"
+        "swtpm_nvram_coalesced_stores_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_coalesced_bytes counter\n"
+        "# UNIT swtpm_nvram_coalesced_bytes bytes\n"
+        "# HELP swtpm_nvram_coalesced_bytes Number of bytes of TPM state not written due to write-behind.\n"
+        "swtpm_nvram_coalesced_bytes_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_elided_stores counter\n"
+        "# HELP swtpm_nvram_elided_stores Number of stores of TPM state skipped since the state was unchanged.\n"
+        "swtpm_nvram_elided_stores_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_elided_bytes counter\n"
+        "# UNIT swtpm_nvram_elided_bytes bytes\n"
+        "# HELP swtpm_nvram_elided_bytes Number of bytes of TPM state not written since the state was unchanged.\n"
+        "swtpm_nvram_elided_bytes_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_flushed_bytes counter\n"
+        "# UNIT swtpm_nvram_flushed_bytes bytes\n"
+        "# HELP swtpm_nvram_flushed_bytes Number of bytes of the file backend flushed to storage.\n"
+        "swtpm_nvram_flushed_bytes_total %" PRIu64 "\n",
+        metrics_get(&metrics.nvram_stores),
+        metrics_get(&metrics.nvram_store_bytes),
+        metrics_get(&metrics.nvram_coalesced),
+        metrics_get(&metrics.nvram_coalesced_bytes),
+        metrics_get(&metrics.nvram_elided),
+        metrics_get(&metrics.nvram_elided_bytes),
+        metrics_get(&metrics.nvram_flushed_bytes));
+
+    for (i = 0; i < CMDSTATS_NUM_BUCKETS; i++)
+        buckets[i] = metrics_get(&metrics.sync.buckets[i]);
+    g_string_append(gstr,
+        "# TYPE swtpm_nvram_sync_duration_seconds histogram\n"
+        "# UNIT swtpm_nvram_sync_duration_seconds seconds\n"
+        "# HELP swtpm_nvram_sync_duration_seconds Time spent syncing TPM state to storage.\n");
+    metrics_append_histogram(gstr, "swtpm_nvram_sync_duration_seconds", "",
+                             buckets, metrics_get(&metrics.sync.sum_ns));
+
+    g_string_append_printf(gstr,
+        "# TYPE swtpm_nvram_compress_input_bytes counter\n"
+        "# UNIT swtpm_nvram_compress_input_bytes bytes\n"
+        "# HELP swtpm_nvram_compress_input_bytes Number of bytes of TPM state before compression.\n"
+        "swtpm_nvram_compress_input_bytes_total %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_compress_output_bytes counter\n"
+        "# UNIT swtpm_nvram_compress_output_bytes bytes\n"
+        "# HELP swtpm_nvram_compress_output_bytes Number of bytes of TPM state after compression.\n"
+        "swtpm_nvram_compress_output_bytes_total %" PRIu64 "\n",
+        metrics_get(&metrics.nvram_compress_in_bytes),
+        metrics_get(&metrics.nvram_compress_out_bytes));
+
+    for (i = 0; i < CMDSTATS_NUM_BUCKETS; i++)
+        buckets[i] = metrics_get(&metrics.compress.buckets[i]);
+    g_string_append(gstr,
+        "# TYPE swtpm_nvram_compress_duration_seconds histogram\n"
+        "# UNIT swtpm_nvram_compress_duration_seconds seconds\n"
+        "# HELP swtpm_nvram_compress_duration_seconds Time spent compressing TPM state.\n");
+    metrics_append_histogram(gstr, "swtpm_nvram_compress_duration_seconds", "",
+                             buckets, metrics_get(&metrics.compress.sum_ns));
+
+    g_string_append_printf(gstr,
+        "# TYPE swtpm_nvram_crypto_setups counter\n"
+        "# HELP swtpm_nvram_crypto_setups Number of cipher and MAC contexts set up for encrypting and decrypting TPM state by whether they were cloned from the ones of the key.\n"
+        "swtpm_nvram_crypto_setups_total{source=\"cache\"} %" PRIu64 "\n"
+        "swtpm_nvram_crypto_setups_total{source=\"new\"} %" PRIu64 "\n"
+        "# TYPE swtpm_nvram_crypto_setup_seconds counter\n"
+        "# UNIT swtpm_nvram_crypto_setup_seconds seconds\n"
+        "# HELP swtpm_nvram_crypto_setup_seconds Time spent setting up cipher and MAC contexts for TPM state.\n"
+        "swtpm_nvram_crypto_setup_seconds_total %.9f\n",
+        metrics_get(&metrics.nvram_crypto_setups_cached),
+        metrics_get(&metrics.nvram_crypto_setups_new),
+        (double)metrics_get(&metrics.nvram_crypto_setup_ns) / 1E9);
+
+    for (i = 0; i < CMDSTATS_NUM_BUCKETS; i++)
+        buckets[i] = metrics_get(&metrics.lock_wait.buckets[i]);
+    g_string_append(gstr,
+        "# TYPE swtpm_nvram_lock_wait_seconds histogram\n"
+        "# UNIT swtpm_nvram_lock_wait_seconds seconds\n"
+        "# HELP swtpm_nvram_lock_wait_seconds Time spent waiting for the lock on the TPM state storage.\n");
+    metrics_append_histogram(gstr, "swtpm_nvram_lock_wait_seconds", "",
+                             buckets, metrics_get(&metrics.lock_wait.sum_ns));
+
+    g_string_append_printf(gstr,
+        "# TYPE swtpm_nvram_lock_timeouts counter\n"
+        "# HELP swtpm_nvram_lock_timeouts Number of times the lock on the TPM state storage could not be taken since another process held it.\n"
+        "swtpm_nvram_lock_timeouts_total %" PRIu64 "\n",
+        metrics_get(&metrics.nvram_lock_timeouts));
+
+    g_string_append(gstr,
+        "# TYPE swtpm_ctrl_commands counter\n"
+        "# HELP swtpm_ctrl_commands Number of control channel commands by command.\n");
+    for (i = 0; i < METRICS_NUM_CTRL_CMDS; i++) {
+        if (!ctrl_cmd_names[i])
+            continue;
+        g_string_append_printf(gstr,
+                               "swtpm_ctrl_commands_total{command=\"%s\"} %"
+                               PRIu64 "\n",
+                               ctrl_cmd_names[i],
+                               metrics_get(&metrics.ctrl_cmds[i]));
+    }
+
+    g_string_append(gstr, "# EOF\n");
+
+    return gstr;
+}
+
+/*
+ * metrics_serve_client: Accept a client on the metrics socket and send it
+ *                       the metrics
+ *
+ * The metrics are sent without blocking the main loop for longer than
+ * METRICS_SEND_TIMEOUT_MS; a client that does not accept them in time gets
+ * an incomplete response.
+ */
+void metrics_serve_client(void)
+{
+    struct timespec deadline, now;
+    struct pollfd pollfd;
+    GString *gstr;
+    size_t sent = 0;
+    long timeout;
+    ssize_t n;
+    int fd;
+
+    fd = accept(metrics.fd, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    gstr = metrics_format();
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += METRICS_SEND_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (METRICS_SEND_TIMEOUT_MS % 1000) * 1000000;
+
+    pollfd.fd = fd;
+    pollfd.events = POLLOUT;
+
+    while (sent < gstr->len) {
+        n = send(fd, &gstr->str[sent], gstr->len - sent,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = (deadline.tv_sec - now.tv_sec) * 1000 +
+                  (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (timeout <= 0)
+            break;
+        n = poll(&pollfd, 1, timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+    }
+    if (sent < gstr->len)
+        logprintf(STDERR_FILENO,
+                  "Could only send %zu of %zu bytes of metrics\n",
+                  sent, gstr->len);
+
+    g_string_free(gstr, TRUE);
+    close(fd);
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * metrics.h -- OpenMetrics endpoint
+ */
+
+#ifndef _SWTPM_METRICS_H_
+#define _SWTPM_METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+void metrics_init(void);
+void metrics_set_fd(int fd, const char *sockpath);
+int metrics_get_fd(void);
+void metrics_free(void);
+void metrics_serve_client(void);
+
+void metrics_nvram_store(uint32_t length);
+void metrics_nvram_coalesced(uint32_t length);
+void metrics_nvram_elided(uint32_t length);
+void metrics_nvram_flush(uint32_t length);
+void metrics_sync_record(const struct timespec *start);
+void metrics_nvram_compress(uint32_t in_length, uint32_t out_length,
+                            const struct timespec *start);
+void metrics_nvram_crypto_setup(bool cached, const struct timespec *start);
+void metrics_nvram_lock_wait(const struct timespec *start);
+void metrics_nvram_lock_timeout(void);
+void metrics_ctrl_cmd(uint32_t cmd);
+
+#endif /* _SWTPM_METRICS_H_ */
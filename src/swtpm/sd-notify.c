@@ -1,15 +1,21 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 
 /*
- * sd-notify.c -- Minimal sd_notify() implementation without libsystemd
+ * sd-notify.c -- Minimal sd_notify() and sd_listen_fds() implementation
+ *                without libsystemd
  *
  * Sends notification messages to systemd via the $NOTIFY_SOCKET
  * Unix datagram socket. Supports filesystem and abstract AF_UNIX sockets.
+ * File descriptors sent along with a message, such as with FDSTORE=1, are
+ * passed with SCM_RIGHTS.
+ * Returns the number of sockets passed by socket activation via
+ * $LISTEN_PID and $LISTEN_FDS and their names via $LISTEN_FDNAMES.
  */
 
 #include <config.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,9 +23,12 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <glib.h>
+
 #include "sd-notify.h"
 
-int sd_notify(int unset_environment, const char *state)
+int sd_notify_with_fds(int unset_environment, const char *state,
+                       const int *fds, unsigned int n_fds)
 {
     union {
         struct sockaddr_un un;
@@ -27,6 +36,15 @@ int sd_notify(int unset_environment, const char *state)
     } addr = {
         .un.sun_family = AF_UNIX,
     };
+    struct iovec iov = {
+        .iov_base = (void *)state,
+        .iov_len = strlen(state),
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
     const char *notify_socket;
     size_t path_len;
     socklen_t addr_len;
@@ -55,12 +73,26 @@ int sd_notify(int unset_environment, const char *state)
     if (fd < 0)
         return -errno;
 
-    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL,
-               &addr.sa, addr_len) < 0)
+    msg.msg_name = &addr.sa;
+    msg.msg_namelen = addr_len;
+
+    if (n_fds > 0) {
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+        msg.msg_control = g_malloc0(msg.msg_controllen);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
         r = -errno;
     else
         r = 1; /* sent successfully */
 
+    g_free(msg.msg_control);
     (void) close(fd);
 
     if (unset_environment)
@@ -68,3 +100,85 @@ int sd_notify(int unset_environment, const char *state)
 
     return r;
 }
+
+int sd_notify(int unset_environment, const char *state)
+{
+    return sd_notify_with_fds(unset_environment, state, NULL, 0);
+}
+
+int sd_listen_fds(int unset_environment)
+{
+    const char *listen_pid, *listen_fds;
+    unsigned long pid, n;
+    char *end_ptr;
+    int r = 0;
+
+    listen_pid = getenv("LISTEN_PID");
+    listen_fds = getenv("LISTEN_FDS");
+    if (!listen_pid || !listen_fds)
+        goto exit;
+
+    /* the sockets were passed to another process */
+    errno = 0;
+    pid = strtoul(listen_pid, &end_ptr, 10);
+    if (errno || end_ptr == listen_pid || *end_ptr != '\0') {
+        r = -EINVAL;
+        goto exit;
+    }
+    if (pid != (unsigned long)getpid())
+        goto exit;
+
+    errno = 0;
+    n = strtoul(listen_fds, &end_ptr, 10);
+    if (errno || end_ptr == listen_fds || *end_ptr != '\0' ||
+        n > INT_MAX - SD_LISTEN_FDS_START) {
+        r = -EINVAL;
+        goto exit;
+    }
+    r = n;
+
+exit:
+    if (unset_environment) {
+        (void) unsetenv("LISTEN_PID");
+        (void) unsetenv("LISTEN_FDS");
+        (void) unsetenv("LISTEN_FDNAMES");
+    }
+
+    return r;
+}
+
+/*
+ * The names are returned in a NULL-terminated array to be freed with
+ * g_strfreev(); file descriptors without a name are called "unknown".
+ */
+int sd_listen_fds_with_names(int unset_environment, char ***names)
+{
+    char **l = NULL;
+    int n, i;
+
+    /* sd_listen_fds() may unset it */
+    if (getenv("LISTEN_FDNAMES"))
+        l = g_strsplit(getenv("LISTEN_FDNAMES"), ":", -1);
+
+    n = sd_listen_fds(unset_environment);
+    if (n <= 0) {
+        g_strfreev(l);
+        *names = NULL;
+        return n;
+    }
+
+    if (l) {
+        if (g_strv_length(l) != (guint)n) {
+            g_strfreev(l);
+            *names = NULL;
+            return -EINVAL;
+        }
+    } else {
+        l = g_new0(char *, n + 1);
+        for (i = 0; i < n; i++)
+            l[i] = g_strdup("unknown");
+    }
+    *names = l;
+
+    return n;
+}
@@ -1,12 +1,19 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 
 /*
- * sd-notify.h -- Minimal sd_notify() implementation without libsystemd
+ * sd-notify.h -- Minimal sd_notify() and sd_listen_fds() implementation
+ *                without libsystemd
  */
 
 #ifndef SWTPM_SD_NOTIFY_H
 #define SWTPM_SD_NOTIFY_H
 
+#define SD_LISTEN_FDS_START 3
+
 int sd_notify(int unset_environment, const char *state);
+int sd_notify_with_fds(int unset_environment, const char *state,
+                       const int *fds, unsigned int n_fds);
+int sd_listen_fds(int unset_environment);
+int sd_listen_fds_with_names(int unset_environment, char ***names);
 
 #endif /* SWTPM_SD_NOTIFY_H */
@@ -0,0 +1,335 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * shmring.c -- shared memory TPM command channel
+ *
+ * The client (VMM) and the TPM share a memory region holding a request
+ * and a response ring and signal each other using eventfd doorbells.
+ * The layout of the shared memory is described in tpm_ioctl.h.
+ *
+ * The client has write access to the shared memory at all times. Therefore,
+ * the ring geometry is copied at setup time and every index read from the
+ * shared memory is validated before it is used.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "logging.h"
+#include "pcap.h"
+#include "shmring.h"
+#include "swtpm_debug.h"
+#include "tpm_ioctl.h"
+#include "tpmlib.h"
+
+struct shmring {
+    int shm_fd;
+    int req_evfd;    /* client -> TPM doorbell */
+    int resp_evfd;   /* TPM -> client doorbell */
+    struct ptm_shmring_hdr *hdr;
+    size_t map_size;
+    /* private copies of the ring geometry and of the indices we own */
+    unsigned char *req_ring;
+    uint32_t req_size;
+    uint32_t req_tail;
+    unsigned char *resp_ring;
+    uint32_t resp_size;
+    uint32_t resp_head;
+};
+
+static bool is_power_of_2(uint32_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+static bool shmring_check_area(uint32_t offset, uint32_t size, size_t map_size)
+{
+    uint64_t end = (uint64_t)offset + size;
+
+    return offset >= sizeof(struct ptm_shmring_hdr) && end <= map_size;
+}
+
+/*
+ * shmring_new: Create the shared memory ring from the given file descriptors
+ *
+ * @shm_fd: file descriptor of the shared memory
+ * @req_evfd: eventfd that the client signals after queuing a request
+ * @resp_evfd: eventfd that we signal after queuing a response
+ * @min_ring_size: minimum size of each ring
+ *
+ * This function takes ownership of the file descriptors and closes them in
+ * case of error.
+ */
+struct shmring *shmring_new(int shm_fd, int req_evfd, int resp_evfd,
+                            uint32_t min_ring_size)
+{
+    struct shmring *sr;
+    struct stat statbuf;
+    struct ptm_shmring_hdr hdr;
+    int flags;
+
+    sr = calloc(1, sizeof(*sr));
+    if (!sr) {
+        logprintf(STDERR_FILENO, "Out of memory.\n");
+        goto err_close_fds;
+    }
+    sr->shm_fd = shm_fd;
+    sr->req_evfd = req_evfd;
+    sr->resp_evfd = resp_evfd;
+
+    if (fstat(shm_fd, &statbuf) < 0) {
+        logprintf(STDERR_FILENO, "Could not stat shared memory: %s\n",
+                  strerror(errno));
+        goto err_free;
+    }
+    if (statbuf.st_size < (off_t)sizeof(struct ptm_shmring_hdr) ||
+        (uint64_t)statbuf.st_size > UINT32_MAX) {
+        logprintf(STDERR_FILENO, "Shared memory has invalid size %jd.\n",
+                  (intmax_t)statbuf.st_size);
+        goto err_free;
+    }
+    sr->map_size = statbuf.st_size;
+
+    sr->hdr = mmap(NULL, sr->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   shm_fd, 0);
+    if (sr->hdr == MAP_FAILED) {
+        logprintf(STDERR_FILENO, "Could not mmap shared memory: %s\n",
+                  strerror(errno));
+        sr->hdr = NULL;
+        goto err_free;
+    }
+
+    memcpy(&hdr, sr->hdr, sizeof(hdr));
+
+    if (hdr.magic != PTM_SHMRING_MAGIC ||
+        hdr.version != PTM_SHMRING_VERSION) {
+        logprintf(STDERR_FILENO,
+                  "Shared memory has bad magic 0x%08x or version %u.\n",
+                  hdr.magic, hdr.version);
+        goto err_free;
+    }
+    if (!is_power_of_2(hdr.req_size) || hdr.req_size < min_ring_size ||
+        !is_power_of_2(hdr.resp_size) || hdr.resp_size < min_ring_size ||
+        !shmring_check_area(hdr.req_offset, hdr.req_size, sr->map_size) ||
+        !shmring_check_area(hdr.resp_offset, hdr.resp_size, sr->map_size) ||
+        ((uint64_t)hdr.req_offset + hdr.req_size > hdr.resp_offset &&
+         (uint64_t)hdr.resp_offset + hdr.resp_size > hdr.req_offset)) {
+        logprintf(STDERR_FILENO,
+                  "Shared memory has invalid ring geometry; each ring must "
+                  "be a power of 2 and at least %u bytes.\n", min_ring_size);
+        goto err_free;
+    }
+
+    sr->req_ring = (unsigned char *)sr->hdr + hdr.req_offset;
+    sr->req_size = hdr.req_size;
+    sr->resp_ring = (unsigned char *)sr->hdr + hdr.resp_offset;
+    sr->resp_size = hdr.resp_size;
+
+    /* we own req_tail and resp_head; start where the client left them */
+    sr->req_tail = __atomic_load_n(&sr->hdr->req_tail.idx, __ATOMIC_ACQUIRE);
+    sr->resp_head = __atomic_load_n(&sr->hdr->resp_head.idx,
+                                    __ATOMIC_ACQUIRE);
+
+    /* we drain the request doorbell and must never block on it */
+    flags = fcntl(req_evfd, F_GETFL);
+    if (flags < 0 || fcntl(req_evfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Could not set request eventfd to non-blocking: %s\n",
+                  strerror(errno));
+        goto err_free;
+    }
+
+    return sr;
+
+err_free:
+    shmring_free(sr);
+    return NULL;
+
+err_close_fds:
+    close(shm_fd);
+    close(req_evfd);
+    close(resp_evfd);
+    return NULL;
+}
+
+void shmring_free(struct shmring *sr)
+{
+    if (!sr)
+        return;
+
+    if (sr->hdr)
+        munmap(sr->hdr, sr->map_size);
+    close(sr->shm_fd);
+    close(sr->req_evfd);
+    close(sr->resp_evfd);
+    free(sr);
+}
+
+/* get the file descriptor to poll on for incoming requests */
+int shmring_get_fd(const struct shmring *sr)
+{
+    return sr->req_evfd;
+}
+
+static void ring_copy_out(const unsigned char *ring, uint32_t ring_size,
+                          uint32_t idx, void *dest, uint32_t len)
+{
+    uint32_t offset = idx & (ring_size - 1);
+    uint32_t first = ring_size - offset;
+
+    if (first > len)
+        first = len;
+    memcpy(dest, &ring[offset], first);
+    memcpy((unsigned char *)dest + first, ring, len - first);
+}
+
+static void ring_copy_in(unsigned char *ring, uint32_t ring_size,
+                         uint32_t idx, const void *src, uint32_t len)
+{
+    uint32_t offset = idx & (ring_size - 1);
+    uint32_t first = ring_size - offset;
+
+    if (first > len)
+        first = len;
+    memcpy(&ring[offset], src, first);
+    memcpy(ring, (const unsigned char *)src + first, len - first);
+}
+
+static void shmring_doorbell_drain(int evfd)
+{
+    uint64_t cnt;
+
+    while (read(evfd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+}
+
+static int shmring_doorbell_ring(int evfd)
+{
+    uint64_t cnt = 1;
+    ssize_t n;
+
+    do {
+        n = write(evfd, &cnt, sizeof(cnt));
+    } while (n < 0 && errno == EINTR);
+
+    return n == sizeof(cnt) ? 0 : -1;
+}
+
+/*
+ * shmring_read: Read the next TPM request from the request ring
+ *
+ * This function returns TPM_RETRY if no request was available, which may
+ * happen after a spurious wakeup. If more requests are queued after the
+ * one that was read, the request doorbell is re-armed so that polling on
+ * it reports them.
+ */
+TPM_RESULT shmring_read(struct shmring *sr,
+                        unsigned char *buffer,
+                        uint32_t *bufferLength,
+                        uint32_t bufferSize,
+                        struct pcap_state *ps)
+{
+    uint32_t head, used, len;
+
+    shmring_doorbell_drain(sr->req_evfd);
+
+    head = __atomic_load_n(&sr->hdr->req_head.idx, __ATOMIC_ACQUIRE);
+    used = head - sr->req_tail;
+    if (used == 0)
+        return TPM_RETRY;
+
+    if (used > sr->req_size || used < sizeof(len))
+        goto err_corrupt;
+
+    ring_copy_out(sr->req_ring, sr->req_size, sr->req_tail, &len, sizeof(len));
+    if (len < sizeof(struct tpm_req_header) || len > bufferSize ||
+        len > used - sizeof(len))
+        goto err_corrupt;
+
+    ring_copy_out(sr->req_ring, sr->req_size, sr->req_tail + sizeof(len),
+                  buffer, len);
+
+    sr->req_tail += sizeof(len) + len;
+    __atomic_store_n(&sr->hdr->req_tail.idx, sr->req_tail, __ATOMIC_RELEASE);
+
+    if (head != sr->req_tail)
+        shmring_doorbell_ring(sr->req_evfd);
+
+    *bufferLength = len;
+    SWTPM_PrintAll(" shmring_read:", " ", buffer, *bufferLength);
+
+    pcap_packet_record_write(ps, buffer, *bufferLength, true);
+
+    return 0;
+
+err_corrupt:
+    logprintf(STDERR_FILENO,
+              "shmring_read: Error, corrupted request ring (used: %u)\n",
+              used);
+    return TPM_IOERROR;
+}
+
+/*
+ * shmring_write: Write a TPM response into the response ring and signal
+ *                the client
+ */
+TPM_RESULT shmring_write(struct shmring *sr,
+                         const struct iovec *iovec,
+                         int iovcnt,
+                         struct pcap_state *ps)
+{
+    uint32_t tail, used, idx;
+    uint32_t len = 0;
+    int i;
+
+    SWTPM_PrintAll(" shmring_write:", " ",
+                   iovec[1].iov_base, iovec[1].iov_len);
+
+    pcap_packet_record_write(ps, iovec[1].iov_base, iovec[1].iov_len, false);
+
+    for (i = 0; i < iovcnt; i++)
+        len += iovec[i].iov_len;
+
+    tail = __atomic_load_n(&sr->hdr->resp_tail.idx, __ATOMIC_ACQUIRE);
+    used = sr->resp_head - tail;
+    if (used > sr->resp_size ||
+        sr->resp_size - used < sizeof(len) + len) {
+        logprintf(STDERR_FILENO,
+                  "shmring_write: Error, no space for %u bytes in response "
+                  "ring (used: %u)\n", len, used);
+        return TPM_IOERROR;
+    }
+
+    idx = sr->resp_head;
+    ring_copy_in(sr->resp_ring, sr->resp_size, idx, &len, sizeof(len));
+    idx += sizeof(len);
+    for (i = 0; i < iovcnt; i++) {
+        ring_copy_in(sr->resp_ring, sr->resp_size, idx,
+                     iovec[i].iov_base, iovec[i].iov_len);
+        idx += iovec[i].iov_len;
+    }
+
+    sr->resp_head = idx;
+    __atomic_store_n(&sr->hdr->resp_head.idx, sr->resp_head,
+                     __ATOMIC_RELEASE);
+
+    if (shmring_doorbell_ring(sr->resp_evfd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "shmring_write: Error, could not signal client: %s\n",
+                  strerror(errno));
+        return TPM_IOERROR;
+    }
+
+    return 0;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * shmring.h -- shared memory TPM command channel
+ */
+
+#ifndef _SWTPM_SHMRING_H_
+#define _SWTPM_SHMRING_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <libtpms/tpm_types.h>
+
+struct shmring;
+struct pcap_state;
+
+struct shmring *shmring_new(int shm_fd, int req_evfd, int resp_evfd,
+                            uint32_t min_ring_size);
+void shmring_free(struct shmring *sr);
+int shmring_get_fd(const struct shmring *sr);
+TPM_RESULT shmring_read(struct shmring *sr,
+                        unsigned char *buffer,
+                        uint32_t *bufferLength,
+                        uint32_t bufferSize,
+                        struct pcap_state *ps);
+TPM_RESULT shmring_write(struct shmring *sr,
+                         const struct iovec *iovec,
+                         int iovcnt,
+                         struct pcap_state *ps);
+
+#endif /* _SWTPM_SHMRING_H_ */
@@ -50,6 +50,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <glib.h>
+
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_library.h>
 #include <libtpms/tpm_memory.h>
@@ -74,6 +76,9 @@
 #include "seccomp_profile.h"
 #include "options.h"
 #include "capabilities.h"
+#include "threadpool.h"
+#include "metrics.h"
+#include "upgrade.h"
 
 /* local variables */
 static int notify_fd[2] = {-1, -1};
@@ -125,12 +130,12 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   the value must be given in octal number format\n"
     "                   uid and gid set the ownership of the Unixio socket's file;\n"
     "                   terminate terminates on ctrl channel connection loss;\n"
-    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                 : use an AES key for the encryption of the TPM's state\n"
     "                   when it is retrieved from the TPM via ioctls;\n"
     "                   Setting this key ensures that the TPM's state will always\n"
     "                   be encrypted when migrated\n"
-    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                 : provide a passphrase in a file; the AES key will be\n"
     "                   derived from this passphrase; default kdf is PBKDF2\n"
     "--log file=<path>|fd=<filedescriptor>[,level=n][,prefix=<prefix>][,truncate]\n"
@@ -139,13 +144,13 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   log level 5 and higher will enable libtpms logging;\n"
     "                   all logged output will be prefixed with prefix;\n"
     "                   the log file can be reset (truncate)\n"
-    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                 : use an AES key for the encryption of the TPM's state\n"
     "                   files; use the given mode for the block encryption;\n"
     "                   the key is to be provided as a hex string or in binary\n"
     "                   format; the keyfile can be automatically removed using\n"
     "                   the remove parameter\n"
-    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                 : provide a passphrase in a file; the AES key will be\n"
     "                   derived from this passphrase; default kdf is PBKDF2\n"
     "--locality [reject-locality-4][,allow-set-locality]\n"
@@ -154,6 +159,8 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "--pid file=<path>|fd=<filedescriptor>\n"
     "                 : write the process ID into the given file\n"
     "--tpmstate dir=<dir>|backend-uri=<uri>[,mode=0...][,lock][,backup][,fsync]\n"
+    "           [,write-behind=<ms>][,page-flush][,max-states=<n>][,batch-fsync]\n"
+    "           [,direct-io][,compress]\n"
     "                 : set the directory or uri where the TPM's state will be written\n"
     "                   into; the TPM_PATH environment variable can be used\n"
     "                   instead dir option;\n"
@@ -162,8 +169,20 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   lock enables file-locking by the storage backend;\n"
     "                   backup has the directory-backend create a backup of the\n"
     "                   permanent state file;\n"
-    "                   with fsync the directory-backend ensures that all data have been\n"
-    "                   transferred to disk before proceeding;\n"
+    "                   with fsync the directory-backend and the file backend ensure that\n"
+    "                   all data have been transferred to disk before proceeding;\n"
+    "                   write-behind writes the state in the background after\n"
+    "                   the given number of milliseconds and combines the writes\n"
+    "                   of the same state in that time;\n"
+    "                   page-flush has the file backend only write and flush the\n"
+    "                   pages of the state that changed;\n"
+    "                   max-states sets the number of entries in the header of a new\n"
+    "                   file backend;\n"
+    "                   batch-fsync has the directory-backend sync the directory once\n"
+    "                   for all states stored by a TPM command; implies fsync;\n"
+    "                   direct-io has the file backend access the file or block\n"
+    "                   device with O_DIRECT instead of memory-mapping it;\n"
+    "                   compress compresses the state with zstd before writing it;\n"
     "--server [type=tcp][,port=port[,bindaddr=address[,ifname=ifname]]][,fd=fd][,disconnect]\n"
     "                 : Expect TCP connections on the given port;\n"
     "                   if fd is provided, packets will be read from it directly;\n"
@@ -196,10 +215,11 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                 : Choose the action of the seccomp profile when a\n"
     "                   blacklisted syscall is executed; default is kill\n"
 #endif
-    "--migration [incoming][,release-lock-outgoing]\n"
+    "--migration [incoming][,release-lock-outgoing][,compress]\n"
     "                 : Incoming migration defers locking of storage backend\n"
     "                   until the TPM state is received; release-lock-outgoing\n"
-    "                   releases the storage lock on outgoing migration\n"
+    "                   releases the storage lock on outgoing migration;\n"
+    "                   compress compresses the state blobs for migration\n"
     "--print-capabilities\n"
     "                 : print capabilities and terminate\n"
     "--print-states\n"
@@ -220,6 +240,19 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   the default mode is 0640;\n"
     "                   checksums enables calculation of IP and TCP checksums;\n"
     "                   the default is that no checksums are calculated;\n"
+    "--metrics type=unixio,path=<path>|fd=<filedescriptor>[,mode=0...][,uid=uid][,gid=gid]\n"
+    "                 : Provide metrics in OpenMetrics text format to clients\n"
+    "                   connecting to the given UnixIO socket;\n"
+    "                   mode allows a user to set the file mode bits of the socket;\n"
+    "                   the default mode is 0770;\n"
+    "--hibernate idle=<seconds>\n"
+    "                 : Store the volatile state and terminate after the given\n"
+    "                   number of seconds without commands; the sockets must be\n"
+    "                   passed by socket activation that restarts the TPM and\n"
+    "                   connected clients are kept in the file descriptor store\n"
+    "--live-upgrade fd=<filedescriptor>\n"
+    "                 : Take over the TPM state and clients handed over by a\n"
+    "                   live upgrade; this option is used internally\n"
     "-h|--help        : display this help screen and terminate\n"
     "\n",
     prgname, iface);
@@ -232,6 +265,7 @@ static void swtpm_cleanup(struct mainLoopParams *mlp, struct server *server)
     pidfile_remove();
     ctrlchannel_free(mlp->cc);
     server_free(server);
+    metrics_free();
     log_global_free();
     tpmstate_global_free();
     SWTPM_NVRAM_Shutdown();
@@ -278,7 +312,11 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     char *chroot = NULL;
     char *profiledata = NULL;
     char *pcapdata = NULL;
+    char *metricsdata = NULL;
+    char *hibernatedata = NULL;
+    char *upgradedata = NULL;
     bool need_init_cmd = true;
+    bool hibernated = false;
 #ifdef DEBUG
     time_t              start_time;
 #endif
@@ -317,11 +355,16 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
         {"print-profiles",   no_argument, 0, 'N'},
         {"print-info", required_argument, 0, 'x'},
         {"pcap"      , required_argument, 0, 'A'},
+        {"metrics"   , required_argument, 0, 'M'},
+        {"hibernate" , required_argument, 0, 'H'},
+        {"live-upgrade", required_argument, 0, 'u'},
         {NULL        , 0                , 0, 0  },
     };
 
     log_set_prefix("swtpm: ");
 
+    upgrade_init(prgname, argc, argv);
+
     while (TRUE) {
         opt = getopt_long(argc, argv, "dhp:f:tr:R:", longopts, &longindex);
 
@@ -331,7 +374,8 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
         switch (opt) {
         case 'd':
             daemonize = TRUE;
-            if (daemonize_prep() == -1) {
+            /* --live-upgrade is passed first; the process is a daemon */
+            if (!upgradedata && daemonize_prep() == -1) {
                 logprintf(STDERR_FILENO,
                           "Could not prepare to daemonize: %s\n", strerror(errno));
                 exit(EXIT_FAILURE);
@@ -471,6 +515,18 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
             pcapdata = optarg;
             break;
 
+        case 'M': /* --metrics */
+            metricsdata = optarg;
+            break;
+
+        case 'H': /* --hibernate */
+            hibernatedata = optarg;
+            break;
+
+        case 'u': /* --live-upgrade */
+            upgradedata = optarg;
+            break;
+
         case 'N': /* --print-profiles */
             printprofiles = true;
             break;
@@ -500,10 +556,15 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     if (chroot) {
         if (do_chroot(chroot) < 0)
             exit(EXIT_FAILURE);
+        /* the binary cannot be executed again */
+        upgrade_disable("--chroot");
     }
 
+    if (handle_upgrade_options(upgradedata) < 0)
+        exit(EXIT_FAILURE);
+
     /* change process ownership before accessing files */
-    if (runas) {
+    if (runas && !upgrade_in_progress()) {
         if (change_process_owner(runas) < 0)
             exit(EXIT_FAILURE);
     }
@@ -531,7 +592,8 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
         exit(EXIT_FAILURE);
 
     if (handle_ctrlchannel_options(ctrlchdata, &mlp.cc, &mlp.flags) < 0 ||
-        handle_server_options(serverdata, &server) < 0) {
+        handle_server_options(serverdata, &server) < 0 ||
+        handle_metrics_options(metricsdata) < 0) {
         goto exit_failure;
     }
 
@@ -568,10 +630,32 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
         handle_migration_options(migrationdata, &mlp.incoming_migration,
                                  &mlp.release_lock_outgoing) < 0  ||
         handle_profile_options(profiledata, &mlp.json_profile) < 0 ||
-        handle_pcap_options(pcapdata, &mlp.ps) < 0) {
+        handle_pcap_options(pcapdata, &mlp.ps) < 0 ||
+        handle_hibernate_options(hibernatedata, &mlp.hibernate_idle_ms) < 0) {
         goto exit_failure;
     }
 
+#ifdef WITH_SECCOMP
+    /* the profile is inherited by the new process and blocks execve */
+    if (seccomp_action == SWTPM_SECCOMP_ACTION_KILL)
+        upgrade_disable("the seccomp action kill");
+#endif
+
+    if (mlp.hibernate_idle_ms) {
+        if (need_init_cmd) {
+            logprintf(STDERR_FILENO,
+                      "Error: --hibernate requires --flags not-need-init\n");
+            goto exit_failure;
+        }
+        /* the sockets must outlive the TPM to restart it */
+        if (sd_listen_fds(0) <= 0) {
+            logprintf(STDERR_FILENO,
+                      "Error: --hibernate requires sockets passed by socket "
+                      "activation\n");
+            goto exit_failure;
+        }
+    }
+
     if (server) {
         if (server_get_fd(server) >= 0) {
             mlp.fd = server_set_fd(server, -1);
@@ -604,16 +688,26 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     if ((rc = tpmlib_register_callbacks(&callbacks)))
         goto error_no_tpm;
 
-    if (!need_init_cmd || (infoflags && tpmstate_get_backend_uri())) {
+    if (upgrade_in_progress() && !infoflags) {
+        if ((rc = upgrade_restore(&mlp)))
+            goto error_no_tpm;
+        tpm_running = true;
+    } else if (!need_init_cmd || (infoflags && tpmstate_get_backend_uri())) {
         if (infoflags)
             log_init_fd(SUPPRESS_INFO_LOGGING);
 
         mlp.storage_locked = !mlp.incoming_migration;
 
+        if (mlp.hibernate_idle_ms)
+            hibernated = mainloop_hibernated();
+
         if ((rc = tpmlib_start(0, mlp.tpmversion, mlp.storage_locked,
                                mlp.json_profile)))
             goto error_no_tpm;
         tpm_running = true;
+
+        if (hibernated)
+            mainloop_resumed(&mlp);
         SWTPM_G_FREE(mlp.json_profile);
     }
 
@@ -627,10 +721,18 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     if (install_sighandlers(notify_fd, sigterm_handler) < 0)
         goto error_no_sighandlers;
 
-    if (create_seccomp_profile(false, seccomp_action) < 0)
+    /* threads cannot be created once the seccomp profile is applied */
+    if (mainloop_start_worker_thread() < 0 ||
+        (rc = SWTPM_NVRAM_Start_WriteBehind()) ||
+        (rc = SWTPM_NVRAM_Start_LockWaiter()))
+        goto error_seccomp_profile;
+
+    /* the profile of the process before the live upgrade still applies */
+    if (!upgrade_in_progress() &&
+        create_seccomp_profile(false, seccomp_action) < 0)
         goto error_seccomp_profile;
 
-    if (daemonize) {
+    if (daemonize && !upgrade_in_progress()) {
         daemonize_finish();
     }
 
@@ -639,6 +741,7 @@ int swtpm_main(int argc, char **argv, const char *prgname, const char *iface)
     rc = mainLoop(&mlp, notify_fd[0], tpm_running);
 
 error_seccomp_profile:
+    worker_thread_end();
     uninstall_sighandlers();
 
 error_no_sighandlers:
@@ -40,6 +40,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -50,22 +51,134 @@
 #include <libtpms/tpm_memory.h>
 
 #include "swtpm_aes.h"
+#include "cmdstats.h"
 #include "logging.h"
+#include "metrics.h"
 
 typedef const EVP_CIPHER *(*evpfunc)(void);
 
-static evpfunc SWTPM_Get_AES_EVPFn(unsigned int bits)
+static evpfunc SWTPM_Get_AES_EVPFn(unsigned int bits, bool gcm)
 {
     switch (bits) {
     case 128:
-        return EVP_aes_128_cbc;
+        return gcm ? NULL : EVP_aes_128_cbc;
     case 256:
-        return EVP_aes_256_cbc;
+        return gcm ? EVP_aes_256_gcm : EVP_aes_256_cbc;
     default:
         return NULL;
     }
 }
 
+/* SWTPM_SymmetricKeyData_SetupCtx() sets up a context of the given type with
+   the key; this fetches the cipher and expands the key
+*/
+
+static EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_SetupCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                         *tpm_symmetric_key_token,
+                                                       enum swtpm_aes_ctx_type type,
+                                                       const unsigned char *ivec)
+{
+    bool gcm = (type == SWTPM_AES_CTX_GCM_ENCRYPT ||
+                type == SWTPM_AES_CTX_GCM_DECRYPT);
+    int enc = (type == SWTPM_AES_CTX_CBC_ENCRYPT ||
+               type == SWTPM_AES_CTX_GCM_ENCRYPT);
+    EVP_CIPHER_CTX *ctx;
+    evpfunc evpfn;
+
+    evpfn = SWTPM_Get_AES_EVPFn(tpm_symmetric_key_token->userKeyLength * 8,
+                                gcm);
+    if (!evpfn)
+        return NULL;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (!ctx ||
+        EVP_CipherInit_ex(ctx, evpfn(), NULL,
+                          tpm_symmetric_key_token->userKey, ivec, enc) != 1 ||
+        (!gcm && EVP_CIPHER_CTX_set_padding(ctx, 0) != 1)) {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+/* SWTPM_SymmetricKeyData_NewCtx() returns a context of the given type for an
+   operation with the given IV
+
+   The context is cloned from the one SWTPM_SymmetricKeyData_InitCtx() set up
+   for the key, which avoids fetching the cipher and expanding the key again.
+   Without such a context a new one is set up.
+
+   The context must be freed by the caller with EVP_CIPHER_CTX_free()
+*/
+
+static EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_NewCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                       *tpm_symmetric_key_token,
+                                                     enum swtpm_aes_ctx_type type,
+                                                     const unsigned char *ivec)
+{
+    const EVP_CIPHER_CTX *cached = tpm_symmetric_key_token->ctx[type];
+    struct timespec start;
+    EVP_CIPHER_CTX *ctx;
+
+    cmdstats_start(&start);
+
+    if (cached) {
+        ctx = EVP_CIPHER_CTX_new();
+        /* only set the IV; the cipher and the key are kept */
+        if (!ctx ||
+            EVP_CIPHER_CTX_copy(ctx, cached) != 1 ||
+            EVP_CipherInit_ex(ctx, NULL, NULL, NULL, ivec, -1) != 1) {
+            EVP_CIPHER_CTX_free(ctx);
+            ctx = NULL;
+        }
+    } else {
+        ctx = SWTPM_SymmetricKeyData_SetupCtx(tpm_symmetric_key_token, type,
+                                              ivec);
+    }
+
+    if (ctx)
+        metrics_nvram_crypto_setup(cached != NULL, &start);
+
+    return ctx;
+}
+
+/* SWTPM_SymmetricKeyData_InitCtx() sets up the contexts for all operations
+   the key can be used for, so that they only need to be cloned later on
+
+   Contexts that cannot be set up are set up for every operation instead.
+*/
+
+void SWTPM_SymmetricKeyData_InitCtx(TPM_SYMMETRIC_KEY_DATA
+                                      *tpm_symmetric_key_token)
+{
+    unsigned int type;
+
+    SWTPM_SymmetricKeyData_FreeCtx(tpm_symmetric_key_token);
+
+    for (type = 0; type < SWTPM_AES_CTX_NUM; type++) {
+        /* there is no AES-128-GCM mode */
+        if ((type == SWTPM_AES_CTX_GCM_ENCRYPT ||
+             type == SWTPM_AES_CTX_GCM_DECRYPT) &&
+            tpm_symmetric_key_token->userKeyLength != SWTPM_AES256_BLOCK_SIZE)
+            continue;
+        tpm_symmetric_key_token->ctx[type] =
+            SWTPM_SymmetricKeyData_SetupCtx(tpm_symmetric_key_token, type,
+                                            NULL);
+    }
+}
+
+void SWTPM_SymmetricKeyData_FreeCtx(TPM_SYMMETRIC_KEY_DATA
+                                      *tpm_symmetric_key_token)
+{
+    unsigned int type;
+
+    for (type = 0; type < SWTPM_AES_CTX_NUM; type++) {
+        EVP_CIPHER_CTX_free(tpm_symmetric_key_token->ctx[type]);
+        tpm_symmetric_key_token->ctx[type] = NULL;
+    }
+}
+
 /* SWTPM_SymmetricKeyData_Encrypt() is AES non-portable code to encrypt 'decrypt_data' to
    'encrypt_data'
 
@@ -87,11 +200,8 @@ TPM_RESULT SWTPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,   /* out
     uint32_t            pad_length;
     unsigned char       *decrypt_data_pad;
     unsigned char       ivec[SWTPM_AES256_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
     size_t userKeyLength = tpm_symmetric_key_token->userKeyLength;
     EVP_CIPHER_CTX *ctx = NULL;
-    evpfunc evpfn;
 
     decrypt_data_pad = NULL;    /* freed @1 */
 
@@ -135,12 +245,9 @@ TPM_RESULT SWTPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,   /* out
     }
 
     if (rc == 0) {
-        evpfn = SWTPM_Get_AES_EVPFn(userKeyLength * 8);
-        ctx = EVP_CIPHER_CTX_new();
-        if (!evpfn || !ctx ||
-            EVP_EncryptInit_ex(ctx, evpfn(), NULL,
-                               tpm_symmetric_key_data->userKey, ivec) != 1 ||
-            EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) {
+        ctx = SWTPM_SymmetricKeyData_NewCtx(tpm_symmetric_key_token,
+                                            SWTPM_AES_CTX_CBC_ENCRYPT, ivec);
+        if (!ctx) {
             logprintf(STDERR_FILENO,
                       "Could not setup context for encryption.\n");
             rc = TPM_FAIL;
@@ -176,6 +283,39 @@ TPM_RESULT SWTPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,   /* out
     return rc;
 }
 
+/* SWTPM_SymmetricKeyData_EncryptCtx() creates a context for encrypting data in pieces
+   the same way as SWTPM_SymmetricKeyData_Encrypt() does
+
+   The caller must pad the stream as per PKCS#7 / RFC2630 and free the context
+   with EVP_CIPHER_CTX_free()
+*/
+
+EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_EncryptCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                    *tpm_symmetric_key_token,	/* input */
+                                                  const unsigned char *u_ivec,	/* input */
+                                                  uint32_t u_ivec_length)	/* input */
+{
+    size_t userKeyLength = tpm_symmetric_key_token->userKeyLength;
+    unsigned char ivec[SWTPM_AES256_BLOCK_SIZE];
+    EVP_CIPHER_CTX *ctx;
+
+    if (u_ivec_length != userKeyLength) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_SymmetricKeyData_EncryptCtx: IV is %u bytes, "
+                  "but expected %zu bytes\n", u_ivec_length, userKeyLength);
+        return NULL;
+    }
+    memcpy(ivec, u_ivec, u_ivec_length);
+
+    ctx = SWTPM_SymmetricKeyData_NewCtx(tpm_symmetric_key_token,
+                                        SWTPM_AES_CTX_CBC_ENCRYPT, ivec);
+    if (!ctx)
+        logprintf(STDERR_FILENO,
+                  "Could not setup context for encryption.\n");
+
+    return ctx;
+}
+
 /* SWTPM_SymmetricKeyData_Decrypt() is AES non-portable code to decrypt 'encrypt_data' to
    'decrypt_data'
 
@@ -198,11 +338,8 @@ TPM_RESULT SWTPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,   /* out
     uint32_t		i;
     unsigned char       *pad_data;
     unsigned char       ivec[SWTPM_AES256_BLOCK_SIZE];       /* initial chaining vector */
-    TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_data =
-	(TPM_SYMMETRIC_KEY_DATA *)tpm_symmetric_key_token;
     size_t userKeyLength = tpm_symmetric_key_token->userKeyLength;
     EVP_CIPHER_CTX *ctx = NULL;
-    evpfunc evpfn;
 
     /* sanity check encrypted length */
     if (rc == 0) {
@@ -238,12 +375,9 @@ TPM_RESULT SWTPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,   /* out
     }
 
     if (rc == 0) {
-        evpfn = SWTPM_Get_AES_EVPFn(userKeyLength * 8);
-        ctx = EVP_CIPHER_CTX_new();
-        if (!evpfn || !ctx ||
-            EVP_DecryptInit_ex(ctx, evpfn(), NULL,
-                               tpm_symmetric_key_data->userKey, ivec) != 1 ||
-            EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) {
+        ctx = SWTPM_SymmetricKeyData_NewCtx(tpm_symmetric_key_token,
+                                            SWTPM_AES_CTX_CBC_DECRYPT, ivec);
+        if (!ctx) {
             logprintf(STDERR_FILENO,
                       "Could not setup context for decryption.\n");
             rc = TPM_FAIL;
@@ -300,3 +434,208 @@ TPM_RESULT SWTPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,   /* out
 
     return rc;
 }
+
+/* SWTPM_SymmetricKeyData_EncryptGCMCtx() creates a context for encrypting data
+   with AES-256-GCM in pieces
+
+   The caller must get the authentication tag with
+   SWTPM_SymmetricKeyData_FinalGCMCtx() and free the context with
+   EVP_CIPHER_CTX_free()
+*/
+
+EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_EncryptGCMCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                       *tpm_symmetric_key_token,	/* input */
+                                                     const unsigned char *nonce,	/* input */
+                                                     uint32_t nonce_length)	/* input */
+{
+    EVP_CIPHER_CTX *ctx;
+
+    if (tpm_symmetric_key_token->userKeyLength != SWTPM_AES256_BLOCK_SIZE ||
+        nonce_length != SWTPM_AES_GCM_NONCE_SIZE) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_SymmetricKeyData_EncryptGCMCtx: Need a %u byte key "
+                  "and a %u byte nonce\n",
+                  SWTPM_AES256_BLOCK_SIZE, SWTPM_AES_GCM_NONCE_SIZE);
+        return NULL;
+    }
+
+    ctx = SWTPM_SymmetricKeyData_NewCtx(tpm_symmetric_key_token,
+                                        SWTPM_AES_CTX_GCM_ENCRYPT, nonce);
+    if (!ctx)
+        logprintf(STDERR_FILENO,
+                  "Could not setup context for encryption.\n");
+
+    return ctx;
+}
+
+/* SWTPM_SymmetricKeyData_FinalGCMCtx() finishes the encryption with a context
+   from SWTPM_SymmetricKeyData_EncryptGCMCtx() and returns the authentication
+   tag in 'tag'
+*/
+
+TPM_RESULT SWTPM_SymmetricKeyData_FinalGCMCtx(EVP_CIPHER_CTX *ctx,	/* input */
+                                              unsigned char *tag,	/* output */
+                                              uint32_t tag_length)	/* input */
+{
+    unsigned char out[SWTPM_AES128_BLOCK_SIZE];
+    int outlen = 0;
+
+    /* GCM is a stream mode; nothing is left over for the final call */
+    if (EVP_EncryptFinal_ex(ctx, out, &outlen) != 1 || outlen != 0 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_length, tag) != 1) {
+        logprintf(STDERR_FILENO,
+                  "Could not get the authentication tag.\n");
+        return TPM_ENCRYPT_ERROR;
+    }
+
+    return 0;
+}
+
+/* SWTPM_SymmetricKeyData_EncryptGCM() encrypts 'decrypt_data' to 'encrypt_data'
+   with AES-256-GCM and returns the authentication tag in 'tag'
+
+   The encrypted data have the length of the decrypted data; no padding is
+   needed.
+
+   'encrypt_data' must be freed by the caller
+*/
+
+TPM_RESULT SWTPM_SymmetricKeyData_EncryptGCM(unsigned char **encrypt_data,	/* output, caller frees */
+                                             uint32_t *encrypt_length,		/* output */
+                                             const unsigned char *decrypt_data,	/* input */
+                                             uint32_t decrypt_length,		/* input */
+                                             const TPM_SYMMETRIC_KEY_DATA
+                                               *tpm_symmetric_key_token,	/* input */
+                                             const unsigned char *nonce,	/* input */
+                                             uint32_t nonce_length,		/* input */
+                                             unsigned char *tag,		/* output */
+                                             uint32_t tag_length)		/* input */
+{
+    TPM_RESULT rc = 0;
+    EVP_CIPHER_CTX *ctx;
+    int outlen = 0;
+
+    ctx = SWTPM_SymmetricKeyData_EncryptGCMCtx(tpm_symmetric_key_token,
+                                               nonce, nonce_length);
+    if (!ctx)
+        return TPM_ENCRYPT_ERROR;
+
+    /* malloc(0) may return NULL */
+    *encrypt_data = malloc(decrypt_length ? decrypt_length : 1);
+    if (!*encrypt_data) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %u bytes.\n", decrypt_length);
+        rc = TPM_SIZE;
+    }
+
+    if (rc == 0) {
+        if (EVP_EncryptUpdate(ctx, *encrypt_data, &outlen,
+                              decrypt_data, decrypt_length) != 1 ||
+            (uint32_t)outlen != decrypt_length) {
+            logprintf(STDERR_FILENO,
+                      "Could not encrypt %u bytes.\n", decrypt_length);
+            rc = TPM_ENCRYPT_ERROR;
+        }
+    }
+    if (rc == 0)
+        rc = SWTPM_SymmetricKeyData_FinalGCMCtx(ctx, tag, tag_length);
+
+    if (rc == 0) {
+        *encrypt_length = decrypt_length;
+    } else {
+        free(*encrypt_data);
+        *encrypt_data = NULL;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return rc;
+}
+
+/* SWTPM_SymmetricKeyData_DecryptGCM() decrypts 'encrypt_data' to 'decrypt_data'
+   with AES-256-GCM and checks the authentication tag
+
+   Data with a wrong tag were not encrypted with this key or were modified;
+   TPM_DECRYPT_ERROR is returned for them and no data are returned.
+
+   'decrypt_data' must be freed by the caller
+*/
+
+TPM_RESULT SWTPM_SymmetricKeyData_DecryptGCM(unsigned char **decrypt_data,	/* output, caller frees */
+                                             uint32_t *decrypt_length,		/* output */
+                                             const unsigned char *encrypt_data,	/* input */
+                                             uint32_t encrypt_length,		/* input */
+                                             const TPM_SYMMETRIC_KEY_DATA
+                                               *tpm_symmetric_key_token,	/* input */
+                                             const unsigned char *nonce,	/* input */
+                                             uint32_t nonce_length,		/* input */
+                                             const unsigned char *tag,		/* input */
+                                             uint32_t tag_length)		/* input */
+{
+    TPM_RESULT rc = 0;
+    unsigned char out[SWTPM_AES128_BLOCK_SIZE];
+    unsigned char tagbuf[SWTPM_AES_GCM_TAG_SIZE];
+    EVP_CIPHER_CTX *ctx = NULL;
+    int outlen1 = 0, outlen2 = 0;
+
+    *decrypt_data = NULL;
+
+    if (tpm_symmetric_key_token->userKeyLength != SWTPM_AES256_BLOCK_SIZE ||
+        nonce_length != SWTPM_AES_GCM_NONCE_SIZE ||
+        tag_length != SWTPM_AES_GCM_TAG_SIZE) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_SymmetricKeyData_DecryptGCM: Need a %u byte key, "
+                  "a %u byte nonce, and a %u byte tag\n",
+                  SWTPM_AES256_BLOCK_SIZE, SWTPM_AES_GCM_NONCE_SIZE,
+                  SWTPM_AES_GCM_TAG_SIZE);
+        return TPM_DECRYPT_ERROR;
+    }
+    /* OpenSSL 1.0 wants a non-const tag */
+    memcpy(tagbuf, tag, tag_length);
+
+    /* malloc(0) may return NULL */
+    *decrypt_data = malloc(encrypt_length ? encrypt_length : 1);
+    if (!*decrypt_data) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %u bytes.\n", encrypt_length);
+        rc = TPM_SIZE;
+    }
+
+    if (rc == 0) {
+        ctx = SWTPM_SymmetricKeyData_NewCtx(tpm_symmetric_key_token,
+                                            SWTPM_AES_CTX_GCM_DECRYPT, nonce);
+        if (!ctx ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+                                tag_length, tagbuf) != 1) {
+            logprintf(STDERR_FILENO,
+                      "Could not setup context for decryption.\n");
+            rc = TPM_FAIL;
+        }
+    }
+
+    if (rc == 0) {
+        if (EVP_DecryptUpdate(ctx, *decrypt_data, &outlen1,
+                              encrypt_data, encrypt_length) != 1 ||
+            (uint32_t)outlen1 != encrypt_length) {
+            logprintf(STDERR_FILENO,
+                      "Could not decrypt %u bytes.\n", encrypt_length);
+            rc = TPM_FAIL;
+        } else if (EVP_DecryptFinal_ex(ctx, out, &outlen2) != 1) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_SymmetricKeyData_DecryptGCM: Error, the "
+                      "authentication tag does not match\n");
+            rc = TPM_DECRYPT_ERROR;
+        }
+    }
+
+    if (rc == 0) {
+        *decrypt_length = encrypt_length;
+    } else {
+        free(*decrypt_data);
+        *decrypt_data = NULL;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return rc;
+}
@@ -39,16 +39,38 @@
 #ifndef _SWTPM_AES_H_
 #define _SWTPM_AES_H_
 
+#include <openssl/evp.h>
+
 #include <libtpms/tpm_types.h>
 
 #define SWTPM_AES128_BLOCK_SIZE 16
 #define SWTPM_AES256_BLOCK_SIZE 32
 
+#define SWTPM_AES_GCM_NONCE_SIZE 12
+#define SWTPM_AES_GCM_TAG_SIZE   16
+
+enum swtpm_aes_ctx_type {
+    SWTPM_AES_CTX_CBC_ENCRYPT = 0,
+    SWTPM_AES_CTX_CBC_DECRYPT,
+    SWTPM_AES_CTX_GCM_ENCRYPT,
+    SWTPM_AES_CTX_GCM_DECRYPT,
+
+    SWTPM_AES_CTX_NUM
+};
+
 typedef struct tdTPM_SYMMETRIC_KEY_DATA {
     unsigned char userKey[SWTPM_AES256_BLOCK_SIZE];
     size_t userKeyLength;
+    /* contexts holding the expanded key; cloned for every operation */
+    EVP_CIPHER_CTX *ctx[SWTPM_AES_CTX_NUM];
 } TPM_SYMMETRIC_KEY_DATA;
 
+void SWTPM_SymmetricKeyData_InitCtx(TPM_SYMMETRIC_KEY_DATA
+                                      *tpm_symmetric_key_token);
+
+void SWTPM_SymmetricKeyData_FreeCtx(TPM_SYMMETRIC_KEY_DATA
+                                      *tpm_symmetric_key_token);
+
 TPM_RESULT SWTPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,
                                         uint32_t *encrypt_length,
                                         const unsigned char *decrypt_data,
@@ -58,6 +80,11 @@ TPM_RESULT SWTPM_SymmetricKeyData_Encrypt(unsigned char **encrypt_data,
 					const unsigned char *ivec,
 					uint32_t ivec_length);
 
+EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_EncryptCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                    *tpm_symmetric_key_token,
+                                                  const unsigned char *ivec,
+                                                  uint32_t ivec_length);
+
 TPM_RESULT SWTPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,
                                         uint32_t *decrypt_length,
                                         const unsigned char *encrypt_data,
@@ -67,4 +94,35 @@ TPM_RESULT SWTPM_SymmetricKeyData_Decrypt(unsigned char **decrypt_data,
                                         const unsigned char *ivec,
                                         uint32_t ivec_length);
 
+EVP_CIPHER_CTX *SWTPM_SymmetricKeyData_EncryptGCMCtx(const TPM_SYMMETRIC_KEY_DATA
+                                                       *tpm_symmetric_key_token,
+                                                     const unsigned char *nonce,
+                                                     uint32_t nonce_length);
+
+TPM_RESULT SWTPM_SymmetricKeyData_FinalGCMCtx(EVP_CIPHER_CTX *ctx,
+                                              unsigned char *tag,
+                                              uint32_t tag_length);
+
+TPM_RESULT SWTPM_SymmetricKeyData_EncryptGCM(unsigned char **encrypt_data,
+                                             uint32_t *encrypt_length,
+                                             const unsigned char *decrypt_data,
+                                             uint32_t decrypt_length,
+                                             const TPM_SYMMETRIC_KEY_DATA
+                                               *tpm_symmetric_key_token,
+                                             const unsigned char *nonce,
+                                             uint32_t nonce_length,
+                                             unsigned char *tag,
+                                             uint32_t tag_length);
+
+TPM_RESULT SWTPM_SymmetricKeyData_DecryptGCM(unsigned char **decrypt_data,
+                                             uint32_t *decrypt_length,
+                                             const unsigned char *encrypt_data,
+                                             uint32_t encrypt_length,
+                                             const TPM_SYMMETRIC_KEY_DATA
+                                               *tpm_symmetric_key_token,
+                                             const unsigned char *nonce,
+                                             uint32_t nonce_length,
+                                             const unsigned char *tag,
+                                             uint32_t tag_length);
+
 #endif /* _SWTPM_AES_H_ */
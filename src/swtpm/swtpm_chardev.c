@@ -50,6 +50,8 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 
+#include <glib.h>
+
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_library.h>
 #include <libtpms/tpm_memory.h>
@@ -76,6 +78,8 @@
 #include "seccomp_profile.h"
 #include "options.h"
 #include "capabilities.h"
+#include "threadpool.h"
+#include "metrics.h"
 
 /* local variables */
 static int notify_fd[2] = {-1, -1};
@@ -153,12 +157,12 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   the value must be given in octal number format\n"
     "                   uid and gid set the ownership of the Unixio socket's file;\n"
     "                   terminate terminates on ctrl channel connection loss;\n"
-    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--migration-key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                 : use an AES key for the encryption of the TPM's state\n"
     "                   when it is retrieved from the TPM via ioctls;\n"
     "                   Setting this key ensures that the TPM's state will always\n"
     "                   be encrypted when migrated\n"
-    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--migration-key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                 : provide a passphrase in a file; the AES key will be\n"
     "                   derived from this passphrase; default kdf is PBKDF2\n"
     "--log file=<path>|fd=<filedescriptor>[,level=n][,prefix=<prefix>][,truncate]\n"
@@ -167,18 +171,20 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   log level 5 and higher will enable libtpms logging;\n"
     "                   all logged output will be prefixed with prefix;\n"
     "                   the log file can be reset (truncate)\n"
-    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc][,format=hex|binary][,remove=[true|false]]\n"
+    "--key file=<path>|fd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,format=hex|binary][,remove=[true|false]]\n"
     "                 : use an AES key for the encryption of the TPM's state\n"
     "                   files; use the given mode for the block encryption;\n"
     "                   the key is to be provided as a hex string or in binary\n"
     "                   format; the keyfile can be automatically removed using\n"
     "                   the remove parameter\n"
-    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
+    "--key pwdfile=<path>|pwdfd=<fd>[,mode=aes-cbc|aes-256-cbc|aes-256-gcm][,remove=[true|false]][,kdf=sha512|pbkdf2]\n"
     "                 : provide a passphrase in a file; the AES key will be\n"
     "                   derived from this passphrase; default kdf is PBKDF2\n"
     "--pid file=<path>|fd=<filedescriptor>\n"
     "                 : write the process ID into the given file\n"
     "--tpmstate dir=<dir>|backend-uri=<uri>[,mode=0...][,lock][,backup][,fsync]\n"
+    "           [,write-behind=<ms>][,page-flush][,max-states=<n>][,batch-fsync]\n"
+    "           [,direct-io][,compress]\n"
     "                 : set the directory or uri where the TPM's state will be written\n"
     "                   into; the TPM_PATH environment variable can be used\n"
     "                   instead of dir option;\n"
@@ -187,8 +193,20 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   lock enables file-locking by the storage backend;\n"
     "                   backup has the directory-backend create a backup of the\n"
     "                   permanent state file;\n"
-    "                   with fsync the directory-backend ensures that all data have been\n"
-    "                   transferred to disk before proceeding;\n"
+    "                   with fsync the directory-backend and the file backend ensure that\n"
+    "                   all data have been transferred to disk before proceeding;\n"
+    "                   write-behind writes the state in the background after\n"
+    "                   the given number of milliseconds and combines the writes\n"
+    "                   of the same state in that time;\n"
+    "                   page-flush has the file backend only write and flush the\n"
+    "                   pages of the state that changed;\n"
+    "                   max-states sets the number of entries in the header of a new\n"
+    "                   file backend;\n"
+    "                   batch-fsync has the directory-backend sync the directory once\n"
+    "                   for all states stored by a TPM command; implies fsync;\n"
+    "                   direct-io has the file backend access the file or block\n"
+    "                   device with O_DIRECT instead of memory-mapping it;\n"
+    "                   compress compresses the state with zstd before writing it;\n"
     "-r|--runas <user>: change to the given user\n"
     "-R|--chroot <path>\n"
     "                 : chroot to the given directory at startup\n"
@@ -217,10 +235,11 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                 : Choose the action of the seccomp profile when a\n"
     "                   blacklisted syscall is executed; default is kill\n"
 #endif
-    "--migration [incoming][,release-lock-outgoing]\n"
+    "--migration [incoming][,release-lock-outgoing][,compress]\n"
     "                 : Incoming migration defers locking of storage backend\n"
     "                   until the TPM state is received; release-lock-outgoing\n"
-    "                   releases the storage lock on outgoing migration\n"
+    "                   releases the storage lock on outgoing migration;\n"
+    "                   compress compresses the state blobs for migration\n"
     "--print-capabilities\n"
     "                 : print capabilities and terminate\n"
     "--print-states\n"
@@ -241,6 +260,11 @@ static void usage(FILE *file, const char *prgname, const char *iface)
     "                   the default mode is 0640\n"
     "                   checksums enables calculation of IP and TCP checksums;\n"
     "                   the default is that no checksums are calculated;\n"
+    "--metrics type=unixio,path=<path>|fd=<filedescriptor>[,mode=0...][,uid=uid][,gid=gid]\n"
+    "                 : Provide metrics in OpenMetrics text format to clients\n"
+    "                   connecting to the given UnixIO socket;\n"
+    "                   mode allows a user to set the file mode bits of the socket;\n"
+    "                   the default mode is 0770;\n"
     "-h|--help        : display this help screen and terminate\n"
     "\n",
     prgname, iface);
@@ -252,6 +276,7 @@ static void swtpm_cleanup(struct mainLoopParams *mlp)
     free(mlp->json_profile);
     pidfile_remove();
     ctrlchannel_free(mlp->cc);
+    metrics_free();
     log_global_free();
     tpmstate_global_free();
     SWTPM_NVRAM_Shutdown();
@@ -333,6 +358,7 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
     char *chroot = NULL;
     char *profiledata = NULL;
     char *pcapdata = NULL;
+    char *metricsdata = NULL;
 #ifdef WITH_VTPM_PROXY
     bool use_vtpm_proxy = false;
 #endif
@@ -376,6 +402,7 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
         {"print-profiles",   no_argument, 0, 'N'},
         {"print-info", required_argument, 0, 'x'},
         {"pcap"      , required_argument, 0, 'A'},
+        {"metrics"   , required_argument, 0, 'M'},
         {NULL        , 0                , 0, 0  },
     };
 
@@ -521,6 +548,10 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
             pcapdata = optarg;
             break;
 
+        case 'M': /* --metrics */
+            metricsdata = optarg;
+            break;
+
         case 'N': /* --print-profiles */
             printprofiles = true;
             break;
@@ -618,7 +649,8 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
         exit(EXIT_FAILURE);
     }
 
-    if (handle_ctrlchannel_options(ctrlchdata, &mlp.cc, &mlp.flags) < 0) {
+    if (handle_ctrlchannel_options(ctrlchdata, &mlp.cc, &mlp.flags) < 0 ||
+        handle_metrics_options(metricsdata) < 0) {
         goto exit_failure;
     }
 
@@ -677,6 +709,12 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
     if (install_sighandlers(notify_fd, sigterm_handler) < 0)
         goto error_no_sighandlers;
 
+    /* threads cannot be created once the seccomp profile is applied */
+    if (mainloop_start_worker_thread() < 0 ||
+        (rc = SWTPM_NVRAM_Start_WriteBehind()) ||
+        (rc = SWTPM_NVRAM_Start_LockWaiter()))
+        goto error_seccomp_profile;
+
     if (create_seccomp_profile(false, seccomp_action) < 0)
         goto error_seccomp_profile;
 
@@ -692,6 +730,7 @@ int swtpm_chardev_main(int argc, char **argv, const char *prgname, const char *i
     rc = mainLoop(&mlp, notify_fd[0], tpm_running);
 
 error_seccomp_profile:
+    worker_thread_end();
     uninstall_sighandlers();
 
 error_no_sighandlers:
@@ -78,12 +78,53 @@
 static int      sock_fd = -1;
 
 
+/* SWTPM_IO_CommandLength() determines the length of the command at the
+   beginning of 'buffer', including an optional TCG TPM 2 command header.
+
+   Returns 0 if not enough bytes are available to tell. A malformed length
+   is not rejected here but all available bytes are passed on so that the
+   TPM can respond with an error.
+*/
+
+static uint32_t SWTPM_IO_CommandLength(const unsigned char *buffer,
+                                       uint32_t length,
+                                       uint32_t bufferSize)
+{
+    struct tpm2_send_command_prefix prefix;
+    struct tpm_req_header hdr;
+    uint32_t offset = 0;
+    uint32_t cmdlen;
+
+    if (length < sizeof(hdr))
+        return 0;
+
+    memcpy(&prefix, buffer, sizeof(prefix));
+    if (be32toh(prefix.cmd) == TPM2_SEND_COMMAND) {
+        offset = sizeof(prefix);
+        cmdlen = be32toh(prefix.size);
+    } else {
+        memcpy(&hdr, buffer, sizeof(hdr));
+        cmdlen = be32toh(hdr.size);
+    }
+
+    if (cmdlen < sizeof(hdr) || cmdlen > bufferSize - offset)
+        return length;
+
+    return offset + cmdlen;
+}
+
 /* SWTPM_IO_Read() reads a TPM command packet from the host
 
    Puts the result in 'buffer' up to 'bufferSize' bytes.
 
    On success, the number of bytes in the buffer is equal to 'bufferLength' bytes
 
+   The read does not block. If the command has not been completely received,
+   TPM_RETRY is returned and the function has to be called again once the
+   file descriptor is readable. Bytes received beyond the end of the command
+   are kept in 'buffer' and are moved to its beginning by the next call,
+   therefore the same buffer must be passed every time.
+
    This function is intended to be platform independent.
 */
 
@@ -94,7 +135,7 @@ TPM_RESULT SWTPM_IO_Read(TPM_CONNECTION_FD *connection_fd,   /* read/write file
                          struct pcap_state *ps)     /* input: max size of output buffer */
 {
     ssize_t   n;
-    uint32_t  offset = 0;
+    uint32_t  cmdlen;
 
     if (connection_fd->fd < 0) {
         TPM_DEBUG("SWTPM_IO_Read: Passed file descriptor is invalid\n");
@@ -106,23 +147,50 @@ TPM_RESULT SWTPM_IO_Read(TPM_CONNECTION_FD *connection_fd,   /* read/write file
         return TPM_IOERROR;
     }
 
-    while (true) {
-        n = read(connection_fd->fd, &buffer[offset], bufferSize - offset);
-        if (n < 0 && errno == EINTR)
-            continue;
+    /* drop the previously returned command and keep what followed it */
+    if (connection_fd->rx_consumed) {
+        connection_fd->rx_len -= connection_fd->rx_consumed;
+        memmove(buffer, &buffer[connection_fd->rx_consumed],
+                connection_fd->rx_len);
+        connection_fd->rx_consumed = 0;
+    }
+
+    cmdlen = SWTPM_IO_CommandLength(buffer, connection_fd->rx_len, bufferSize);
+    if (cmdlen == 0 || cmdlen > connection_fd->rx_len) {
+        while (true) {
+            if (connection_fd->not_socket)
+                n = read(connection_fd->fd, &buffer[connection_fd->rx_len],
+                         bufferSize - connection_fd->rx_len);
+            else
+                n = recv(connection_fd->fd, &buffer[connection_fd->rx_len],
+                         bufferSize - connection_fd->rx_len, MSG_DONTWAIT);
+            if (n < 0 && errno == ENOTSOCK && !connection_fd->not_socket) {
+                connection_fd->not_socket = true;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TPM_RETRY;
         if (n <= 0)
             return TPM_IOERROR;
 
-        /* offset += n; overflow already prevented by 'bufferSize' variable */
-        if (__builtin_add_overflow(offset, n, &offset))
+        /* rx_len += n; overflow already prevented by 'bufferSize' variable */
+        if (__builtin_add_overflow(connection_fd->rx_len, n,
+                                   &connection_fd->rx_len))
             return TPM_IOERROR;
 
-        if (offset < sizeof(struct tpm_req_header))
-            continue;
-        break;
+        cmdlen = SWTPM_IO_CommandLength(buffer, connection_fd->rx_len,
+                                        bufferSize);
+        if (cmdlen == 0 || cmdlen > connection_fd->rx_len)
+            return TPM_RETRY;
     }
 
-    *bufferLength = offset;
+    connection_fd->rx_consumed = cmdlen;
+
+    *bufferLength = cmdlen;
     SWTPM_PrintAll(" SWTPM_IO_Read:", " ", buffer, *bufferLength);
 
     pcap_packet_record_write(ps, buffer, *bufferLength, true);
@@ -130,6 +198,28 @@ TPM_RESULT SWTPM_IO_Read(TPM_CONNECTION_FD *connection_fd,   /* read/write file
     return 0;
 }
 
+/* SWTPM_IO_HasCommand() determines whether a complete command that was
+   received along with the previous one is waiting in 'buffer'. Such a
+   command must be read with SWTPM_IO_Read() without waiting for the file
+   descriptor to become readable.
+*/
+
+bool SWTPM_IO_HasCommand(const TPM_CONNECTION_FD *connection_fd,
+                         const unsigned char *buffer,
+                         uint32_t bufferSize)
+{
+    uint32_t length = connection_fd->rx_len - connection_fd->rx_consumed;
+    uint32_t cmdlen;
+
+    if (connection_fd->fd < 0)
+        return false;
+
+    cmdlen = SWTPM_IO_CommandLength(&buffer[connection_fd->rx_consumed],
+                                    length, bufferSize);
+
+    return cmdlen > 0 && cmdlen <= length;
+}
+
 
 /* SWTPM_IO_SetSocketFD tells the IO layer that it's not necessary to open
    a server socket.
@@ -212,6 +302,11 @@ TPM_RESULT SWTPM_IO_Connect(TPM_CONNECTION_FD *connection_fd,     /* read/write
 
 /* SWTPM_IO_Write() writes 'buffer_length' bytes to the host.
 
+   The write does not block. If not all bytes could be written, TPM_RETRY
+   is returned and SWTPM_IO_Flush() has to be called once the file
+   descriptor is writable. The buffers referenced by 'iovec' must remain
+   valid until then.
+
    This is the Unix platform dependent socket version.
 */
 
@@ -220,8 +315,6 @@ TPM_RESULT SWTPM_IO_Write(TPM_CONNECTION_FD *connection_fd,       /* read/write
                           int iovcnt,
                           struct pcap_state *ps)
 {
-    ssize_t     nwritten = 0;
-    size_t      totlen = 0;
     int         i;
 
     SWTPM_PrintAll(" SWTPM_IO_Write:", " ",
@@ -237,24 +330,87 @@ TPM_RESULT SWTPM_IO_Write(TPM_CONNECTION_FD *connection_fd,       /* read/write
         return TPM_IOERROR;
     }
 
-    for (i = 0; i < iovcnt; i++)
-        totlen += iovec[i].iov_len;
-
-    nwritten = writev_full(connection_fd->fd, iovec, iovcnt);
-    if (nwritten < 0) {
-        logprintf(STDERR_FILENO, "SWTPM_IO_Write: Error, writev() %d %s\n",
-                  errno, strerror(errno));
-        return TPM_IOERROR;
-    }
-    if ((size_t)nwritten < totlen) {
+    if (iovcnt > SWTPM_IO_MAX_IOV) {
         logprintf(STDERR_FILENO,
-                  "SWTPM_IO_Write: Failed to write all bytes %zu != %zu\n",
-                  nwritten, totlen);
+                  "SWTPM_IO_Write: Error, too many buffers: %d\n", iovcnt);
         return TPM_IOERROR;
     }
+
+    connection_fd->tx_iovcnt = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iovec[i].iov_len == 0)
+            continue;
+        connection_fd->tx_iov[connection_fd->tx_iovcnt++] = iovec[i];
+    }
+
+    return SWTPM_IO_Flush(connection_fd);
+}
+
+/* SWTPM_IO_Flush() continues writing a response started by SWTPM_IO_Write()
+
+   Returns 0 once all bytes were written and TPM_RETRY if the file
+   descriptor is not writable.
+*/
+
+TPM_RESULT SWTPM_IO_Flush(TPM_CONNECTION_FD *connection_fd)
+{
+    struct msghdr msg;
+    ssize_t       n;
+    size_t        len;
+
+    while (connection_fd->tx_iovcnt > 0) {
+        if (connection_fd->not_socket) {
+            n = writev(connection_fd->fd, connection_fd->tx_iov,
+                       connection_fd->tx_iovcnt);
+        } else {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = connection_fd->tx_iov;
+            msg.msg_iovlen = connection_fd->tx_iovcnt;
+            n = sendmsg(connection_fd->fd, &msg, MSG_DONTWAIT);
+            if (n < 0 && errno == ENOTSOCK) {
+                connection_fd->not_socket = true;
+                continue;
+            }
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TPM_RETRY;
+        if (n < 0) {
+            logprintf(STDERR_FILENO, "SWTPM_IO_Write: Error, writev() %d %s\n",
+                      errno, strerror(errno));
+            connection_fd->tx_iovcnt = 0;
+            return TPM_IOERROR;
+        }
+
+        /* skip over what was written */
+        while (n > 0) {
+            len = connection_fd->tx_iov[0].iov_len;
+            if ((size_t)n < len) {
+                connection_fd->tx_iov[0].iov_base =
+                    (char *)connection_fd->tx_iov[0].iov_base + n;
+                connection_fd->tx_iov[0].iov_len -= n;
+                break;
+            }
+            n -= len;
+            connection_fd->tx_iovcnt--;
+            memmove(&connection_fd->tx_iov[0], &connection_fd->tx_iov[1],
+                    connection_fd->tx_iovcnt * sizeof(struct iovec));
+        }
+    }
+
     return 0;
 }
 
+/* SWTPM_IO_WritePending() determines whether SWTPM_IO_Write() could not
+   write all bytes of a response
+*/
+
+bool SWTPM_IO_WritePending(const TPM_CONNECTION_FD *connection_fd)
+{
+    return connection_fd->tx_iovcnt > 0;
+}
+
 /* SWTPM_IO_Disconnect() breaks the connection between the TPM server and the host client
 
    This is the Unix platform dependent socket version.
@@ -267,6 +423,10 @@ TPM_RESULT SWTPM_IO_Disconnect(TPM_CONNECTION_FD *connection_fd)
         close(connection_fd->fd);
         connection_fd->fd = -1;     /* mark the connection closed */
     }
+    connection_fd->not_socket = false;
+    connection_fd->rx_len = 0;
+    connection_fd->rx_consumed = 0;
+    connection_fd->tx_iovcnt = 0;
 
     return 0;
 }
@@ -40,8 +40,20 @@
 #ifndef _SWTPM_IO_H_
 #define _SWTPM_IO_H_
 
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define SWTPM_IO_MAX_IOV  3
+
 typedef struct TPM_CONNECTION_FD {
     int fd;     /* for socket, just an int */
+    bool not_socket;   /* use read() and writev() rather than recv/sendmsg */
+    /* non-blocking input state */
+    uint32_t rx_len;        /* number of bytes in the command buffer */
+    uint32_t rx_consumed;   /* length of the command that was returned */
+    /* non-blocking output state; tx_iovcnt > 0 while sending a response */
+    struct iovec tx_iov[SWTPM_IO_MAX_IOV];
+    int tx_iovcnt;
 } TPM_CONNECTION_FD;
 
 struct pcap_state;
@@ -54,10 +66,15 @@ TPM_RESULT SWTPM_IO_Read(TPM_CONNECTION_FD *connection_fd,
                          uint32_t *paramSize,
                          uint32_t buffer_size,
                          struct pcap_state *ps);
+bool SWTPM_IO_HasCommand(const TPM_CONNECTION_FD *connection_fd,
+                         const unsigned char *buffer,
+                         uint32_t buffer_size);
 TPM_RESULT SWTPM_IO_Write(TPM_CONNECTION_FD *connection_fd,
                           const struct iovec *iovec,
                           int iovcnt,
                           struct pcap_state *ps);
+TPM_RESULT SWTPM_IO_Flush(TPM_CONNECTION_FD *connection_fd);
+bool SWTPM_IO_WritePending(const TPM_CONNECTION_FD *connection_fd);
 TPM_RESULT SWTPM_IO_Disconnect(TPM_CONNECTION_FD *connection_fd);
 TPM_RESULT SWTPM_IO_SetSocketFD(int fd);
 int SWTPM_IO_GetSocketFD(void);
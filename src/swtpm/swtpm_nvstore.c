@@ -61,12 +61,19 @@
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_memory.h>
 #include <libtpms/tpm_nvfilename.h>
 #include <libtpms/tpm_library.h>
 
+#include <glib.h>
+
+#if defined(WITH_ZSTD)
+# include <zstd.h>
+#endif
+
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 #if OPENSSL_VERSION_NUMBER >= 0x30000000L
@@ -92,9 +99,13 @@
 #include "logging.h"
 #include "tpmstate.h"
 #include "tpmlib.h"
+#include "tpm_ioctl.h"
 #include "tlv.h"
+#include "metrics.h"
+#include "cmdstats.h"
 #include "utils.h"
 #include "compiler_dependencies.h"
+#include "sys_dependencies.h"
 
 /* local structures */
 typedef struct {
@@ -105,7 +116,14 @@ typedef struct {
     uint32_t totlen; /* length of the header and following data */
 } __attribute__((packed)) blobheader;
 
-#define BLOB_HEADER_VERSION 2
+#define BLOB_HEADER_VERSION 4
+
+/* the version of blobs with TLV data; written for uncompressed data */
+#define BLOB_HEADER_VERSION_TLV         2
+/* the version of blobs with compressed data, which v2 readers must reject */
+#define BLOB_HEADER_VERSION_COMPRESSED  3
+/* the version of blobs encrypted with AES-GCM, which v3 readers must reject */
+#define BLOB_HEADER_VERSION_GCM         4
 
 /* flags for blobheader */
 #define BLOB_FLAG_ENCRYPTED              0x01
@@ -113,10 +131,26 @@ typedef struct {
 #define BLOB_FLAG_MIGRATION_DATA         0x04  /* migration data are available */
 #define BLOB_FLAG_ENCRYPTED_256BIT_KEY   0x08  /* 256 bit file key was used */
 #define BLOB_FLAG_MIGRATION_256BIT_KEY   0x10  /* 256 bit migration key was used */
+#define BLOB_FLAG_COMPRESSED             0x20  /* data compressed with zstd */
+#define BLOB_FLAG_ENCRYPTED_GCM          0x40  /* file key used AES-256-GCM */
+#define BLOB_FLAG_MIGRATION_GCM          0x80  /* migration key used AES-256-GCM */
+
+#if defined(WITH_ZSTD)
+/* higher levels hardly shrink the TPM state further but take much longer */
+# define NVRAM_COMPRESSION_LEVEL 3
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX SWTPM_HMAC_CTX;
+#else
+typedef HMAC_CTX SWTPM_HMAC_CTX;
+#endif
 
 typedef struct {
     enum encryption_mode data_encmode;
     TPM_SYMMETRIC_KEY_DATA symkey;
+    /* HMAC context holding the key; cloned for every HMAC */
+    SWTPM_HMAC_CTX *hmac;
 } encryptionkey ;
 
 static encryptionkey filekey = {
@@ -135,8 +169,110 @@ static uint32_t g_ivec_length;
 static unsigned char *g_ivec;
 static struct nvram_backend_ops *g_nvram_backend_ops;
 
+/* the number of names libtpms stores: permall, volatilestate, savestate */
+#define NVRAM_MAX_NAMES 4
+
+/* a store of plain data that has not been written to the backend yet */
+struct nvram_wb_pending {
+    char *name;                 /* NULL if the entry is not used */
+    uint32_t tpm_number;
+    unsigned char *data;
+    uint32_t length;
+    gint64 deadline;            /* monotonic time by which to write it */
+};
+
+/*
+ * With write-behind, SWTPM_NVRAM_StoreData only keeps a copy of the data
+ * and the writer thread writes it once the delay has passed. Repeated
+ * stores of the same name within the delay are coalesced into one write.
+ */
+static struct {
+    GMutex lock;                /* protects the fields below */
+    GCond cond;
+    GThread *thread;
+    bool terminate;
+    TPM_RESULT error;           /* first error of a background write */
+    struct nvram_wb_pending pending[NVRAM_MAX_NAMES];
+} g_nvram_wb;
+
+/* serializes the accesses to the backend; taken before g_nvram_wb.lock */
+static GMutex g_nvram_io_lock;
+
+/* the interval at which to retry taking a lock without the lock waiter */
+#define NVRAM_LOCK_RETRY_INTERVAL_US  10000
+
+/*
+ * The lock waiter thread waits for a lock on the storage with F_OFD_SETLKW
+ * so that the lock is taken as soon as another process releases it. It
+ * locks a duplicate of the caller's file descriptor; the lock belongs to
+ * the open file description and is therefore also held by the caller's
+ * file descriptor. If the caller stops waiting, the thread releases the
+ * lock once it gets it and closes the duplicate.
+ */
+static struct {
+    GMutex lock;                /* protects the fields below */
+    GCond cond;
+    GThread *thread;
+    bool terminate;
+    int fd;                     /* the duplicate to lock; -1 if none */
+    struct flock flock;
+    bool done;                  /* fcntl() returned ret and err */
+    bool abandoned;             /* the caller stopped waiting */
+    int ret;
+    int err;
+} g_nvram_lw = {
+    .fd = -1,
+};
+
+/* open file description locks, or process-associated locks on kernels
+   without them */
+#ifdef F_OFD_SETLKW
+static int g_nvram_setlk_cmd = F_OFD_SETLK;
+#else
+static int g_nvram_setlk_cmd = F_SETLK;
+#endif
+
+/* whether to compress the state blobs for migration */
+static bool g_nvram_migration_compress;
+
+/*
+ * The digest of the plain data that the backend holds for a name, if known.
+ * A store of the same data is skipped. Protected by g_nvram_io_lock.
+ */
+struct nvram_digest {
+    char *name;                 /* NULL if the entry is not used */
+    uint32_t tpm_number;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+static struct nvram_digest g_nvram_digests[NVRAM_MAX_NAMES];
+
+/*
+ * The generation of the permanent state changes with every store of it so
+ * that a client that got the permanent state ahead of a migration can tell
+ * whether it must get it again. It starts out at the wall clock time in
+ * nanoseconds so that a restarted swtpm does not reuse a generation.
+ */
+static uint64_t g_nvram_permanent_generation;
+
+/* a plain state that was checked and is kept until it is set */
+struct nvram_staged_state {
+    bool valid;
+    unsigned char *data;
+    uint32_t length;
+};
+
+/*
+ * The plain permanent state that was received ahead of a migration and is
+ * kept until it is committed; see SWTPM_NVRAM_StageStateBlob().
+ */
+static struct nvram_staged_state g_nvram_staged;
+
 /* local prototypes */
 
+static void SWTPM_NVRAM_Key_InitCtx(encryptionkey *key);
+static void SWTPM_NVRAM_Key_FreeCtx(encryptionkey *key);
+
 static TPM_RESULT SWTPM_NVRAM_EncryptData(const encryptionkey *key,
                                           tlv_data *td,
                                           size_t *td_len,
@@ -155,18 +291,145 @@ static TPM_RESULT SWTPM_NVRAM_GetDecryptedData(const encryptionkey *key,
                                                uint8_t hdrversion,
                                                uint16_t tag_ivec,
                                                uint16_t hdrflags,
-                                               uint16_t flag_256bitkey);
+                                               uint16_t flag_256bitkey,
+                                               uint16_t flag_gcm);
 
-static TPM_RESULT SWTPM_NVRAM_PrependHeader(unsigned char **data,
-                                            uint32_t *length,
-                                            uint16_t flags);
+static TPM_RESULT SWTPM_NVRAM_CompressData(unsigned char **out,
+                                           uint32_t *out_length,
+                                           const unsigned char *data,
+                                           uint32_t length);
 
-static TPM_RESULT SWTPM_NVRAM_CheckHeader(unsigned char *data, uint32_t length,
+static TPM_RESULT SWTPM_NVRAM_DecompressData(unsigned char **out,
+                                             uint32_t *out_length,
+                                             const unsigned char *data,
+                                             uint32_t length);
+
+static void SWTPM_NVRAM_FillHeader(blobheader *bh, uint32_t totlen,
+                                   uint16_t flags);
+
+static TPM_RESULT SWTPM_NVRAM_CheckHeader(const unsigned char *data, uint32_t length,
                                           uint32_t *dataoffset,
                                           uint16_t *hdrflags,
                                           uint8_t *hdrversion,
                                           bool quiet);
 
+static TPM_BOOL SWTPM_NVRAM_WB_Load(unsigned char **data,
+                                    uint32_t *length,
+                                    uint32_t tpm_number,
+                                    const char *name);
+
+/* SWTPM_NVRAM_Digest_Set() records the digest of the data the backend holds
+   for 'name'; the caller must hold g_nvram_io_lock
+*/
+
+static void SWTPM_NVRAM_Digest_Set(uint32_t tpm_number, const char *name,
+                                   const unsigned char *digest)
+{
+    struct nvram_digest *nd = NULL;
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(g_nvram_digests); i++) {
+        if (g_nvram_digests[i].name &&
+            g_nvram_digests[i].tpm_number == tpm_number &&
+            !strcmp(g_nvram_digests[i].name, name)) {
+            nd = &g_nvram_digests[i];
+            break;
+        }
+        if (!nd && !g_nvram_digests[i].name)
+            nd = &g_nvram_digests[i];
+    }
+    if (!nd)
+        return;
+
+    if (!nd->name) {
+        nd->name = strdup(name);
+        if (!nd->name)
+            return;
+        nd->tpm_number = tpm_number;
+    }
+    memcpy(nd->digest, digest, sizeof(nd->digest));
+}
+
+/* SWTPM_NVRAM_Digest_Matches() checks whether the backend holds data with
+   the given digest for 'name'; the caller must hold g_nvram_io_lock
+*/
+
+static bool SWTPM_NVRAM_Digest_Matches(uint32_t tpm_number, const char *name,
+                                       const unsigned char *digest)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(g_nvram_digests); i++) {
+        if (g_nvram_digests[i].name &&
+            g_nvram_digests[i].tpm_number == tpm_number &&
+            !strcmp(g_nvram_digests[i].name, name))
+            return !memcmp(g_nvram_digests[i].digest, digest,
+                           sizeof(g_nvram_digests[i].digest));
+    }
+    return false;
+}
+
+/* SWTPM_NVRAM_Digest_Clear() forgets the digest of 'name' or of all names
+   if 'name' is NULL; the caller must hold g_nvram_io_lock
+*/
+
+static void SWTPM_NVRAM_Digest_Clear(uint32_t tpm_number, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(g_nvram_digests); i++) {
+        if (!g_nvram_digests[i].name)
+            continue;
+        if (name && (g_nvram_digests[i].tpm_number != tpm_number ||
+                     strcmp(g_nvram_digests[i].name, name)))
+            continue;
+        free(g_nvram_digests[i].name);
+        memset(&g_nvram_digests[i], 0, sizeof(g_nvram_digests[i]));
+    }
+}
+
+/* SWTPM_NVRAM_Digest_ClearAll() forgets all digests since the data the
+   backend holds may have been changed by someone else
+*/
+
+static void SWTPM_NVRAM_Digest_ClearAll(void)
+{
+    g_mutex_lock(&g_nvram_io_lock);
+    SWTPM_NVRAM_Digest_Clear(0, NULL);
+    g_mutex_unlock(&g_nvram_io_lock);
+}
+
+/* SWTPM_NVRAM_Generation_Bump() starts a new generation of the permanent
+   state if 'name' is the one of the permanent state
+*/
+
+static void SWTPM_NVRAM_Generation_Bump(const char *name)
+{
+    if (strcmp(name, TPM_PERMANENT_ALL_NAME) == 0)
+        __atomic_fetch_add(&g_nvram_permanent_generation, 1,
+                           __ATOMIC_SEQ_CST);
+}
+
+/* SWTPM_NVRAM_Get_PermanentGeneration() returns the current generation of
+   the permanent state
+*/
+
+uint64_t SWTPM_NVRAM_Get_PermanentGeneration(void)
+{
+    return __atomic_load_n(&g_nvram_permanent_generation, __ATOMIC_SEQ_CST);
+}
+
+static void SWTPM_NVRAM_Staged_Free(struct nvram_staged_state *ss)
+{
+    free(ss->data);
+    memset(ss, 0, sizeof(*ss));
+}
+
+static void SWTPM_NVRAM_Stage_Clear(void)
+{
+    SWTPM_NVRAM_Staged_Free(&g_nvram_staged);
+}
+
 /* SWTPM_NVRAM_Init() is called once at startup.  It does any NVRAM required initialization.
 
    This function sets some static variables that are used by all TPM's.
@@ -176,8 +439,16 @@ TPM_RESULT SWTPM_NVRAM_Init(void)
 {
     const char  *backend_uri;
     TPM_RESULT  rc = 0;
+    struct timespec ts;
     TPM_DEBUG(" SWTPM_NVRAM_Init:\n");
 
+    if (SWTPM_NVRAM_Get_PermanentGeneration() == 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        __atomic_store_n(&g_nvram_permanent_generation,
+                         (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+                         __ATOMIC_SEQ_CST);
+    }
+
     backend_uri = tpmstate_get_backend_uri();
     if (!backend_uri) {
         logprintf(STDERR_FILENO,
@@ -185,8 +456,14 @@ TPM_RESULT SWTPM_NVRAM_Init(void)
         rc = TPM_FAIL;
     } else if (strncmp(backend_uri, "dir://", 6) == 0) {
         g_nvram_backend_ops = &nvram_dir_ops;
-    } else if (strncmp(backend_uri, "file://", 7) == 0) {
+    } else if (strncmp(backend_uri, "file://", 7) == 0 ||
+               strncmp(backend_uri, "nbd://", 6) == 0 ||
+               strncmp(backend_uri, "nbd+unix://", 11) == 0) {
         g_nvram_backend_ops = &nvram_linear_ops;
+#if defined(WITH_SQLITE)
+    } else if (strncmp(backend_uri, "sqlite://", 9) == 0) {
+        g_nvram_backend_ops = &nvram_sqlite_ops;
+#endif
     } else {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_Init: Unsupported backend.\n");
@@ -200,6 +477,7 @@ TPM_RESULT SWTPM_NVRAM_Init(void)
         g_nvram_backend_ops->restore_backup_pre_start &&
         tpmstate_get_make_backup()) {
         rc = g_nvram_backend_ops->restore_backup_pre_start(backend_uri);
+        SWTPM_NVRAM_Digest_ClearAll();
     }
 
     return rc;
@@ -207,8 +485,16 @@ TPM_RESULT SWTPM_NVRAM_Init(void)
 
 void SWTPM_NVRAM_Shutdown(void)
 {
+    SWTPM_NVRAM_Stop_WriteBehind();
+    SWTPM_NVRAM_Stop_LockWaiter();
+    SWTPM_NVRAM_Sync();
+
     if (g_nvram_backend_ops)
         g_nvram_backend_ops->cleanup();
+    SWTPM_NVRAM_Digest_ClearAll();
+    SWTPM_NVRAM_Stage_Clear();
+    SWTPM_NVRAM_Key_FreeCtx(&filekey);
+    SWTPM_NVRAM_Key_FreeCtx(&migrationkey);
     memset(&filekey, 0, sizeof(filekey));
     memset(&migrationkey, 0, sizeof(migrationkey));
 }
@@ -236,6 +522,10 @@ TPM_RESULT SWTPM_NVRAM_Lock_Storage(unsigned int retries)
 
 void SWTPM_NVRAM_Unlock(void)
 {
+    /* another process may take over the storage */
+    SWTPM_NVRAM_Flush();
+    SWTPM_NVRAM_Digest_ClearAll();
+
     if (!tpmstate_get_locking()) {
         /* no locking requested by user */
         return;
@@ -307,12 +597,22 @@ SWTPM_NVRAM_LoadData(unsigned char **data,     /* freed by caller */
     uint32_t      dataoffset = 0;
     uint8_t       hdrversion = 0;
     uint16_t      hdrflags;
+    uint8_t       exp_version = BLOB_HEADER_VERSION_TLV;
+    uint16_t      exp_flags = 0;
     const char    *backend_uri = NULL;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
 
     TPM_DEBUG(" SWTPM_NVRAM_LoadData: From file %s\n", name);
     *data = NULL;
     *length = 0;
 
+    /* data not written yet are the most recent ones */
+    if (SWTPM_NVRAM_WB_Load(data, length, tpm_number, name))
+        return *data ? 0 : TPM_SIZE;
+
+    /* the digest must be of the data the backend still holds */
+    g_mutex_lock(&g_nvram_io_lock);
+
     if (rc == 0) {
         backend_uri = tpmstate_get_backend_uri();
         rc = g_nvram_backend_ops->load(data, length, tpm_number, name,
@@ -334,11 +634,14 @@ SWTPM_NVRAM_LoadData(unsigned char **data,     /* freed by caller */
                                           &decrypt_data, &decrypt_length,
                                           *data + dataoffset,
                                           *length - dataoffset,
-                                          TAG_ENCRYPTED_DATA, TAG_DATA,
+                                          TAG_ENCRYPTED_DATA,
+                                          (hdrflags & BLOB_FLAG_COMPRESSED)
+                                            ? TAG_COMPRESSED_DATA : TAG_DATA,
                                           hdrversion,
                                           TAG_IVEC_ENCRYPTED_DATA,
                                           hdrflags,
-                                          BLOB_FLAG_ENCRYPTED_256BIT_KEY);
+                                          BLOB_FLAG_ENCRYPTED_256BIT_KEY,
+                                          BLOB_FLAG_ENCRYPTED_GCM);
         TPM_DEBUG(" SWTPM_NVRAM_LoadData: SWTPM_NVRAM_GetDecryptedData rc = %d\n",
                   rc);
         if (rc != 0)
@@ -347,6 +650,17 @@ SWTPM_NVRAM_LoadData(unsigned char **data,     /* freed by caller */
                       "rc = %d\n", rc);
     }
 
+    if (rc == 0 && (hdrflags & BLOB_FLAG_COMPRESSED)) {
+        free(*data);
+        *data = decrypt_data;
+        rc = SWTPM_NVRAM_DecompressData(&decrypt_data, &decrypt_length,
+                                        *data, decrypt_length);
+        if (rc != 0)
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LoadData: Error from SWTPM_NVRAM_DecompressData "
+                      "rc = %d\n", rc);
+    }
+
     free(*data);
 
     if (rc == 0) {
@@ -355,15 +669,40 @@ SWTPM_NVRAM_LoadData(unsigned char **data,     /* freed by caller */
                   *length, decrypt_length);
         *data = decrypt_data;
         *length = decrypt_length;
+
+        /* a store of the same data only has to be skipped if it would
+           write the blob in the same format */
+        if (SWTPM_NVRAM_Has_FileKey()) {
+            exp_flags |= BLOB_FLAG_ENCRYPTED;
+            if (SWTPM_NVRAM_FileKey_Size() == SWTPM_AES256_BLOCK_SIZE)
+                exp_flags |= BLOB_FLAG_ENCRYPTED_256BIT_KEY;
+        }
+        if (tpmstate_get_compress()) {
+            exp_flags |= BLOB_FLAG_COMPRESSED;
+            exp_version = BLOB_HEADER_VERSION_COMPRESSED;
+        }
+        if (SWTPM_NVRAM_Has_FileKey() &&
+            filekey.data_encmode == ENCRYPTION_MODE_AES_256_GCM) {
+            exp_flags |= BLOB_FLAG_ENCRYPTED_GCM;
+            exp_version = BLOB_HEADER_VERSION_GCM;
+        }
+        if (hdrversion == exp_version && hdrflags == exp_flags) {
+            SHA256(*data, *length, digest);
+            SWTPM_NVRAM_Digest_Set(tpm_number, name, digest);
+        }
     } else {
         *data = NULL;
     }
 
+    g_mutex_unlock(&g_nvram_io_lock);
+
     return rc;
 }
 
 /* SWTPM_NVRAM_StoreData stores 'data' of 'length' to the rooted 'filename'
 
+   The caller must hold g_nvram_io_lock.
+
    Returns
         0 on success
         TPM_FAIL for other fatal errors
@@ -378,784 +717,2275 @@ SWTPM_NVRAM_StoreData_Intern(const unsigned char *data,
 {
     TPM_RESULT    rc = 0;
     unsigned char *filedata = NULL;
-    uint32_t      filedata_length = 0;
+    blobheader    bh;
+    tlv_iovec     tiov;
     tlv_data      td[3];
     size_t        td_len = 0;
     uint16_t      flags = 0;
     const char    *backend_uri = NULL;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    const unsigned char *plain = data;
+    uint32_t      plain_length = length;
+    unsigned char *compressed = NULL;
+    uint32_t      compressed_length = 0;
 
     TPM_DEBUG(" SWTPM_NVRAM_StoreData: To name %s\n", name);
 
+    /* libtpms often stores the same data again */
+    SHA256(data, length, digest);
+    if (encrypt && SWTPM_NVRAM_Digest_Matches(tpm_number, name, digest)) {
+        TPM_DEBUG("  SWTPM_NVRAM_StoreData: Data unchanged\n");
+        metrics_nvram_elided(length);
+        return 0;
+    }
+
+    /* compression must be done before encryption */
+    if (tpmstate_get_compress()) {
+        rc = SWTPM_NVRAM_CompressData(&compressed, &compressed_length,
+                                      data, length);
+        if (rc == 0) {
+            TPM_DEBUG("  SWTPM_NVRAM_StoreData: Compressed %u bytes to %u "
+                      "bytes\n", length, compressed_length);
+            plain = compressed;
+            plain_length = compressed_length;
+            flags |= BLOB_FLAG_COMPRESSED;
+        }
+    }
+
     if (rc == 0) {
         if (encrypt && SWTPM_NVRAM_Has_FileKey()) {
             td_len = 3;
             rc = SWTPM_NVRAM_EncryptData(&filekey, &td[0], &td_len,
-                                         TAG_ENCRYPTED_DATA, data, length,
+                                         TAG_ENCRYPTED_DATA,
+                                         plain, plain_length,
                                          TAG_IVEC_ENCRYPTED_DATA);
             if (rc) {
                 logprintf(STDERR_FILENO,
                           "SWTPM_NVRAM_EncryptData failed: 0x%02x\n", rc);
             } else {
                 TPM_DEBUG("  SWTPM_NVRAM_StoreData: Encrypted %u bytes before "
-                          "write, will write %u bytes\n", length,
+                          "write, will write %u bytes\n", plain_length,
                           td[0].tlv.length);
             }
             flags |= BLOB_FLAG_ENCRYPTED;
             if (SWTPM_NVRAM_FileKey_Size() == SWTPM_AES256_BLOCK_SIZE)
                 flags |= BLOB_FLAG_ENCRYPTED_256BIT_KEY;
+            if (filekey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+                flags |= BLOB_FLAG_ENCRYPTED_GCM;
         } else {
             td_len = 1;
-            td[0] = TLV_DATA_CONST(TAG_DATA, length, data);
+            td[0] = TLV_DATA_CONST((flags & BLOB_FLAG_COMPRESSED)
+                                     ? TAG_COMPRESSED_DATA : TAG_DATA,
+                                   plain_length, plain);
         }
     }
 
+    /* the header is filled in once the total length is known */
     if (rc == 0)
-        rc = tlv_data_append(&filedata, &filedata_length, td, td_len);
-
-    if (rc == 0)
-        rc = SWTPM_NVRAM_PrependHeader(&filedata, &filedata_length, flags);
+        rc = tlv_iovec_init(&tiov, &bh, sizeof(bh), td, td_len);
 
     if (rc == 0) {
+        SWTPM_NVRAM_FillHeader(&bh, tiov.length, flags);
+
         backend_uri = tpmstate_get_backend_uri();
-        rc = g_nvram_backend_ops->store(filedata, filedata_length, tpm_number, name,
-                                        backend_uri, tpmstate_get_do_fsync());
+        if (g_nvram_backend_ops->storev) {
+            rc = g_nvram_backend_ops->storev(tiov.iov, tiov.iovcnt,
+                                             tiov.length, tpm_number, name,
+                                             backend_uri,
+                                             tpmstate_get_do_fsync());
+        } else {
+            filedata = malloc(tiov.length);
+            if (!filedata) {
+                logprintf(STDERR_FILENO,
+                          "Could not allocate %u bytes.\n", tiov.length);
+                rc = TPM_FAIL;
+            } else {
+                tlv_iovec_copy(&tiov, filedata);
+                rc = g_nvram_backend_ops->store(filedata, tiov.length,
+                                                tpm_number, name, backend_uri,
+                                                tpmstate_get_do_fsync());
+            }
+        }
+        if (rc == 0)
+            metrics_nvram_store(tiov.length);
     }
 
+    if (rc == 0 && encrypt)
+        SWTPM_NVRAM_Digest_Set(tpm_number, name, digest);
+    else
+        SWTPM_NVRAM_Digest_Clear(tpm_number, name);
+
     tlv_data_free(td, td_len);
     free(filedata);
+    free(compressed);
 
     TPM_DEBUG(" SWTPM_NVRAM_StoreData: rc=%d\n", rc);
 
     return rc;
 }
 
-TPM_RESULT SWTPM_NVRAM_StoreData(const unsigned char *data,
-                                 uint32_t length,
-                                 uint32_t tpm_number,
-                                 const char *name)
+/* SWTPM_NVRAM_WB_Find() finds the pending store of 'name'; the caller must
+   hold g_nvram_wb.lock
+*/
+
+static struct nvram_wb_pending *
+SWTPM_NVRAM_WB_Find(uint32_t tpm_number, const char *name)
 {
-    return SWTPM_NVRAM_StoreData_Intern(data, length, tpm_number, name, TRUE);
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(g_nvram_wb.pending); i++) {
+        if (g_nvram_wb.pending[i].name &&
+            g_nvram_wb.pending[i].tpm_number == tpm_number &&
+            !strcmp(g_nvram_wb.pending[i].name, name))
+            return &g_nvram_wb.pending[i];
+    }
+    return NULL;
 }
 
-/* SWTPM_NVRAM_DeleteName() deletes the 'name' from NVRAM
+static void SWTPM_NVRAM_WB_Free(struct nvram_wb_pending *p)
+{
+    free(p->name);
+    free(p->data);
+    memset(p, 0, sizeof(*p));
+}
 
-   Returns:
-        0 on success, or if the file does not exist and mustExist is FALSE
-        TPM_FAIL if the file could not be removed, since this should never occur and there is
-                no recovery
+/* SWTPM_NVRAM_WB_Load() gets a copy of the pending data of 'name'
 
-   NOTE: Not portable code, but supported by Linux and Windows
+   Returns TRUE if there are pending data; *data is NULL on out of memory
 */
 
-TPM_RESULT SWTPM_NVRAM_DeleteName(uint32_t tpm_number,
-                                  const char *name,
-                                  TPM_BOOL mustExist)
+static TPM_BOOL
+SWTPM_NVRAM_WB_Load(unsigned char **data,
+                    uint32_t *length,
+                    uint32_t tpm_number,
+                    const char *name)
 {
-    const char *backend_uri = NULL;
-    backend_uri = tpmstate_get_backend_uri();
+    struct nvram_wb_pending *p;
+    TPM_BOOL found = FALSE;
 
-    return g_nvram_backend_ops->delete(tpm_number, name, mustExist,
-                                       backend_uri);
+    if (!g_nvram_wb.thread)
+        return FALSE;
+
+    g_mutex_lock(&g_nvram_wb.lock);
+
+    p = SWTPM_NVRAM_WB_Find(tpm_number, name);
+    if (p) {
+        found = TRUE;
+        *data = malloc(p->length);
+        if (*data) {
+            memcpy(*data, p->data, p->length);
+            *length = p->length;
+        } else {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LoadData: Out of memory\n");
+        }
+    }
+
+    g_mutex_unlock(&g_nvram_wb.lock);
+
+    return found;
 }
 
+/* SWTPM_NVRAM_WB_Store() keeps a copy of 'data' for the writer thread
 
-TPM_RESULT SWTPM_NVRAM_Store_Volatile(void)
-{
-    TPM_RESULT     rc = 0;
-    const char     *name = TPM_VOLATILESTATE_NAME;
-    uint32_t       tpm_number = 0;
-    unsigned char  *buffer = NULL;
-    uint32_t       buflen;
+   Returns
+        0 on success
+        TPM_SIZE on out of memory
+*/
 
-    TPM_DEBUG(" SWTPM_Store_Volatile: Name %s\n", name);
-    if (rc == 0) {
-        rc = TPMLIB_VolatileAll_Store(&buffer, &buflen);
+static TPM_RESULT
+SWTPM_NVRAM_WB_Store(const unsigned char *data,
+                     uint32_t length,
+                     uint32_t tpm_number,
+                     const char *name)
+{
+    struct nvram_wb_pending *p;
+    unsigned char *copy;
+    size_t i;
+
+    copy = malloc(length);
+    if (!copy) {
+        logprintf(STDERR_FILENO, "SWTPM_NVRAM_StoreData: Out of memory\n");
+        return TPM_SIZE;
     }
-    if (rc == 0) {
-        /* map name to the rooted filename */
-        rc = SWTPM_NVRAM_StoreData(buffer, buflen, tpm_number, name);
+    memcpy(copy, data, length);
+
+    g_mutex_lock(&g_nvram_wb.lock);
+
+    p = SWTPM_NVRAM_WB_Find(tpm_number, name);
+    if (p) {
+        /* coalesce with the previous store; keep its deadline */
+        metrics_nvram_coalesced(p->length);
+        free(p->data);
+    } else {
+        for (i = 0; i < ARRAY_LEN(g_nvram_wb.pending); i++) {
+            if (!g_nvram_wb.pending[i].name)
+                break;
+        }
+        if (i < ARRAY_LEN(g_nvram_wb.pending))
+            p = &g_nvram_wb.pending[i];
+        if (p)
+            p->name = strdup(name);
+        if (!p || !p->name) {
+            g_mutex_unlock(&g_nvram_wb.lock);
+            free(copy);
+            /* fall back to writing it now */
+            return TPM_RETRY;
+        }
+        p->tpm_number = tpm_number;
+        p->deadline = g_get_monotonic_time() +
+                      (gint64)tpmstate_get_write_behind_ms() * 1000;
+        g_cond_signal(&g_nvram_wb.cond);
     }
+    p->data = copy;
+    p->length = length;
 
-    free(buffer);
+    g_mutex_unlock(&g_nvram_wb.lock);
 
-    return rc;
+    return 0;
 }
 
+/* SWTPM_NVRAM_WB_Write() writes the pending data to the backend
+
+   @all: whether to write all pending data or only those whose deadline
+         has passed
+
+   Returns the first error of writing the data, including those of earlier
+   background writes if 'all' is set.
+*/
+
 static TPM_RESULT
-SWTPM_NVRAM_KeyParamCheck(uint32_t keylen,
-                          enum encryption_mode encmode)
+SWTPM_NVRAM_WB_Write(bool all)
 {
-    TPM_RESULT rc = 0;
+    struct nvram_wb_pending todo[NVRAM_MAX_NAMES];
+    TPM_RESULT rc = 0, res;
+    size_t i, n = 0;
+    gint64 now;
+
+    /* the data taken must be written before any later ones */
+    g_mutex_lock(&g_nvram_io_lock);
+    g_mutex_lock(&g_nvram_wb.lock);
+
+    now = g_get_monotonic_time();
+    for (i = 0; i < ARRAY_LEN(g_nvram_wb.pending); i++) {
+        if (g_nvram_wb.pending[i].name &&
+            (all || g_nvram_wb.pending[i].deadline <= now)) {
+            todo[n++] = g_nvram_wb.pending[i];
+            memset(&g_nvram_wb.pending[i], 0, sizeof(g_nvram_wb.pending[i]));
+        }
+    }
+    if (all) {
+        rc = g_nvram_wb.error;
+        g_nvram_wb.error = 0;
+    }
 
-    if (keylen != SWTPM_AES128_BLOCK_SIZE &&
-        keylen != SWTPM_AES256_BLOCK_SIZE) {
-        rc = TPM_BAD_KEY_PROPERTY;
+    g_mutex_unlock(&g_nvram_wb.lock);
+
+    for (i = 0; i < n; i++) {
+        res = SWTPM_NVRAM_StoreData_Intern(todo[i].data, todo[i].length,
+                                           todo[i].tpm_number, todo[i].name,
+                                           TRUE);
+        if (res && rc == 0)
+            rc = res;
+        SWTPM_NVRAM_WB_Free(&todo[i]);
     }
-    switch (encmode) {
-    case ENCRYPTION_MODE_AES_CBC:
-        break;
-    case ENCRYPTION_MODE_UNKNOWN:
-        rc = TPM_BAD_MODE;
+
+    g_mutex_unlock(&g_nvram_io_lock);
+
+    if (!all && rc) {
+        g_mutex_lock(&g_nvram_wb.lock);
+        if (g_nvram_wb.error == 0)
+            g_nvram_wb.error = rc;
+        g_mutex_unlock(&g_nvram_wb.lock);
     }
 
     return rc;
 }
 
-size_t SWTPM_NVRAM_FileKey_Size(void)
+static gpointer SWTPM_NVRAM_WB_Thread(gpointer data SWTPM_ATTR_UNUSED)
 {
-    return filekey.symkey.userKeyLength;
-}
+    gint64 deadline;
+    size_t i;
 
-TPM_RESULT SWTPM_NVRAM_Set_FileKey(const unsigned char *key, uint32_t keylen,
-                                   enum encryption_mode encmode)
-{
-    TPM_RESULT rc;
+    g_mutex_lock(&g_nvram_wb.lock);
 
-    rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
+    while (!g_nvram_wb.terminate) {
+        deadline = G_MAXINT64;
+        for (i = 0; i < ARRAY_LEN(g_nvram_wb.pending); i++) {
+            if (g_nvram_wb.pending[i].name)
+                deadline = min(deadline, g_nvram_wb.pending[i].deadline);
+        }
 
-    if (rc == 0) {
-        memcpy(filekey.symkey.userKey, key, keylen);
-        filekey.symkey.userKeyLength = keylen;
-        filekey.data_encmode = encmode;
+        if (deadline == G_MAXINT64) {
+            g_cond_wait(&g_nvram_wb.cond, &g_nvram_wb.lock);
+        } else if (g_get_monotonic_time() < deadline) {
+            g_cond_wait_until(&g_nvram_wb.cond, &g_nvram_wb.lock, deadline);
+        } else {
+            g_mutex_unlock(&g_nvram_wb.lock);
+            SWTPM_NVRAM_WB_Write(false);
+            g_mutex_lock(&g_nvram_wb.lock);
+        }
     }
 
-    return rc;
-}
+    g_mutex_unlock(&g_nvram_wb.lock);
 
-size_t SWTPM_NVRAM_MigrationKey_Size(void)
-{
-    return migrationkey.symkey.userKeyLength;
+    return NULL;
 }
 
-TPM_RESULT SWTPM_NVRAM_Set_MigrationKey(const unsigned char *key,
-                                        uint32_t keylen,
-                                        enum encryption_mode encmode)
-{
-    TPM_RESULT rc;
+/* SWTPM_NVRAM_Start_WriteBehind() starts the thread writing the data in the
+   background if the user enabled it; this must be called before the seccomp
+   profile is applied
 
-    rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
+   Returns
+        0 on success
+        TPM_FAIL if the thread could not be started
+*/
 
-    if (rc == 0) {
-        memcpy(migrationkey.symkey.userKey, key, keylen);
-        migrationkey.symkey.userKeyLength = keylen;
-        migrationkey.data_encmode = encmode;
+TPM_RESULT SWTPM_NVRAM_Start_WriteBehind(void)
+{
+    if (tpmstate_get_write_behind_ms() == 0 || g_nvram_wb.thread)
+        return 0;
+
+    g_nvram_wb.terminate = false;
+    g_nvram_wb.thread = g_thread_try_new("nvram-writer",
+                                         SWTPM_NVRAM_WB_Thread, NULL, NULL);
+    if (!g_nvram_wb.thread) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not create the NVRAM writer thread.\n");
+        return TPM_FAIL;
     }
 
-    return rc;
+    return 0;
 }
 
-# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+/* SWTPM_NVRAM_Stop_WriteBehind() writes all pending data and stops the
+   writer thread
+*/
 
-static int SWTPM_HMAC(unsigned char *md, unsigned int *md_len,
-                      const void *key, int key_len,
-                      const unsigned char *in, uint32_t in_length,
-                      const unsigned char *ivec, uint32_t ivec_length)
+void SWTPM_NVRAM_Stop_WriteBehind(void)
 {
-    OSSL_PARAM params[2];
-    EVP_MAC_CTX *ctx;
-    EVP_MAC *hmac;
-    size_t outl;
-    int ret = 0;
+    GThread *thread = g_nvram_wb.thread;
 
-    hmac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
-    if (!hmac)
-        return 0;
+    if (!thread)
+        return;
 
-    ctx = EVP_MAC_CTX_new(hmac);
-    if (!ctx)
-        goto err;
+    g_mutex_lock(&g_nvram_wb.lock);
+    g_nvram_wb.terminate = true;
+    g_cond_signal(&g_nvram_wb.cond);
+    g_mutex_unlock(&g_nvram_wb.lock);
 
-    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_ALG_PARAM_DIGEST,
-                                                 (char *)"sha256", 0);
-    params[1] = OSSL_PARAM_construct_end();
+    g_thread_join(thread);
 
-    if (!EVP_MAC_init(ctx, key, key_len, params) ||
-        !EVP_MAC_update(ctx, in, in_length))
-        goto err;
+    /* stores until now are still pending rather than written directly */
+    SWTPM_NVRAM_Flush();
+    g_nvram_wb.thread = NULL;
+}
 
-    if (ivec &&
-        !EVP_MAC_update(ctx, ivec, ivec_length))
-        goto err;
+#ifdef F_OFD_SETLKW
+static gpointer SWTPM_NVRAM_LW_Thread(gpointer data SWTPM_ATTR_UNUSED)
+{
+    struct flock flock;
+    int fd, ret, err;
 
-    if (!EVP_MAC_final(ctx, md, &outl, *md_len))
-        goto err;
-    *md_len = outl;
+    g_mutex_lock(&g_nvram_lw.lock);
 
-    ret = 1;
+    while (!g_nvram_lw.terminate) {
+        if (g_nvram_lw.fd < 0 || g_nvram_lw.done) {
+            g_cond_wait(&g_nvram_lw.cond, &g_nvram_lw.lock);
+            continue;
+        }
+        fd = g_nvram_lw.fd;
+        flock = g_nvram_lw.flock;
+
+        g_mutex_unlock(&g_nvram_lw.lock);
+        do {
+            ret = fcntl(fd, F_OFD_SETLKW, &flock);
+        } while (ret < 0 && errno == EINTR);
+        err = errno;
+        g_mutex_lock(&g_nvram_lw.lock);
+
+        if (g_nvram_lw.abandoned) {
+            if (ret == 0) {
+                flock.l_type = F_UNLCK;
+                fcntl(fd, F_OFD_SETLK, &flock);
+            }
+            close(fd);
+            g_nvram_lw.fd = -1;
+            g_nvram_lw.abandoned = false;
+        } else {
+            g_nvram_lw.ret = ret;
+            g_nvram_lw.err = err;
+            g_nvram_lw.done = true;
+            g_cond_broadcast(&g_nvram_lw.cond);
+        }
+    }
 
-err:
-    EVP_MAC_CTX_free(ctx);
-    EVP_MAC_free(hmac);
+    g_mutex_unlock(&g_nvram_lw.lock);
 
-    return ret;
+    return NULL;
 }
+#endif
 
-#else
-
-static int SWTPM_HMAC(unsigned char *md, unsigned int *md_len,
-                      const void *key, int key_len,
-                      const unsigned char *in, uint32_t in_length,
-                      const unsigned char *ivec, uint32_t ivec_length)
-{
-    int ret = 0;
-
-#if defined OPENSSL_OLD_API
-    HMAC_CTX sctx, *ctx = &sctx;
+/* SWTPM_NVRAM_Start_LockWaiter() starts the thread waiting for locks on the
+   storage; this must be called before the seccomp profile is applied
 
-    HMAC_CTX_init(ctx);
-#else
-    HMAC_CTX *ctx = HMAC_CTX_new();
+   Returns
+        0 on success
+        TPM_FAIL if the thread could not be started
+*/
 
-    if (!ctx)
+TPM_RESULT SWTPM_NVRAM_Start_LockWaiter(void)
+{
+#ifdef F_OFD_SETLKW
+    if (!tpmstate_get_locking() || g_nvram_lw.thread)
         return 0;
+
+    g_nvram_lw.terminate = false;
+    g_nvram_lw.thread = g_thread_try_new("nvram-locker",
+                                         SWTPM_NVRAM_LW_Thread, NULL, NULL);
+    if (!g_nvram_lw.thread) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not create the NVRAM lock waiter thread.\n");
+        return TPM_FAIL;
+    }
 #endif
 
+    return 0;
+}
+
+/* SWTPM_NVRAM_Stop_LockWaiter() stops the lock waiter thread; a thread that
+   still waits for an abandoned lock is left behind
+*/
 
-    if (!HMAC_Init_ex(ctx, key, key_len, EVP_sha256(), NULL) ||
-        !HMAC_Update(ctx, in, in_length))
-        goto err;
+void SWTPM_NVRAM_Stop_LockWaiter(void)
+{
+    GThread *thread = g_nvram_lw.thread;
+    bool busy;
 
-    if (ivec &&
-        !HMAC_Update(ctx, ivec, ivec_length))
-        goto err;
+    if (!thread)
+        return;
 
-    if (!HMAC_Final(ctx, md, md_len))
-        goto err;
+    g_mutex_lock(&g_nvram_lw.lock);
+    g_nvram_lw.terminate = true;
+    busy = g_nvram_lw.fd >= 0;
+    g_cond_broadcast(&g_nvram_lw.cond);
+    g_mutex_unlock(&g_nvram_lw.lock);
+
+    if (busy)
+        g_thread_unref(thread);
+    else
+        g_thread_join(thread);
+    g_nvram_lw.thread = NULL;
+}
 
-    ret = 1;
+static int SWTPM_NVRAM_SetLk(int fd, struct flock *flock)
+{
+    int ret;
 
-err:
-#if defined OPENSSL_OLD_API
-    HMAC_CTX_cleanup(ctx);
-#else
-    HMAC_CTX_free(ctx);
-#endif
+    ret = fcntl(fd, g_nvram_setlk_cmd, flock);
+    if (ret < 0 && errno == EINVAL && g_nvram_setlk_cmd != F_SETLK) {
+        /* the kernel does not support open file description locks */
+        g_nvram_setlk_cmd = F_SETLK;
+        ret = fcntl(fd, F_SETLK, flock);
+    }
 
     return ret;
 }
-#endif /* if OPENSSL_VERSION_NUMBER >= 0x30000000L */
 
-/*
- * SWTPM_RollAndSetGlobalIvec: Create an IV for the AES CBC algorithm to use
- *                             Create it with a random number every time.
- *                             and leave the pointer to the data in @td.
- *
- * @td: pointer to tlv_data to get pointer to the random data
- * @tag_ivec: tag for the IV tlv header
- * @ivec_length: number of bytes needed for the ivec
- */
-static TPM_RESULT SWTPM_RollAndSetGlobalIvec(tlv_data *td,
-                                             uint16_t tag_ivec,
-                                             uint32_t ivec_length)
+/* SWTPM_NVRAM_LW_Wait() has the lock waiter thread take the lock and waits
+   until it has it or the deadline has passed
+
+   Returns 0 if the lock was taken and -1 with errno set otherwise; errno is
+   ENOLCK if the lock waiter is not available
+*/
+
+static int SWTPM_NVRAM_LW_Wait(int fd, const struct flock *flock,
+                               gint64 deadline)
 {
-    unsigned char data[16]; /* do not initialize */
-    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
-    void *p;
+    int ret = -1;
 
-    if (g_ivec_length < ivec_length) {
-        p = realloc(g_ivec, ivec_length);
-        if (!p) {
-            *td = TLV_DATA_CONST(tag_ivec, 0, NULL);
+    g_mutex_lock(&g_nvram_lw.lock);
 
-            logprintf(STDOUT_FILENO,
-                      "Could not allocate %u bytes.\n", ivec_length);
-            return TPM_FAIL;
-        }
-        g_ivec = p;
-        g_ivec_length = ivec_length;
+    /* still waiting for an abandoned lock? */
+    if (!g_nvram_lw.thread || g_nvram_lw.fd >= 0 ||
+        g_nvram_setlk_cmd == F_SETLK) {
+        errno = ENOLCK;
+        goto exit;
     }
 
-    if (RAND_bytes(g_ivec, g_ivec_length) != 1) {
-        /* random data from stack to the rescue */
-        SHA256(g_ivec, g_ivec_length, hashbuf);
-        SHA256(data, sizeof(data), hashbuf);
-        memcpy(g_ivec, hashbuf,
-               g_ivec_length < sizeof(hashbuf)
-                   ? g_ivec_length
-                   : sizeof(hashbuf));
+    g_nvram_lw.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (g_nvram_lw.fd < 0) {
+        errno = ENOLCK;
+        goto exit;
+    }
+    g_nvram_lw.flock = *flock;
+    g_nvram_lw.done = false;
+    g_cond_broadcast(&g_nvram_lw.cond);
+
+    while (!g_nvram_lw.done &&
+           g_cond_wait_until(&g_nvram_lw.cond, &g_nvram_lw.lock, deadline))
+        ;
+
+    if (g_nvram_lw.done) {
+        close(g_nvram_lw.fd);
+        g_nvram_lw.fd = -1;
+        g_nvram_lw.done = false;
+        ret = g_nvram_lw.ret;
+        errno = g_nvram_lw.err;
+    } else {
+        g_nvram_lw.abandoned = true;
+        errno = EAGAIN;
     }
 
-    *td = TLV_DATA_CONST(tag_ivec, g_ivec_length, g_ivec);
+exit:
+    g_mutex_unlock(&g_nvram_lw.lock);
 
-    return 0;
+    return ret;
 }
 
-/*
- * SWTPM_GetIvec: Get the encryption IV from the data stream. If none is
- *                found a NULL pointer is set in *ivec, otherwise a pointer
- *                to the beginning of the IV and its length are returned.
- */
-static void SWTPM_GetIvec(const unsigned char *data, uint32_t length,
-                          const unsigned char **ivec, uint32_t *ivec_length,
-                          uint16_t tag)
-{
-    tlv_data td;
+/* SWTPM_NVRAM_LockFile() takes a write lock on a range of the file; if
+   another process holds a lock on it, it waits for up to 'retries' * 10ms
+   for the lock to be released
 
-    if (!tlv_data_find_tag(data, length, tag, &td)) {
-        *ivec = NULL;
-    } else {
-        *ivec = td.u.const_ptr;
-        *ivec_length = td.tlv.length;
+   Returns 0 on success and -1 with errno set otherwise
+*/
+
+int SWTPM_NVRAM_LockFile(int fd, off_t start, off_t len, unsigned int retries)
+{
+    struct flock flock = {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = start,
+        .l_len = len,
+    };
+    struct timespec wait_start;
+    gint64 deadline;
+    int ret;
+
+    cmdstats_start(&wait_start);
+    deadline = g_get_monotonic_time() +
+               (gint64)retries * NVRAM_LOCK_RETRY_INTERVAL_US;
+
+    ret = SWTPM_NVRAM_SetLk(fd, &flock);
+    if (ret < 0 && (errno == EAGAIN || errno == EACCES) && retries > 0) {
+        ret = SWTPM_NVRAM_LW_Wait(fd, &flock, deadline);
+        if (ret < 0 && errno == ENOLCK) {
+            /* without the lock waiter poll for the lock */
+            do {
+                usleep(NVRAM_LOCK_RETRY_INTERVAL_US);
+                ret = SWTPM_NVRAM_SetLk(fd, &flock);
+            } while (ret < 0 && (errno == EAGAIN || errno == EACCES) &&
+                     g_get_monotonic_time() < deadline);
+        }
     }
+
+    if (ret == 0)
+        metrics_nvram_lock_wait(&wait_start);
+    else if (errno == EAGAIN || errno == EACCES)
+        metrics_nvram_lock_timeout();
+
+    return ret;
 }
 
-/*
- * SWTPM_CalcHMAC
- *
- * @in: input buffer to calculate HMAC on
- * @in_length: length of input buffer
- * @td: pointer to a tlv_data structure to receive the result with the
- *      tag, length, and pointer to an allocated buffer holding the HMAC
- * @tpm_symmetric_key_token: symmetric key
- * @ivec: the IV for AES CBC
- * @ivec_length: the length of the IV
- *
- * Calculate an HMAC on the input buffer with payload and create an output
- * buffer with the HMAC
- */
-static TPM_RESULT
-SWTPM_CalcHMAC(const unsigned char *in, uint32_t in_length,
-               tlv_data *td,
-               const TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_token,
-               const unsigned char *ivec, uint32_t ivec_length)
+/* SWTPM_NVRAM_UnlockFile() releases a lock taken with SWTPM_NVRAM_LockFile()
+*/
+
+int SWTPM_NVRAM_UnlockFile(int fd, off_t start, off_t len)
 {
-    TPM_RESULT rc = 0;
-    unsigned char md[EVP_MAX_MD_SIZE];
-    unsigned int md_len = sizeof(md);
-    unsigned char *buffer = NULL;
+    struct flock flock = {
+        .l_type = F_UNLCK,
+        .l_whence = SEEK_SET,
+        .l_start = start,
+        .l_len = len,
+    };
 
-    if (!SWTPM_HMAC(md, &md_len,
-                    tpm_symmetric_key_token->userKey,
-                    tpm_symmetric_key_token->userKeyLength,
-                    in, in_length, ivec, ivec_length)) {
-        logprintf(STDOUT_FILENO, "HMAC calculation failed.\n");
-        return TPM_FAIL;
-    }
+    return SWTPM_NVRAM_SetLk(fd, &flock);
+}
 
-    buffer = malloc(md_len);
+/* SWTPM_NVRAM_Flush() writes all pending data to the backend; it is a
+   barrier after which all data stored before are durable
 
-    if (buffer) {
-        *td = TLV_DATA(TAG_HMAC, md_len, buffer);
-        memcpy(buffer, md, md_len);
-    } else {
-       logprintf(STDOUT_FILENO,
-                 "Could not allocate %u bytes.\n", md_len);
-       rc = TPM_FAIL;
+   Returns
+        0 on success
+        the first error of writing the data since the last flush
+*/
+
+TPM_RESULT SWTPM_NVRAM_Flush(void)
+{
+    TPM_RESULT rc = 0, res;
+
+    if (tpmstate_get_write_behind_ms() != 0) {
+        rc = SWTPM_NVRAM_WB_Write(true);
+        if (rc)
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_Flush: Error writing TPM state rc = %d\n",
+                      rc);
     }
 
+    res = SWTPM_NVRAM_Sync();
+    if (rc == 0)
+        rc = res;
+
     return rc;
 }
 
-/*
- * SWTPM_CheckHMAC:
- *
- * @hmac: tlv_data with pointer to hmac bytes
- * @encrypted_data: tlv_data with pointer to encrypted data bytes
- * @tpm_symmetric_key_token: symmetric key
- * @ivec: the IV for AES CBC
- * @ivec_length: the length of the IV
- *
- * Verify the HMAC given the expected @hmac and the @tpm_symmetric_key_token
- * to calculate the HMAC over the @encrypted_data.
- */
-static TPM_RESULT
-SWTPM_CheckHMAC(tlv_data *hmac, tlv_data *encrypted_data,
-                const TPM_SYMMETRIC_KEY_DATA *tpm_symmetric_key_token,
-                const unsigned char *ivec, uint32_t ivec_length)
-{
-    const unsigned char *data;
-    uint32_t data_length;
-    unsigned int md_len;
-    unsigned char md[EVP_MAX_MD_SIZE];
+/* SWTPM_NVRAM_Sync() makes the data written to the backend so far durable if
+   the backend defers this, as the directory backend does with batch-fsync;
+   it is called once a TPM command is done so that all the states it stored
+   are synced together
 
-    md_len = EVP_MD_size(EVP_sha256());
-    if (md_len > hmac->tlv.length) {
-        logprintf(STDOUT_FILENO, "Insufficient bytes for CheckHMAC()\n");
-        return TPM_FAIL;
-    }
+   Returns
+        0 on success
+        TPM_FAIL if the data could not be synced
+*/
 
-    data = encrypted_data->u.ptr;
-    data_length = encrypted_data->tlv.length;
+TPM_RESULT SWTPM_NVRAM_Sync(void)
+{
+    TPM_RESULT rc;
 
-    if (!SWTPM_HMAC(md, &md_len,
-                    tpm_symmetric_key_token->userKey,
-                    tpm_symmetric_key_token->userKeyLength,
-                    data, data_length, ivec, ivec_length)) {
-        logprintf(STDOUT_FILENO, "HMAC() call failed.\n");
-        return TPM_FAIL;
-    }
+    if (!g_nvram_backend_ops || !g_nvram_backend_ops->sync)
+        return 0;
 
-    if (memcmp(hmac->u.ptr, md, md_len)) {
-        logprintf(STDOUT_FILENO, "Verification of HMAC failed. "
-                  "Data integrity is compromised\n");
-        /* TPM_DECRYPT_ERROR indicates (to libtpms) that something
-           exists but we have the wrong key. */
-        return TPM_DECRYPT_ERROR;
-    }
+    g_mutex_lock(&g_nvram_io_lock);
+    rc = g_nvram_backend_ops->sync(tpmstate_get_backend_uri());
+    g_mutex_unlock(&g_nvram_io_lock);
 
-    return TPM_SUCCESS;
+    if (rc)
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Sync: Error syncing TPM state rc = %d\n", rc);
+
+    return rc;
 }
 
-/*
- * SWTPM_CheckHash: sha256-hash the data in a buffer and check it against its leading
- *                  sha256; on success return the data in an allocated buffer
- *
- * @in: input buffer that has a sha256 in the first few bytes followed by data
- *      that will be sha256-hashed; the hash of the data must be equal to the
- *      leading hash in the buffer
- * @in_length: input buffer length
- * @out: pointer to pointer for output buffer; will be allocated by function
- * @out_length: pointer to output buffer length; will be set by function
- *
- * Returns TPM_FAIL on failure, TPM_SUCCESS otherwise.
- */
-static TPM_RESULT
-SWTPM_CheckHash(const unsigned char *in, uint32_t in_length,
-                unsigned char **out, uint32_t *out_length)
+TPM_RESULT SWTPM_NVRAM_StoreData(const unsigned char *data,
+                                 uint32_t length,
+                                 uint32_t tpm_number,
+                                 const char *name)
 {
-    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
-    const unsigned char *data = &in[sizeof(hashbuf)];
-    uint32_t data_length = in_length - sizeof(hashbuf);
-
-    if (in_length < sizeof(hashbuf))
-        return TPM_FAIL;
-
-    /* hash the data */
-    SHA256(data, data_length, hashbuf);
+    TPM_RESULT rc;
 
-    if (memcmp(in, hashbuf, sizeof(hashbuf))) {
-        logprintf(STDOUT_FILENO, "Verification of hash failed. "
-                  "Data integrity is compromised\n");
-        return TPM_FAIL;
-    }
+    SWTPM_NVRAM_Generation_Bump(name);
 
-    *out = malloc(data_length);
-    if (*out == NULL) {
-        logprintf(STDOUT_FILENO,
-                  "Could not allocated %u bytes.\n", data_length);
-        return TPM_FAIL;
+    if (g_nvram_wb.thread) {
+        rc = SWTPM_NVRAM_WB_Store(data, length, tpm_number, name);
+        if (rc != TPM_RETRY)
+            return rc;
     }
 
-    *out_length = data_length;
-    memcpy(*out, data, data_length);
+    g_mutex_lock(&g_nvram_io_lock);
+    rc = SWTPM_NVRAM_StoreData_Intern(data, length, tpm_number, name, TRUE);
+    g_mutex_unlock(&g_nvram_io_lock);
 
-    return TPM_SUCCESS;
+    return rc;
 }
 
-static TPM_RESULT
-SWTPM_NVRAM_EncryptData(const encryptionkey *key,
-                        struct tlv_data *td, /* must provide 2 array members */
-                        size_t *td_len,
-                        uint16_t tag_encrypted_data,
-                        const unsigned char *data, uint32_t length,
-                        uint16_t tag_ivec)
+/* SWTPM_NVRAM_DeleteName() deletes the 'name' from NVRAM
+
+   Returns:
+        0 on success, or if the file does not exist and mustExist is FALSE
+        TPM_FAIL if the file could not be removed, since this should never occur and there is
+                no recovery
+
+   NOTE: Not portable code, but supported by Linux and Windows
+*/
+
+TPM_RESULT SWTPM_NVRAM_DeleteName(uint32_t tpm_number,
+                                  const char *name,
+                                  TPM_BOOL mustExist)
+{
+    const char *backend_uri = NULL;
+    struct nvram_wb_pending *p;
+    TPM_RESULT rc;
+
+    backend_uri = tpmstate_get_backend_uri();
+
+    g_mutex_lock(&g_nvram_io_lock);
+
+    /* a pending store must not bring the name back */
+    g_mutex_lock(&g_nvram_wb.lock);
+    p = SWTPM_NVRAM_WB_Find(tpm_number, name);
+    if (p)
+        SWTPM_NVRAM_WB_Free(p);
+    g_mutex_unlock(&g_nvram_wb.lock);
+
+    rc = g_nvram_backend_ops->delete(tpm_number, name, mustExist,
+                                     backend_uri);
+    SWTPM_NVRAM_Digest_Clear(tpm_number, name);
+    SWTPM_NVRAM_Generation_Bump(name);
+
+    g_mutex_unlock(&g_nvram_io_lock);
+
+    return rc;
+}
+
+
+TPM_RESULT SWTPM_NVRAM_Store_Volatile(void)
+{
+    TPM_RESULT     rc = 0;
+    const char     *name = TPM_VOLATILESTATE_NAME;
+    uint32_t       tpm_number = 0;
+    unsigned char  *buffer = NULL;
+    uint32_t       buflen;
+
+    TPM_DEBUG(" SWTPM_Store_Volatile: Name %s\n", name);
+    if (rc == 0) {
+        rc = TPMLIB_VolatileAll_Store(&buffer, &buflen);
+    }
+    if (rc == 0) {
+        /* map name to the rooted filename */
+        rc = SWTPM_NVRAM_StoreData(buffer, buflen, tpm_number, name);
+    }
+    /* the user expects the volatile state to be written now */
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Flush();
+
+    free(buffer);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_KeyParamCheck(uint32_t keylen,
+                          enum encryption_mode encmode)
 {
     TPM_RESULT rc = 0;
-    TPM_RESULT irc;
-    unsigned char *tmp_data = NULL;
-    uint32_t tmp_length = 0;
 
-    *td_len = 0;
+    if (keylen != SWTPM_AES128_BLOCK_SIZE &&
+        keylen != SWTPM_AES256_BLOCK_SIZE) {
+        rc = TPM_BAD_KEY_PROPERTY;
+    }
+    switch (encmode) {
+    case ENCRYPTION_MODE_AES_CBC:
+        break;
+    case ENCRYPTION_MODE_AES_256_GCM:
+        if (keylen != SWTPM_AES256_BLOCK_SIZE)
+            rc = TPM_BAD_KEY_PROPERTY;
+        break;
+    case ENCRYPTION_MODE_UNKNOWN:
+        rc = TPM_BAD_MODE;
+    }
 
-    if (key->symkey.userKeyLength > 0) {
-        switch (key->data_encmode) {
-        case ENCRYPTION_MODE_UNKNOWN:
-            rc = TPM_BAD_MODE;
-            break;
-        case ENCRYPTION_MODE_AES_CBC:
-            irc = SWTPM_RollAndSetGlobalIvec(&td[2], tag_ivec,
-                                             key->symkey.userKeyLength);
-            rc = SWTPM_SymmetricKeyData_Encrypt(&tmp_data, &tmp_length,
-                                                data, length, &key->symkey,
-                                                td[2].u.const_ptr,
-                                                td[2].tlv.length);
-            if (rc)
-                 break;
+    return rc;
+}
+
+size_t SWTPM_NVRAM_FileKey_Size(void)
+{
+    return filekey.symkey.userKeyLength;
+}
+
+TPM_RESULT SWTPM_NVRAM_Set_FileKey(const unsigned char *key, uint32_t keylen,
+                                   enum encryption_mode encmode)
+{
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
+
+    if (rc == 0) {
+        memcpy(filekey.symkey.userKey, key, keylen);
+        filekey.symkey.userKeyLength = keylen;
+        filekey.data_encmode = encmode;
+        SWTPM_NVRAM_Key_InitCtx(&filekey);
+        /* the stored data have to be written with the new key */
+        SWTPM_NVRAM_Digest_ClearAll();
+    }
+
+    return rc;
+}
+
+size_t SWTPM_NVRAM_MigrationKey_Size(void)
+{
+    return migrationkey.symkey.userKeyLength;
+}
+
+TPM_RESULT SWTPM_NVRAM_Set_MigrationKey(const unsigned char *key,
+                                        uint32_t keylen,
+                                        enum encryption_mode encmode)
+{
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_KeyParamCheck(keylen, encmode);
+
+    if (rc == 0) {
+        memcpy(migrationkey.symkey.userKey, key, keylen);
+        migrationkey.symkey.userKeyLength = keylen;
+        migrationkey.data_encmode = encmode;
+        SWTPM_NVRAM_Key_InitCtx(&migrationkey);
+    }
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_Set_MigrationCompression: Set whether the state blobs for
+ *                                       migration are compressed
+ */
+void SWTPM_NVRAM_Set_MigrationCompression(bool compress)
+{
+    g_nvram_migration_compress = compress;
+}
+
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+static void SWTPM_HMAC_Free(SWTPM_HMAC_CTX *ctx)
+{
+    EVP_MAC_CTX_free(ctx);
+}
+
+static SWTPM_HMAC_CTX *SWTPM_HMAC_New(const void *key, int key_len)
+{
+    OSSL_PARAM params[2];
+    EVP_MAC_CTX *ctx;
+    EVP_MAC *hmac;
+
+    hmac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+    if (!hmac)
+        return NULL;
+
+    /* the context holds its own reference to hmac */
+    ctx = EVP_MAC_CTX_new(hmac);
+    EVP_MAC_free(hmac);
+    if (!ctx)
+        return NULL;
+
+    params[0] = OSSL_PARAM_construct_utf8_string(OSSL_ALG_PARAM_DIGEST,
+                                                 (char *)"sha256", 0);
+    params[1] = OSSL_PARAM_construct_end();
+
+    if (!EVP_MAC_init(ctx, key, key_len, params)) {
+        SWTPM_HMAC_Free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static SWTPM_HMAC_CTX *SWTPM_HMAC_Dup(const SWTPM_HMAC_CTX *ctx)
+{
+    return EVP_MAC_CTX_dup(ctx);
+}
+
+static int SWTPM_HMAC_Update(SWTPM_HMAC_CTX *ctx,
+                             const unsigned char *in, size_t in_length)
+{
+    return EVP_MAC_update(ctx, in, in_length);
+}
+
+static int SWTPM_HMAC_Final(SWTPM_HMAC_CTX *ctx,
+                            unsigned char *md, unsigned int *md_len)
+{
+    size_t outl;
+
+    if (!EVP_MAC_final(ctx, md, &outl, *md_len))
+        return 0;
+    *md_len = outl;
+
+    return 1;
+}
+
+#else
+
+static void SWTPM_HMAC_Free(SWTPM_HMAC_CTX *ctx)
+{
+#if defined OPENSSL_OLD_API
+    if (ctx)
+        HMAC_CTX_cleanup(ctx);
+    free(ctx);
+#else
+    HMAC_CTX_free(ctx);
+#endif
+}
+
+static SWTPM_HMAC_CTX *SWTPM_HMAC_New(const void *key, int key_len)
+{
+#if defined OPENSSL_OLD_API
+    HMAC_CTX *ctx = malloc(sizeof(*ctx));
+
+    if (!ctx)
+        return NULL;
+    HMAC_CTX_init(ctx);
+#else
+    HMAC_CTX *ctx = HMAC_CTX_new();
+
+    if (!ctx)
+        return NULL;
+#endif
+
+    if (!HMAC_Init_ex(ctx, key, key_len, EVP_sha256(), NULL)) {
+        SWTPM_HMAC_Free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static SWTPM_HMAC_CTX *SWTPM_HMAC_Dup(const SWTPM_HMAC_CTX *ctx)
+{
+#if defined OPENSSL_OLD_API
+    HMAC_CTX *dup = malloc(sizeof(*dup));
+
+    if (!dup)
+        return NULL;
+    HMAC_CTX_init(dup);
+#else
+    HMAC_CTX *dup = HMAC_CTX_new();
+
+    if (!dup)
+        return NULL;
+#endif
+
+    if (!HMAC_CTX_copy(dup, (HMAC_CTX *)ctx)) {
+        SWTPM_HMAC_Free(dup);
+        return NULL;
+    }
+
+    return dup;
+}
+
+static int SWTPM_HMAC_Update(SWTPM_HMAC_CTX *ctx,
+                             const unsigned char *in, size_t in_length)
+{
+    return HMAC_Update(ctx, in, in_length);
+}
+
+static int SWTPM_HMAC_Final(SWTPM_HMAC_CTX *ctx,
+                            unsigned char *md, unsigned int *md_len)
+{
+    return HMAC_Final(ctx, md, md_len);
+}
+#endif /* if OPENSSL_VERSION_NUMBER >= 0x30000000L */
+
+/*
+ * SWTPM_NVRAM_HMAC_New: Get an HMAC context for the given key; it is cloned
+ *                       from the one of the key if there is one
+ */
+static SWTPM_HMAC_CTX *SWTPM_NVRAM_HMAC_New(const encryptionkey *key)
+{
+    struct timespec start;
+    SWTPM_HMAC_CTX *ctx;
+
+    cmdstats_start(&start);
+
+    if (key->hmac)
+        ctx = SWTPM_HMAC_Dup(key->hmac);
+    else
+        ctx = SWTPM_HMAC_New(key->symkey.userKey, key->symkey.userKeyLength);
+
+    if (ctx)
+        metrics_nvram_crypto_setup(key->hmac != NULL, &start);
+
+    return ctx;
+}
+
+/*
+ * SWTPM_NVRAM_Key_InitCtx: Set up the cipher and HMAC contexts of a key
+ *                          that was just set, so that they only need to
+ *                          be cloned for every operation
+ */
+static void SWTPM_NVRAM_Key_InitCtx(encryptionkey *key)
+{
+    SWTPM_SymmetricKeyData_InitCtx(&key->symkey);
+
+    SWTPM_HMAC_Free(key->hmac);
+    key->hmac = SWTPM_HMAC_New(key->symkey.userKey,
+                               key->symkey.userKeyLength);
+}
+
+static void SWTPM_NVRAM_Key_FreeCtx(encryptionkey *key)
+{
+    SWTPM_SymmetricKeyData_FreeCtx(&key->symkey);
+
+    SWTPM_HMAC_Free(key->hmac);
+    key->hmac = NULL;
+}
+
+static int SWTPM_HMAC(unsigned char *md, unsigned int *md_len,
+                      const encryptionkey *key,
+                      const unsigned char *in, uint32_t in_length,
+                      const unsigned char *ivec, uint32_t ivec_length)
+{
+    SWTPM_HMAC_CTX *ctx;
+    int ret = 0;
+
+    ctx = SWTPM_NVRAM_HMAC_New(key);
+    if (!ctx)
+        return 0;
+
+    if (SWTPM_HMAC_Update(ctx, in, in_length) &&
+        (!ivec || SWTPM_HMAC_Update(ctx, ivec, ivec_length)) &&
+        SWTPM_HMAC_Final(ctx, md, md_len))
+        ret = 1;
+
+    SWTPM_HMAC_Free(ctx);
+
+    return ret;
+}
+
+/*
+ * SWTPM_RollAndSetGlobalIvec: Create an IV for the AES algorithm to use
+ *                             Create it with a random number every time.
+ *                             and leave the pointer to the data in @td.
+ *
+ * @td: pointer to tlv_data to get pointer to the random data
+ * @tag_ivec: tag for the IV tlv header
+ * @ivec_length: number of bytes needed for the ivec
+ * @encmode: the encryption mode the IV is used with; for AES-256-GCM the IV
+ *           is a nonce that must never repeat, so it must be random
+ */
+static TPM_RESULT SWTPM_RollAndSetGlobalIvec(tlv_data *td,
+                                             uint16_t tag_ivec,
+                                             uint32_t ivec_length,
+                                             enum encryption_mode encmode)
+{
+    unsigned char data[16]; /* do not initialize */
+    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
+    void *p;
+
+    if (g_ivec_length < ivec_length) {
+        p = realloc(g_ivec, ivec_length);
+        if (!p) {
+            *td = TLV_DATA_CONST(tag_ivec, 0, NULL);
+
+            logprintf(STDOUT_FILENO,
+                      "Could not allocate %u bytes.\n", ivec_length);
+            return TPM_FAIL;
+        }
+        g_ivec = p;
+        g_ivec_length = ivec_length;
+    }
+
+    if (RAND_bytes(g_ivec, g_ivec_length) != 1) {
+        if (encmode == ENCRYPTION_MODE_AES_256_GCM) {
+            *td = TLV_DATA_CONST(tag_ivec, 0, NULL);
+
+            logprintf(STDERR_FILENO,
+                      "Could not get random bytes for the AES-GCM nonce.\n");
+            return TPM_FAIL;
+        }
+        /* random data from stack to the rescue */
+        SHA256(g_ivec, g_ivec_length, hashbuf);
+        SHA256(data, sizeof(data), hashbuf);
+        memcpy(g_ivec, hashbuf,
+               g_ivec_length < sizeof(hashbuf)
+                   ? g_ivec_length
+                   : sizeof(hashbuf));
+    }
+
+    *td = TLV_DATA_CONST(tag_ivec, ivec_length, g_ivec);
+
+    return 0;
+}
+
+/*
+ * SWTPM_GetIvec: Get the encryption IV from the data stream. If none is
+ *                found a NULL pointer is set in *ivec, otherwise a pointer
+ *                to the beginning of the IV and its length are returned.
+ */
+static void SWTPM_GetIvec(const unsigned char *data, uint32_t length,
+                          const unsigned char **ivec, uint32_t *ivec_length,
+                          uint16_t tag)
+{
+    tlv_data td;
+
+    if (!tlv_data_find_tag(data, length, tag, &td)) {
+        *ivec = NULL;
+    } else {
+        *ivec = td.u.const_ptr;
+        *ivec_length = td.tlv.length;
+    }
+}
+
+/*
+ * SWTPM_CalcHMAC
+ *
+ * @in: input buffer to calculate HMAC on
+ * @in_length: length of input buffer
+ * @td: pointer to a tlv_data structure to receive the result with the
+ *      tag, length, and pointer to an allocated buffer holding the HMAC
+ * @key: the key
+ * @ivec: the IV for AES CBC
+ * @ivec_length: the length of the IV
+ *
+ * Calculate an HMAC on the input buffer with payload and create an output
+ * buffer with the HMAC
+ */
+static TPM_RESULT
+SWTPM_CalcHMAC(const unsigned char *in, uint32_t in_length,
+               tlv_data *td,
+               const encryptionkey *key,
+               const unsigned char *ivec, uint32_t ivec_length)
+{
+    TPM_RESULT rc = 0;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = sizeof(md);
+    unsigned char *buffer = NULL;
+
+    if (!SWTPM_HMAC(md, &md_len, key, in, in_length, ivec, ivec_length)) {
+        logprintf(STDOUT_FILENO, "HMAC calculation failed.\n");
+        return TPM_FAIL;
+    }
+
+    buffer = malloc(md_len);
+
+    if (buffer) {
+        *td = TLV_DATA(TAG_HMAC, md_len, buffer);
+        memcpy(buffer, md, md_len);
+    } else {
+       logprintf(STDOUT_FILENO,
+                 "Could not allocate %u bytes.\n", md_len);
+       rc = TPM_FAIL;
+    }
+
+    return rc;
+}
+
+/*
+ * SWTPM_CheckHMAC:
+ *
+ * @hmac: tlv_data with pointer to hmac bytes
+ * @encrypted_data: tlv_data with pointer to encrypted data bytes
+ * @key: the key
+ * @ivec: the IV for AES CBC
+ * @ivec_length: the length of the IV
+ *
+ * Verify the HMAC given the expected @hmac and the @key
+ * to calculate the HMAC over the @encrypted_data.
+ */
+static TPM_RESULT
+SWTPM_CheckHMAC(tlv_data *hmac, tlv_data *encrypted_data,
+                const encryptionkey *key,
+                const unsigned char *ivec, uint32_t ivec_length)
+{
+    const unsigned char *data;
+    uint32_t data_length;
+    unsigned int md_len;
+    unsigned char md[EVP_MAX_MD_SIZE];
+
+    md_len = EVP_MD_size(EVP_sha256());
+    if (md_len > hmac->tlv.length) {
+        logprintf(STDOUT_FILENO, "Insufficient bytes for CheckHMAC()\n");
+        return TPM_FAIL;
+    }
+
+    data = encrypted_data->u.ptr;
+    data_length = encrypted_data->tlv.length;
+
+    if (!SWTPM_HMAC(md, &md_len, key, data, data_length, ivec, ivec_length)) {
+        logprintf(STDOUT_FILENO, "HMAC() call failed.\n");
+        return TPM_FAIL;
+    }
+
+    if (memcmp(hmac->u.ptr, md, md_len)) {
+        logprintf(STDOUT_FILENO, "Verification of HMAC failed. "
+                  "Data integrity is compromised\n");
+        /* TPM_DECRYPT_ERROR indicates (to libtpms) that something
+           exists but we have the wrong key. */
+        return TPM_DECRYPT_ERROR;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_CheckHash: sha256-hash the data in a buffer and check it against its leading
+ *                  sha256; on success return the data in an allocated buffer
+ *
+ * @in: input buffer that has a sha256 in the first few bytes followed by data
+ *      that will be sha256-hashed; the hash of the data must be equal to the
+ *      leading hash in the buffer
+ * @in_length: input buffer length
+ * @out: pointer to pointer for output buffer; will be allocated by function
+ * @out_length: pointer to output buffer length; will be set by function
+ *
+ * Returns TPM_FAIL on failure, TPM_SUCCESS otherwise.
+ */
+static TPM_RESULT
+SWTPM_CheckHash(const unsigned char *in, uint32_t in_length,
+                unsigned char **out, uint32_t *out_length)
+{
+    unsigned char hashbuf[SHA256_DIGEST_LENGTH];
+    const unsigned char *data = &in[sizeof(hashbuf)];
+    uint32_t data_length = in_length - sizeof(hashbuf);
+
+    if (in_length < sizeof(hashbuf))
+        return TPM_FAIL;
+
+    /* hash the data */
+    SHA256(data, data_length, hashbuf);
+
+    if (memcmp(in, hashbuf, sizeof(hashbuf))) {
+        logprintf(STDOUT_FILENO, "Verification of hash failed. "
+                  "Data integrity is compromised\n");
+        return TPM_FAIL;
+    }
+
+    *out = malloc(data_length);
+    if (*out == NULL) {
+        logprintf(STDOUT_FILENO,
+                  "Could not allocated %u bytes.\n", data_length);
+        return TPM_FAIL;
+    }
+
+    *out_length = data_length;
+    memcpy(*out, data, data_length);
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_EncryptData(const encryptionkey *key,
+                        struct tlv_data *td, /* must provide 2 array members */
+                        size_t *td_len,
+                        uint16_t tag_encrypted_data,
+                        const unsigned char *data, uint32_t length,
+                        uint16_t tag_ivec)
+{
+    TPM_RESULT rc = 0;
+    TPM_RESULT irc;
+    unsigned char *tmp_data = NULL;
+    uint32_t tmp_length = 0;
+    unsigned char *gcm_tag = NULL;
+
+    *td_len = 0;
+
+    if (key->symkey.userKeyLength > 0) {
+        switch (key->data_encmode) {
+        case ENCRYPTION_MODE_UNKNOWN:
+            rc = TPM_BAD_MODE;
+            break;
+        case ENCRYPTION_MODE_AES_CBC:
+            irc = SWTPM_RollAndSetGlobalIvec(&td[2], tag_ivec,
+                                             key->symkey.userKeyLength,
+                                             key->data_encmode);
+            rc = SWTPM_SymmetricKeyData_Encrypt(&tmp_data, &tmp_length,
+                                                data, length, &key->symkey,
+                                                td[2].u.const_ptr,
+                                                td[2].tlv.length);
+            if (rc)
+                 break;
+
+            rc = SWTPM_CalcHMAC(tmp_data, tmp_length, &td[1], key,
+                                td[2].u.const_ptr, td[2].tlv.length);
+            if (rc == 0) {
+                td[0] = TLV_DATA(tag_encrypted_data, tmp_length, tmp_data);
+                /* in case we couldn't get an IV */
+                *td_len = (irc == 0) ? 3 : 2;
+                tmp_data = NULL;
+            }
+            break;
+        case ENCRYPTION_MODE_AES_256_GCM:
+            /* a GCM nonce must never be reused, so there must be one */
+            rc = SWTPM_RollAndSetGlobalIvec(&td[2], tag_ivec,
+                                            SWTPM_AES_GCM_NONCE_SIZE,
+                                            key->data_encmode);
+            if (rc)
+                break;
+
+            gcm_tag = malloc(SWTPM_AES_GCM_TAG_SIZE);
+            if (!gcm_tag) {
+                logprintf(STDERR_FILENO, "Could not allocate %u bytes.\n",
+                          SWTPM_AES_GCM_TAG_SIZE);
+                rc = TPM_FAIL;
+                break;
+            }
+
+            rc = SWTPM_SymmetricKeyData_EncryptGCM(&tmp_data, &tmp_length,
+                                                   data, length, &key->symkey,
+                                                   td[2].u.const_ptr,
+                                                   td[2].tlv.length,
+                                                   gcm_tag,
+                                                   SWTPM_AES_GCM_TAG_SIZE);
+            if (rc == 0) {
+                td[0] = TLV_DATA(tag_encrypted_data, tmp_length, tmp_data);
+                td[1] = TLV_DATA(TAG_GCM_TAG, SWTPM_AES_GCM_TAG_SIZE,
+                                 gcm_tag);
+                *td_len = 3;
+                tmp_data = NULL;
+                gcm_tag = NULL;
+            }
+            break;
+        }
+    }
+
+    if (rc)
+        tlv_data_free(td, *td_len);
+
+    free(tmp_data);
+    free(gcm_tag);
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_DecryptData_GCM: Decrypt data that SWTPM_NVRAM_EncryptData
+ *                              encrypted with AES-256-GCM; the tag is
+ *                              checked while decrypting
+ */
+static TPM_RESULT
+SWTPM_NVRAM_DecryptData_GCM(const encryptionkey *key,
+                            unsigned char **decrypt_data,
+                            uint32_t *decrypt_length,
+                            const unsigned char *data, uint32_t length,
+                            uint16_t tag_encrypted_data,
+                            uint8_t hdrversion,
+                            uint16_t tag_ivec)
+{
+    tlv_data td[3];
+
+    if (hdrversion < BLOB_HEADER_VERSION_GCM) {
+        logprintf(STDERR_FILENO,
+                  "AES-GCM encrypted data in a v%u blob.\n", hdrversion);
+        return TPM_FAIL;
+    }
+    if (key->symkey.userKeyLength != SWTPM_AES256_BLOCK_SIZE) {
+        logprintf(STDERR_FILENO,
+                  "Wrong decryption key. Need %u bit key.\n",
+                  SWTPM_AES256_BLOCK_SIZE * 8);
+        return TPM_BAD_KEY_PROPERTY;
+    }
+
+    if (!tlv_data_find_tag(data, length, tag_encrypted_data, &td[0]) ||
+        !tlv_data_find_tag(data, length, TAG_GCM_TAG, &td[1]) ||
+        !tlv_data_find_tag(data, length, tag_ivec, &td[2])) {
+        logprintf(STDERR_FILENO,
+                  "Could not find encrypted data (tag %u), tag, or nonce "
+                  "in byte stream.\n", tag_encrypted_data);
+        return TPM_FAIL;
+    }
+
+    return SWTPM_SymmetricKeyData_DecryptGCM(decrypt_data, decrypt_length,
+                                             td[0].u.const_ptr,
+                                             td[0].tlv.length,
+                                             &key->symkey,
+                                             td[2].u.const_ptr,
+                                             td[2].tlv.length,
+                                             td[1].u.const_ptr,
+                                             td[1].tlv.length);
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DecryptData(const encryptionkey *key,
+                        unsigned char **decrypt_data, uint32_t *decrypt_length,
+                        const unsigned char *data, uint32_t length,
+                        uint16_t tag_encrypted_data,
+                        uint8_t hdrversion,
+                        uint16_t tag_ivec, uint16_t hdrflags,
+                        uint16_t flag_256bitkey,
+                        uint16_t flag_gcm)
+{
+    TPM_RESULT rc = TPM_FAIL;
+    unsigned char *tmp_data = NULL;
+    uint32_t tmp_length = 0;
+    tlv_data td[2];
+    const unsigned char *ivec = NULL;
+    uint32_t ivec_length = 0;
+    size_t keylen;
+
+    if (key->symkey.userKeyLength == 0)
+        return rc;
+
+    switch (key->data_encmode) {
+    case ENCRYPTION_MODE_UNKNOWN:
+        rc = TPM_BAD_MODE;
+        break;
+    case ENCRYPTION_MODE_AES_CBC:
+    case ENCRYPTION_MODE_AES_256_GCM:
+        /* the header tells how the data were encrypted, so that blobs
+           written in either mode can be read with the same key */
+        if ((hdrflags & flag_gcm)) {
+            rc = SWTPM_NVRAM_DecryptData_GCM(key, decrypt_data,
+                                             decrypt_length, data, length,
+                                             tag_encrypted_data, hdrversion,
+                                             tag_ivec);
+            break;
+        }
+        switch (hdrversion) {
+        case 1:
+            rc = SWTPM_SymmetricKeyData_Decrypt(&tmp_data,
+                                                &tmp_length,
+                                                data, length,
+                                                &key->symkey,
+                                                NULL, 0);
+            if (rc == 0) {
+                rc = SWTPM_CheckHash(tmp_data, tmp_length,
+                                     decrypt_data, decrypt_length);
+            }
+        break;
+        case 2:
+        case 3:
+        case 4:
+            keylen = (hdrflags & flag_256bitkey)
+                      ? SWTPM_AES256_BLOCK_SIZE : SWTPM_AES128_BLOCK_SIZE;
+            if (keylen != key->symkey.userKeyLength) {
+                logprintf(STDERR_FILENO,
+                          "Wrong decryption key. Need %zu bit key.\n",
+                          keylen * 8);
+                rc = TPM_BAD_KEY_PROPERTY;
+                break;
+            }
+
+            if (!tlv_data_find_tag(data, length, TAG_HMAC, &td[0]) ||
+                !tlv_data_find_tag(data, length, tag_encrypted_data,
+                                   &td[1])) {
+                logprintf(STDERR_FILENO,
+                          "Could not find HMAC or encrypted data (tag %u) "
+                          "in byte stream.\n", tag_encrypted_data);
+                rc = TPM_FAIL;
+                break;
+            }
+            /* get the IV, if there is one */
+            SWTPM_GetIvec(data, length, &ivec, &ivec_length, tag_ivec);
+
+            rc = SWTPM_CheckHMAC(&td[0], &td[1], key,
+                                 ivec, ivec_length);
+            if (rc == 0) {
+                rc = SWTPM_SymmetricKeyData_Decrypt(decrypt_data,
+                                                    decrypt_length,
+                                                    td[1].u.const_ptr,
+                                                    td[1].tlv.length,
+                                                    &key->symkey,
+                                                    ivec, ivec_length);
+            }
+        break;
+        }
+        free(tmp_data);
+    }
+
+    return rc;
+}
+
+/*
+ * SWTPM_NVRAM_FindPlainData: Find the plain data in the given data without
+ *                            copying them
+ */
+static TPM_RESULT
+SWTPM_NVRAM_FindPlainData(const unsigned char **plain, uint32_t *plain_length,
+                          const unsigned char *data, uint32_t length,
+                          uint16_t tag_data,
+                          uint8_t hdrversion)
+{
+    tlv_data td;
+
+    switch (hdrversion) {
+    case 1:
+        *plain = data;
+        *plain_length = length;
+        return TPM_SUCCESS;
+
+    case 2:
+    case 3:
+    case 4:
+        if (!tlv_data_find_tag(data, length, tag_data, &td)) {
+            logprintf(STDERR_FILENO,
+                      "Could not find plain data in byte stream.\n");
+            return TPM_FAIL;
+        }
+        *plain = td.u.const_ptr;
+        *plain_length = td.tlv.length;
+        return TPM_SUCCESS;
+    }
+
+    return TPM_FAIL;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_GetPlainData(unsigned char **plain, uint32_t *plain_length,
+                         const unsigned char *data, uint32_t length,
+                         uint16_t tag_data,
+                         uint8_t hdrversion)
+{
+    const unsigned char *found;
+    uint32_t found_length;
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_FindPlainData(&found, &found_length, data, length,
+                                   tag_data, hdrversion);
+    if (rc)
+        return rc;
+
+    /* malloc(0) may return NULL */
+    *plain = malloc(found_length ? found_length : 1);
+    if (!*plain) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %u bytes.\n", found_length);
+        return TPM_FAIL;
+    }
+    memcpy(*plain, found, found_length);
+    *plain_length = found_length;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * SWTPM_NVRAM_GetDecryptedData: Get the decrytped data either by just returning
+ *                               the data if they were not encrypted or by
+ *                               actually decrypting them if there is a key.
+ *                               The plain data is returned, meaning any TLV
+ *                               header has been removed.
+ * @key: the encryption key, may be NULL
+ * @decrypt_data: pointer to a pointer for the result
+ * @decrypt_length: the length of the returned data
+ * @data: input data
+ * @length: length of the input data
+ * @tag_encrypted_data: the tag the encrypted data is stored with
+ * @tag_data: the tag the plain data is stored with
+ * @hdrversion: the version found in the header that determines in what
+ *              format the data is stored; tag-length-value is the format
+ *              in v2
+ * @tag_ivec: the tag for finding the IV
+ * @hdrflags: the flags from the header
+ * @flag_256bitkey: the flag in the header to check whether we expect a
+ *                  256 bit key; different flag for migration and state key
+ * @flag_gcm: the flag in the header to check whether the data were encrypted
+ *            with AES-256-GCM; different flag for migration and state key
+ */
+static TPM_RESULT
+SWTPM_NVRAM_GetDecryptedData(const encryptionkey *key,
+                             unsigned char **decrypt_data,
+                             uint32_t *decrypt_length,
+                             const unsigned char *data,
+                             uint32_t length,
+                             uint16_t tag_encrypted_data,
+                             uint16_t tag_data,
+                             uint8_t hdrversion,
+                             uint16_t tag_ivec,
+                             uint16_t hdrflags,
+                             uint16_t flag_256bitkey,
+                             uint16_t flag_gcm)
+{
+    if (key && key->symkey.userKeyLength > 0) {
+        /* we assume the data are encrypted when there's a key given */
+        return SWTPM_NVRAM_DecryptData(key, decrypt_data, decrypt_length,
+                                       data, length, tag_encrypted_data,
+                                       hdrversion, tag_ivec, hdrflags,
+                                       flag_256bitkey, flag_gcm);
+    }
+    return SWTPM_NVRAM_GetPlainData(decrypt_data, decrypt_length,
+                                    data, length, tag_data, hdrversion);
+}
+
+/*
+ * SWTPM_NVRAM_CompressData: Compress data
+ *
+ * @out: pointer to a pointer for the compressed data; freed by the caller
+ * @out_length: the length of the compressed data
+ * @data: the data to compress
+ * @length: the length of the data
+ */
+static TPM_RESULT
+SWTPM_NVRAM_CompressData(unsigned char **out, uint32_t *out_length,
+                         const unsigned char *data, uint32_t length)
+{
+#if defined(WITH_ZSTD)
+    size_t bound = ZSTD_compressBound(length);
+    struct timespec start;
+    size_t n;
+
+    cmdstats_start(&start);
+
+    *out = malloc(bound);
+    if (!*out) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %zu bytes.\n", bound);
+        return TPM_FAIL;
+    }
+
+    n = ZSTD_compress(*out, bound, data, length, NVRAM_COMPRESSION_LEVEL);
+    if (ZSTD_isError(n)) {
+        logprintf(STDERR_FILENO,
+                  "Could not compress the data: %s\n", ZSTD_getErrorName(n));
+        free(*out);
+        *out = NULL;
+        return TPM_FAIL;
+    }
+    *out_length = n;
+
+    metrics_nvram_compress(length, n, &start);
+
+    return TPM_SUCCESS;
+#else
+    (void)out;
+    (void)out_length;
+    (void)data;
+    (void)length;
+
+    logprintf(STDERR_FILENO,
+              "This swtpm was built without support for compression.\n");
+
+    return TPM_FAIL;
+#endif
+}
+
+/*
+ * SWTPM_NVRAM_DecompressData: Decompress data
+ *
+ * @out: pointer to a pointer for the decompressed data; freed by the caller
+ * @out_length: the length of the decompressed data
+ * @data: the compressed data
+ * @length: the length of the compressed data
+ */
+static TPM_RESULT
+SWTPM_NVRAM_DecompressData(unsigned char **out, uint32_t *out_length,
+                           const unsigned char *data, uint32_t length)
+{
+#if defined(WITH_ZSTD)
+    unsigned long long size;
+    size_t n;
+
+    size = ZSTD_getFrameContentSize(data, length);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+        size > UINT32_MAX) {
+        logprintf(STDERR_FILENO,
+                  "Compressed data have an invalid or unknown size.\n");
+        return TPM_FAIL;
+    }
+
+    /* malloc(0) may return NULL */
+    *out = malloc(size ? size : 1);
+    if (!*out) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %llu bytes.\n", size);
+        return TPM_FAIL;
+    }
+
+    n = ZSTD_decompress(*out, size, data, length);
+    if (ZSTD_isError(n) || n != size) {
+        logprintf(STDERR_FILENO,
+                  "Could not decompress the data: %s\n",
+                  ZSTD_isError(n) ? ZSTD_getErrorName(n) : "size mismatch");
+        free(*out);
+        *out = NULL;
+        return TPM_FAIL;
+    }
+    *out_length = n;
+
+    return TPM_SUCCESS;
+#else
+    (void)out;
+    (void)out_length;
+    (void)data;
+    (void)length;
+
+    logprintf(STDERR_FILENO,
+              "This swtpm was built without support for compression; "
+              "cannot read compressed data.\n");
+
+    return TPM_FAIL;
+#endif
+}
+
+/*
+ * Fill in the header of a state blob; older versions cannot read
+ * compressed or AES-GCM encrypted data and must reject them
+ */
+static void SWTPM_NVRAM_FillHeader(blobheader *bh, uint32_t totlen,
+                                   uint16_t flags)
+{
+    uint8_t version = BLOB_HEADER_VERSION_TLV;
+    uint8_t min_version = 1;
+
+    if (flags & (BLOB_FLAG_ENCRYPTED_GCM | BLOB_FLAG_MIGRATION_GCM)) {
+        version = BLOB_HEADER_VERSION_GCM;
+        min_version = BLOB_HEADER_VERSION_GCM;
+    } else if (flags & BLOB_FLAG_COMPRESSED) {
+        version = BLOB_HEADER_VERSION_COMPRESSED;
+        min_version = BLOB_HEADER_VERSION_COMPRESSED;
+    }
+
+    *bh = (blobheader) {
+        .version = version,
+        .min_version = min_version,
+        .hdrsize = htons(sizeof(*bh)),
+        .flags = htons(flags),
+        .totlen = htonl(totlen),
+    };
+}
+
+
+static TPM_RESULT
+SWTPM_NVRAM_CheckHeader(const unsigned char *data, uint32_t length,
+                        uint32_t *dataoffset, uint16_t *hdrflags,
+                        uint8_t *hdrversion, bool quiet)
+{
+    const blobheader *bh = (const blobheader *)data;
+    uint16_t hdrsize;
+
+    if (length < sizeof(bh)) {
+        if (!quiet)
+            logprintf(STDERR_FILENO,
+                      "not enough bytes for header: %u\n", length);
+        return TPM_BAD_PARAMETER;
+    }
+
+    if (ntohl(bh->totlen) != length) {
+        if (!quiet)
+            logprintf(STDERR_FILENO,
+                      "broken header: bh->totlen %u != %u\n",
+                      htonl(bh->totlen), length);
+        return TPM_BAD_PARAMETER;
+    }
+
+    if (bh->min_version > BLOB_HEADER_VERSION) {
+        if (!quiet)
+            logprintf(STDERR_FILENO,
+                      "Minimum required version for the blob is %d, we "
+                      "only support version %d\n", bh->min_version,
+                      BLOB_HEADER_VERSION);
+        return TPM_BAD_VERSION;
+    }
+
+    hdrsize = ntohs(bh->hdrsize);
+    if (hdrsize != sizeof(blobheader)) {
+        logprintf(STDERR_FILENO,
+                  "bad header size: %u != %zu\n",
+                  hdrsize, sizeof(blobheader));
+        return TPM_BAD_DATASIZE;
+    }
+
+    *hdrversion = bh->version;
+    *dataoffset = hdrsize;
+    *hdrflags = ntohs(bh->flags);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * State blobs for migration are produced piecewise and handed to a sink so
+ * that only the plain state needs to be held in memory but not the
+ * encrypted blob and all its intermediate copies.
+ */
+struct nvram_sink {
+    TPM_RESULT (*write)(struct nvram_sink *sink,
+                        const unsigned char *data, uint32_t length);
+};
+
+/* a sink that writes into a buffer of the size of the blob */
+struct nvram_mem_sink {
+    struct nvram_sink sink;
+    unsigned char *buffer;
+    uint32_t size;
+    uint32_t used;
+};
+
+/* a sink that writes to a file descriptor through a bounded buffer */
+struct nvram_fd_sink {
+    struct nvram_sink sink;
+    int fd;
+    uint32_t skip;          /* number of leading bytes not to write */
+    unsigned char *buffer;
+    size_t size;
+    size_t used;
+};
+
+/* a stage that encrypts the data and passes them on to the next sink */
+struct nvram_encrypt_stage {
+    struct nvram_sink sink;
+    struct nvram_sink *next;
+    const encryptionkey *key;
+    EVP_CIPHER_CTX *ctx;
+    SWTPM_HMAC_CTX *hmac;   /* NULL for AES-GCM */
+    uint32_t length;        /* number of plain bytes received */
+    uint16_t tag_ivec;
+    unsigned char ivec[SWTPM_AES256_BLOCK_SIZE];
+    uint32_t ivec_length;
+};
+
+struct nvram_stateblob {
+    unsigned char *plain;   /* plain, possibly compressed, data */
+    uint32_t plain_len;
+    uint16_t flags;         /* flags for the blob header */
+    uint32_t length;        /* total length of the blob */
+};
+
+/* size of the chunks passed through the encryption stages */
+#define NVRAM_STREAM_CHUNK_SIZE   4096
+/* size of the buffer holding the blob before it is written to a fd */
+#define NVRAM_STREAM_BUFFER_SIZE  (64 * 1024)
+
+static TPM_RESULT SWTPM_NVRAM_Sink_TLVHeader(struct nvram_sink *sink,
+                                             uint16_t tag, uint32_t length)
+{
+    tlv_header hdr = {
+        .tag = htobe16(tag),
+        .length = htobe32(length),
+    };
+
+    return sink->write(sink, (const unsigned char *)&hdr, sizeof(hdr));
+}
+
+static TPM_RESULT SWTPM_NVRAM_MemSink_Write(struct nvram_sink *sink,
+                                            const unsigned char *data,
+                                            uint32_t length)
+{
+    struct nvram_mem_sink *ms = (struct nvram_mem_sink *)sink;
+
+    if (length > ms->size - ms->used) {
+        logprintf(STDERR_FILENO,
+                  "State blob is larger than the expected %u bytes.\n",
+                  ms->size);
+        return TPM_FAIL;
+    }
+    memcpy(&ms->buffer[ms->used], data, length);
+    ms->used += length;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT SWTPM_NVRAM_FdSink_Flush(struct nvram_fd_sink *fs)
+{
+    ssize_t n;
+
+    if (fs->used == 0)
+        return TPM_SUCCESS;
+
+    n = write_full(fs->fd, fs->buffer, fs->used);
+    if (n < 0 || (size_t)n != fs->used) {
+        logprintf(STDERR_FILENO,
+                  "Could not write the state blob: %s\n",
+                  n < 0 ? strerror(errno) : "short write");
+        return TPM_IOERROR;
+    }
+    fs->used = 0;
+
+    return TPM_SUCCESS;
+}
+
+static TPM_RESULT SWTPM_NVRAM_FdSink_Write(struct nvram_sink *sink,
+                                           const unsigned char *data,
+                                           uint32_t length)
+{
+    struct nvram_fd_sink *fs = (struct nvram_fd_sink *)sink;
+    TPM_RESULT rc;
+    size_t n;
 
-            rc = SWTPM_CalcHMAC(tmp_data, tmp_length, &td[1], &key->symkey,
-                                td[2].u.const_ptr, td[2].tlv.length);
-            if (rc == 0) {
-                td[0] = TLV_DATA(tag_encrypted_data, tmp_length, tmp_data);
-                /* in case we couldn't get an IV */
-                *td_len = (irc == 0) ? 3 : 2;
-                tmp_data = NULL;
-            }
-            break;
+    if (fs->skip > 0) {
+        n = MIN(fs->skip, length);
+        fs->skip -= n;
+        data += n;
+        length -= n;
+    }
+
+    while (length > 0) {
+        n = MIN(fs->size - fs->used, length);
+        memcpy(&fs->buffer[fs->used], data, n);
+        fs->used += n;
+        data += n;
+        length -= n;
+
+        if (fs->used == fs->size) {
+            rc = SWTPM_NVRAM_FdSink_Flush(fs);
+            if (rc)
+                return rc;
         }
     }
 
-    if (rc)
-        tlv_data_free(td, *td_len);
+    return TPM_SUCCESS;
+}
 
-    free(tmp_data);
+/* the length of the TLVs SWTPM_NVRAM_EncryptData creates for @length bytes */
+static uint64_t SWTPM_NVRAM_EncryptedLength(const encryptionkey *key,
+                                            uint64_t length)
+{
+    uint32_t keylen = key->symkey.userKeyLength;
+
+    /* GCM needs no padding */
+    if (key->data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+        return sizeof(tlv_header) + length +
+               sizeof(tlv_header) + SWTPM_AES_GCM_TAG_SIZE +
+               sizeof(tlv_header) + SWTPM_AES_GCM_NONCE_SIZE;
+
+    /* PKCS#7 padding always adds between 1 and keylen bytes */
+    return sizeof(tlv_header) + length + keylen - length % keylen +
+           sizeof(tlv_header) + SHA256_DIGEST_LENGTH +
+           sizeof(tlv_header) + keylen;
+}
 
-    return rc;
+static TPM_RESULT SWTPM_NVRAM_EncryptStage_Write(struct nvram_sink *sink,
+                                                 const unsigned char *data,
+                                                 uint32_t length)
+{
+    struct nvram_encrypt_stage *es = (struct nvram_encrypt_stage *)sink;
+    unsigned char out[NVRAM_STREAM_CHUNK_SIZE + SWTPM_AES256_BLOCK_SIZE];
+    TPM_RESULT rc;
+    uint32_t n;
+    int outlen;
+
+    while (length > 0) {
+        n = MIN(length, NVRAM_STREAM_CHUNK_SIZE);
+        if (EVP_EncryptUpdate(es->ctx, out, &outlen, data, n) != 1 ||
+            (es->hmac && !SWTPM_HMAC_Update(es->hmac, out, outlen))) {
+            logprintf(STDERR_FILENO, "Could not encrypt the state blob.\n");
+            return TPM_FAIL;
+        }
+        rc = es->next->write(es->next, out, outlen);
+        if (rc)
+            return rc;
+
+        es->length += n;
+        data += n;
+        length -= n;
+    }
+
+    return TPM_SUCCESS;
 }
 
+static void SWTPM_NVRAM_EncryptStage_Free(struct nvram_encrypt_stage *es)
+{
+    EVP_CIPHER_CTX_free(es->ctx);
+    es->ctx = NULL;
+    SWTPM_HMAC_Free(es->hmac);
+    es->hmac = NULL;
+}
+
+/*
+ * SWTPM_NVRAM_EncryptStage_Init: Set up a stage that produces the same TLVs
+ *                                as SWTPM_NVRAM_EncryptData for @length bytes
+ *                                that are written to it and write the header
+ *                                of the encrypted data to @next
+ */
 static TPM_RESULT
-SWTPM_NVRAM_DecryptData(const encryptionkey *key,
-                        unsigned char **decrypt_data, uint32_t *decrypt_length,
-                        const unsigned char *data, uint32_t length,
-                        uint16_t tag_encrypted_data,
-                        uint8_t hdrversion,
-                        uint16_t tag_ivec, uint16_t hdrflags,
-                        uint16_t flag_256bitkey)
+SWTPM_NVRAM_EncryptStage_Init(struct nvram_encrypt_stage *es,
+                              struct nvram_sink *next,
+                              const encryptionkey *key,
+                              uint16_t tag_encrypted_data,
+                              uint32_t length,
+                              uint16_t tag_ivec)
 {
-    TPM_RESULT rc = TPM_FAIL;
-    unsigned char *tmp_data = NULL;
-    uint32_t tmp_length = 0;
-    tlv_data td[2];
-    const unsigned char *ivec = NULL;
-    uint32_t ivec_length = 0;
-    size_t keylen;
+    uint32_t keylen = key->symkey.userKeyLength;
+    TPM_RESULT rc;
+    tlv_data td;
 
-    if (key->symkey.userKeyLength == 0)
-        return rc;
+    memset(es, 0, sizeof(*es));
+    es->sink.write = SWTPM_NVRAM_EncryptStage_Write;
+    es->next = next;
+    es->key = key;
+    es->tag_ivec = tag_ivec;
 
     switch (key->data_encmode) {
-    case ENCRYPTION_MODE_UNKNOWN:
-        rc = TPM_BAD_MODE;
-        break;
     case ENCRYPTION_MODE_AES_CBC:
-        switch (hdrversion) {
-        case 1:
-            rc = SWTPM_SymmetricKeyData_Decrypt(&tmp_data,
-                                                &tmp_length,
-                                                data, length,
-                                                &key->symkey,
-                                                NULL, 0);
-            if (rc == 0) {
-                rc = SWTPM_CheckHash(tmp_data, tmp_length,
-                                     decrypt_data, decrypt_length);
-            }
+        es->ivec_length = keylen;
         break;
-        case 2:
-            keylen = (hdrflags & flag_256bitkey)
-                      ? SWTPM_AES256_BLOCK_SIZE : SWTPM_AES128_BLOCK_SIZE;
-            if (keylen != key->symkey.userKeyLength) {
-                logprintf(STDERR_FILENO,
-                          "Wrong decryption key. Need %zu bit key.\n",
-                          keylen * 8);
-                rc = TPM_BAD_KEY_PROPERTY;
-                break;
-            }
+    case ENCRYPTION_MODE_AES_256_GCM:
+        es->ivec_length = SWTPM_AES_GCM_NONCE_SIZE;
+        break;
+    default:
+        return TPM_BAD_MODE;
+    }
 
-            if (!tlv_data_find_tag(data, length, TAG_HMAC, &td[0]) ||
-                !tlv_data_find_tag(data, length, tag_encrypted_data,
-                                   &td[1])) {
-                logprintf(STDERR_FILENO,
-                          "Could not find HMAC or encrypted data (tag %u) "
-                          "in byte stream.\n", tag_encrypted_data);
-                rc = TPM_FAIL;
-                break;
-            }
-            /* get the IV, if there is one */
-            SWTPM_GetIvec(data, length, &ivec, &ivec_length, tag_ivec);
+    rc = SWTPM_RollAndSetGlobalIvec(&td, tag_ivec, es->ivec_length,
+                                    key->data_encmode);
+    if (rc)
+        return rc;
+    /* the global IV is rolled again by the next stage */
+    memcpy(es->ivec, td.u.const_ptr, es->ivec_length);
 
-            rc = SWTPM_CheckHMAC(&td[0], &td[1], &key->symkey,
-                                 ivec, ivec_length);
-            if (rc == 0) {
-                rc = SWTPM_SymmetricKeyData_Decrypt(decrypt_data,
-                                                    decrypt_length,
-                                                    td[1].u.const_ptr,
-                                                    td[1].tlv.length,
-                                                    &key->symkey,
-                                                    ivec, ivec_length);
-            }
-        break;
-        }
-        free(tmp_data);
+    if (key->data_encmode == ENCRYPTION_MODE_AES_256_GCM) {
+        es->ctx = SWTPM_SymmetricKeyData_EncryptGCMCtx(&key->symkey, es->ivec,
+                                                       es->ivec_length);
+        if (!es->ctx)
+            return TPM_FAIL;
+
+        return SWTPM_NVRAM_Sink_TLVHeader(next, tag_encrypted_data, length);
     }
 
-    return rc;
+    es->ctx = SWTPM_SymmetricKeyData_EncryptCtx(&key->symkey,
+                                                es->ivec, keylen);
+    es->hmac = SWTPM_NVRAM_HMAC_New(key);
+    if (!es->ctx || !es->hmac) {
+        SWTPM_NVRAM_EncryptStage_Free(es);
+        return TPM_FAIL;
+    }
+
+    return SWTPM_NVRAM_Sink_TLVHeader(next, tag_encrypted_data,
+                                      length + keylen - length % keylen);
 }
 
+/*
+ * SWTPM_NVRAM_EncryptStage_FinishGCM: Write the tag and nonce TLVs of
+ *                                     AES-GCM encrypted data
+ */
 static TPM_RESULT
-SWTPM_NVRAM_GetPlainData(unsigned char **plain, uint32_t *plain_length,
-                         const unsigned char *data, uint32_t length,
-                         uint16_t tag_data,
-                         uint8_t hdrversion)
+SWTPM_NVRAM_EncryptStage_FinishGCM(struct nvram_encrypt_stage *es)
 {
-    TPM_RESULT rc = 0;
-    tlv_data td[1];
-
-    switch (hdrversion) {
-    case 1:
-        *plain = malloc(length);
-        if (*plain) {
-            memcpy(*plain, data, length);
-            *plain_length = length;
-        } else {
-            logprintf(STDERR_FILENO,
-                      "Could not allocate %u bytes.\n", length);
-            rc = TPM_FAIL;
-        }
-    break;
+    unsigned char tag[SWTPM_AES_GCM_TAG_SIZE];
+    TPM_RESULT rc;
 
-    case 2:
-        if (!tlv_data_find_tag(data, length, tag_data, &td[0])) {
-            logprintf(STDERR_FILENO,
-                      "Could not find plain data in byte stream.\n");
-            rc = TPM_FAIL;
-            break;
-        }
-        *plain = malloc(td->tlv.length);
-        if (*plain) {
-            memcpy(*plain, td->u.const_ptr, td->tlv.length);
-            *plain_length = td->tlv.length;
-        } else {
-            logprintf(STDERR_FILENO,
-                      "Could not allocate %u bytes.\n", td->tlv.length);
-            rc = TPM_FAIL;
-        }
-    break;
+    rc = SWTPM_SymmetricKeyData_FinalGCMCtx(es->ctx, tag, sizeof(tag));
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Sink_TLVHeader(es->next, TAG_GCM_TAG, sizeof(tag));
+    if (rc == 0)
+        rc = es->next->write(es->next, tag, sizeof(tag));
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Sink_TLVHeader(es->next, es->tag_ivec,
+                                        es->ivec_length);
+    if (rc == 0)
+        rc = es->next->write(es->next, es->ivec, es->ivec_length);
 
-    default:
-        rc = TPM_FAIL;
-    }
+    SWTPM_NVRAM_EncryptStage_Free(es);
 
     return rc;
 }
 
 /*
- * SWTPM_NVRAM_GetDecryptedData: Get the decrytped data either by just returning
- *                               the data if they were not encrypted or by
- *                               actually decrypting them if there is a key.
- *                               The plain data is returned, meaning any TLV
- *                               header has been removed.
- * @key: the encryption key, may be NULL
- * @decrypt_data: pointer to a pointer for the result
- * @decrypt_length: the length of the returned data
- * @data: input data
- * @length: length of the input data
- * @tag_encrypted_data: the tag the encrypted data is stored with
- * @tag_data: the tag the plain data is stored with
- * @hdrversion: the version found in the header that determines in what
- *              format the data is stored; tag-length-value is the format
- *              in v2
- * @tag_ivec: the tag for finding the IV
- * @hdrflags: the flags from the header
- * @flag_256bitkey: the flag in the header to check whether we expect a
- *                  256 bit key; different flag for migration and state key
+ * SWTPM_NVRAM_EncryptStage_Finish: Pad and encrypt the last block and write
+ *                                  the HMAC and IV TLVs, or the tag and nonce
+ *                                  TLVs for AES-GCM
  */
 static TPM_RESULT
-SWTPM_NVRAM_GetDecryptedData(const encryptionkey *key,
-                             unsigned char **decrypt_data,
-                             uint32_t *decrypt_length,
-                             const unsigned char *data,
-                             uint32_t length,
-                             uint16_t tag_encrypted_data,
-                             uint16_t tag_data,
-                             uint8_t hdrversion,
-                             uint16_t tag_ivec,
-                             uint16_t hdrflags,
-                             uint16_t flag_256bitkey)
+SWTPM_NVRAM_EncryptStage_Finish(struct nvram_encrypt_stage *es)
 {
-    if (key && key->symkey.userKeyLength > 0) {
-        /* we assume the data are encrypted when there's a key given */
-        return SWTPM_NVRAM_DecryptData(key, decrypt_data, decrypt_length,
-                                       data, length, tag_encrypted_data,
-                                       hdrversion, tag_ivec, hdrflags,
-                                       flag_256bitkey);
+    uint32_t keylen = es->key->symkey.userKeyLength;
+    unsigned char pad[SWTPM_AES256_BLOCK_SIZE];
+    unsigned char out[2 * SWTPM_AES256_BLOCK_SIZE];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = sizeof(md);
+    uint32_t pad_length = keylen - es->length % keylen;
+    TPM_RESULT rc;
+    int outlen, outlen2;
+
+    if (es->key->data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+        return SWTPM_NVRAM_EncryptStage_FinishGCM(es);
+
+    memset(pad, pad_length, pad_length);
+
+    if (EVP_EncryptUpdate(es->ctx, out, &outlen, pad, pad_length) != 1 ||
+        EVP_EncryptFinal_ex(es->ctx, &out[outlen], &outlen2) != 1 ||
+        !SWTPM_HMAC_Update(es->hmac, out, outlen + outlen2) ||
+        !SWTPM_HMAC_Update(es->hmac, es->ivec, keylen) ||
+        !SWTPM_HMAC_Final(es->hmac, md, &md_len)) {
+        logprintf(STDERR_FILENO, "Could not encrypt the state blob.\n");
+        rc = TPM_FAIL;
+        goto exit;
     }
-    return SWTPM_NVRAM_GetPlainData(decrypt_data, decrypt_length,
-                                    data, length, tag_data, hdrversion);
+
+    rc = es->next->write(es->next, out, outlen + outlen2);
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Sink_TLVHeader(es->next, TAG_HMAC, md_len);
+    if (rc == 0)
+        rc = es->next->write(es->next, md, md_len);
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Sink_TLVHeader(es->next, es->tag_ivec, keylen);
+    if (rc == 0)
+        rc = es->next->write(es->next, es->ivec, keylen);
+
+exit:
+    SWTPM_NVRAM_EncryptStage_Free(es);
+
+    return rc;
 }
 
 /*
- * Prepend a header in front of the state blob
+ * SWTPM_NVRAM_OpenStateBlob: Load the state blob with the given name and
+ * determine the format and size of the blob for migration. The volatile
+ * state is not loaded from the backend but taken from the TPM as it is now.
+ * The blob is then written with SWTPM_NVRAM_WriteStateBlob and must be
+ * freed with SWTPM_NVRAM_FreeStateBlob. Return whether the blob will be
+ * encrypted with the state key.
  */
-static TPM_RESULT
-SWTPM_NVRAM_PrependHeader(unsigned char **data, uint32_t *length,
-                          uint16_t flags)
-{
-    unsigned char *out = NULL;
-    uint32_t out_len = sizeof(blobheader) + *length;
-    blobheader bh = {
-        .version = BLOB_HEADER_VERSION,
-        .min_version = 1,
-        .hdrsize = htons(sizeof(bh)),
-        .flags = htons(flags),
-        .totlen = htonl(out_len),
-    };
+TPM_RESULT SWTPM_NVRAM_OpenStateBlob(struct nvram_stateblob **sb,
+                                     uint32_t tpm_number,
+                                     const char *name,
+                                     TPM_BOOL decrypt,
+                                     TPM_BOOL *is_encrypted,
+                                     uint32_t *length)
+{
+    unsigned char *buffer = NULL;
+    uint32_t buffer_len = 0;
+    uint64_t len;
     TPM_RESULT res;
 
-    out = malloc(out_len);
-    if (!out) {
+    *sb = calloc(1, sizeof(**sb));
+    if (!*sb) {
         logprintf(STDERR_FILENO,
-                  "Could not allocate %u bytes.\n", out_len);
-        res = TPM_FAIL;
-        goto error;
+                  "Could not allocate %zu bytes.\n", sizeof(**sb));
+        return TPM_FAIL;
     }
 
-    memcpy(out, &bh, sizeof(bh));
-    memcpy(&out[sizeof(bh)], *data, *length);
+    if (strcmp(name, TPM_VOLATILESTATE_NAME) == 0) {
+        /* take the volatile state directly from the TPM rather than
+           storing it with the backend and loading it again */
+        res = TPMLIB_VolatileAll_Store(&(*sb)->plain, &(*sb)->plain_len);
+    } else {
+        res = SWTPM_NVRAM_LoadData(&(*sb)->plain, &(*sb)->plain_len,
+                                   tpm_number, name);
+    }
+    if (res)
+        goto err_exit;
+
+    /* compression must be done before encryption */
+    if (g_nvram_migration_compress) {
+        res = SWTPM_NVRAM_CompressData(&buffer, &buffer_len,
+                                       (*sb)->plain, (*sb)->plain_len);
+        if (res)
+            goto err_exit;
+        free((*sb)->plain);
+        (*sb)->plain = buffer;
+        (*sb)->plain_len = buffer_len;
+        (*sb)->flags |= BLOB_FLAG_COMPRESSED;
+    }
 
-    free(*data);
+    /* if the user doesn't want decryption and there's a file key, we need to
+       encrypt the data */
+    *is_encrypted = (!decrypt && SWTPM_NVRAM_Has_FileKey());
+    if (*is_encrypted) {
+        (*sb)->flags |= BLOB_FLAG_ENCRYPTED;
+        if (SWTPM_NVRAM_FileKey_Size() == SWTPM_AES256_BLOCK_SIZE)
+            (*sb)->flags |= BLOB_FLAG_ENCRYPTED_256BIT_KEY;
+        if (filekey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+            (*sb)->flags |= BLOB_FLAG_ENCRYPTED_GCM;
+        len = SWTPM_NVRAM_EncryptedLength(&filekey, (*sb)->plain_len);
+    } else {
+        len = sizeof(tlv_header) + (uint64_t)(*sb)->plain_len;
+    }
+
+    if (SWTPM_NVRAM_Has_MigrationKey()) {
+        (*sb)->flags |= BLOB_FLAG_MIGRATION_ENCRYPTED;
+        if (SWTPM_NVRAM_MigrationKey_Size() == SWTPM_AES256_BLOCK_SIZE)
+            (*sb)->flags |= BLOB_FLAG_MIGRATION_256BIT_KEY;
+        if (migrationkey.data_encmode == ENCRYPTION_MODE_AES_256_GCM)
+            (*sb)->flags |= BLOB_FLAG_MIGRATION_GCM;
+        len = SWTPM_NVRAM_EncryptedLength(&migrationkey, len);
+    } else {
+        len += sizeof(tlv_header);
+    }
+    (*sb)->flags |= BLOB_FLAG_MIGRATION_DATA;
 
-    *data = out;
-    *length = out_len;
+    len += sizeof(blobheader);
+    if (len > UINT32_MAX) {
+        logprintf(STDERR_FILENO,
+                  "The %s blob is too large.\n", name);
+        res = TPM_SIZE;
+        goto err_exit;
+    }
+    (*sb)->length = *length = len;
 
     return TPM_SUCCESS;
 
- error:
-    free(*data);
-    *data = NULL;
-    *length = 0;
+err_exit:
+    SWTPM_NVRAM_FreeStateBlob(*sb);
+    *sb = NULL;
 
     return res;
 }
 
+void SWTPM_NVRAM_FreeStateBlob(struct nvram_stateblob *sb)
+{
+    if (sb)
+        free(sb->plain);
+    free(sb);
+}
 
-static TPM_RESULT
-SWTPM_NVRAM_CheckHeader(unsigned char *data, uint32_t length,
-                        uint32_t *dataoffset, uint16_t *hdrflags,
-                        uint8_t *hdrversion, bool quiet)
+/* produce the state blob and write it to the given sink */
+static TPM_RESULT SWTPM_NVRAM_ProduceStateBlob(struct nvram_stateblob *sb,
+                                               struct nvram_sink *sink)
 {
-    blobheader *bh = (blobheader *)data;
-    uint16_t hdrsize;
+    struct nvram_encrypt_stage mig_stage, file_stage;
+    struct nvram_sink *inner = sink;
+    bool mig_encrypt = (sb->flags & BLOB_FLAG_MIGRATION_ENCRYPTED);
+    bool file_encrypt = (sb->flags & BLOB_FLAG_ENCRYPTED);
+    uint64_t inner_len;
+    blobheader bh;
+    TPM_RESULT res;
 
-    if (length < sizeof(bh)) {
-        if (!quiet)
-            logprintf(STDERR_FILENO,
-                      "not enough bytes for header: %u\n", length);
-        return TPM_BAD_PARAMETER;
+    SWTPM_NVRAM_FillHeader(&bh, sb->length, sb->flags);
+    res = sink->write(sink, (const unsigned char *)&bh, sizeof(bh));
+    if (res)
+        return res;
+
+    if (file_encrypt)
+        inner_len = SWTPM_NVRAM_EncryptedLength(&filekey, sb->plain_len);
+    else
+        inner_len = sizeof(tlv_header) + sb->plain_len;
+
+    if (mig_encrypt) {
+        res = SWTPM_NVRAM_EncryptStage_Init(&mig_stage, sink, &migrationkey,
+                                            TAG_ENCRYPTED_MIGRATION_DATA,
+                                            inner_len,
+                                            TAG_IVEC_ENCRYPTED_MIGRATION_DATA);
+        if (res)
+            return res;
+        inner = &mig_stage.sink;
+    } else {
+        res = SWTPM_NVRAM_Sink_TLVHeader(sink, TAG_MIGRATION_DATA, inner_len);
+        if (res)
+            return res;
+    }
+
+    if (file_encrypt) {
+        res = SWTPM_NVRAM_EncryptStage_Init(&file_stage, inner, &filekey,
+                                            TAG_ENCRYPTED_DATA,
+                                            sb->plain_len,
+                                            TAG_IVEC_ENCRYPTED_DATA);
+        if (res)
+            goto err_exit;
+        res = file_stage.sink.write(&file_stage.sink,
+                                    sb->plain, sb->plain_len);
+        if (res == 0)
+            res = SWTPM_NVRAM_EncryptStage_Finish(&file_stage);
+        else
+            SWTPM_NVRAM_EncryptStage_Free(&file_stage);
+    } else {
+        res = SWTPM_NVRAM_Sink_TLVHeader(inner,
+                                         (sb->flags & BLOB_FLAG_COMPRESSED)
+                                           ? TAG_COMPRESSED_DATA : TAG_DATA,
+                                         sb->plain_len);
+        if (res == 0)
+            res = inner->write(inner, sb->plain, sb->plain_len);
     }
+    if (res)
+        goto err_exit;
+
+    if (mig_encrypt)
+        res = SWTPM_NVRAM_EncryptStage_Finish(&mig_stage);
+
+    return res;
+
+err_exit:
+    if (mig_encrypt)
+        SWTPM_NVRAM_EncryptStage_Free(&mig_stage);
+
+    return res;
+}
 
-    if (ntohl(bh->totlen) != length) {
-        if (!quiet)
-            logprintf(STDERR_FILENO,
-                      "broken header: bh->totlen %u != %u\n",
-                      htonl(bh->totlen), length);
-        return TPM_BAD_PARAMETER;
-    }
+/*
+ * SWTPM_NVRAM_WriteStateBlob: Write the state blob to the given file
+ * descriptor starting at @offset. The @prefix, such as a response header,
+ * is written ahead of the blob. At most NVRAM_STREAM_BUFFER_SIZE bytes of
+ * the encrypted blob are held in memory at any time.
+ */
+TPM_RESULT SWTPM_NVRAM_WriteStateBlob(struct nvram_stateblob *sb,
+                                      int fd, uint32_t offset,
+                                      const void *prefix, size_t prefix_len)
+{
+    struct nvram_fd_sink fs = {
+        .sink.write = SWTPM_NVRAM_FdSink_Write,
+        .fd = fd,
+        .size = NVRAM_STREAM_BUFFER_SIZE,
+    };
+    TPM_RESULT res;
 
-    if (bh->min_version > BLOB_HEADER_VERSION) {
-        if (!quiet)
-            logprintf(STDERR_FILENO,
-                      "Minimum required version for the blob is %d, we "
-                      "only support version %d\n", bh->min_version,
-                      BLOB_HEADER_VERSION);
-        return TPM_BAD_VERSION;
+    fs.buffer = malloc(fs.size);
+    if (!fs.buffer) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %zu bytes.\n", fs.size);
+        return TPM_FAIL;
     }
 
-    hdrsize = ntohs(bh->hdrsize);
-    if (hdrsize != sizeof(blobheader)) {
-        logprintf(STDERR_FILENO,
-                  "bad header size: %u != %zu\n",
-                  hdrsize, sizeof(blobheader));
-        return TPM_BAD_DATASIZE;
+    res = fs.sink.write(&fs.sink, prefix, prefix_len);
+    if (res == 0) {
+        fs.skip = offset;
+        res = SWTPM_NVRAM_ProduceStateBlob(sb, &fs.sink);
     }
+    if (res == 0)
+        res = SWTPM_NVRAM_FdSink_Flush(&fs);
 
-    *hdrversion = bh->version;
-    *dataoffset = hdrsize;
-    *hdrflags = ntohs(bh->flags);
+    free(fs.buffer);
 
-    return TPM_SUCCESS;
+    return res;
 }
 
 /*
- * Get the state blob with the current name; read it from the filesystem.
+ * Get the state blob with the current name; read it from the filesystem
+ * or, for the volatile state, get it from the TPM.
  * Decrypt it if the caller asks for it and if a key is set. Return
  * whether it's still encrypyted.
  */
@@ -1166,116 +2996,79 @@ TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
                                     TPM_BOOL decrypt,
                                     TPM_BOOL *is_encrypted)
 {
+    struct nvram_mem_sink ms = {
+        .sink.write = SWTPM_NVRAM_MemSink_Write,
+    };
+    struct nvram_stateblob *sb;
     TPM_RESULT res;
-    uint16_t flags = 0;
-    tlv_data td[3];
-    size_t td_len;
-    unsigned char *plain = NULL, *buffer = NULL;
-    uint32_t plain_len, buffer_len = 0;
 
     *data = NULL;
     *length = 0;
 
-    res = SWTPM_NVRAM_LoadData(&plain, &plain_len, tpm_number, name);
+    res = SWTPM_NVRAM_OpenStateBlob(&sb, tpm_number, name, decrypt,
+                                    is_encrypted, &ms.size);
     if (res)
         return res;
 
-    /* @plain contains unencrypted data without tlv headers */
-
-    /* if the user doesn't want decryption and there's a file key, we need to
-       encrypt the data */
-    if (!decrypt && SWTPM_NVRAM_Has_FileKey()) {
-        td_len = 3;
-        res = SWTPM_NVRAM_EncryptData(&filekey, &td[0], &td_len,
-                                      TAG_ENCRYPTED_DATA, plain, plain_len,
-                                      TAG_IVEC_ENCRYPTED_DATA);
-        if (res)
-            goto err_exit;
-
-        *is_encrypted = TRUE;
-        if (SWTPM_NVRAM_FileKey_Size() == SWTPM_AES256_BLOCK_SIZE)
-            flags |= BLOB_FLAG_ENCRYPTED_256BIT_KEY;
-    } else {
-        *is_encrypted = FALSE;
-        td[0] = TLV_DATA(TAG_DATA, plain_len, plain);
-        plain = NULL;
-        td_len = 1;
+    ms.buffer = malloc(ms.size);
+    if (!ms.buffer) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %u bytes.\n", ms.size);
+        res = TPM_FAIL;
+        goto exit;
     }
 
-    res = tlv_data_append(&buffer, &buffer_len, td, td_len);
-    if (res)
-        goto err_exit;
-
-    tlv_data_free(td, td_len);
-
-    /* @buffer contains tlv data */
-
-    if (SWTPM_NVRAM_Has_MigrationKey()) {
-        /* we have to encrypt it now with the migration key */
-        flags |= BLOB_FLAG_MIGRATION_ENCRYPTED;
-        if (SWTPM_NVRAM_MigrationKey_Size() == SWTPM_AES256_BLOCK_SIZE)
-             flags |= BLOB_FLAG_MIGRATION_256BIT_KEY;
-
-        td_len = 3;
-        res = SWTPM_NVRAM_EncryptData(&migrationkey, &td[0], &td_len,
-                                      TAG_ENCRYPTED_MIGRATION_DATA,
-                                      buffer, buffer_len,
-                                      TAG_IVEC_ENCRYPTED_MIGRATION_DATA);
-        if (res)
-            goto err_exit;
+    res = SWTPM_NVRAM_ProduceStateBlob(sb, &ms.sink);
+    if (res == 0 && ms.used != ms.size) {
+        logprintf(STDERR_FILENO,
+                  "State blob has %u bytes rather than the expected %u.\n",
+                  ms.used, ms.size);
+        res = TPM_FAIL;
+    }
+    if (res == 0) {
+        *data = ms.buffer;
+        *length = ms.size;
     } else {
-        td[0] = TLV_DATA(TAG_MIGRATION_DATA, buffer_len, buffer);
-        buffer = NULL;
-        td_len = 1;
+        free(ms.buffer);
     }
-    flags |= BLOB_FLAG_MIGRATION_DATA;
-
-    res = tlv_data_append(data, length, td, td_len);
-    if (res)
-        goto err_exit;
 
-    /* put the header in clear text */
-    if (*is_encrypted)
-        flags |= BLOB_FLAG_ENCRYPTED;
-
-    res = SWTPM_NVRAM_PrependHeader(data, length, flags);
-
-err_exit:
-    tlv_data_free(td, td_len);
-    free(buffer);
-    free(plain);
+exit:
+    SWTPM_NVRAM_FreeStateBlob(sb);
 
     return res;
 }
 
+/* the function that takes the plain state of a blob */
+typedef TPM_RESULT (*SWTPM_NVRAM_SetStateFn)(enum TPMLIB_StateType st,
+                                             const unsigned char *buffer,
+                                             uint32_t buflen,
+                                             void *opaque);
+
 /*
- * Set the state blob with the given name; the caller tells us if
- * the blob is encrypted; if it is encrypted, it will be written
- * into the file as-is, otherwise it will be encrypted if a key is set.
+ * Decrypt and decompress the state blob as needed and pass the plain state
+ * to @set_state; the caller tells us if the blob is encrypted with the
+ * state key.
  */
-TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
-                                    uint32_t length,
-                                    TPM_BOOL is_encrypted,
-                                    uint32_t tpm_number SWTPM_ATTR_UNUSED,
-                                    uint32_t blobtype)
+static TPM_RESULT SWTPM_NVRAM_DecodeStateBlob(const unsigned char *data,
+                                              uint32_t length,
+                                              TPM_BOOL is_encrypted,
+                                              enum TPMLIB_StateType st,
+                                              const char *blobname,
+                                              SWTPM_NVRAM_SetStateFn set_state,
+                                              void *opaque)
 {
     TPM_RESULT res;
     uint32_t dataoffset;
-    unsigned char *plain = NULL, *mig_decrypt = NULL;
-    uint32_t plain_len = 0, mig_decrypt_len = 0;
+    unsigned char *plain = NULL, *mig_decrypt = NULL, *decompressed = NULL;
+    uint32_t plain_len = 0, mig_decrypt_len = 0, decompressed_len = 0;
+    /* pointers into @data or the decrypted buffers; nothing is copied */
+    const unsigned char *mig_data, *state;
+    uint32_t mig_data_len, state_len;
     uint16_t hdrflags;
-    enum TPMLIB_StateType st = tpmlib_blobtype_to_statetype(blobtype);
-    const char *blobname = tpmlib_get_blobname(blobtype);
     uint8_t hdrversion;
 
-    if (st == 0) {
-        logprintf(STDERR_FILENO,
-                  "Unknown blob type %u\n", blobtype);
-        return TPM_BAD_PARAMETER;
-    }
-
     if (length == 0)
-        return TPMLIB_SetState(st, NULL, 0);
+        return set_state(st, NULL, 0, opaque);
 
     res = SWTPM_NVRAM_CheckHeader(data, length, &dataoffset, &hdrflags,
                                   &hdrversion, false);
@@ -1283,7 +3076,7 @@ TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
         return res;
 
     if (length - dataoffset == 0)
-        return TPMLIB_SetState(st, NULL, 0);
+        return set_state(st, NULL, 0, opaque);
 
     /*
      * We allow setting of blobs that were not encrypted before;
@@ -1307,18 +3100,21 @@ TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
                                       TAG_ENCRYPTED_MIGRATION_DATA,
                                       hdrversion,
                                       TAG_IVEC_ENCRYPTED_MIGRATION_DATA,
-                                      hdrflags, BLOB_FLAG_MIGRATION_256BIT_KEY);
+                                      hdrflags, BLOB_FLAG_MIGRATION_256BIT_KEY,
+                                      BLOB_FLAG_MIGRATION_GCM);
         if (res) {
             logprintf(STDERR_FILENO,
                       "Decrypting the %s blob with the migration key failed; "
                       "res = %d\n", blobname, res);
             return res;
         }
+        mig_data = mig_decrypt;
+        mig_data_len = mig_decrypt_len;
     } else {
-        res = SWTPM_NVRAM_GetPlainData(&mig_decrypt, &mig_decrypt_len,
-                                       &data[dataoffset], length - dataoffset,
-                                       TAG_MIGRATION_DATA,
-                                       hdrversion);
+        res = SWTPM_NVRAM_FindPlainData(&mig_data, &mig_data_len,
+                                        &data[dataoffset], length - dataoffset,
+                                        TAG_MIGRATION_DATA,
+                                        hdrversion);
         if (res)
             return res;
     }
@@ -1337,36 +3133,450 @@ TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
         }
 
         res = SWTPM_NVRAM_DecryptData(&filekey, &plain, &plain_len,
-                                      mig_decrypt, mig_decrypt_len,
+                                      mig_data, mig_data_len,
                                       TAG_ENCRYPTED_DATA,
                                       hdrversion, TAG_IVEC_ENCRYPTED_DATA,
-                                      hdrflags, BLOB_FLAG_ENCRYPTED_256BIT_KEY);
+                                      hdrflags, BLOB_FLAG_ENCRYPTED_256BIT_KEY,
+                                      BLOB_FLAG_ENCRYPTED_GCM);
         if (res) {
             logprintf(STDERR_FILENO,
                       "Decrypting the %s blob with the state key "
                       "failed; res = %d\n", blobname, res);
             goto cleanup;
         }
+        state = plain;
+        state_len = plain_len;
     } else {
-        res = SWTPM_NVRAM_GetPlainData(&plain, &plain_len,
-                                       mig_decrypt, mig_decrypt_len,
-                                       TAG_DATA,
-                                       hdrversion);
+        res = SWTPM_NVRAM_FindPlainData(&state, &state_len,
+                                        mig_data, mig_data_len,
+                                        (hdrflags & BLOB_FLAG_COMPRESSED)
+                                          ? TAG_COMPRESSED_DATA : TAG_DATA,
+                                        hdrversion);
         if (res)
             goto cleanup;
     }
 
-    /* SetState will make a copy of the buffer */
-    res = TPMLIB_SetState(st, plain, plain_len);
+    if ((hdrflags & BLOB_FLAG_COMPRESSED)) {
+        res = SWTPM_NVRAM_DecompressData(&decompressed, &decompressed_len,
+                                         state, state_len);
+        if (res) {
+            logprintf(STDERR_FILENO,
+                      "Decompressing the %s blob failed; res = %d\n",
+                      blobname, res);
+            goto cleanup;
+        }
+        state = decompressed;
+        state_len = decompressed_len;
+    }
 
-    free(plain);
+    /* SetState will make a copy of the buffer */
+    res = set_state(st, state, state_len, opaque);
 
 cleanup:
+    free(decompressed);
+    free(plain);
     free(mig_decrypt);
 
     return res;
 }
 
+static TPM_RESULT SWTPM_NVRAM_SetState(enum TPMLIB_StateType st,
+                                       const unsigned char *buffer,
+                                       uint32_t buflen,
+                                       void *opaque SWTPM_ATTR_UNUSED)
+{
+    return TPMLIB_SetState(st, buffer, buflen);
+}
+
+/*
+ * Set the state blob with the given name; the caller tells us if
+ * the blob is encrypted; if it is encrypted, it will be written
+ * into the file as-is, otherwise it will be encrypted if a key is set.
+ */
+TPM_RESULT SWTPM_NVRAM_SetStateBlob(const unsigned char *data,
+                                    uint32_t length,
+                                    TPM_BOOL is_encrypted,
+                                    uint32_t tpm_number,
+                                    uint32_t blobtype)
+{
+    enum TPMLIB_StateType st = tpmlib_blobtype_to_statetype(blobtype);
+    const char *blobname = tpmlib_get_blobname(blobtype);
+
+    if (st == 0) {
+        logprintf(STDERR_FILENO,
+                  "Unknown blob type %u\n", blobtype);
+        return TPM_BAD_PARAMETER;
+    }
+
+    /* the blob replaces a staged one */
+    if (st == TPMLIB_STATE_PERMANENT)
+        SWTPM_NVRAM_Stage_Clear();
+
+    /* libtpms will store the new state; it must not be skipped */
+    g_mutex_lock(&g_nvram_io_lock);
+    SWTPM_NVRAM_Digest_Clear(tpm_number, blobname);
+    g_mutex_unlock(&g_nvram_io_lock);
+    SWTPM_NVRAM_Generation_Bump(blobname);
+
+    return SWTPM_NVRAM_DecodeStateBlob(data, length, is_encrypted, st,
+                                       blobname, SWTPM_NVRAM_SetState, NULL);
+}
+
+/* keep a copy of the plain state in the nvram_staged_state @opaque */
+static TPM_RESULT SWTPM_NVRAM_Stage_Set(enum TPMLIB_StateType st
+                                          SWTPM_ATTR_UNUSED,
+                                        const unsigned char *buffer,
+                                        uint32_t buflen,
+                                        void *opaque)
+{
+    struct nvram_staged_state *ss = opaque;
+    unsigned char *copy = NULL;
+
+    if (buflen) {
+        copy = malloc(buflen);
+        if (!copy) {
+            logprintf(STDERR_FILENO,
+                      "Could not allocate %u bytes.\n", buflen);
+            return TPM_FAIL;
+        }
+        memcpy(copy, buffer, buflen);
+    }
+
+    SWTPM_NVRAM_Staged_Free(ss);
+    ss->data = copy;
+    ss->length = buflen;
+    ss->valid = true;
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Stage the permanent state blob ahead of a migration: decrypt and check it
+ * now but only set it with SWTPM_NVRAM_CommitStagedStateBlob(). This way
+ * the blob can be received while the source of the migration still uses
+ * the storage and setting it later takes little time.
+ */
+TPM_RESULT SWTPM_NVRAM_StageStateBlob(const unsigned char *data,
+                                      uint32_t length,
+                                      TPM_BOOL is_encrypted,
+                                      uint32_t blobtype)
+{
+    enum TPMLIB_StateType st = tpmlib_blobtype_to_statetype(blobtype);
+
+    if (st != TPMLIB_STATE_PERMANENT) {
+        logprintf(STDERR_FILENO,
+                  "Only the permanent state blob can be staged.\n");
+        return TPM_BAD_PARAMETER;
+    }
+
+    SWTPM_NVRAM_Stage_Clear();
+
+    return SWTPM_NVRAM_DecodeStateBlob(data, length, is_encrypted, st,
+                                       tpmlib_get_blobname(blobtype),
+                                       SWTPM_NVRAM_Stage_Set, &g_nvram_staged);
+}
+
+/*
+ * Set the state blob that SWTPM_NVRAM_StageStateBlob() staged.
+ */
+TPM_RESULT SWTPM_NVRAM_CommitStagedStateBlob(uint32_t tpm_number,
+                                             uint32_t blobtype)
+{
+    enum TPMLIB_StateType st = tpmlib_blobtype_to_statetype(blobtype);
+    const char *blobname = tpmlib_get_blobname(blobtype);
+    TPM_RESULT res;
+
+    if (st != TPMLIB_STATE_PERMANENT || !g_nvram_staged.valid) {
+        logprintf(STDERR_FILENO,
+                  "There is no staged %s blob.\n",
+                  blobname ? blobname : "state");
+        return TPM_BAD_PARAMETER;
+    }
+
+    g_mutex_lock(&g_nvram_io_lock);
+    SWTPM_NVRAM_Digest_Clear(tpm_number, blobname);
+    g_mutex_unlock(&g_nvram_io_lock);
+    SWTPM_NVRAM_Generation_Bump(blobname);
+
+    res = TPMLIB_SetState(st, g_nvram_staged.data, g_nvram_staged.length);
+
+    SWTPM_NVRAM_Stage_Clear();
+
+    return res;
+}
+
+/* the blob types of a state bundle in the order they are written in */
+static const uint32_t nvram_bundle_blobtypes[] = {
+    PTM_BLOB_TYPE_PERMANENT,
+    PTM_BLOB_TYPE_VOLATILE,
+    PTM_BLOB_TYPE_SAVESTATE,
+};
+
+struct nvram_statebundle {
+    size_t count;
+    struct {
+        uint32_t blobtype;
+        TPM_BOOL is_encrypted;
+        uint32_t length;
+        struct nvram_stateblob *sb;
+    } entries[ARRAY_LEN(nvram_bundle_blobtypes)];
+};
+
+/*
+ * SWTPM_NVRAM_OpenStateBundle: Load all state blobs at this point in time
+ * and determine the size of the bundle holding them. The bundle is then
+ * written with SWTPM_NVRAM_WriteStateBundle and must be freed with
+ * SWTPM_NVRAM_FreeStateBundle.
+ */
+TPM_RESULT SWTPM_NVRAM_OpenStateBundle(struct nvram_statebundle **sbu,
+                                       uint32_t tpm_number,
+                                       TPM_BOOL decrypt,
+                                       uint32_t *length)
+{
+    uint64_t len = sizeof(struct ptm_state_bundle_hdr);
+    const char *blobname;
+    TPM_RESULT res = 0;
+    size_t i, c;
+
+    *sbu = calloc(1, sizeof(**sbu));
+    if (!*sbu) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %zu bytes.\n", sizeof(**sbu));
+        return TPM_FAIL;
+    }
+
+    for (i = 0; i < ARRAY_LEN(nvram_bundle_blobtypes); i++) {
+        c = (*sbu)->count;
+        blobname = tpmlib_get_blobname(nvram_bundle_blobtypes[i]);
+        res = SWTPM_NVRAM_OpenStateBlob(&(*sbu)->entries[c].sb, tpm_number,
+                                        blobname, decrypt,
+                                        &(*sbu)->entries[c].is_encrypted,
+                                        &(*sbu)->entries[c].length);
+        /* a state that does not exist is left out */
+        if (res == TPM_RETRY)
+            continue;
+        if (res)
+            goto err_exit;
+
+        (*sbu)->entries[c].blobtype = nvram_bundle_blobtypes[i];
+        (*sbu)->count++;
+        len += sizeof(struct ptm_state_bundle_entry) +
+               (*sbu)->entries[c].length;
+    }
+
+    if (len > UINT32_MAX) {
+        logprintf(STDERR_FILENO, "The state bundle is too large.\n");
+        res = TPM_SIZE;
+        goto err_exit;
+    }
+    *length = len;
+
+    return TPM_SUCCESS;
+
+err_exit:
+    SWTPM_NVRAM_FreeStateBundle(*sbu);
+    *sbu = NULL;
+
+    return res;
+}
+
+void SWTPM_NVRAM_FreeStateBundle(struct nvram_statebundle *sbu)
+{
+    size_t i;
+
+    if (!sbu)
+        return;
+
+    for (i = 0; i < sbu->count; i++)
+        SWTPM_NVRAM_FreeStateBlob(sbu->entries[i].sb);
+    free(sbu);
+}
+
+/*
+ * SWTPM_NVRAM_WriteStateBundle: Write the state bundle to the given file
+ * descriptor. The @prefix, such as a response header, is written ahead of
+ * the bundle. All entries go through the same buffer, and the plain data
+ * of each blob are freed once the blob is written.
+ */
+TPM_RESULT SWTPM_NVRAM_WriteStateBundle(struct nvram_statebundle *sbu,
+                                        int fd,
+                                        const void *prefix, size_t prefix_len)
+{
+    struct ptm_state_bundle_hdr hdr = {
+        .magic = htobe32(PTM_STATE_BUNDLE_MAGIC),
+        .version = htobe32(PTM_STATE_BUNDLE_VERSION),
+        .count = htobe32(sbu->count),
+    };
+    struct nvram_fd_sink fs = {
+        .sink.write = SWTPM_NVRAM_FdSink_Write,
+        .fd = fd,
+        .size = NVRAM_STREAM_BUFFER_SIZE,
+    };
+    struct ptm_state_bundle_entry entry;
+    TPM_RESULT res;
+    size_t i;
+
+    fs.buffer = malloc(fs.size);
+    if (!fs.buffer) {
+        logprintf(STDERR_FILENO,
+                  "Could not allocate %zu bytes.\n", fs.size);
+        return TPM_FAIL;
+    }
+
+    res = fs.sink.write(&fs.sink, prefix, prefix_len);
+    if (res == 0)
+        res = fs.sink.write(&fs.sink, (const unsigned char *)&hdr,
+                            sizeof(hdr));
+
+    for (i = 0; i < sbu->count && res == 0; i++) {
+        entry.type = htobe32(sbu->entries[i].blobtype);
+        entry.state_flags = htobe32(sbu->entries[i].is_encrypted
+                                    ? PTM_STATE_FLAG_ENCRYPTED : 0);
+        entry.length = htobe32(sbu->entries[i].length);
+
+        res = fs.sink.write(&fs.sink, (const unsigned char *)&entry,
+                            sizeof(entry));
+        if (res == 0)
+            res = SWTPM_NVRAM_ProduceStateBlob(sbu->entries[i].sb, &fs.sink);
+
+        SWTPM_NVRAM_FreeStateBlob(sbu->entries[i].sb);
+        sbu->entries[i].sb = NULL;
+    }
+    if (res == 0)
+        res = SWTPM_NVRAM_FdSink_Flush(&fs);
+
+    free(fs.buffer);
+
+    return res;
+}
+
+/*
+ * SWTPM_NVRAM_SetStateBundle: Set the state blobs of a bundle. All blobs
+ * are decrypted and checked before the first one is set; if setting a blob
+ * fails, the ones set before it are removed again, so that either all or
+ * none of the blobs are set.
+ */
+TPM_RESULT SWTPM_NVRAM_SetStateBundle(const unsigned char *data,
+                                      uint32_t length,
+                                      uint32_t tpm_number)
+{
+    /* indexed by the blob type starting at PTM_BLOB_TYPE_PERMANENT */
+    struct nvram_staged_state staged[ARRAY_LEN(nvram_bundle_blobtypes)];
+    struct nvram_staged_state *ss;
+    enum TPMLIB_StateType st;
+    struct ptm_state_bundle_hdr hdr;
+    struct ptm_state_bundle_entry entry;
+    const char *blobname;
+    uint32_t offset, count, blobtype, blob_length, i;
+    TPM_RESULT res = 0;
+
+    memset(staged, 0, sizeof(staged));
+
+    if (length < sizeof(hdr)) {
+        logprintf(STDERR_FILENO, "The state bundle is too short.\n");
+        return TPM_BAD_PARAMETER;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    count = be32toh(hdr.count);
+    if (be32toh(hdr.magic) != PTM_STATE_BUNDLE_MAGIC ||
+        be32toh(hdr.version) != PTM_STATE_BUNDLE_VERSION ||
+        count > ARRAY_LEN(nvram_bundle_blobtypes)) {
+        logprintf(STDERR_FILENO, "Unsupported state bundle.\n");
+        return TPM_BAD_PARAMETER;
+    }
+    offset = sizeof(hdr);
+
+    for (i = 0; i < count; i++) {
+        if (length - offset < sizeof(entry)) {
+            res = TPM_BAD_PARAMETER;
+            break;
+        }
+        memcpy(&entry, &data[offset], sizeof(entry));
+        offset += sizeof(entry);
+
+        blobtype = be32toh(entry.type);
+        blob_length = be32toh(entry.length);
+        if (blobtype < PTM_BLOB_TYPE_PERMANENT ||
+            blobtype > PTM_BLOB_TYPE_SAVESTATE ||
+            length - offset < blob_length) {
+            res = TPM_BAD_PARAMETER;
+            break;
+        }
+        /* each blob type may only appear once */
+        ss = &staged[blobtype - PTM_BLOB_TYPE_PERMANENT];
+        if (ss->valid) {
+            res = TPM_BAD_PARAMETER;
+            break;
+        }
+
+        st = tpmlib_blobtype_to_statetype(blobtype);
+        res = SWTPM_NVRAM_DecodeStateBlob(&data[offset], blob_length,
+                                          (be32toh(entry.state_flags) &
+                                           PTM_STATE_FLAG_ENCRYPTED) != 0,
+                                          st, tpmlib_get_blobname(blobtype),
+                                          SWTPM_NVRAM_Stage_Set, ss);
+        if (res)
+            break;
+        offset += blob_length;
+    }
+    if (res == 0 && offset != length)
+        res = TPM_BAD_PARAMETER;
+    if (res) {
+        logprintf(STDERR_FILENO, "The state bundle is not valid.\n");
+        goto exit;
+    }
+
+    /* the bundle replaces a staged permanent state */
+    SWTPM_NVRAM_Stage_Clear();
+
+    for (i = 0; i < ARRAY_LEN(staged) && res == 0; i++) {
+        if (!staged[i].valid)
+            continue;
+
+        blobtype = PTM_BLOB_TYPE_PERMANENT + i;
+        blobname = tpmlib_get_blobname(blobtype);
+        g_mutex_lock(&g_nvram_io_lock);
+        SWTPM_NVRAM_Digest_Clear(tpm_number, blobname);
+        g_mutex_unlock(&g_nvram_io_lock);
+        SWTPM_NVRAM_Generation_Bump(blobname);
+
+        st = tpmlib_blobtype_to_statetype(blobtype);
+        res = TPMLIB_SetState(st, staged[i].data, staged[i].length);
+        if (res) {
+            /* remove the states that were set before this one */
+            while (i-- > 0) {
+                if (staged[i].valid) {
+                    st = tpmlib_blobtype_to_statetype(
+                             PTM_BLOB_TYPE_PERMANENT + i);
+                    TPMLIB_SetState(st, NULL, 0);
+                }
+            }
+            break;
+        }
+    }
+
+exit:
+    for (i = 0; i < ARRAY_LEN(staged); i++)
+        SWTPM_NVRAM_Staged_Free(&staged[i]);
+
+    return res;
+}
+
+/*
+ * SWTPM_NVRAM_HasState: Check whether the backend holds the state blob with
+ *                       the given name without reading it
+ */
+TPM_BOOL SWTPM_NVRAM_HasState(const char *name)
+{
+    size_t blobsize;
+
+    if (SWTPM_NVRAM_Init() != TPM_SUCCESS)
+        return FALSE;
+
+    return g_nvram_backend_ops->check_state(tpmstate_get_backend_uri(), name,
+                                            &blobsize) == TPM_SUCCESS;
+}
+
 /* Example JSON output:
  *  { "type": "swtpm",
  *    "states": [ "permall", "volatilestate", "savestate" ]
@@ -1424,5 +3634,7 @@ TPM_RESULT SWTPM_NVRAM_RestoreBackup(void)
 
     backend_uri = tpmstate_get_backend_uri();
 
+    SWTPM_NVRAM_Digest_ClearAll();
+
     return g_nvram_backend_ops->restore_backup(backend_uri);
 }
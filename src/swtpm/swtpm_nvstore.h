@@ -41,6 +41,7 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #include <libtpms/tpm_types.h>
 #include <libtpms/tpm_library.h>
 
@@ -68,8 +69,19 @@ TPM_RESULT SWTPM_NVRAM_StoreData(const unsigned char *data,
 TPM_RESULT SWTPM_NVRAM_DeleteName(uint32_t tpm_number,
 				  const char *name,
                                   TPM_BOOL mustExist);
+TPM_BOOL SWTPM_NVRAM_HasState(const char *name);
 TPM_RESULT SWTPM_NVRAM_Store_Volatile(void);
 
+TPM_RESULT SWTPM_NVRAM_Start_WriteBehind(void);
+void SWTPM_NVRAM_Stop_WriteBehind(void);
+TPM_RESULT SWTPM_NVRAM_Flush(void);
+TPM_RESULT SWTPM_NVRAM_Sync(void);
+
+TPM_RESULT SWTPM_NVRAM_Start_LockWaiter(void);
+void SWTPM_NVRAM_Stop_LockWaiter(void);
+int SWTPM_NVRAM_LockFile(int fd, off_t start, off_t len, unsigned int retries);
+int SWTPM_NVRAM_UnlockFile(int fd, off_t start, off_t len);
+
 TPM_RESULT SWTPM_NVRAM_Set_FileKey(const unsigned char *data,
                                    uint32_t length,
                                    enum encryption_mode mode);
@@ -78,6 +90,8 @@ TPM_RESULT SWTPM_NVRAM_Set_MigrationKey(const unsigned char *data,
                                         uint32_t length,
                                         enum encryption_mode mode);
 
+void SWTPM_NVRAM_Set_MigrationCompression(bool compress);
+
 TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
                                     uint32_t *length,
                                     uint32_t tpm_number,
@@ -85,12 +99,60 @@ TPM_RESULT SWTPM_NVRAM_GetStateBlob(unsigned char **data,
                                     TPM_BOOL decrypt,
                                     TPM_BOOL *is_encrypted);
 
-TPM_RESULT SWTPM_NVRAM_SetStateBlob(unsigned char *data,
+struct nvram_stateblob;
+
+TPM_RESULT SWTPM_NVRAM_OpenStateBlob(struct nvram_stateblob **sb,
+                                     uint32_t tpm_number,
+                                     const char *name,
+                                     TPM_BOOL decrypt,
+                                     TPM_BOOL *is_encrypted,
+                                     uint32_t *length);
+
+TPM_RESULT SWTPM_NVRAM_WriteStateBlob(struct nvram_stateblob *sb,
+                                      int fd, uint32_t offset,
+                                      const void *prefix, size_t prefix_len);
+
+void SWTPM_NVRAM_FreeStateBlob(struct nvram_stateblob *sb);
+
+/* the maximum size of a state blob that is accepted for setting */
+#define SWTPM_NVRAM_MAX_STATEBLOB_SIZE  (16 * 1024 * 1024)
+
+TPM_RESULT SWTPM_NVRAM_SetStateBlob(const unsigned char *data,
                                     uint32_t length,
                                     TPM_BOOL is_encrypted,
                                     uint32_t tpm_number,
                                     uint32_t blobtype);
 
+TPM_RESULT SWTPM_NVRAM_StageStateBlob(const unsigned char *data,
+                                      uint32_t length,
+                                      TPM_BOOL is_encrypted,
+                                      uint32_t blobtype);
+
+TPM_RESULT SWTPM_NVRAM_CommitStagedStateBlob(uint32_t tpm_number,
+                                             uint32_t blobtype);
+
+uint64_t SWTPM_NVRAM_Get_PermanentGeneration(void);
+
+struct nvram_statebundle;
+
+TPM_RESULT SWTPM_NVRAM_OpenStateBundle(struct nvram_statebundle **sbu,
+                                       uint32_t tpm_number,
+                                       TPM_BOOL decrypt,
+                                       uint32_t *length);
+
+TPM_RESULT SWTPM_NVRAM_WriteStateBundle(struct nvram_statebundle *sbu,
+                                        int fd,
+                                        const void *prefix, size_t prefix_len);
+
+void SWTPM_NVRAM_FreeStateBundle(struct nvram_statebundle *sbu);
+
+/* the maximum size of a state bundle that is accepted for setting */
+#define SWTPM_NVRAM_MAX_STATEBUNDLE_SIZE  (4 * SWTPM_NVRAM_MAX_STATEBLOB_SIZE)
+
+TPM_RESULT SWTPM_NVRAM_SetStateBundle(const unsigned char *data,
+                                      uint32_t length,
+                                      uint32_t tpm_number);
+
 TPM_RESULT SWTPM_NVRAM_GetFilenameForName(char *filename,
                                           size_t bufsize,
                                           uint32_t tpm_number,
@@ -126,6 +188,14 @@ struct nvram_backend_ops {
                         const char *name,
                         const char *uri,
                         TPM_BOOL do_fsync);
+    /* optional: store data given as iovecs of @data_length bytes in total */
+    TPM_RESULT (*storev)(const struct iovec *iov,
+                         int iovcnt,
+                         uint32_t data_length,
+                         uint32_t tpm_number,
+                         const char *name,
+                         const char *uri,
+                         TPM_BOOL do_fsync);
     TPM_RESULT (*delete)(uint32_t tpm_number,
                          const char *name,
                          TPM_BOOL mustExist,
@@ -135,12 +205,17 @@ struct nvram_backend_ops {
                               size_t *blobsize);
     TPM_RESULT (*restore_backup_pre_start)(const char *uri);
     TPM_RESULT (*restore_backup)(const char *uri);
+    /* optional: make deferred writes durable */
+    TPM_RESULT (*sync)(const char *uri);
     void (*cleanup)(void);
 };
 
 /* backend interfaces */
 extern struct nvram_backend_ops nvram_dir_ops;
 extern struct nvram_backend_ops nvram_linear_ops;
+#if defined(WITH_SQLITE)
+extern struct nvram_backend_ops nvram_sqlite_ops;
+#endif
 
 
 int SWTPM_NVRAM_PrintJson(void);
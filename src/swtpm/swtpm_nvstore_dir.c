@@ -44,6 +44,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
@@ -62,6 +63,11 @@
 
 static int lock_fd = -1;
 
+/* with batch-fsync: the state directory and whether it needs to be synced */
+static int dir_fd = -1;
+static bool dir_sync_pending;
+static bool no_tmpfile; /* O_TMPFILE files cannot be linked */
+
 static const char *
 SWTPM_NVRAM_Uri_to_Dir(const char *uri)
 {
@@ -101,6 +107,55 @@ SWTPM_NVRAM_Validate_Dir(const char *tpm_state_path)
     return rc;
 }
 
+/*
+ * Open the state directory for batch-fsync unless it is open already.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_OpenDir_Dir(const char *tpm_state_path)
+{
+    if (dir_fd >= 0)
+        return 0;
+
+    dir_fd = open(tpm_state_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_OpenDir_Dir: Could not open directory %s: %s\n",
+                  tpm_state_path, strerror(errno));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+/*
+ * Sync the state directory once for all files that were stored into it since
+ * the last time.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_Sync_Dir(const char *uri SWTPM_ATTR_UNUSED)
+{
+    if (!dir_sync_pending)
+        return 0;
+
+    dir_sync_pending = false;
+    if (fsync_eintr(dir_fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Sync_Dir: Could not sync directory: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+static void
+SWTPM_NVRAM_CloseDir_Dir(void)
+{
+    if (dir_fd >= 0) {
+        SWTPM_NVRAM_Sync_Dir(NULL);
+        close(dir_fd);
+        dir_fd = -1;
+    }
+}
+
 static void
 SWTPM_NVRAM_Unlock_Dir(void)
 {
@@ -108,6 +163,8 @@ SWTPM_NVRAM_Unlock_Dir(void)
         close(lock_fd);
         lock_fd = -1;
     }
+    /* another process may replace the directory */
+    SWTPM_NVRAM_CloseDir_Dir();
 }
 
 static TPM_RESULT
@@ -116,12 +173,6 @@ SWTPM_NVRAM_Lock_Dir(const char *backend_uri, unsigned int retries)
     const char *tpm_state_path;
     TPM_RESULT rc = 0;
     char *lockfile = NULL;
-    struct flock flock = {
-        .l_type = F_WRLCK,
-        .l_whence = SEEK_SET,
-        .l_start = 0,
-        .l_len = 0,
-    };
 
     if (lock_fd >= 0)
         return 0;
@@ -143,21 +194,16 @@ SWTPM_NVRAM_Lock_Dir(const char *backend_uri, unsigned int retries)
         goto exit;
     }
 
-    while (1) {
-        if (fcntl(lock_fd, F_SETLK, &flock) == 0)
-            break;
-        if (retries == 0) {
-            rc = TPM_FAIL;
-            SWTPM_NVRAM_Unlock_Dir();
-            break;
-        }
-        retries--;
-        usleep(10000);
-    }
-    if (rc == TPM_FAIL)
+    if (SWTPM_NVRAM_LockFile(lock_fd, 0, 0, retries) < 0) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_Lock_Dir: Could not lock access to lockfile: %s\n",
                   strerror(errno));
+        rc = TPM_FAIL;
+        SWTPM_NVRAM_Unlock_Dir();
+    }
+
+    if (rc == 0 && tpmstate_get_batch_fsync())
+        rc = SWTPM_NVRAM_OpenDir_Dir(tpm_state_path);
 
 exit:
     free(lockfile);
@@ -231,6 +277,30 @@ SWTPM_NVRAM_Prepare_Dir(const char *uri)
     TPM_RESULT    rc = 0;
     const char *tpm_state_path = NULL;
 
+    if (tpmstate_get_page_flush()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_Dir: The page-flush option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_max_states()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_Dir: The max-states option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_direct_io()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_Dir: The direct-io option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_batch_fsync() && tpmstate_get_make_backup()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_Dir: The batch-fsync option cannot be combined with the backup option\n");
+        rc = TPM_FAIL;
+    }
+
     tpm_state_path = SWTPM_NVRAM_Uri_to_Dir(uri);
     if (rc == 0)
         rc = SWTPM_NVRAM_Validate_Dir(tpm_state_path);
@@ -242,6 +312,7 @@ static void
 SWTPM_NVRAM_Cleanup_Dir(void)
 {
     SWTPM_NVRAM_Unlock_Dir();
+    SWTPM_NVRAM_CloseDir_Dir();
 }
 
 static TPM_RESULT
@@ -307,13 +378,128 @@ SWTPM_NVRAM_CreateBackupFilename(const char *filepath,
     return rc;
 }
 
+/*
+ * Create the file to write a state into for batch-fsync and return its file
+ * descriptor. Where the file system supports it, the file is unnamed
+ * (O_TMPFILE) so that an interrupted write does not leave a file behind;
+ * otherwise it is the temporary file.
+ */
+static int
+SWTPM_NVRAM_CreateFile_Dirfd(const char *tmpname, mode_t mode,
+                             bool clear_umask, bool *is_unnamed)
+{
+    mode_t orig_umask = 0;
+    int fd = -1;
+
+    if (clear_umask)
+        orig_umask = umask(0);
+
+#if defined(O_TMPFILE)
+    if (!no_tmpfile)
+        fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, mode);
+#endif
+    *is_unnamed = fd >= 0;
+    if (fd < 0)
+        fd = openat(dir_fd, tmpname,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                    mode);
+
+    if (clear_umask)
+        umask(orig_umask);
+
+    return fd;
+}
+
+/*
+ * Write a state file relative to the open state directory for batch-fsync.
+ * Only the file data are synced; the file is renamed to its final name and
+ * the directory is synced later by SWTPM_NVRAM_Sync_Dir() together with the
+ * other files stored by the same TPM command.
+ */
 static TPM_RESULT
-SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
-                          uint32_t filedata_length,
-                          uint32_t tpm_number,
-                          const char *name,
-                          const char *uri,
-                          TPM_BOOL do_fsync)
+SWTPM_NVRAM_StoreData_Dirfd(const struct iovec *iov,
+                            int iovcnt,
+                            uint32_t filedata_length,
+                            const char *filename,
+                            const char *tmpname,
+                            mode_t mode,
+                            bool clear_umask)
+{
+    char procpath[32];
+    bool is_unnamed;
+    int fd;
+
+    fd = SWTPM_NVRAM_CreateFile_Dirfd(tmpname, mode, clear_umask,
+                                      &is_unnamed);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_StoreData_Dirfd: Could not create %s: %s\n",
+                  tmpname, strerror(errno));
+        return TPM_FAIL;
+    }
+
+    if (writev_file(fd, iov, iovcnt) != (ssize_t)filedata_length ||
+        fdatasync_eintr(fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_StoreData_Dirfd: Error (fatal), data write of "
+                  "%u bytes failed: %s\n", filedata_length, strerror(errno));
+        goto err_close;
+    }
+
+    if (is_unnamed) {
+        /*
+         * linkat(AT_EMPTY_PATH) would require CAP_DAC_READ_SEARCH. A
+         * temporary file left behind by a crash is in the way of linkat.
+         */
+        snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+        unlinkat(dir_fd, tmpname, 0);
+        if (linkat(AT_FDCWD, procpath, dir_fd, tmpname,
+                   AT_SYMLINK_FOLLOW) < 0) {
+            /* without /proc, for example after chroot, use named files */
+            close(fd);
+            no_tmpfile = true;
+            return SWTPM_NVRAM_StoreData_Dirfd(iov, iovcnt, filedata_length,
+                                               filename, tmpname, mode,
+                                               clear_umask);
+        }
+    }
+
+    if (close(fd) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_StoreData_Dirfd: Could not close %s: %s\n",
+                  tmpname, strerror(errno));
+        goto err_unlink;
+    }
+
+    if (renameat(dir_fd, tmpname, dir_fd, filename) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_StoreData_Dirfd: Error (fatal) renaming file: %s\n",
+                  strerror(errno));
+        goto err_unlink;
+    }
+    dir_sync_pending = true;
+
+    return 0;
+
+err_close:
+    close(fd);
+    if (is_unnamed)
+        return TPM_FAIL;
+
+err_unlink:
+    unlinkat(dir_fd, tmpname, 0);
+
+    return TPM_FAIL;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreDataV_Dir(const struct iovec *iov,
+                           int iovcnt,
+                           uint32_t filedata_length,
+                           uint32_t tpm_number,
+                           const char *name,
+                           const char *uri,
+                           TPM_BOOL do_fsync)
 {
     TPM_RESULT    rc = 0;
     int           irc;
@@ -333,7 +519,22 @@ SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
                                             tpm_state_path);
     }
 
-    if (rc == 0 &&
+    if (rc == 0 && tpmstate_get_batch_fsync()) {
+        char filename[FILENAME_MAX];
+        char tmpname[FILENAME_MAX];
+
+        rc = SWTPM_NVRAM_OpenDir_Dir(tpm_state_path);
+        if (rc == 0)
+            rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                                tpm_number, name, false);
+        if (rc == 0)
+            rc = SWTPM_NVRAM_GetFilenameForName(tmpname, sizeof(tmpname),
+                                                tpm_number, name, true);
+        if (rc == 0)
+            rc = SWTPM_NVRAM_StoreData_Dirfd(iov, iovcnt, filedata_length,
+                                             filename, tmpname, mode,
+                                             !mode_is_default);
+    } else if (rc == 0 &&
         tpmstate_get_make_backup() &&
         strcmp(name, TPM_PERMANENT_ALL_NAME) == 0) {
         char bakfile[FILENAME_MAX];  /* rooted backup file name */
@@ -357,9 +558,9 @@ SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
 
         if (rc == 0) {
             /* write new permanent state file */
-            n = file_write(filepath, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode,
-                           !mode_is_default, filedata, filedata_length,
-                           do_fsync, tpm_state_path);
+            n = file_writev(filepath, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode,
+                            !mode_is_default, iov, iovcnt,
+                            do_fsync, tpm_state_path);
             if (n < 0) {
                 if (renamed) {
                     if (rename(bakfile, filepath) < 0) {  /* revert @1 */
@@ -384,9 +585,9 @@ SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
                                             tpm_state_path);
 
         if (rc == 0) {
-            n = file_write(tmpfile, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode,
-                           !mode_is_default, filedata, filedata_length,
-                           do_fsync, tpm_state_path);
+            n = file_writev(tmpfile, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode,
+                            !mode_is_default, iov, iovcnt,
+                            do_fsync, tpm_state_path);
             if (n < 0) {
                 logprintf(STDERR_FILENO,
                           "SWTPM_NVRAM_StoreData_Dir: Error (fatal), data write of %u bytes failed: %s\n",
@@ -409,6 +610,23 @@ SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
     return rc;
 }
 
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Dir(unsigned char *filedata,
+                          uint32_t filedata_length,
+                          uint32_t tpm_number,
+                          const char *name,
+                          const char *uri,
+                          TPM_BOOL do_fsync)
+{
+    struct iovec iov = {
+        .iov_base = filedata,
+        .iov_len = filedata_length,
+    };
+
+    return SWTPM_NVRAM_StoreDataV_Dir(&iov, 1, filedata_length, tpm_number,
+                                      name, uri, do_fsync);
+}
+
 static TPM_RESULT
 SWTPM_NVRAM_DeleteName_Dir(uint32_t tpm_number,
                            const char *name,
@@ -437,6 +655,10 @@ SWTPM_NVRAM_DeleteName_Dir(uint32_t tpm_number,
                       "remove failed, errno %d\n", errno);
             rc = TPM_FAIL;
         }
+        /* sync the removal along with the stores of the same command */
+        if (irc == 0 && tpmstate_get_batch_fsync() &&
+            SWTPM_NVRAM_OpenDir_Dir(tpm_state_path) == 0)
+            dir_sync_pending = true;
     }
     return rc;
 }
@@ -579,9 +801,11 @@ struct nvram_backend_ops nvram_dir_ops = {
     .unlock  = SWTPM_NVRAM_Unlock_Dir,
     .load    = SWTPM_NVRAM_LoadData_Dir,
     .store   = SWTPM_NVRAM_StoreData_Dir,
+    .storev  = SWTPM_NVRAM_StoreDataV_Dir,
     .delete  = SWTPM_NVRAM_DeleteName_Dir,
     .cleanup = SWTPM_NVRAM_Cleanup_Dir,
     .check_state    = SWTPM_NVRAM_CheckState_Dir,
     .restore_backup = SWTPM_NVRAM_RestoreBackup_Dir,
+    .sync           = SWTPM_NVRAM_Sync_Dir,
     .restore_backup_pre_start = SWTPM_NVRAM_RestoreBackupPreStart_Dir,
 };
@@ -1,8 +1,11 @@
 #include "config.h"
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
 
 #include <libtpms/tpm_error.h>
 #include <libtpms/tpm_nvfilename.h>
@@ -25,6 +28,10 @@ static struct {
     unsigned char *data;
     uint32_t      length;
     struct nvram_linear_hdr *hdr; /* points into *data */
+    uint32_t      num_files; /* number of entries in hdr->files */
+    uint32_t      num_slots; /* 2 for files in A/B slots, otherwise 1 */
+
+    uint32_t      pagesize; /* page-granular layout and flushing if not 0 */
 } state;
 
 /*
@@ -50,7 +57,7 @@ SWTPM_NVRAM_Linear_SafeResize(const char* uri, uint32_t new_size)
     uint32_t result;
 
     if (!state.ops->resize) {
-        return new_size < state.length ? 0 : TPM_SIZE;
+        return new_size <= state.length ? 0 : TPM_SIZE;
     }
 
     rc = state.ops->resize(uri, &state.data, &result, new_size);
@@ -71,6 +78,56 @@ SWTPM_NVRAM_Linear_SafeResize(const char* uri, uint32_t new_size)
 
 #define FILE_NR_INVALID 0xffffffff
 
+/*
+    Returns the header entry of a slot of a file. Files of format versions
+    before 3 only have slot 0.
+*/
+static struct nvram_linear_hdr_file *
+SWTPM_NVRAM_Linear_GetSlot(uint32_t file_nr, uint32_t slot)
+{
+    struct nvram_linear_hdr_ab_file *ab_files;
+
+    if (state.num_slots == 1) {
+        return &state.hdr->files[file_nr];
+    }
+    ab_files = (struct nvram_linear_hdr_ab_file *)state.hdr->files;
+    return &ab_files[file_nr].slots[slot];
+}
+
+/*
+    Returns the number of the slot that holds the valid data of a file.
+*/
+static uint32_t
+SWTPM_NVRAM_Linear_ActiveSlot(uint32_t file_nr)
+{
+    struct nvram_linear_hdr_ab_file *ab_files;
+
+    if (state.num_slots == 1) {
+        return 0;
+    }
+    ab_files = (struct nvram_linear_hdr_ab_file *)state.hdr->files;
+    return le32toh(ab_files[file_nr].generation) & 1;
+}
+
+/*
+    Make the other slot of a file the active one by incrementing its
+    generation and flushing the header. The generation is a single aligned
+    32 bit word, so this write cannot be torn. Anything the new active slot
+    points to must have been flushed before.
+*/
+static TPM_RESULT
+SWTPM_NVRAM_Linear_FlipSlot(const char *uri, uint32_t file_nr)
+{
+    struct nvram_linear_hdr_ab_file *ab_files;
+    uint32_t generation;
+
+    ab_files = (struct nvram_linear_hdr_ab_file *)state.hdr->files;
+    generation = le32toh(ab_files[file_nr].generation);
+    ab_files[file_nr].generation = htole32(generation + 1);
+
+    return SWTPM_NVRAM_Linear_FlushHeader(uri);
+}
+
 /*
     Returns the offset into the state.hdr.files array given a TPM state name and
     number. Will be FILE_NR_INVALID if out of bounds or unknown name.
@@ -91,7 +148,7 @@ SWTPM_NVRAM_Linear_GetFileNr(const char *name)
                   name);
         return FILE_NR_INVALID;
     }
-    if (rc >= SWTPM_NVSTORE_LINEAR_MAX_STATES) {
+    if (rc >= state.num_files) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_Linear_GetFileOffset: File limit exceeded: %d\n",
                   rc);
@@ -101,133 +158,223 @@ SWTPM_NVRAM_Linear_GetFileNr(const char *name)
 }
 
 /*
-    Allocate a new file entry in the linear address space of state.data.
-    The new file will be placed at the end.
+    Grow the linear address space to at least 'needed' bytes. The size is at
+    least doubled so that a state that keeps growing does not cause a resize
+    every time. Backends that cannot grow, like block devices, only need to be
+    big enough already.
+*/
+static TPM_RESULT
+SWTPM_NVRAM_Linear_Grow(const char *uri, uint32_t needed)
+{
+    TPM_RESULT rc;
+    uint32_t new_size;
+
+    if (__builtin_mul_overflow(state.length, 2, &new_size) ||
+        new_size < needed) {
+        new_size = needed;
+    }
+
+    rc = SWTPM_NVRAM_Linear_SafeResize(uri, new_size);
+    if (rc == TPM_SIZE && state.length >= needed) {
+        rc = 0;
+    }
+
+    return rc;
+}
+
+/*
+    Align an offset for the start of a section; with page-flush sections start
+    on a page.
+*/
+static uint32_t
+SWTPM_NVRAM_Linear_AlignOffset(uint32_t offset)
+{
+    if (state.pagesize) {
+        return (offset + state.pagesize - 1) & ~(state.pagesize - 1);
+    }
+    return offset;
+}
+
+/*
+    Returns the allocated slot with the lowest offset at or after 'offset',
+    ignoring slot 'skip_slot' of file 'skip_nr'. Will be NULL if there is
+    none.
+*/
+static struct nvram_linear_hdr_file *
+SWTPM_NVRAM_Linear_NextSlot(uint32_t offset, uint32_t skip_nr,
+                            uint32_t skip_slot)
+{
+    struct nvram_linear_hdr_file *found = NULL;
+    struct nvram_linear_hdr_file *cur;
+    uint32_t found_offset = 0;
+    uint32_t cur_offset;
+    uint32_t i, j;
+
+    for (i = 0; i < state.num_files; i++) {
+        for (j = 0; j < state.num_slots; j++) {
+            cur = SWTPM_NVRAM_Linear_GetSlot(i, j);
+            if ((i == skip_nr && j == skip_slot) || !cur->offset) {
+                continue;
+            }
+            cur_offset = le32toh(cur->offset);
+            if (cur_offset >= offset &&
+                (found == NULL || cur_offset < found_offset)) {
+                found = cur;
+                found_offset = cur_offset;
+            }
+        }
+    }
+    return found;
+}
+
+/*
+    Allocate space for a slot of a file in the linear address space of
+    state.data. The space currently held by the slot is considered free, so it
+    either grows in place or is placed into the first free space between the
+    other slots that is big enough. Only if there is none, the slot will be
+    placed at the end, growing the address space. Other slots are never
+    moved. With page-flush each section starts on a page and spans whole pages
+    so that the pages of one file are not shared with the header or another
+    file.
 
     Importantly, this may perform a resize, so pointers into state.data or
     state.hdr must not be kept over this function call.
 */
 static TPM_RESULT
-SWTPM_NVRAM_Linear_AllocFile(const char *uri, uint32_t file_nr, uint32_t size)
+SWTPM_NVRAM_Linear_AllocFile(const char *uri, uint32_t file_nr, uint32_t slot,
+                             uint32_t size)
 {
     TPM_RESULT rc = 0;
     struct nvram_linear_hdr_file *file;
-    uint32_t new_offset = le16toh(state.hdr->hdrsize);
-    uint32_t new_size;
-    uint32_t cur_end;
-    uint32_t i;
+    struct nvram_linear_hdr_file *next;
+    uint32_t cur_end = le16toh(state.hdr->hdrsize);
+    uint32_t new_offset;
+    uint32_t new_end;
+    uint32_t next_offset;
     uint32_t section_size = size;
     ROUND_TO_NEXT_POWER_OF_2_32(section_size);
+    if (section_size < state.pagesize) {
+        section_size = state.pagesize;
+    }
+
+    /* find the first gap between files that is big enough */
+    while (1) {
+        new_offset = SWTPM_NVRAM_Linear_AlignOffset(cur_end);
 
-    /* find end of current last file */
-    for (i = 0; i < SWTPM_NVSTORE_LINEAR_MAX_STATES; i++) {
-        file = &state.hdr->files[i];
-        if (!file->offset) {
-            continue;
+        next = SWTPM_NVRAM_Linear_NextSlot(cur_end, file_nr, slot);
+        if (next == NULL) {
+            break;
         }
 
-        cur_end = le32toh(file->offset) + le32toh(file->section_length);
-        if (cur_end > new_offset) {
-            new_offset = cur_end;
+        next_offset = le32toh(next->offset);
+        if (new_offset <= next_offset &&
+            next_offset - new_offset >= section_size) {
+            break;
         }
+        cur_end = next_offset + le32toh(next->section_length);
     }
 
-    new_size = new_offset + section_size;
-    rc = SWTPM_NVRAM_Linear_SafeResize(uri, new_size);
-    if (rc) {
-        return rc;
+    if (__builtin_add_overflow(new_offset, section_size, &new_end)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Linear_AllocFile: Integer overflow at offset "
+                  "%u with size %u\n", new_offset, section_size);
+        return TPM_SIZE;
+    }
+
+    if (new_end > state.length) {
+        rc = SWTPM_NVRAM_Linear_Grow(uri, new_end);
+        if (rc) {
+            return rc;
+        }
     }
 
-    file = &state.hdr->files[file_nr];
+    file = SWTPM_NVRAM_Linear_GetSlot(file_nr, slot);
     file->section_length = htole32(section_size);
     file->data_length = htole32(size);
     file->offset = htole32(new_offset);
 
-    TPM_DEBUG("SWTPM_NVRAM_Linear_AllocFile: allocated file %d @ %d "
+    TPM_DEBUG("SWTPM_NVRAM_Linear_AllocFile: allocated file %d slot %d @ %d "
               "(len=%d section=%d)\n",
-              file_nr, new_offset, size, section_size);
+              file_nr, slot, new_offset, size, section_size);
 
     return rc;
 }
 
 /*
-    Deallocate a file from state.data. It's entry in state.hdr will be zeroed,
-    and the file length adjusted accordingly (if 'resize' is TRUE).
-    If the file was not at the end, any following files will be moved forward,
-    as to not leave any holes. This simplifies the allocator strategy, since it
-    allows new files to always be placed at the end.
-
-    If resize is true, this may perform a resize, so pointers into state.data or
-    state.hdr must not be kept over this function call.
+    Deallocate a slot of a file from state.data. Its entry in state.hdr will be
+    zeroed, which leaves its space free for other files. Nothing is moved and
+    the address space is not shrunk, it will most likely be needed again.
 */
-static TPM_RESULT
-SWTPM_NVRAM_Linear_RemoveFile(const char *uri,
-                              uint32_t file_nr,
-                              TPM_BOOL resize)
+static void
+SWTPM_NVRAM_Linear_RemoveFile(uint32_t file_nr, uint32_t slot)
 {
-    TPM_RESULT rc = 0;
-    uint32_t next_offset = 0xffffffff;
-    uint32_t state_end = 0;
-    uint32_t new_len;
-    uint32_t i, cur_offset, cur_end;
     struct nvram_linear_hdr_file *file;
-    struct nvram_linear_hdr_file old_file = state.hdr->files[file_nr];
-
-    if (old_file.offset == 0) {
-        return 0;
-    }
-
-    TPM_DEBUG("SWTPM_NVRAM_Linear_RemoveFile: removing filenr %d (resize=%d)\n",
-              file_nr, resize);
 
-    state.hdr->files[file_nr].offset = 0;
-    state.hdr->files[file_nr].data_length = 0;
-    state.hdr->files[file_nr].section_length = 0;
+    TPM_DEBUG("SWTPM_NVRAM_Linear_RemoveFile: removing filenr %d slot %d\n",
+              file_nr, slot);
 
-    /* find offset of file right after the one we remove, and adjust offsets */
-    for (i = 0; i < SWTPM_NVSTORE_LINEAR_MAX_STATES; i++) {
-        file = &state.hdr->files[i];
-        if (!file->offset) {
-            continue;
-        }
+    file = SWTPM_NVRAM_Linear_GetSlot(file_nr, slot);
+    file->offset = 0;
+    file->data_length = 0;
+    file->section_length = 0;
+}
 
-        cur_offset = le32toh(file->offset);
-        if (cur_offset > le32toh(old_file.offset)) {
-            if (cur_offset < next_offset) {
-                next_offset = cur_offset;
-            }
-            cur_end = cur_offset + le32toh(file->section_length);
-            if (cur_end > state_end) {
-                state_end = cur_end;
-            }
-            file->offset = htole32(cur_offset -
-                                   le32toh(old_file.section_length));
-        }
-    }
+/*
+    Returns the length of the part of a store, starting at its beginning, that
+    holds the header and all allocated sections, so that a store backend only
+    needs to load that part of a big device. 'data' must hold at least
+    'length' bytes of the store. If the returned value is bigger than
+    'length', it must be called again once more data is loaded since the
+    header was not complete. 0 is returned for data without a valid header.
+*/
+uint32_t
+SWTPM_NVRAM_Linear_UsedLength(const unsigned char *data, uint32_t length)
+{
+    const struct nvram_linear_hdr *hdr = (const void *)data;
+    const struct nvram_linear_hdr_ab_file *ab_files = (const void *)hdr->files;
+    const struct nvram_linear_hdr_file *file;
+    uint32_t hdrsize, used, num_files, num_slots, i, j;
+    uint64_t end;
+
+    if (length < sizeof(*hdr) ||
+        le64toh(hdr->magic) != SWTPM_NVSTORE_LINEAR_MAGIC)
+        return 0;
 
-    if (next_offset != 0xffffffff) {
-        TPM_DEBUG("SWTPM_NVRAM_Linear_RemoveFile: compacting\n");
-        /* if we weren't the end, compact by moving following files forward */
-        memmove(state.data + le32toh(old_file.offset),
-                state.data + next_offset,
-                state_end - next_offset);
-    }
+    hdrsize = le16toh(hdr->hdrsize);
+    if (hdrsize > length || hdrsize < sizeof(*hdr))
+        return hdrsize;
 
-    if (resize) {
-        new_len = state.length - le32toh(old_file.section_length);
-        rc = SWTPM_NVRAM_Linear_SafeResize(uri, new_len);
-        if (rc == 0) {
-            state.length = new_len;
+    if (hdr->version >= SWTPM_NVSTORE_LINEAR_VERSION_AB) {
+        num_files = (hdrsize - sizeof(*hdr)) / sizeof(ab_files[0]);
+        num_slots = 2;
+    } else {
+        num_files = (hdrsize - sizeof(*hdr)) / sizeof(hdr->files[0]);
+        num_slots = 1;
+    }
+
+    used = hdrsize;
+    for (i = 0; i < num_files; i++) {
+        for (j = 0; j < num_slots; j++) {
+            file = num_slots == 2 ? &ab_files[i].slots[j] : &hdr->files[i];
+            if (!file->offset)
+                continue;
+            end = (uint64_t)le32toh(file->offset) +
+                  MAX(le32toh(file->section_length),
+                      le32toh(file->data_length));
+            if (end > used)
+                used = MIN(end, UINT32_MAX);
         }
     }
-
-    return rc;
+    return used;
 }
 
 static TPM_RESULT
 SWTPM_NVRAM_Prepare_Linear(const char *uri)
 {
     TPM_RESULT rc = 0;
+    uint32_t num_files;
+    uint32_t hdrsize;
+    size_t entry_size;
 
     TPM_DEBUG("SWTPM_NVRAM_Prepare_Linear: uri='%s'\n", uri);
 
@@ -237,9 +384,9 @@ SWTPM_NVRAM_Prepare_Linear(const char *uri)
         return TPM_FAIL;
     }
 
-    if (tpmstate_get_do_fsync()) {
+    if (tpmstate_get_batch_fsync()) {
         logprintf(STDERR_FILENO,
-                  "SWTPM_NVRAM_PrepareLinear: The fsync option is not supported with this storage backend\n");
+                  "SWTPM_NVRAM_PrepareLinear: The batch-fsync option is not supported with this storage backend\n");
         return TPM_FAIL;
     }
 
@@ -261,8 +408,31 @@ SWTPM_NVRAM_Prepare_Linear(const char *uri)
         return TPM_FAIL;
     }
 
-    /* TODO: Parse URI prefixes ("iscsi://", "rbd://", etc...) */
-    state.ops = &nvram_linear_file_ops;
+    if (tpmstate_get_page_flush()) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+
+        if (pagesize <= 0 || (pagesize & (pagesize - 1))) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_PrepareLinear: Could not get the page size: %s\n",
+                      strerror(errno));
+            return TPM_FAIL;
+        }
+        state.pagesize = pagesize;
+    }
+
+    if (strncmp(uri, "nbd://", 6) == 0 ||
+        strncmp(uri, "nbd+unix://", 11) == 0) {
+        if (tpmstate_get_direct_io()) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_PrepareLinear: The direct-io option is not supported with NBD exports\n");
+            return TPM_FAIL;
+        }
+        state.ops = &nvram_linear_nbd_ops;
+    } else if (tpmstate_get_direct_io()) {
+        state.ops = &nvram_linear_direct_ops;
+    } else {
+        state.ops = &nvram_linear_file_ops;
+    }
 
     if ((rc = state.ops->open(uri, &state.data, &state.length))) {
         return rc;
@@ -275,10 +445,23 @@ SWTPM_NVRAM_Prepare_Linear(const char *uri)
                   "Formatting '%s' as new linear NVRAM store\n",
                   uri);
 
+        num_files = tpmstate_get_max_states();
+        if (num_files == 0) {
+            num_files = SWTPM_NVSTORE_LINEAR_MAX_STATES_DEFAULT;
+        }
+        entry_size = sizeof(struct nvram_linear_hdr_ab_file);
+        hdrsize = sizeof(struct nvram_linear_hdr) + num_files * entry_size;
+        if (hdrsize > state.length) {
+            rc = SWTPM_NVRAM_Linear_SafeResize(uri, hdrsize);
+            if (rc) {
+                return rc;
+            }
+        }
+
         state.hdr->magic = htole64(SWTPM_NVSTORE_LINEAR_MAGIC);
         state.hdr->version = SWTPM_NVSTORE_LINEAR_VERSION;
-        state.hdr->hdrsize = htole16(sizeof(struct nvram_linear_hdr));
-        memset(&state.hdr->files, 0, sizeof(state.hdr->files));
+        state.hdr->hdrsize = htole16(hdrsize);
+        memset(state.hdr->files, 0, num_files * entry_size);
 
         SWTPM_NVRAM_Linear_FlushHeader(uri);
 
@@ -290,6 +473,41 @@ SWTPM_NVRAM_Prepare_Linear(const char *uri)
                       state.hdr->version);
             return TPM_FAIL;
         }
+
+        if (state.hdr->version >= SWTPM_NVSTORE_LINEAR_VERSION_AB) {
+            entry_size = sizeof(struct nvram_linear_hdr_ab_file);
+        } else {
+            entry_size = sizeof(struct nvram_linear_hdr_file);
+        }
+
+        hdrsize = le16toh(state.hdr->hdrsize);
+        if (hdrsize < sizeof(struct nvram_linear_hdr) ||
+            hdrsize > state.length ||
+            (hdrsize - sizeof(struct nvram_linear_hdr)) % entry_size) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_PrepareLinear: Invalid header size: %u\n",
+                      hdrsize);
+            return TPM_FAIL;
+        }
+        num_files = (hdrsize - sizeof(struct nvram_linear_hdr)) / entry_size;
+
+        if (state.hdr->version < SWTPM_NVSTORE_LINEAR_VERSION_FREE_SPACE) {
+            /* older versions would corrupt free space between files */
+            state.hdr->version = SWTPM_NVSTORE_LINEAR_VERSION_FREE_SPACE;
+            rc = SWTPM_NVRAM_Linear_FlushHeader(uri);
+            if (rc) {
+                return rc;
+            }
+        }
+    }
+    state.num_files = num_files;
+    state.num_slots = entry_size / sizeof(struct nvram_linear_hdr_file);
+
+    if (tpmstate_get_do_fsync() && state.num_slots == 1) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_PrepareLinear: The fsync option requires format version %d, the file has version %d\n",
+                  SWTPM_NVSTORE_LINEAR_VERSION_AB, state.hdr->version);
+        return TPM_FAIL;
     }
 
     state.initialized = TRUE;
@@ -329,7 +547,8 @@ SWTPM_NVRAM_LoadData_Linear(unsigned char **data,
         return TPM_FAIL;
     }
 
-    file = &state.hdr->files[file_nr];
+    file = SWTPM_NVRAM_Linear_GetSlot(file_nr,
+                                      SWTPM_NVRAM_Linear_ActiveSlot(file_nr));
     file_offset = le32toh(file->offset);
     file_data_len = le32toh(file->data_length);
 
@@ -363,20 +582,78 @@ SWTPM_NVRAM_LoadData_Linear(unsigned char **data,
     return 0;
 }
 
+/*
+    Copy data to the given offset in state.data page by page and flush only
+    the runs of pages whose contents changed. The TPM state is mostly the same
+    from one store to the next, so for small changes this writes much less
+    than the whole file.
+*/
 static TPM_RESULT
-SWTPM_NVRAM_StoreData_Linear(unsigned char *filedata,
-                             uint32_t filedata_length,
-                             uint32_t tpm_number SWTPM_ATTR_UNUSED,
-                             const char *name,
-                             const char *uri,
-                             TPM_BOOL do_fsync SWTPM_ATTR_UNUSED)
+SWTPM_NVRAM_Linear_StorePages(const char *uri,
+                              uint32_t offset,
+                              const struct iovec *iov,
+                              int iovcnt)
+{
+    TPM_RESULT rc = 0;
+    uint32_t pos = offset;
+    uint32_t dirty_start = 0;
+    TPM_BOOL dirty = FALSE;
+    const unsigned char *data;
+    uint32_t page_end;
+    size_t left, n;
+    int i;
+
+    /* a page may be compared in pieces where it spans two iovecs */
+    for (i = 0; rc == 0 && i < iovcnt; i++) {
+        data = iov[i].iov_base;
+        left = iov[i].iov_len;
+
+        while (rc == 0 && left > 0) {
+            page_end = (pos & ~(state.pagesize - 1)) + state.pagesize;
+            n = MIN(page_end - pos, left);
+
+            if (memcmp(state.data + pos, data, n)) {
+                memcpy(state.data + pos, data, n);
+                if (!dirty) {
+                    dirty_start = pos;
+                    dirty = TRUE;
+                }
+            } else if (dirty) {
+                if (state.ops->flush) {
+                    rc = state.ops->flush(uri, dirty_start, pos - dirty_start);
+                }
+                dirty = FALSE;
+            }
+            pos += n;
+            data += n;
+            left -= n;
+        }
+    }
+
+    if (rc == 0 && dirty && state.ops->flush) {
+        rc = state.ops->flush(uri, dirty_start, pos - dirty_start);
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreDataV_Linear(const struct iovec *iov,
+                              int iovcnt,
+                              uint32_t filedata_length,
+                              uint32_t tpm_number SWTPM_ATTR_UNUSED,
+                              const char *name,
+                              const char *uri,
+                              TPM_BOOL do_fsync SWTPM_ATTR_UNUSED)
 {
     TPM_RESULT rc = 0;
     TPM_BOOL needs_hdr_flush = FALSE;
-    TPM_BOOL needs_full_flush = FALSE;
     uint32_t file_nr;
+    uint32_t slot;
     uint32_t file_offset;
+    uint32_t pos;
     struct nvram_linear_hdr_file *file;
+    int i;
 
     TPM_DEBUG("SWTPM_NVRAM_StoreData_Linear: request for %dB to %s:%d\n",
               filedata_length, name, tpm_number);
@@ -386,30 +663,25 @@ SWTPM_NVRAM_StoreData_Linear(unsigned char *filedata,
         return TPM_FAIL;
     }
 
-    file = &state.hdr->files[file_nr];
+    /* with A/B slots the data goes into the inactive slot */
+    slot = SWTPM_NVRAM_Linear_ActiveSlot(file_nr);
+    if (state.num_slots > 1) {
+        slot ^= 1;
+    }
+    file = SWTPM_NVRAM_Linear_GetSlot(file_nr, slot);
 
-    if (!file->offset) {
-        /* alloc */
-        rc = SWTPM_NVRAM_Linear_AllocFile(uri, file_nr, filedata_length);
+    if (!file->offset ||
+        filedata_length > le32toh(file->section_length)) {
+        /* (re)alloc, resize will be done by AllocFile */
+        rc = SWTPM_NVRAM_Linear_AllocFile(uri, file_nr, slot, filedata_length);
         if (rc) {
             return rc;
         }
         needs_hdr_flush = TRUE;
-    } else if (filedata_length > le32toh(file->section_length)) {
-        /* realloc, resize will be done by AllocFile */
-        rc = SWTPM_NVRAM_Linear_RemoveFile(uri, file_nr, FALSE);
-        if (rc) {
-            return rc;
-        }
-        rc = SWTPM_NVRAM_Linear_AllocFile(uri, file_nr, filedata_length);
-        if (rc) {
-            return rc;
-        }
-        needs_full_flush = TRUE;
     }
 
     /* resize might have changed pointer */
-    file = &state.hdr->files[file_nr];
+    file = SWTPM_NVRAM_Linear_GetSlot(file_nr, slot);
     file_offset = le32toh(file->offset);
 
     if (filedata_length != le32toh(file->data_length)) {
@@ -417,50 +689,85 @@ SWTPM_NVRAM_StoreData_Linear(unsigned char *filedata,
         needs_hdr_flush = TRUE;
     }
 
-    memcpy(state.data + file_offset, filedata, filedata_length);
-
-    TPM_DEBUG("SWTPM_NVRAM_StoreData_Linear: stored %dB to %s:%d\n",
-              filedata_length, name, tpm_number);
-
-    if (needs_full_flush) {
+    if (state.pagesize) {
+        rc = SWTPM_NVRAM_Linear_StorePages(uri, file_offset, iov, iovcnt);
+    } else {
+        /* copy the data into place in one pass */
+        pos = file_offset;
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(state.data + pos, iov[i].iov_base, iov[i].iov_len);
+            pos += iov[i].iov_len;
+        }
         if (state.ops->flush) {
-            rc = state.ops->flush(uri, 0, state.length);
+            rc = state.ops->flush(uri, file_offset, filedata_length);
         }
-        return rc;
     }
 
-    if (needs_hdr_flush) {
+    TPM_DEBUG("SWTPM_NVRAM_StoreData_Linear: stored %dB to %s:%d\n",
+              filedata_length, name, tpm_number);
+
+    /* the header goes last so that it never points to data not flushed */
+    if (rc == 0 && needs_hdr_flush) {
         rc = SWTPM_NVRAM_Linear_FlushHeader(uri);
     }
-
-    if (rc == 0 && state.ops->flush) {
-        rc = state.ops->flush(uri, file_offset, filedata_length);
+    if (rc == 0 && state.num_slots > 1) {
+        rc = SWTPM_NVRAM_Linear_FlipSlot(uri, file_nr);
     }
 
     return rc;
 }
 
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_Linear(unsigned char *filedata,
+                             uint32_t filedata_length,
+                             uint32_t tpm_number,
+                             const char *name,
+                             const char *uri,
+                             TPM_BOOL do_fsync)
+{
+    struct iovec iov = {
+        .iov_base = filedata,
+        .iov_len = filedata_length,
+    };
+
+    return SWTPM_NVRAM_StoreDataV_Linear(&iov, 1, filedata_length,
+                                         tpm_number, name, uri, do_fsync);
+}
+
 static TPM_RESULT
 SWTPM_NVRAM_DeleteName_Linear(uint32_t tpm_number SWTPM_ATTR_UNUSED,
                               const char *name,
                               TPM_BOOL mustExist SWTPM_ATTR_UNUSED,
                               const char *uri)
 {
-    TPM_RESULT rc = 0;
+    TPM_RESULT rc;
     uint32_t file_nr;
+    uint32_t slot;
 
     file_nr = SWTPM_NVRAM_Linear_GetFileNr(name);
     if (file_nr == FILE_NR_INVALID) {
-        rc = TPM_FAIL;
+        return TPM_FAIL;
     }
 
-    if (rc == 0) {
-        rc = SWTPM_NVRAM_Linear_RemoveFile(uri, file_nr, TRUE);
+    slot = SWTPM_NVRAM_Linear_ActiveSlot(file_nr);
+    if (!SWTPM_NVRAM_Linear_GetSlot(file_nr, slot)->offset) {
+        return 0;
+    }
+
+    if (state.num_slots == 1) {
+        SWTPM_NVRAM_Linear_RemoveFile(file_nr, slot);
+        return SWTPM_NVRAM_Linear_FlushHeader(uri);
     }
 
-    if (rc == 0 && state.ops->flush) {
-        /* full flush, RemoveFile can move around data */
-        rc = state.ops->flush(uri, 0, state.length);
+    /* activate the emptied inactive slot, then free the old active one */
+    SWTPM_NVRAM_Linear_RemoveFile(file_nr, slot ^ 1);
+    rc = SWTPM_NVRAM_Linear_FlushHeader(uri);
+    if (rc == 0) {
+        rc = SWTPM_NVRAM_Linear_FlipSlot(uri, file_nr);
+    }
+    if (rc == 0) {
+        SWTPM_NVRAM_Linear_RemoveFile(file_nr, slot);
+        rc = SWTPM_NVRAM_Linear_FlushHeader(uri);
     }
 
     return rc;
@@ -490,7 +797,8 @@ SWTPM_NVRAM_CheckState_Linear(const char *uri SWTPM_ATTR_UNUSED,
     }
 
     if (rc == 0) {
-         file = &state.hdr->files[file_nr];
+         file = SWTPM_NVRAM_Linear_GetSlot(file_nr,
+                                    SWTPM_NVRAM_Linear_ActiveSlot(file_nr));
          if (file->offset == 0) {
              rc = TPM_RETRY;
          } else {
@@ -507,6 +815,7 @@ struct nvram_backend_ops nvram_linear_ops = {
     .unlock  = SWTPM_NVRAM_Unlock_Linear,
     .load    = SWTPM_NVRAM_LoadData_Linear,
     .store   = SWTPM_NVRAM_StoreData_Linear,
+    .storev  = SWTPM_NVRAM_StoreDataV_Linear,
     .delete  = SWTPM_NVRAM_DeleteName_Linear,
     .cleanup = SWTPM_NVRAM_Cleanup_Linear,
     .check_state = SWTPM_NVRAM_CheckState_Linear,
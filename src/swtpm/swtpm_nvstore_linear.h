@@ -4,18 +4,40 @@
 #include <libtpms/tpm_types.h>
 
 #define SWTPM_NVSTORE_LINEAR_MAGIC 0x737774706d6c696e /* 'swtpmlin' */
-#define SWTPM_NVSTORE_LINEAR_VERSION 1
-/* TODO: Make this user configurable? */
+/*
+ * Version 1 has SWTPM_NVSTORE_LINEAR_V1_STATES entries and no free space
+ * between the files. Since version 2, the number of entries follows from
+ * hdrsize and files may be followed by free space. Version 3 has two slots
+ * per file (struct nvram_linear_hdr_ab_file) so that a file is never
+ * overwritten in place.
+ */
+#define SWTPM_NVSTORE_LINEAR_VERSION 3
+#define SWTPM_NVSTORE_LINEAR_VERSION_FREE_SPACE 2
+#define SWTPM_NVSTORE_LINEAR_VERSION_AB 3
+#define SWTPM_NVSTORE_LINEAR_V1_STATES 15
 /*
  * Without distributed locking to coordinate concurrent access on
  * block devices: 1 TPM only
  */
-#define SWTPM_NVSTORE_LINEAR_MAX_STATES 15 /* 3 files per TPM = 5 TPMs */
+#define SWTPM_NVSTORE_LINEAR_MAX_STATES_DEFAULT 15 /* 3 files per TPM = 5 TPMs */
+#define SWTPM_NVSTORE_LINEAR_MAX_STATES_MIN 3
+#define SWTPM_NVSTORE_LINEAR_MAX_STATES_MAX 1024
 
 struct nvram_linear_hdr_file {
     uint32_t offset; /* offset from beginning of file - 0 means unallocated */
     uint32_t data_length; /* length of actually valid data */
-    uint32_t section_length; /* length until next file */
+    uint32_t section_length; /* length of the space allocated to the file */
+} __attribute__((packed));
+
+/*
+    A file in version 3: the slot selected by the lowest bit of 'generation'
+    holds the valid data. A store writes the other slot, flushes it and only
+    then increments the generation, so a crash in the middle of a store leaves
+    the previous data of the file intact.
+*/
+struct nvram_linear_hdr_ab_file {
+    struct nvram_linear_hdr_file slots[2];
+    uint32_t generation;
 } __attribute__((packed));
 
 /*
@@ -28,7 +50,11 @@ struct nvram_linear_hdr {
     uint8_t  _padding; /* at least align to 32 */
     uint16_t hdrsize;
 
-    struct nvram_linear_hdr_file files[SWTPM_NVSTORE_LINEAR_MAX_STATES];
+    /*
+        (hdrsize - sizeof(struct nvram_linear_hdr)) / sizeof(files[0]); since
+        version 3 the entries are struct nvram_linear_hdr_ab_file instead
+    */
+    struct nvram_linear_hdr_file files[];
 } __attribute__((packed));
 
 /*
@@ -45,7 +71,8 @@ struct nvram_linear_store_ops {
         contains the loaded data in it's entirety (e.g. when loaded from a file,
         the mmap base address and file length).
         If a new store is created, it must contain at least enough space to
-        store 'sizeof(struct nvram_linear_hdr)' bytes.
+        store 'sizeof(struct nvram_linear_hdr)' bytes; the space for the file
+        entries is requested with resize().
     */
     TPM_RESULT (*open)(const char* uri,
                        unsigned char **data,
@@ -73,12 +100,15 @@ struct nvram_linear_store_ops {
                         uint32_t count);
 
     /*
-       Called whenever space has been freed or more space is required to store
-       data. Implementations can choose to leave this unimplemented, or make the
-       implementation a no-op, TPM_SIZE should be returned if 'requested_length'
-       can not be made available. 'data' and 'new_length' must be set similar to
-       open(), either to the same region or a different one (in case of remap or
-       similar).
+       Called whenever more space is required to store data. The data in the
+       buffer has already been flushed. Implementations can choose to leave
+       this unimplemented, or make the implementation a no-op, TPM_SIZE should
+       be returned if 'requested_length' can not be made available. 'data' and
+       'new_length' must be set similar to open(), either to the same region or
+       a different one (in case of remap or similar). An implementation that
+       moved the data to a different region must return 0 and a 'new_length'
+       less than 'requested_length' instead of TPM_SIZE, since the caller
+       only takes over 'data' on success.
     */
     TPM_RESULT (*resize)(const char* uri,
                          unsigned char **data,
@@ -92,7 +122,12 @@ struct nvram_linear_store_ops {
     void (*cleanup)(void);
 };
 
+uint32_t SWTPM_NVRAM_Linear_UsedLength(const unsigned char *data,
+                                       uint32_t length);
+
 /* available store interfaces */
 extern struct nvram_linear_store_ops nvram_linear_file_ops;
+extern struct nvram_linear_store_ops nvram_linear_nbd_ops;
+extern struct nvram_linear_store_ops nvram_linear_direct_ops;
 
 #endif /* _SWTPM_NVSTORE_LINEAR_H */
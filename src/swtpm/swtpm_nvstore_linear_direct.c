@@ -0,0 +1,416 @@
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifndef __gnu_hurd__
+# include <sys/mount.h>
+#endif
+#include <fcntl.h>
+
+#include <libtpms/tpm_types.h>
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_error.h>
+
+#include "compiler_dependencies.h"
+#include "swtpm.h"
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "swtpm_nvstore_linear.h"
+#include "logging.h"
+#include "tpmstate.h"
+#include "utils.h"
+#include "cmdstats.h"
+#include "metrics.h"
+
+/*
+    Provides a linear backend that accesses a regular file or block device
+    with O_DIRECT instead of through a memory mapping. The part of the file
+    that holds the header and the allocated sections is read into an aligned
+    buffer when opened, and every flush writes the changed blocks from the
+    buffer with pwrite, so it is known when the data reached the device rather
+    than leaving this to the writeback of the page cache. With the fsync
+    option the file is opened with O_DSYNC, which has the kernel complete the
+    writes with FUA, or a cache flush where the device does not support FUA.
+*/
+
+static struct {
+    int fd;
+    unsigned char *ptr;
+    uint32_t size;          /* the part of the file that was read */
+    uint32_t align;         /* the alignment required for O_DIRECT */
+    uint64_t file_size;
+    TPM_BOOL can_truncate;
+} direct_state = {
+    .fd = -1,
+};
+
+static uint32_t
+SWTPM_NVRAM_LinearDirect_AlignUp(uint64_t value)
+{
+    value = (value + direct_state.align - 1) & ~(uint64_t)(direct_state.align - 1);
+
+    return MIN(value, UINT32_MAX & ~(direct_state.align - 1));
+}
+
+/*
+    Read the file up to 'length', rounded up to the alignment, into the
+    buffer. Whatever is beyond the end of a regular file reads as zeros.
+*/
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_ReadUpTo(uint32_t length)
+{
+    unsigned char *ptr;
+    uint32_t offset = direct_state.size;
+    ssize_t n;
+
+    length = SWTPM_NVRAM_LinearDirect_AlignUp(length);
+    if (length <= direct_state.size)
+        return 0;
+
+    /* realloc() would not keep the alignment */
+    if (posix_memalign((void **)&ptr, direct_state.align, length)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_ReadUpTo: Out of memory\n");
+        return TPM_FAIL;
+    }
+    if (direct_state.ptr)
+        memcpy(ptr, direct_state.ptr, direct_state.size);
+    memset(&ptr[offset], 0, length - offset);
+    free(direct_state.ptr);
+    direct_state.ptr = ptr;
+    direct_state.size = length;
+
+    while (offset < length) {
+        n = pread(direct_state.fd, &ptr[offset], length - offset, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearDirect_ReadUpTo: Could not read file: %s\n",
+                      strerror(errno));
+            return TPM_FAIL;
+        }
+        if (n == 0)
+            break;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_GetSize(void)
+{
+    struct stat st;
+
+    if (fstat(direct_state.fd, &st)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_GetSize: Could not stat file: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        direct_state.file_size = st.st_size;
+        direct_state.can_truncate = true;
+        direct_state.align = MAX(st.st_blksize, 512);
+    } else if (S_ISBLK(st.st_mode)) {
+#if defined(BLKGETSIZE64) && defined(BLKSSZGET)
+        int sector_size;
+
+        if (ioctl(direct_state.fd, BLKGETSIZE64, &direct_state.file_size) ||
+            ioctl(direct_state.fd, BLKSSZGET, &sector_size)) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearDirect_GetSize: Could not get block "
+                      "device size: %s\n",
+                      strerror(errno));
+            return TPM_FAIL;
+        }
+        direct_state.can_truncate = false;
+        direct_state.align = MAX(sector_size, 512);
+
+        if (direct_state.file_size < sizeof(struct nvram_linear_hdr)) {
+            logprintf(STDERR_FILENO, "SWTPM_NVRAM_LinearDirect_GetSize: block "
+                                     "device too small, cannot resize\n");
+            return TPM_FAIL;
+        }
+#else
+        logprintf(STDERR_FILENO, "SWTPM_NVRAM_LinearDirect_GetSize: block "
+                                 "devices are not supported\n");
+        return TPM_FAIL;
+#endif
+    } else {
+        logprintf(STDERR_FILENO, "SWTPM_NVRAM_LinearDirect_GetSize: invalid stat\n");
+        return TPM_FAIL;
+    }
+
+    if (direct_state.align & (direct_state.align - 1)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_GetSize: Unsupported block size %u\n",
+                  direct_state.align);
+        return TPM_FAIL;
+    }
+
+    return 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_DoOpenURI(const char *uri)
+{
+    const char *path = uri;
+    bool mode_is_default = false;
+    int flags = O_RDWR | O_CREAT;
+
+    if (direct_state.fd >= 0)
+        return TPM_SUCCESS;
+
+    if (strncmp(uri, "file://", 7) == 0)
+        path += 7;
+
+#if defined(O_DIRECT)
+    flags |= O_DIRECT;
+    if (tpmstate_get_do_fsync())
+        flags |= O_DSYNC;
+#else
+    logprintf(STDERR_FILENO,
+              "SWTPM_NVRAM_LinearDirect_Open: O_DIRECT is not supported on this platform\n");
+    return TPM_FAIL;
+#endif
+
+    direct_state.fd = open(path, flags, tpmstate_get_mode(&mode_is_default));
+    if (direct_state.fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Open: Could not open file with O_DIRECT: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    /* Set non-default (user-provided) mode bits not masked by umask */
+    if (!mode_is_default &&
+        fchmod(direct_state.fd, tpmstate_get_mode(&mode_is_default)) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Open: Could not change mode bits: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+static void SWTPM_NVRAM_LinearDirect_Cleanup(void)
+{
+    free(direct_state.ptr);
+    direct_state.ptr = NULL;
+    direct_state.size = 0;
+
+    if (direct_state.fd >= 0) {
+        close(direct_state.fd);
+        direct_state.fd = -1;
+    }
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_Open(const char* uri,
+                              unsigned char **data,
+                              uint32_t *length)
+{
+    TPM_RESULT rc = 0;
+    uint32_t available, used;
+
+    if (direct_state.ptr) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Open: Already open\n");
+        return TPM_FAIL;
+    }
+
+    rc = SWTPM_NVRAM_LinearDirect_DoOpenURI(uri);
+    if (rc == 0)
+        rc = SWTPM_NVRAM_LinearDirect_GetSize();
+    if (rc)
+        goto fail;
+
+    /* a regular file can be grown, a block device can only be used as is */
+    if (direct_state.can_truncate)
+        available = UINT32_MAX;
+    else
+        available = MIN(direct_state.file_size, UINT32_MAX) &
+                    ~(direct_state.align - 1);
+
+    /* read the header and then the part that the files are in */
+    rc = SWTPM_NVRAM_LinearDirect_ReadUpTo(MAX(sizeof(struct nvram_linear_hdr),
+                                               direct_state.align));
+    while (rc == 0) {
+        used = MIN(available,
+                   SWTPM_NVRAM_Linear_UsedLength(direct_state.ptr,
+                                                 direct_state.size));
+        if (used <= direct_state.size)
+            break;
+        rc = SWTPM_NVRAM_LinearDirect_ReadUpTo(used);
+    }
+    if (rc)
+        goto fail;
+
+    TPM_DEBUG("SWTPM_NVRAM_LinearDirect_Open: Read %u bytes of '%s'\n",
+              direct_state.size, uri);
+    *data = direct_state.ptr;
+    *length = direct_state.size;
+
+    return 0;
+
+fail:
+    SWTPM_NVRAM_LinearDirect_Cleanup();
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_Flush(const char* uri SWTPM_ATTR_UNUSED,
+                               uint32_t offset,
+                               uint32_t count)
+{
+    TPM_RESULT rc = 0;
+    uint32_t start_off, end_off;
+    struct timespec start;
+    ssize_t n;
+
+    if (!direct_state.ptr) {
+        logprintf(STDERR_FILENO, "%s: Nothing loaded\n", __func__);
+        return TPM_FAIL;
+    }
+
+    /* O_DIRECT writes whole blocks from an aligned buffer */
+    start_off = offset & ~(direct_state.align - 1);
+    end_off = MIN(SWTPM_NVRAM_LinearDirect_AlignUp((uint64_t)offset + count),
+                  direct_state.size);
+
+    TPM_DEBUG("SWTPM_NVRAM_LinearDirect_Flush: pwrite %u@0x%x\n",
+              end_off - start_off, start_off);
+
+    metrics_nvram_flush(end_off - start_off);
+
+    cmdstats_start(&start);
+    while (start_off < end_off) {
+        n = pwrite(direct_state.fd, &direct_state.ptr[start_off],
+                   end_off - start_off, start_off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearDirect_Flush: Error in pwrite: %s\n",
+                      n < 0 ? strerror(errno) : "No space left");
+            rc = TPM_FAIL;
+            break;
+        }
+        start_off += n;
+    }
+    if (rc == 0)
+        metrics_sync_record(&start);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_Resize(const char* uri SWTPM_ATTR_UNUSED,
+                                unsigned char **data,
+                                uint32_t *new_length,
+                                uint32_t requested_length)
+{
+    TPM_RESULT rc = 0;
+    uint64_t available;
+
+    if (!direct_state.ptr) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Resize: Nothing loaded\n");
+        return TPM_FAIL;
+    }
+
+    if (requested_length <= direct_state.size) {
+        *data = direct_state.ptr;
+        *new_length = direct_state.size;
+        return 0;
+    }
+
+    if (direct_state.can_truncate) {
+        TPM_DEBUG("SWTPM_NVRAM_LinearDirect_Resize: resizing file to %d\n",
+                  requested_length);
+
+        available = SWTPM_NVRAM_LinearDirect_AlignUp(requested_length);
+        if (direct_state.file_size < available) {
+#if defined(HAVE_POSIX_FALLOCATE)
+            /* allocate the blocks so that writing them cannot fail later */
+            if (posix_fallocate(direct_state.fd, 0, available) == 0) {
+                TPM_DEBUG("SWTPM_NVRAM_LinearDirect_Resize: allocated %lu bytes\n",
+                          (unsigned long)available);
+            } else
+#endif
+            if (ftruncate(direct_state.fd, available)) {
+                logprintf(STDERR_FILENO,
+                          "SWTPM_NVRAM_LinearDirect_Resize: Error in ftruncate: %s\n",
+                          strerror(errno));
+                return TPM_FAIL;
+            }
+            direct_state.file_size = available;
+        }
+    } else {
+        TPM_DEBUG("SWTPM_NVRAM_LinearDirect_Resize: reading more of the block device\n");
+
+        available = direct_state.file_size & ~(uint64_t)(direct_state.align - 1);
+    }
+
+    rc = SWTPM_NVRAM_LinearDirect_ReadUpTo(MIN(requested_length, available));
+    if (rc == 0) {
+        /* the caller finds out if it got less than requested */
+        *data = direct_state.ptr;
+        *new_length = direct_state.size;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearDirect_Lock(const char *uri, unsigned int retries)
+{
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_LinearDirect_DoOpenURI(uri);
+    if (rc)
+        return rc;
+
+    if (SWTPM_NVRAM_LockFile(direct_state.fd, 0, 0, retries) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Lock: Could not lock backend-uri %s: %s\n",
+                  uri, strerror(errno));
+        rc = TPM_FAIL;
+        SWTPM_NVRAM_LinearDirect_Cleanup();
+    }
+
+    return rc;
+}
+
+static void
+SWTPM_NVRAM_LinearDirect_Unlock(void)
+{
+    if (direct_state.fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Unlock: File not open\n");
+        return;
+    }
+
+    if (SWTPM_NVRAM_UnlockFile(direct_state.fd, 0, 0) < 0)
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearDirect_Unlock: Unlock failed: %s\n",
+                  strerror(errno));
+}
+
+struct nvram_linear_store_ops nvram_linear_direct_ops = {
+    .open = SWTPM_NVRAM_LinearDirect_Open,
+    .lock = SWTPM_NVRAM_LinearDirect_Lock,
+    .unlock = SWTPM_NVRAM_LinearDirect_Unlock,
+    .flush = SWTPM_NVRAM_LinearDirect_Flush,
+    .resize = SWTPM_NVRAM_LinearDirect_Resize,
+    .cleanup = SWTPM_NVRAM_LinearDirect_Cleanup,
+};
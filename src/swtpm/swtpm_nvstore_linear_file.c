@@ -20,9 +20,12 @@
 #include "compiler_dependencies.h"
 #include "swtpm.h"
 #include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
 #include "swtpm_nvstore_linear.h"
 #include "logging.h"
 #include "tpmstate.h"
+#include "cmdstats.h"
+#include "metrics.h"
 
 /*
     Provides a linear backend based on memory-mapping a filesystem path.
@@ -219,6 +222,7 @@ SWTPM_NVRAM_LinearFile_Flush(const char* uri SWTPM_ATTR_UNUSED,
     TPM_RESULT rc = 0;
     uint8_t *msync_offset;
     uint32_t msync_count;
+    struct timespec start;
 
     if (!mmap_state.mapped) {
         logprintf(STDERR_FILENO, "%s: Nothing mapped\n", __func__);
@@ -237,28 +241,35 @@ SWTPM_NVRAM_LinearFile_Flush(const char* uri SWTPM_ATTR_UNUSED,
         return TPM_FAIL;
     }
     msync_offset = mmap_state.ptr + (offset & ~(pagesize - 1));
-#if defined(__CYGWIN__)
-    /* Cygwin uses Win API FlushViewOfFile, which we call with len = 0 */
-    msync_count = 0;
-#else
-    /* msync_count = count + (pagesize - 1) & ~(pagesize - 1); */
-    if (__builtin_add_overflow(count, pagesize - 1, &msync_count)) {
+    /*
+     * msync_count = (offset % pagesize) + count + (pagesize - 1)
+     *               & ~(pagesize - 1);
+     */
+    if (__builtin_add_overflow(count, (offset & (pagesize - 1)) + pagesize - 1,
+                               &msync_count)) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_LinearFile_Flush: Integer overflow with count %u and pagesize %u\n",
                   count, pagesize);
         return TPM_FAIL;
     }
     msync_count &= ~(pagesize - 1);
+    metrics_nvram_flush(msync_count);
+#if defined(__CYGWIN__)
+    /* Cygwin uses Win API FlushViewOfFile, which we call with len = 0 */
+    msync_count = 0;
 #endif
 
     TPM_DEBUG("SWTPM_NVRAM_LinearFile_Flush: msync %d@0x%x\n",
               msync_count, msync_offset);
 
+    cmdstats_start(&start);
     if (rc == 0 && msync(msync_offset, msync_count, MS_SYNC)) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_LinearFile_Flush: Error in msync: %s\n",
                   strerror(errno));
         rc = TPM_FAIL;
+    } else {
+        metrics_sync_record(&start);
     }
 
     return rc;
@@ -298,13 +309,28 @@ SWTPM_NVRAM_LinearFile_Resize(const char* uri SWTPM_ATTR_UNUSED,
         TPM_DEBUG("SWTPM_NVRAM_LinearFile_Resize: resizing file to %d\n",
                   requested_length);
 
-        rc = SWTPM_NVRAM_LinearFile_Flush(NULL, 0, mmap_state.size);
-        if (rc == 0 && munmap(mmap_state.ptr, mmap_state.size)) {
+        /*
+         * The caller has flushed all changes and unmapping keeps them in the
+         * page cache, so there is no need to flush the whole file here.
+         */
+        if (munmap(mmap_state.ptr, mmap_state.size)) {
             logprintf(STDERR_FILENO,
                       "SWTPM_NVRAM_LinearFile_Resize: Error in munmap: %s\n",
                       strerror(errno));
             rc = TPM_FAIL;
         }
+#if defined(HAVE_POSIX_FALLOCATE)
+        /*
+         * Allocate the blocks when growing so that storing to the mapping
+         * cannot fail with SIGBUS on a full filesystem; fall back to
+         * ftruncate where this is not supported.
+         */
+        if (rc == 0 && mmap_state.size < requested_length &&
+            posix_fallocate(mmap_state.fd, 0, requested_length) == 0) {
+            TPM_DEBUG("SWTPM_NVRAM_LinearFile_Resize: allocated %d bytes\n",
+                      requested_length);
+        } else
+#endif
         /* only complain when ftruncate fails if growing was requested */
         if (rc == 0 &&
             ftruncate(mmap_state.fd, requested_length) &&
@@ -337,34 +363,17 @@ SWTPM_NVRAM_LinearFile_Resize(const char* uri SWTPM_ATTR_UNUSED,
 static TPM_RESULT
 SWTPM_NVRAM_LinearFile_Lock(const char *uri, unsigned int retries)
 {
-    struct flock flock = {
-        .l_type = F_WRLCK,
-        .l_whence = SEEK_SET,
-        .l_start = 0,
-        .l_len = 0,
-    };
     TPM_RESULT rc;
 
     rc = SWTPM_NVRAM_LinearFile_DoOpenURI(uri);
     if (rc)
         return rc;
 
-    while (1) {
-        if (fcntl(mmap_state.fd, F_SETLK, &flock) == 0)
-            break;
-
-        if (retries == 0) {
-            rc = TPM_FAIL;
-            break;
-        }
-        retries--;
-        usleep(10000);
-    }
-
-    if (rc) {
+    if (SWTPM_NVRAM_LockFile(mmap_state.fd, 0, 0, retries) < 0) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_LinearFile_Lock: Could not lock backend-uri %s: %s\n",
                   uri, strerror(errno));
+        rc = TPM_FAIL;
         SWTPM_NVRAM_LinearFile_Cleanup();
     }
 
@@ -375,20 +384,13 @@ SWTPM_NVRAM_LinearFile_Lock(const char *uri, unsigned int retries)
 static void
 SWTPM_NVRAM_LinearFile_Unlock(void)
 {
-    struct flock flock = {
-        .l_type = F_UNLCK,
-        .l_whence = SEEK_SET,
-        .l_start = 0,
-        .l_len = 0,
-    };
-
     if (mmap_state.fd < 0) {
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_LinearFile_Unlock: File not open\n");
         return;
     }
 
-    if (fcntl(mmap_state.fd, F_SETLK, &flock) < 0)
+    if (SWTPM_NVRAM_UnlockFile(mmap_state.fd, 0, 0) < 0)
         logprintf(STDERR_FILENO,
                   "SWTPM_NVRAM_LinearFile_Unlock: Unlock failed: %s\n",
                   strerror(errno));
@@ -0,0 +1,661 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * swtpm_nvstore_linear_nbd.c -- linear store on an NBD export
+ *
+ * Provides a linear backend on an export of a Network Block Device server
+ * such as nbdkit or qemu-nbd. The URIs follow the NBD URI specification:
+ *
+ *   nbd://<host>[:<port>][/<export>]
+ *   nbd+unix://[/<export>]?socket=<path>
+ *
+ * Only the part of the export that is used by the linear store is read into
+ * memory when it is opened; it grows with resize(). Flushes write only the
+ * ranges that were passed to flush() with pipelined NBD_CMD_WRITE requests
+ * followed by an NBD_CMD_FLUSH if the server supports it.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <libtpms/tpm_types.h>
+#include <libtpms/tpm_error.h>
+
+#include "compiler_dependencies.h"
+#include "sys_dependencies.h"
+#include "swtpm.h"
+#include "swtpm_debug.h"
+#include "swtpm_nvstore_linear.h"
+#include "logging.h"
+#include "utils.h"
+#include "cmdstats.h"
+#include "metrics.h"
+
+#define NBD_DEFAULT_PORT         "10809"
+
+#define NBD_MAGIC                0x4e42444d41474943ULL /* 'NBDMAGIC' */
+#define NBD_OPTS_MAGIC           0x49484156454f5054ULL /* 'IHAVEOPT' */
+#define NBD_REP_MAGIC            0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC        0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC   0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE  (1 << 0)
+#define NBD_FLAG_NO_ZEROES       (1 << 1)
+#define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
+#define NBD_FLAG_C_NO_ZEROES     NBD_FLAG_NO_ZEROES
+
+#define NBD_FLAG_READ_ONLY       (1 << 1)
+#define NBD_FLAG_SEND_FLUSH      (1 << 2)
+
+#define NBD_OPT_GO               7
+#define NBD_REP_ACK              1
+#define NBD_REP_INFO             3
+#define NBD_REP_FLAG_ERROR       (1U << 31)
+#define NBD_INFO_EXPORT          0
+
+#define NBD_CMD_READ             0
+#define NBD_CMD_WRITE            1
+#define NBD_CMD_DISC             2
+#define NBD_CMD_FLUSH            3
+
+/* the maximum payload of an option reply that is accepted */
+#define NBD_MAX_OPT_REPLY        4096
+/* size of a single read or write request and how many may be in flight */
+#define NBD_CHUNK_SIZE           (256 * 1024)
+#define NBD_MAX_IN_FLIGHT        16
+/* how much of a new export is read to look for the header */
+#define NBD_INITIAL_LENGTH       4096
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t cookie;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_simple_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t cookie;
+} __attribute__((packed));
+
+struct nbd_opt_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t length;
+} __attribute__((packed));
+
+static struct {
+    int fd;
+    uint64_t export_size;
+    uint16_t flags;        /* transmission flags of the export */
+    unsigned char *ptr;    /* the part of the export that was read */
+    uint32_t size;
+} nbd_state = {
+    .fd = -1,
+};
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Recv(void *buffer, size_t buflen)
+{
+    unsigned char *p = buffer;
+    ssize_t n;
+
+    while (buflen > 0) {
+        n = read_eintr(nbd_state.fd, p, buflen);
+        if (n <= 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Recv: Could not read from server: %s\n",
+                      n < 0 ? strerror(errno) : "Connection closed");
+            return TPM_FAIL;
+        }
+        p += n;
+        buflen -= n;
+    }
+    return 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Send(const void *buffer, size_t buflen)
+{
+    if (write_full(nbd_state.fd, buffer, buflen) != (ssize_t)buflen) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Send: Could not write to server: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+/*
+ * Connect to the server given by the URI and return the export name in
+ * 'export', which the caller must free.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Connect(const char *uri, char **export)
+{
+    const char *authority, *path, *socket_path, *colon;
+    char *host = NULL;
+    const char *port = NBD_DEFAULT_PORT;
+    char portbuf[8];
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *ais = NULL, *ai;
+    struct sockaddr_un su = {
+        .sun_family = AF_UNIX,
+    };
+    TPM_RESULT rc = TPM_FAIL;
+    int one = 1, n;
+
+    if (strncmp(uri, "nbd+unix://", 11) == 0) {
+        authority = uri + 11;
+        path = strchr(authority, '/');
+        socket_path = strstr(authority, "?socket=");
+        if (!socket_path) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Connect: Missing socket in URI %s\n",
+                      uri);
+            return TPM_FAIL;
+        }
+        socket_path += strlen("?socket=");
+        if (path && path < socket_path)
+            *export = strndup(path + 1,
+                              socket_path - strlen("?socket=") - path - 1);
+        else
+            *export = strdup("");
+
+        if (strlen(socket_path) >= sizeof(su.sun_path)) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Connect: Socket path is too long\n");
+            goto exit;
+        }
+        strcpy(su.sun_path, socket_path);
+
+        nbd_state.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (nbd_state.fd < 0 ||
+            connect(nbd_state.fd, (struct sockaddr *)&su, sizeof(su)) < 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Connect: Could not connect to %s: %s\n",
+                      socket_path, strerror(errno));
+            goto exit;
+        }
+    } else {
+        authority = uri + strlen("nbd://");
+        path = strchr(authority, '/');
+        *export = strdup(path ? path + 1 : "");
+        if (!path)
+            path = authority + strlen(authority);
+
+        if (authority[0] == '[') {
+            /* [IPv6 address] */
+            colon = strchr(authority, ']');
+            if (!colon || colon > path) {
+                logprintf(STDERR_FILENO,
+                          "SWTPM_NVRAM_LinearNBD_Connect: Malformed URI %s\n",
+                          uri);
+                goto exit;
+            }
+            host = strndup(authority + 1, colon - authority - 1);
+            colon = colon[1] == ':' ? colon + 1 : NULL;
+        } else {
+            colon = memchr(authority, ':', path - authority);
+            host = strndup(authority, (colon ? colon : path) - authority);
+        }
+        if (colon) {
+            n = snprintf(portbuf, sizeof(portbuf), "%.*s",
+                         (int)(path - colon - 1), colon + 1);
+            if (n <= 0 || (size_t)n >= sizeof(portbuf)) {
+                logprintf(STDERR_FILENO,
+                          "SWTPM_NVRAM_LinearNBD_Connect: Malformed port in URI %s\n",
+                          uri);
+                goto exit;
+            }
+            port = portbuf;
+        }
+        if (!host)
+            goto oom;
+
+        n = getaddrinfo(host, port, &hints, &ais);
+        if (n) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Connect: Could not resolve %s: %s\n",
+                      host, gai_strerror(n));
+            goto exit;
+        }
+        for (ai = ais; ai; ai = ai->ai_next) {
+            nbd_state.fd = socket(ai->ai_family,
+                                  ai->ai_socktype | SOCK_CLOEXEC,
+                                  ai->ai_protocol);
+            if (nbd_state.fd < 0)
+                continue;
+            if (connect(nbd_state.fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(nbd_state.fd);
+            nbd_state.fd = -1;
+        }
+        if (nbd_state.fd < 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Connect: Could not connect to %s port %s: %s\n",
+                      host, port, strerror(errno));
+            goto exit;
+        }
+        /* requests are pipelined; do not hold back small ones */
+        setsockopt(nbd_state.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (!*export)
+        goto oom;
+
+    rc = 0;
+
+exit:
+    if (ais)
+        freeaddrinfo(ais);
+    free(host);
+
+    return rc;
+
+oom:
+    logprintf(STDERR_FILENO,
+              "SWTPM_NVRAM_LinearNBD_Connect: Out of memory\n");
+    goto exit;
+}
+
+/*
+ * Do the fixed newstyle handshake and select the export with NBD_OPT_GO.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Handshake(const char *export)
+{
+    struct {
+        uint64_t magic;
+        uint64_t opts_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting;
+    struct {
+        uint32_t client_flags;
+        uint64_t magic;
+        uint32_t option;
+        uint32_t length;
+        uint32_t name_length;
+    } __attribute__((packed)) go;
+    struct nbd_opt_reply reply;
+    unsigned char payload[NBD_MAX_OPT_REPLY];
+    uint32_t export_len = strlen(export);
+    uint16_t num_info = 0;
+    uint32_t length;
+    bool have_export = false;
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_LinearNBD_Recv(&greeting, sizeof(greeting));
+    if (rc == 0 &&
+        (be64toh(greeting.magic) != NBD_MAGIC ||
+         be64toh(greeting.opts_magic) != NBD_OPTS_MAGIC ||
+         !(be16toh(greeting.flags) & NBD_FLAG_FIXED_NEWSTYLE))) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Handshake: Server does not support the fixed newstyle negotiation\n");
+        rc = TPM_FAIL;
+    }
+    if (rc)
+        return rc;
+
+    go.client_flags = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE |
+                              (be16toh(greeting.flags) & NBD_FLAG_NO_ZEROES));
+    go.magic = htobe64(NBD_OPTS_MAGIC);
+    go.option = htobe32(NBD_OPT_GO);
+    go.length = htobe32(sizeof(uint32_t) + export_len + sizeof(num_info));
+    go.name_length = htobe32(export_len);
+
+    rc = SWTPM_NVRAM_LinearNBD_Send(&go, sizeof(go));
+    if (rc == 0)
+        rc = SWTPM_NVRAM_LinearNBD_Send(export, export_len);
+    if (rc == 0)
+        rc = SWTPM_NVRAM_LinearNBD_Send(&num_info, sizeof(num_info));
+
+    while (rc == 0) {
+        rc = SWTPM_NVRAM_LinearNBD_Recv(&reply, sizeof(reply));
+        if (rc)
+            break;
+        length = be32toh(reply.length);
+        if (be64toh(reply.magic) != NBD_REP_MAGIC ||
+            length > sizeof(payload) - 1) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Handshake: Malformed option reply\n");
+            rc = TPM_FAIL;
+            break;
+        }
+        rc = SWTPM_NVRAM_LinearNBD_Recv(payload, length);
+        if (rc)
+            break;
+
+        if (be32toh(reply.type) & NBD_REP_FLAG_ERROR) {
+            payload[length] = 0;
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Handshake: Server rejected export '%s': error 0x%x %s\n",
+                      export, be32toh(reply.type), payload);
+            rc = TPM_FAIL;
+        } else if (be32toh(reply.type) == NBD_REP_INFO &&
+                   length >= 12 &&
+                   be16toh(*(uint16_t *)payload) == NBD_INFO_EXPORT) {
+            memcpy(&nbd_state.export_size, &payload[2], sizeof(uint64_t));
+            nbd_state.export_size = be64toh(nbd_state.export_size);
+            memcpy(&nbd_state.flags, &payload[10], sizeof(uint16_t));
+            nbd_state.flags = be16toh(nbd_state.flags);
+            have_export = true;
+        } else if (be32toh(reply.type) == NBD_REP_ACK) {
+            break;
+        }
+    }
+
+    if (rc == 0 && !have_export) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Handshake: Server did not send the size of the export\n");
+        rc = TPM_FAIL;
+    }
+    if (rc == 0 && (nbd_state.flags & NBD_FLAG_READ_ONLY)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Handshake: Export '%s' is read-only\n",
+                  export);
+        rc = TPM_FAIL;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_SendRequest(uint16_t type, uint64_t offset,
+                                  uint32_t length)
+{
+    struct nbd_request req = {
+        .magic = htobe32(NBD_REQUEST_MAGIC),
+        .type = htobe16(type),
+        .cookie = htobe64(offset),
+        .offset = htobe64(offset),
+        .length = htobe32(length),
+    };
+    struct iovec iov[2] = {
+        {
+            .iov_base = &req,
+            .iov_len = sizeof(req),
+        }, {
+            .iov_base = nbd_state.ptr + offset,
+            .iov_len = type == NBD_CMD_WRITE ? length : 0,
+        }
+    };
+    ssize_t total = iov[0].iov_len + iov[1].iov_len;
+
+    if (writev_full(nbd_state.fd, iov, 2) != total) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_SendRequest: Could not send request: %s\n",
+                  strerror(errno));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+/*
+ * Receive a simple reply and return the cookie of the request, which is its
+ * offset.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_RecvReply(uint64_t *cookie)
+{
+    struct nbd_simple_reply reply;
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_LinearNBD_Recv(&reply, sizeof(reply));
+    if (rc)
+        return rc;
+
+    if (be32toh(reply.magic) != NBD_SIMPLE_REPLY_MAGIC) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_RecvReply: Malformed reply\n");
+        return TPM_FAIL;
+    }
+    *cookie = be64toh(reply.cookie);
+    if (reply.error) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_RecvReply: Request at offset %" PRIu64 " failed: %s\n",
+                  *cookie, strerror(be32toh(reply.error)));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+/*
+ * Read or write the range [offset, offset + count) of the buffer from or to
+ * the export with up to NBD_MAX_IN_FLIGHT requests in flight. Every request
+ * covers the chunk starting at the offset in its cookie.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Transfer(uint16_t type, uint32_t offset, uint32_t count)
+{
+    uint64_t next = offset, end = (uint64_t)offset + count;
+    unsigned int in_flight = 0;
+    uint64_t cookie;
+    uint32_t length;
+    TPM_RESULT rc = 0;
+
+    while (rc == 0 && (next < end || in_flight > 0)) {
+        while (rc == 0 && next < end && in_flight < NBD_MAX_IN_FLIGHT) {
+            length = end - next > NBD_CHUNK_SIZE ? NBD_CHUNK_SIZE : end - next;
+            rc = SWTPM_NVRAM_LinearNBD_SendRequest(type, next, length);
+            next += length;
+            in_flight++;
+        }
+        if (rc)
+            break;
+
+        rc = SWTPM_NVRAM_LinearNBD_RecvReply(&cookie);
+        if (rc)
+            break;
+        in_flight--;
+
+        if (cookie < offset || cookie >= next ||
+            (cookie - offset) % NBD_CHUNK_SIZE) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LinearNBD_Transfer: Reply to unknown request\n");
+            rc = TPM_FAIL;
+        } else if (type == NBD_CMD_READ) {
+            length = end - cookie > NBD_CHUNK_SIZE ? NBD_CHUNK_SIZE
+                                                   : end - cookie;
+            rc = SWTPM_NVRAM_LinearNBD_Recv(nbd_state.ptr + cookie, length);
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Make the part of the export up to 'length' available in the buffer, reading
+ * what was not read yet.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_ReadUpTo(uint32_t length)
+{
+    unsigned char *ptr;
+    uint32_t old_size = nbd_state.size;
+
+    if (length <= nbd_state.size)
+        return 0;
+
+    ptr = realloc(nbd_state.ptr, length);
+    if (!ptr) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_ReadUpTo: Out of memory\n");
+        return TPM_FAIL;
+    }
+    nbd_state.ptr = ptr;
+    nbd_state.size = length;
+
+    return SWTPM_NVRAM_LinearNBD_Transfer(NBD_CMD_READ, old_size,
+                                          length - old_size);
+}
+
+static void
+SWTPM_NVRAM_LinearNBD_Cleanup(void)
+{
+    struct nbd_request req = {
+        .magic = htobe32(NBD_REQUEST_MAGIC),
+        .type = htobe16(NBD_CMD_DISC),
+    };
+
+    if (nbd_state.fd >= 0) {
+        /* the server does not reply to NBD_CMD_DISC */
+        write_full(nbd_state.fd, &req, sizeof(req));
+        close(nbd_state.fd);
+        nbd_state.fd = -1;
+    }
+    free(nbd_state.ptr);
+    nbd_state.ptr = NULL;
+    nbd_state.size = 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Open(const char *uri,
+                           unsigned char **data,
+                           uint32_t *length)
+{
+    uint64_t available;
+    uint32_t used;
+    char *export = NULL;
+    TPM_RESULT rc;
+
+    if (nbd_state.fd >= 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Open: Already open\n");
+        return TPM_FAIL;
+    }
+
+    rc = SWTPM_NVRAM_LinearNBD_Connect(uri, &export);
+    if (rc == 0)
+        rc = SWTPM_NVRAM_LinearNBD_Handshake(export);
+    free(export);
+
+    if (rc == 0 && nbd_state.export_size < sizeof(struct nvram_linear_hdr)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_LinearNBD_Open: Export is too small\n");
+        rc = TPM_FAIL;
+    }
+    available = MIN(nbd_state.export_size, UINT32_MAX);
+
+    /* read the header and then the part that the files are in */
+    if (rc == 0)
+        rc = SWTPM_NVRAM_LinearNBD_ReadUpTo(MIN(available,
+                                                NBD_INITIAL_LENGTH));
+    while (rc == 0) {
+        used = MIN(available,
+                   SWTPM_NVRAM_Linear_UsedLength(nbd_state.ptr,
+                                                 nbd_state.size));
+        if (used <= nbd_state.size)
+            break;
+        rc = SWTPM_NVRAM_LinearNBD_ReadUpTo(used);
+    }
+
+    if (rc == 0) {
+        TPM_DEBUG("SWTPM_NVRAM_LinearNBD_Open: Read %u of %" PRIu64 " bytes of '%s'\n",
+                  nbd_state.size, nbd_state.export_size, uri);
+        *data = nbd_state.ptr;
+        *length = nbd_state.size;
+    } else {
+        SWTPM_NVRAM_LinearNBD_Cleanup();
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Flush(const char *uri SWTPM_ATTR_UNUSED,
+                            uint32_t offset,
+                            uint32_t count)
+{
+    struct timespec start;
+    uint64_t cookie;
+    TPM_RESULT rc;
+
+    if (nbd_state.fd < 0) {
+        logprintf(STDERR_FILENO, "%s: Not connected\n", __func__);
+        return TPM_FAIL;
+    }
+    if ((uint64_t)offset + count > nbd_state.size)
+        count = offset < nbd_state.size ? nbd_state.size - offset : 0;
+
+    metrics_nvram_flush(count);
+
+    cmdstats_start(&start);
+    rc = SWTPM_NVRAM_LinearNBD_Transfer(NBD_CMD_WRITE, offset, count);
+    if (rc == 0 && (nbd_state.flags & NBD_FLAG_SEND_FLUSH)) {
+        rc = SWTPM_NVRAM_LinearNBD_SendRequest(NBD_CMD_FLUSH, 0, 0);
+        if (rc == 0)
+            rc = SWTPM_NVRAM_LinearNBD_RecvReply(&cookie);
+    }
+    if (rc == 0)
+        metrics_sync_record(&start);
+
+    return rc;
+}
+
+/*
+ * An export cannot grow but the part of it that is used can.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Resize(const char *uri SWTPM_ATTR_UNUSED,
+                             unsigned char **data,
+                             uint32_t *new_length,
+                             uint32_t requested_length)
+{
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_LinearNBD_ReadUpTo(MIN(requested_length,
+                                            MIN(nbd_state.export_size,
+                                                UINT32_MAX)));
+    if (rc == 0) {
+        /* the caller finds out if it got less than requested */
+        *data = nbd_state.ptr;
+        *new_length = nbd_state.size;
+    }
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LinearNBD_Lock(const char *uri SWTPM_ATTR_UNUSED,
+                           unsigned int retries SWTPM_ATTR_UNUSED)
+{
+    logprintf(STDERR_FILENO,
+              "SWTPM_NVRAM_LinearNBD_Lock: Locking is not supported by NBD exports\n");
+    return TPM_FAIL;
+}
+
+static void
+SWTPM_NVRAM_LinearNBD_Unlock(void)
+{
+}
+
+struct nvram_linear_store_ops nvram_linear_nbd_ops = {
+    .open = SWTPM_NVRAM_LinearNBD_Open,
+    .lock = SWTPM_NVRAM_LinearNBD_Lock,
+    .unlock = SWTPM_NVRAM_LinearNBD_Unlock,
+    .flush = SWTPM_NVRAM_LinearNBD_Flush,
+    .resize = SWTPM_NVRAM_LinearNBD_Resize,
+    .cleanup = SWTPM_NVRAM_LinearNBD_Cleanup,
+};
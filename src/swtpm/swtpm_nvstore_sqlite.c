@@ -0,0 +1,558 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * swtpm_nvstore_sqlite.c -- SQLite storage backend
+ *
+ * The states of many TPM instances are kept as rows of a single SQLite
+ * database in WAL mode, so that a host with many instances does not need a
+ * directory with state, lock, and backup files for each of them. The URI has
+ * the form sqlite://<path>#<instance-id>.
+ *
+ * An instance is locked with a write lock on the byte of a companion lock
+ * file <path>.lock whose offset is the rowid of the instance in the
+ * 'instances' table. This locks only the instance's rows rather than the
+ * whole database and the lock goes away with the process holding it.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <sqlite3.h>
+
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_nvfilename.h>
+
+#include "compiler_dependencies.h"
+#include "swtpm.h"
+#include "swtpm_debug.h"
+#include "swtpm_nvstore.h"
+#include "logging.h"
+#include "tpmstate.h"
+
+#define SQLITE_DEFAULT_INSTANCE  "default"
+#define SQLITE_BUSY_TIMEOUT_MS   10000
+
+static struct {
+    char *loaded_uri;
+    char *path;          /* path of the database */
+    char *instance;      /* id of the instance within the database */
+    sqlite3 *db;
+    sqlite3_stmt *load_stmt;
+    sqlite3_stmt *store_stmt;
+    sqlite3_stmt *delete_stmt;
+    sqlite3_stmt *check_stmt;
+    bool do_fsync;       /* whether the database is in synchronous=FULL */
+    int lock_fd;
+} state = {
+    .lock_fd = -1,
+};
+
+static const char *sqlite_schema =
+    "CREATE TABLE IF NOT EXISTS instances ("
+        "id INTEGER PRIMARY KEY, "
+        "name TEXT NOT NULL UNIQUE"
+    ");"
+    "CREATE TABLE IF NOT EXISTS states ("
+        "instance TEXT NOT NULL, "
+        "name TEXT NOT NULL, "
+        "data BLOB NOT NULL, "
+        "PRIMARY KEY (instance, name)"
+    ") WITHOUT ROWID;";
+
+/*
+ * Split the URI sqlite://<path>[#<instance-id>] into its path and instance
+ * id; the instance id defaults to 'default'.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_ParseUri_SQLite(const char *uri)
+{
+    const char *path = uri + strlen("sqlite://");
+    const char *hash = strrchr(path, '#');
+
+    if (hash) {
+        state.path = strndup(path, hash - path);
+        state.instance = strdup(hash + 1);
+    } else {
+        state.path = strdup(path);
+        state.instance = strdup(SQLITE_DEFAULT_INSTANCE);
+    }
+    if (!state.path || !state.instance) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_ParseUri_SQLite: Out of memory\n");
+        return TPM_FAIL;
+    }
+    if (state.path[0] == 0 || state.instance[0] == 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_ParseUri_SQLite: The URI must have the form "
+                  "sqlite://<path>#<instance-id>\n");
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Exec_SQLite(const char *sql)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(state.db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Exec_SQLite: '%s' failed: %s\n",
+                  sql, errmsg ? errmsg : sqlite3_errmsg(state.db));
+        sqlite3_free(errmsg);
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Prepare_Stmt_SQLite(sqlite3_stmt **stmt, const char *sql)
+{
+    if (sqlite3_prepare_v2(state.db, sql, -1, stmt, NULL) != SQLITE_OK) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_Stmt_SQLite: Could not prepare '%s': %s\n",
+                  sql, sqlite3_errmsg(state.db));
+        return TPM_FAIL;
+    }
+    return 0;
+}
+
+static void
+SWTPM_NVRAM_Close_SQLite(void)
+{
+    sqlite3_finalize(state.load_stmt);
+    sqlite3_finalize(state.store_stmt);
+    sqlite3_finalize(state.delete_stmt);
+    sqlite3_finalize(state.check_stmt);
+    state.load_stmt = NULL;
+    state.store_stmt = NULL;
+    state.delete_stmt = NULL;
+    state.check_stmt = NULL;
+
+    sqlite3_close(state.db);
+    state.db = NULL;
+}
+
+/*
+ * Open the database, creating it with the requested mode bits if it does not
+ * exist yet, and prepare the statements used by the backend operations.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_Open_SQLite(void)
+{
+    TPM_RESULT rc = 0;
+    bool mode_is_default = false;
+    mode_t mode = tpmstate_get_mode(&mode_is_default);
+    mode_t orig_umask = 0;
+    int fd;
+
+    if (state.db)
+        return 0;
+
+    /* SQLite creates new files with 0644; let a new database get the mode */
+    if (!mode_is_default)
+        orig_umask = umask(0);
+    fd = open(state.path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, mode);
+    if (!mode_is_default)
+        umask(orig_umask);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Open_SQLite: Could not open %s: %s\n",
+                  state.path, strerror(errno));
+        return TPM_FAIL;
+    }
+    close(fd);
+
+    if (sqlite3_open_v2(state.path, &state.db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX,
+                        NULL) != SQLITE_OK) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Open_SQLite: Could not open database %s: %s\n",
+                  state.path,
+                  state.db ? sqlite3_errmsg(state.db) : "Out of memory");
+        rc = TPM_FAIL;
+    }
+
+    if (rc == 0 &&
+        sqlite3_busy_timeout(state.db, SQLITE_BUSY_TIMEOUT_MS) != SQLITE_OK)
+        rc = TPM_FAIL;
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Exec_SQLite("PRAGMA journal_mode=WAL;");
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Exec_SQLite(state.do_fsync
+                                     ? "PRAGMA synchronous=FULL;"
+                                     : "PRAGMA synchronous=NORMAL;");
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Exec_SQLite(sqlite_schema);
+
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Prepare_Stmt_SQLite(&state.load_stmt,
+                 "SELECT data FROM states WHERE instance = ?1 AND name = ?2;");
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Prepare_Stmt_SQLite(&state.store_stmt,
+                 "INSERT INTO states (instance, name, data) "
+                 "VALUES (?1, ?2, ?3) "
+                 "ON CONFLICT (instance, name) DO UPDATE SET data = excluded.data;");
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Prepare_Stmt_SQLite(&state.delete_stmt,
+                 "DELETE FROM states WHERE instance = ?1 AND name = ?2;");
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Prepare_Stmt_SQLite(&state.check_stmt,
+                 "SELECT length(data) FROM states "
+                 "WHERE instance = ?1 AND name = ?2;");
+
+    if (rc)
+        SWTPM_NVRAM_Close_SQLite();
+
+    return rc;
+}
+
+/*
+ * Bind the instance id and the name of the state to a statement. The name
+ * is the one of the file the directory backend would use so that the states
+ * of TPM 1.2 and TPM 2 do not collide.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_Bind_SQLite(sqlite3_stmt *stmt,
+                        uint32_t tpm_number,
+                        const char *name)
+{
+    TPM_RESULT rc;
+    char filename[FILENAME_MAX];
+
+    rc = SWTPM_NVRAM_GetFilenameForName(filename, sizeof(filename),
+                                        tpm_number, name, false);
+    if (rc == 0 &&
+        (sqlite3_bind_text(stmt, 1, state.instance, -1,
+                           SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 2, filename, -1,
+                           SQLITE_TRANSIENT) != SQLITE_OK)) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Bind_SQLite: Could not bind parameters: %s\n",
+                  sqlite3_errmsg(state.db));
+        rc = TPM_FAIL;
+    }
+    return rc;
+}
+
+static void
+SWTPM_NVRAM_Reset_SQLite(sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Prepare_SQLite(const char *uri)
+{
+    TPM_RESULT rc = 0;
+
+    if (tpmstate_get_make_backup()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: The backup option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_page_flush()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: The page-flush option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_max_states()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: The max-states option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_direct_io()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: The direct-io option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (tpmstate_get_batch_fsync()) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: The batch-fsync option is not supported with this storage backend\n");
+        rc = TPM_FAIL;
+    }
+
+    if (rc)
+        return rc;
+
+    if (state.loaded_uri) {
+        if (strcmp(state.loaded_uri, uri) == 0)
+            return 0;
+
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: Cannot prepare twice\n");
+        return TPM_FAIL;
+    }
+
+    state.loaded_uri = strdup(uri);
+    if (!state.loaded_uri) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Prepare_SQLite: Out of memory\n");
+        return TPM_FAIL;
+    }
+    state.do_fsync = tpmstate_get_do_fsync();
+
+    return SWTPM_NVRAM_ParseUri_SQLite(uri);
+}
+
+static void
+SWTPM_NVRAM_Unlock_SQLite(void)
+{
+    if (state.lock_fd >= 0) {
+        close(state.lock_fd);
+        state.lock_fd = -1;
+    }
+}
+
+/*
+ * Get the rowid of the instance, adding the instance to the 'instances'
+ * table if it is not there yet.
+ */
+static TPM_RESULT
+SWTPM_NVRAM_GetInstanceId_SQLite(sqlite3_int64 *id)
+{
+    TPM_RESULT rc = 0;
+    sqlite3_stmt *stmt = NULL;
+
+    rc = SWTPM_NVRAM_Prepare_Stmt_SQLite(&stmt,
+             "INSERT INTO instances (name) VALUES (?1) "
+             "ON CONFLICT (name) DO UPDATE SET name = excluded.name "
+             "RETURNING id;");
+    if (rc == 0 &&
+        sqlite3_bind_text(stmt, 1, state.instance, -1,
+                          SQLITE_STATIC) != SQLITE_OK)
+        rc = TPM_FAIL;
+    if (rc == 0) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            *id = sqlite3_column_int64(stmt, 0);
+        } else {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_GetInstanceId_SQLite: Could not get the id of instance %s: %s\n",
+                      state.instance, sqlite3_errmsg(state.db));
+            rc = TPM_FAIL;
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_Lock_SQLite(const char *uri SWTPM_ATTR_UNUSED,
+                        unsigned int retries)
+{
+    TPM_RESULT rc = 0;
+    sqlite3_int64 id = 0;
+    char *lockfile = NULL;
+
+    if (state.lock_fd >= 0)
+        return 0;
+
+    rc = SWTPM_NVRAM_Open_SQLite();
+    if (rc == 0)
+        rc = SWTPM_NVRAM_GetInstanceId_SQLite(&id);
+    if (rc)
+        return rc;
+
+    if (asprintf(&lockfile, "%s.lock", state.path) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Lock_SQLite: Could not asprintf lock filename\n");
+        return TPM_FAIL;
+    }
+
+    state.lock_fd = open(lockfile, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0660);
+    if (state.lock_fd < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Lock_SQLite: Could not open lockfile: %s\n",
+                  strerror(errno));
+        rc = TPM_FAIL;
+        goto exit;
+    }
+
+    if (SWTPM_NVRAM_LockFile(state.lock_fd, id, 1, retries) < 0) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_Lock_SQLite: Could not lock instance %s: %s\n",
+                  state.instance, strerror(errno));
+        rc = TPM_FAIL;
+        SWTPM_NVRAM_Unlock_SQLite();
+    }
+
+exit:
+    free(lockfile);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_LoadData_SQLite(unsigned char **data,
+                            uint32_t *length,
+                            uint32_t tpm_number,
+                            const char *name,
+                            const char *uri SWTPM_ATTR_UNUSED)
+{
+    TPM_RESULT rc;
+    const void *blob;
+    int n;
+
+    rc = SWTPM_NVRAM_Open_SQLite();
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Bind_SQLite(state.load_stmt, tpm_number, name);
+    if (rc == 0) {
+        switch (sqlite3_step(state.load_stmt)) {
+        case SQLITE_ROW:
+            blob = sqlite3_column_blob(state.load_stmt, 0);
+            n = sqlite3_column_bytes(state.load_stmt, 0);
+            *data = malloc(n > 0 ? n : 1);
+            if (*data == NULL) {
+                logprintf(STDERR_FILENO,
+                          "SWTPM_NVRAM_LoadData_SQLite: Out of memory\n");
+                rc = TPM_FAIL;
+                break;
+            }
+            if (n > 0)
+                memcpy(*data, blob, n);
+            *length = n;
+            break;
+        case SQLITE_DONE:
+            rc = TPM_RETRY;
+            break;
+        default:
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_LoadData_SQLite: Error (fatal) reading %s: %s\n",
+                      name, sqlite3_errmsg(state.db));
+            rc = TPM_FAIL;
+        }
+    }
+    SWTPM_NVRAM_Reset_SQLite(state.load_stmt);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_StoreData_SQLite(unsigned char *filedata,
+                             uint32_t filedata_length,
+                             uint32_t tpm_number,
+                             const char *name,
+                             const char *uri SWTPM_ATTR_UNUSED,
+                             TPM_BOOL do_fsync SWTPM_ATTR_UNUSED)
+{
+    TPM_RESULT rc;
+
+    rc = SWTPM_NVRAM_Open_SQLite();
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Bind_SQLite(state.store_stmt, tpm_number, name);
+    if (rc == 0 &&
+        sqlite3_bind_blob(state.store_stmt, 3, filedata, filedata_length,
+                          SQLITE_STATIC) != SQLITE_OK)
+        rc = TPM_FAIL;
+    /* a single statement is a transaction of its own */
+    if (rc == 0 && sqlite3_step(state.store_stmt) != SQLITE_DONE) {
+        logprintf(STDERR_FILENO,
+                  "SWTPM_NVRAM_StoreData_SQLite: Error (fatal), data write of %u bytes failed: %s\n",
+                  filedata_length, sqlite3_errmsg(state.db));
+        rc = TPM_FAIL;
+    }
+    SWTPM_NVRAM_Reset_SQLite(state.store_stmt);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_DeleteName_SQLite(uint32_t tpm_number,
+                              const char *name,
+                              TPM_BOOL mustExist,
+                              const char *uri SWTPM_ATTR_UNUSED)
+{
+    TPM_RESULT rc;
+
+    TPM_DEBUG(" SWTPM_NVRAM_DeleteName_SQLite: Name %s\n", name);
+
+    rc = SWTPM_NVRAM_Open_SQLite();
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Bind_SQLite(state.delete_stmt, tpm_number, name);
+    if (rc == 0) {
+        if (sqlite3_step(state.delete_stmt) != SQLITE_DONE) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_DeleteName_SQLite: Error, (fatal) delete failed: %s\n",
+                      sqlite3_errmsg(state.db));
+            rc = TPM_FAIL;
+        } else if (mustExist && sqlite3_changes(state.db) == 0) {
+            logprintf(STDERR_FILENO,
+                      "SWTPM_NVRAM_DeleteName_SQLite: Error, (fatal) state %s does not exist\n",
+                      name);
+            rc = TPM_FAIL;
+        }
+    }
+    SWTPM_NVRAM_Reset_SQLite(state.delete_stmt);
+
+    return rc;
+}
+
+static TPM_RESULT
+SWTPM_NVRAM_CheckState_SQLite(const char *uri SWTPM_ATTR_UNUSED,
+                              const char *name,
+                              size_t *blobsize)
+{
+    TPM_RESULT rc;
+
+    /* do not create the database just to find that it has no state */
+    if (!state.db && access(state.path, F_OK) < 0 && errno == ENOENT)
+        return TPM_RETRY;
+
+    rc = SWTPM_NVRAM_Open_SQLite();
+    if (rc == 0)
+        rc = SWTPM_NVRAM_Bind_SQLite(state.check_stmt, 0, name);
+    if (rc == 0) {
+        switch (sqlite3_step(state.check_stmt)) {
+        case SQLITE_ROW:
+            *blobsize = sqlite3_column_int64(state.check_stmt, 0);
+            break;
+        case SQLITE_DONE:
+            rc = TPM_RETRY;
+            break;
+        default:
+            rc = TPM_FAIL;
+        }
+    }
+    SWTPM_NVRAM_Reset_SQLite(state.check_stmt);
+
+    return rc;
+}
+
+static void
+SWTPM_NVRAM_Cleanup_SQLite(void)
+{
+    SWTPM_NVRAM_Close_SQLite();
+    SWTPM_NVRAM_Unlock_SQLite();
+
+    free(state.loaded_uri);
+    free(state.path);
+    free(state.instance);
+    state.loaded_uri = NULL;
+    state.path = NULL;
+    state.instance = NULL;
+}
+
+struct nvram_backend_ops nvram_sqlite_ops = {
+    .prepare = SWTPM_NVRAM_Prepare_SQLite,
+    .lock    = SWTPM_NVRAM_Lock_SQLite,
+    .unlock  = SWTPM_NVRAM_Unlock_SQLite,
+    .load    = SWTPM_NVRAM_LoadData_SQLite,
+    .store   = SWTPM_NVRAM_StoreData_SQLite,
+    .delete  = SWTPM_NVRAM_DeleteName_SQLite,
+    .cleanup = SWTPM_NVRAM_Cleanup_SQLite,
+    .check_state = SWTPM_NVRAM_CheckState_SQLite,
+};
@@ -119,6 +119,73 @@ tlv_data_append(unsigned char **buffer, uint32_t *buffer_len,
     return 0;
 }
 
+/*
+ * tlv_iovec_init: describe a prefix followed by the TLVs in a tlv_data array
+ *                 as iovecs and calculate the total length
+ * @tiov: the tlv_iovec to initialize
+ * @prefix: space reserved for a prefix, such as a header, that may be filled
+ *          in once the total length is known; may be NULL
+ * @prefix_len: the length of the prefix
+ * @td: array of tlv_data; must remain valid while @tiov is used
+ * @td_len: length of td array
+ */
+TPM_RESULT
+tlv_iovec_init(tlv_iovec *tiov,
+               void *prefix, size_t prefix_len,
+               const tlv_data *td, size_t td_len)
+{
+    uint64_t totlen = prefix_len;
+    size_t i;
+
+    if (td_len > TLV_IOVEC_MAX_TLVS) {
+        logprintf(STDERR_FILENO, "%s: Too many TLVs: %zu\n", __func__, td_len);
+        return TPM_FAIL;
+    }
+
+    tiov->iovcnt = 0;
+    if (prefix_len > 0) {
+        tiov->iov[tiov->iovcnt].iov_base = prefix;
+        tiov->iov[tiov->iovcnt++].iov_len = prefix_len;
+    }
+
+    for (i = 0; i < td_len; i++) {
+        tiov->hdrs[i].tag = htobe16(td[i].tlv.tag);
+        tiov->hdrs[i].length = htobe32(td[i].tlv.length);
+
+        tiov->iov[tiov->iovcnt].iov_base = &tiov->hdrs[i];
+        tiov->iov[tiov->iovcnt++].iov_len = sizeof(tiov->hdrs[i]);
+        if (td[i].tlv.length > 0) {
+            tiov->iov[tiov->iovcnt].iov_base = (void *)td[i].u.const_ptr;
+            tiov->iov[tiov->iovcnt++].iov_len = td[i].tlv.length;
+        }
+        totlen += sizeof(tiov->hdrs[i]) + td[i].tlv.length;
+    }
+
+    if (totlen > 0xffffffff) {
+        logprintf(STDERR_FILENO, "%s: Excessive buffer size error.\n", __func__);
+        return TPM_FAIL;
+    }
+    tiov->length = totlen;
+
+    return 0;
+}
+
+/*
+ * tlv_iovec_copy: copy the data described by a tlv_iovec into a buffer
+ * @tiov: the tlv_iovec
+ * @buffer: buffer that must hold at least tiov->length bytes
+ */
+void
+tlv_iovec_copy(const tlv_iovec *tiov, unsigned char *buffer)
+{
+    int i;
+
+    for (i = 0; i < tiov->iovcnt; i++) {
+        memcpy(buffer, tiov->iov[i].iov_base, tiov->iov[i].iov_len);
+        buffer += tiov->iov[i].iov_len;
+    }
+}
+
 /* tlv_data_find_tag: in a byte stream that starts with a tlv_header,
                       find a tlv_header with a given tag
  * @buffer: the buffer to search; must start with a tlv_header
@@ -41,6 +41,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include <libtpms/tpm_types.h>
 
@@ -57,6 +58,8 @@ typedef struct tlv_header {
 #define TAG_ENCRYPTED_MIGRATION_DATA 5
 #define TAG_IVEC_ENCRYPTED_DATA      6
 #define TAG_IVEC_ENCRYPTED_MIGRATION_DATA  7
+#define TAG_COMPRESSED_DATA          8
+#define TAG_GCM_TAG                  9
 
 typedef struct tlv_data {
     struct tlv_header tlv;
@@ -85,6 +88,26 @@ void tlv_data_free(tlv_data *td, size_t td_len);
 TPM_RESULT tlv_data_append(unsigned char **buffer, uint32_t *buffer_len,
                            tlv_data *td, size_t td_len);
 
+/* the maximum number of tlv_data a tlv_iovec can describe */
+#define TLV_IOVEC_MAX_TLVS  3
+
+/*
+ * A prefix, such as a blob header, followed by TLVs described as iovecs
+ * that point to the tlv_data rather than to a copy of them.
+ */
+typedef struct tlv_iovec {
+    tlv_header hdrs[TLV_IOVEC_MAX_TLVS];
+    struct iovec iov[1 + 2 * TLV_IOVEC_MAX_TLVS];
+    int iovcnt;
+    uint32_t length; /* total length of prefix and TLVs */
+} tlv_iovec;
+
+TPM_RESULT tlv_iovec_init(tlv_iovec *tiov,
+                          void *prefix, size_t prefix_len,
+                          const tlv_data *td, size_t td_len);
+
+void tlv_iovec_copy(const tlv_iovec *tiov, unsigned char *buffer);
+
 const unsigned char *tlv_data_find_tag(const unsigned char *buffer,
                                        uint32_t buffer_len,
                                        uint16_t tag, tlv_data *td);
@@ -274,11 +274,78 @@ static int tpmlib_maybe_configure_openssl(TPMLIB_TPMVersion tpmversion)
     return 0;
 }
 
+/*
+ * The JSON object that TPMLIB_GetInfo() returns for each single flag; it is
+ * taken when the TPM starts so that it can be served while the TPM processes
+ * a command on the worker thread.
+ */
+static char *tpmlib_info[8];
+static bool tpmlib_info_valid;
+
+static void tpmlib_free_info(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(tpmlib_info); i++) {
+        free(tpmlib_info[i]);
+        tpmlib_info[i] = NULL;
+    }
+    tpmlib_info_valid = false;
+}
+
+static void tpmlib_snapshot_info(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_LEN(tpmlib_info); i++)
+        tpmlib_info[i] = TPMLIB_GetInfo((uint64_t)1 << i);
+    tpmlib_info_valid = true;
+}
+
+/*
+ * tpmlib_get_info: Get the same JSON as TPMLIB_GetInfo() does; once the TPM
+ *                  was started it is assembled from the snapshot taken then
+ *                  and does not call into libtpms.
+ *
+ * @flags: the TPMLIB_INFO flags
+ */
+char *tpmlib_get_info(uint64_t flags)
+{
+    const char *sep = "";
+    GString *gstr;
+    char *result;
+    size_t i, len;
+
+    if (!tpmlib_info_valid)
+        return TPMLIB_GetInfo(flags);
+
+    gstr = g_string_new("{");
+    for (i = 0; i < ARRAY_LEN(tpmlib_info); i++) {
+        if (!(flags & ((uint64_t)1 << i)) || !tpmlib_info[i])
+            continue;
+        /* each is an object with a single member; strip the braces */
+        len = strlen(tpmlib_info[i]);
+        if (len <= 2)
+            continue;
+        g_string_append(gstr, sep);
+        g_string_append_len(gstr, &tpmlib_info[i][1], len - 2);
+        sep = ",";
+    }
+    g_string_append(gstr, "}");
+
+    result = strdup(gstr->str);
+    g_string_free(gstr, TRUE);
+
+    return result;
+}
+
 TPM_RESULT tpmlib_start(uint32_t flags, TPMLIB_TPMVersion tpmversion,
                         bool lock_nvram, const char *json_profile)
 {
     TPM_RESULT res;
 
+    tpmlib_free_info();
+
     if ((res = tpmlib_choose_tpm_version(tpmversion)) != TPM_SUCCESS)
         return res;
 
@@ -341,6 +408,11 @@ TPM_RESULT tpmlib_start(uint32_t flags, TPMLIB_TPMVersion tpmversion,
         goto error_terminate;
     }
 
+    /* the state of a newly manufactured TPM must be durable as well */
+    SWTPM_NVRAM_Sync();
+
+    tpmlib_snapshot_info();
+
     return TPM_SUCCESS;
 
 error_terminate:
@@ -742,5 +814,6 @@ void tpmlib_maybe_send_tpm2_shutdown(TPMLIB_TPMVersion tpmversion,
             break;
         }
     }
+    SWTPM_NVRAM_Sync();
     free(rbuffer);
 }
@@ -56,6 +56,12 @@ static TPMLIB_TPMVersion g_tpmstate_version = TPMLIB_TPM_VERSION_1_2;
 static bool g_tpmstate_do_locking = true; /* true: due to dir backend being default */
 static bool g_tpmstate_make_backup = false;
 static bool g_tpmstate_do_fsync = false;
+static unsigned int g_tpmstate_write_behind_ms = 0;
+static bool g_tpmstate_page_flush = false;
+static unsigned int g_tpmstate_max_states = 0;
+static bool g_tpmstate_batch_fsync = false;
+static bool g_tpmstate_direct_io = false;
+static bool g_tpmstate_compress = false;
 
 void tpmstate_global_free(void)
 {
@@ -133,6 +139,66 @@ bool tpmstate_get_do_fsync(void)
     return g_tpmstate_do_fsync;
 }
 
+void tpmstate_set_write_behind_ms(unsigned int write_behind_ms)
+{
+    g_tpmstate_write_behind_ms = write_behind_ms;
+}
+
+unsigned int tpmstate_get_write_behind_ms(void)
+{
+    return g_tpmstate_write_behind_ms;
+}
+
+void tpmstate_set_page_flush(bool page_flush)
+{
+    g_tpmstate_page_flush = page_flush;
+}
+
+bool tpmstate_get_page_flush(void)
+{
+    return g_tpmstate_page_flush;
+}
+
+void tpmstate_set_max_states(unsigned int max_states)
+{
+    g_tpmstate_max_states = max_states;
+}
+
+unsigned int tpmstate_get_max_states(void)
+{
+    return g_tpmstate_max_states;
+}
+
+void tpmstate_set_batch_fsync(bool batch_fsync)
+{
+    g_tpmstate_batch_fsync = batch_fsync;
+}
+
+bool tpmstate_get_batch_fsync(void)
+{
+    return g_tpmstate_batch_fsync;
+}
+
+void tpmstate_set_direct_io(bool direct_io)
+{
+    g_tpmstate_direct_io = direct_io;
+}
+
+bool tpmstate_get_direct_io(void)
+{
+    return g_tpmstate_direct_io;
+}
+
+void tpmstate_set_compress(bool compress)
+{
+    g_tpmstate_compress = compress;
+}
+
+bool tpmstate_get_compress(void)
+{
+    return g_tpmstate_compress;
+}
+
 void tpmstate_set_version(TPMLIB_TPMVersion version)
 {
     g_tpmstate_version = version;
@@ -57,6 +57,24 @@ bool tpmstate_get_make_backup(void);
 void tpmstate_set_do_fsync(bool do_fsync);
 bool tpmstate_get_do_fsync(void);
 
+void tpmstate_set_write_behind_ms(unsigned int write_behind_ms);
+unsigned int tpmstate_get_write_behind_ms(void);
+
+void tpmstate_set_page_flush(bool page_flush);
+bool tpmstate_get_page_flush(void);
+
+void tpmstate_set_max_states(unsigned int max_states);
+unsigned int tpmstate_get_max_states(void);
+
+void tpmstate_set_batch_fsync(bool batch_fsync);
+bool tpmstate_get_batch_fsync(void);
+
+void tpmstate_set_direct_io(bool direct_io);
+bool tpmstate_get_direct_io(void);
+
+void tpmstate_set_compress(bool compress);
+bool tpmstate_get_compress(void);
+
 void tpmstate_global_free(void);
 
 void tpmstate_set_version(TPMLIB_TPMVersion version);
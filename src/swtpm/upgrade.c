@@ -0,0 +1,589 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * upgrade.c -- Live upgrade of the swtpm binary
+ *
+ * On CMD_LIVE_UPGRADE the state of the TPM is written into a memfd together
+ * with the bytes of a partially received command and the process is
+ * re-executed with the same arguments. The binary at the path that the
+ * process was started from is executed, so that an updated swtpm or libtpms
+ * installed there is used. The listening sockets, the connected data and
+ * control channel clients, and the log and pcap files keep their file
+ * descriptor numbers and are picked up by the new process instead of being
+ * opened again. The process keeps its PID and the clients only see a short
+ * stall.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "ctrlchannel.h"
+#include "logging.h"
+#include "mainloop.h"
+#include "metrics.h"
+#include "swtpm_io.h"
+#include "swtpm_nvstore.h"
+#include "tpm_ioctl.h"
+#include "tpmlib.h"
+#include "upgrade.h"
+#include "utils.h"
+#include "swtpm_utils.h"
+
+#define UPGRADE_STATE_MAGIC    0x73777570 /* 'swup' */
+#define UPGRADE_STATE_VERSION  1
+
+/*
+ * The record at the beginning of the memfd; it is followed by the state
+ * bundle and the bytes received from the data client that have not been
+ * processed yet. It is only read by a swtpm on the same host.
+ */
+struct upgrade_state {
+    uint32_t magic;
+    uint32_t version;
+    int32_t fds[UPGRADE_FD_NUM];
+    int32_t ctrl_client_fd;
+    int32_t data_client_fd;
+    uint32_t data_client_not_socket;
+    uint32_t locality;
+    uint32_t last_command;
+    uint32_t buffersize;
+    uint32_t pcap_cseq;
+    uint32_t pcap_sseq;
+    uint32_t pcap_cport;
+    uint32_t pcap_tpmport;
+    uint32_t bundle_length;
+    uint32_t pending_length;
+};
+
+static struct {
+    /* the arguments to execute the new process with */
+    char **argv;
+    char *exe;
+    /* why a live upgrade is not possible; NULL if it is */
+    const char *disabled;
+
+    /* the state handed over by the previous process */
+    bool loaded;
+    struct upgrade_state us;
+    unsigned char *bundle;
+    unsigned char *pending;
+} upgrade;
+
+/*
+ * upgrade_init: Remember how the process was started
+ *
+ * @prgname: the name of the program
+ * @argc: the number of arguments following the program name
+ * @argv: the arguments following the program name, starting with the
+ *        interface type
+ */
+void upgrade_init(const char *prgname, int argc, char **argv)
+{
+#if defined __linux__ && defined MFD_CLOEXEC
+    GError *error = NULL;
+    int i;
+
+    upgrade.exe = g_file_read_link("/proc/self/exe", &error);
+    if (!upgrade.exe) {
+        logprintf(STDERR_FILENO,
+                  "Could not determine the path of the executable: %s\n",
+                  error->message);
+        g_error_free(error);
+        return;
+    }
+
+    /* getopt_long() may permute argv */
+    upgrade.argv = g_new0(char *, argc + 2);
+    upgrade.argv[0] = (char *)prgname;
+    for (i = 0; i < argc; i++)
+        upgrade.argv[i + 1] = argv[i];
+#else
+    (void)prgname;
+    (void)argc;
+    (void)argv;
+#endif
+}
+
+/*
+ * upgrade_disable: Disable the live upgrade since the new process could not
+ * be started with the same arguments
+ *
+ * @reason: describes what prevents the live upgrade
+ */
+void upgrade_disable(const char *reason)
+{
+    if (!upgrade.disabled)
+        upgrade.disabled = reason;
+}
+
+/*
+ * upgrade_check: Check whether a live upgrade can be done
+ *
+ * @mlp: the main loop parameters
+ *
+ * Returns TPM_SUCCESS if it can be done, an error code otherwise.
+ */
+TPM_RESULT upgrade_check(const struct mainLoopParams *mlp)
+{
+    if (!upgrade.exe) {
+        logprintf(STDERR_FILENO,
+                  "Live upgrade is not supported.\n");
+        return TPM_FAIL;
+    }
+    if (upgrade.disabled) {
+        logprintf(STDERR_FILENO,
+                  "Live upgrade is not possible with %s.\n",
+                  upgrade.disabled);
+        return TPM_FAIL;
+    }
+    if (mlp->shmring) {
+        logprintf(STDERR_FILENO,
+                  "Live upgrade is not possible with a shared memory data "
+                  "channel.\n");
+        return TPM_FAIL;
+    }
+    /* the new process must be able to take the lock right away */
+    if (!mlp->storage_locked) {
+        logprintf(STDERR_FILENO,
+                  "Live upgrade is not possible while the storage is not "
+                  "locked.\n");
+        return TPM_FAIL;
+    }
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * Set FD_CLOEXEC on all file descriptors except for stdin, stdout, stderr,
+ * and the ones to keep, which have it cleared.
+ */
+static int upgrade_set_cloexec(const int *keep, size_t nkeep)
+{
+    struct dirent *de;
+    int fd, flags;
+    DIR *dir;
+    size_t i;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir) {
+        logprintf(STDERR_FILENO, "Could not open /proc/self/fd: %s\n",
+                  strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        fd = atoi(de->d_name);
+        if (fd <= STDERR_FILENO || fd == dirfd(dir))
+            continue;
+
+        flags = fcntl(fd, F_GETFD);
+        if (flags < 0)
+            continue;
+
+        for (i = 0; i < nkeep && keep[i] != fd; i++)
+            ;
+        if (i < nkeep)
+            flags &= ~FD_CLOEXEC;
+        else
+            flags |= FD_CLOEXEC;
+
+        if (fcntl(fd, F_SETFD, flags) < 0) {
+            logprintf(STDERR_FILENO,
+                      "Could not set the flags of file descriptor %d: %s\n",
+                      fd, strerror(errno));
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+/*
+ * Build the arguments of the new process: the ones of this process with
+ * --live-upgrade inserted after the interface type and the one of a previous
+ * live upgrade removed.
+ */
+static char **upgrade_build_argv(const char *fdopt)
+{
+    char **argv;
+    size_t i, j, n;
+
+    for (n = 0; upgrade.argv[n]; n++)
+        ;
+
+    argv = g_new0(char *, n + 3);
+    argv[0] = upgrade.argv[0];
+    argv[1] = upgrade.argv[1];
+    argv[2] = (char *)"--live-upgrade";
+    argv[3] = (char *)fdopt;
+
+    for (i = 2, j = 4; i < n; i++) {
+        if (!strcmp(upgrade.argv[i], "--live-upgrade")) {
+            i++;
+            continue;
+        }
+        if (!strncmp(upgrade.argv[i], "--live-upgrade=", 15))
+            continue;
+        argv[j++] = upgrade.argv[i];
+    }
+
+    return argv;
+}
+
+/*
+ * upgrade_exec: Hand the TPM over to a new process
+ *
+ * @mlp: the main loop parameters
+ * @connection_fd: the connection to the data client
+ * @command: the command buffer holding bytes received from the data client
+ * @ctrlclntfd: the control channel client that sent CMD_LIVE_UPGRADE
+ *
+ * The TPM must not be processing a command and no response may be pending.
+ * This function only returns if the new process could not be executed, in
+ * which case the error is sent to the control channel client and this
+ * process continues.
+ */
+void upgrade_exec(struct mainLoopParams *mlp,
+                  const TPM_CONNECTION_FD *connection_fd,
+                  const unsigned char *command,
+                  int ctrlclntfd)
+{
+#if defined __linux__ && defined MFD_CLOEXEC
+    struct nvram_statebundle *sbu = NULL;
+    struct upgrade_state us = {
+        .magic = UPGRADE_STATE_MAGIC,
+        .version = UPGRADE_STATE_VERSION,
+        .fds = {
+            [UPGRADE_FD_CTRL] = ctrlchannel_get_fd(mlp->cc),
+            [UPGRADE_FD_SERVER] = SWTPM_IO_GetSocketFD(),
+            [UPGRADE_FD_METRICS] = metrics_get_fd(),
+            [UPGRADE_FD_LOG] = log_get_fd(),
+            [UPGRADE_FD_PCAP] = mlp->ps.fd,
+        },
+        .ctrl_client_fd = ctrlclntfd,
+        .data_client_fd = connection_fd->fd,
+        .data_client_not_socket = connection_fd->not_socket,
+        .last_command = mlp->lastCommand,
+        .pcap_cseq = mlp->ps.cseq,
+        .pcap_sseq = mlp->ps.sseq,
+        .pcap_cport = mlp->ps.cport,
+        .pcap_tpmport = mlp->ps.tpmport,
+    };
+    int keep[UPGRADE_FD_NUM + 4];
+    TPM_MODIFIER_INDICATOR locality;
+    uint32_t minsize, maxsize;
+    char fdopt[20];
+    char **argv = NULL;
+    TPM_RESULT res;
+    size_t i;
+    int fd;
+
+    res = upgrade_check(mlp);
+    if (res != TPM_SUCCESS)
+        goto err_send_resp;
+
+    fd = memfd_create("swtpm-live-upgrade", 0);
+    if (fd < 0) {
+        logprintf(STDERR_FILENO, "Could not create memfd: %s\n",
+                  strerror(errno));
+        res = TPM_FAIL;
+        goto err_send_resp;
+    }
+
+    mainloop_cb_get_locality(&locality, 0);
+    us.locality = locality;
+    us.buffersize = TPMLIB_SetBufferSize(0, &minsize, &maxsize);
+    if (connection_fd->fd >= 0)
+        us.pending_length = connection_fd->rx_len - connection_fd->rx_consumed;
+
+    /* the volatile state is taken from the running TPM */
+    res = SWTPM_NVRAM_Flush();
+    if (res == TPM_SUCCESS)
+        res = SWTPM_NVRAM_OpenStateBundle(&sbu, 0, TRUE, &us.bundle_length);
+    if (res == TPM_SUCCESS)
+        res = SWTPM_NVRAM_WriteStateBundle(sbu, fd, &us, sizeof(us));
+    SWTPM_NVRAM_FreeStateBundle(sbu);
+    if (res == TPM_SUCCESS && us.pending_length > 0 &&
+        write_full(fd, &command[connection_fd->rx_consumed],
+                   us.pending_length) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Could not write to the memfd: %s\n", strerror(errno));
+        res = TPM_IOERROR;
+    }
+    if (res != TPM_SUCCESS)
+        goto err_close;
+
+    keep[0] = fd;
+    keep[1] = ctrlclntfd;
+    keep[2] = connection_fd->fd;
+    keep[3] = mlp->fd;
+    for (i = 0; i < UPGRADE_FD_NUM; i++)
+        keep[4 + i] = us.fds[i];
+
+    if (upgrade_set_cloexec(keep, ARRAY_LEN(keep)) < 0) {
+        res = TPM_FAIL;
+        goto err_close;
+    }
+
+    snprintf(fdopt, sizeof(fdopt), "fd=%d", fd);
+    argv = upgrade_build_argv(fdopt);
+
+    logprintf(STDOUT_FILENO, "Live upgrade: executing %s\n", upgrade.exe);
+
+    /* the new process takes the lock; an OFD lock would conflict with it */
+    mainloop_unlock_nvram(mlp, 0);
+
+    execv(upgrade.exe, argv);
+
+    logprintf(STDERR_FILENO, "Could not execute %s: %s\n",
+              upgrade.exe, strerror(errno));
+    res = TPM_FAIL;
+
+    if (!mainloop_ensure_locked_storage(mlp))
+        logprintf(STDERR_FILENO,
+                  "Could not lock the storage again.\n");
+
+    g_free(argv);
+
+err_close:
+    close(fd);
+
+err_send_resp:
+#else
+    TPM_RESULT res = TPM_FAIL;
+
+    (void)mlp;
+    (void)connection_fd;
+    (void)command;
+#endif
+    res = htobe32(res);
+    if (ctrlclntfd >= 0 && write_full(ctrlclntfd, &res, sizeof(res)) < 0)
+        logprintf(STDERR_FILENO,
+                  "Error: Could not send response: %s\n", strerror(errno));
+}
+
+static int upgrade_read_full(int fd, void *buffer, size_t buflen)
+{
+    size_t offset = 0;
+    ssize_t n;
+
+    while (offset < buflen) {
+        n = read_eintr(fd, (unsigned char *)buffer + offset, buflen - offset);
+        if (n <= 0)
+            return -1;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/*
+ * upgrade_load: Read the state handed over by the previous process
+ *
+ * @fd: the memfd holding the state; it is closed
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int upgrade_load(int fd)
+{
+    struct upgrade_state *us = &upgrade.us;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        logprintf(STDERR_FILENO,
+                  "Bad file descriptor %d for the live upgrade: %s\n",
+                  fd, strerror(errno));
+        goto error;
+    }
+
+    if (upgrade_read_full(fd, us, sizeof(*us)) < 0 ||
+        us->magic != UPGRADE_STATE_MAGIC) {
+        logprintf(STDERR_FILENO,
+                  "The live upgrade state could not be read.\n");
+        goto error;
+    }
+    if (us->version != UPGRADE_STATE_VERSION) {
+        logprintf(STDERR_FILENO,
+                  "Unsupported version %u of the live upgrade state.\n",
+                  us->version);
+        goto error;
+    }
+    if (us->bundle_length > SWTPM_NVRAM_MAX_STATEBUNDLE_SIZE ||
+        (off_t)sizeof(*us) + us->bundle_length + us->pending_length !=
+        st.st_size) {
+        logprintf(STDERR_FILENO,
+                  "The live upgrade state has a bad size.\n");
+        goto error;
+    }
+
+    /* malloc(0) may return NULL */
+    upgrade.bundle = malloc(us->bundle_length ? us->bundle_length : 1);
+    upgrade.pending = malloc(us->pending_length ? us->pending_length : 1);
+    if (!upgrade.bundle || !upgrade.pending) {
+        logprintf(STDERR_FILENO, "Out of memory.\n");
+        goto error;
+    }
+
+    if (upgrade_read_full(fd, upgrade.bundle, us->bundle_length) < 0 ||
+        upgrade_read_full(fd, upgrade.pending, us->pending_length) < 0) {
+        logprintf(STDERR_FILENO,
+                  "The live upgrade state could not be read.\n");
+        goto error;
+    }
+
+    close(fd);
+    upgrade.loaded = true;
+
+    return 0;
+
+error:
+    close(fd);
+    SWTPM_G_FREE(upgrade.bundle);
+    SWTPM_G_FREE(upgrade.pending);
+
+    return -1;
+}
+
+/* whether this process was started by a live upgrade */
+bool upgrade_in_progress(void)
+{
+    return upgrade.loaded;
+}
+
+/*
+ * upgrade_get_fd: Get a file descriptor handed over by the previous process
+ *
+ * @which: the file descriptor to get
+ *
+ * Returns the file descriptor or -1 if there is none.
+ */
+int upgrade_get_fd(enum upgrade_fd which)
+{
+    int fd;
+
+    if (!upgrade.loaded)
+        return -1;
+
+    fd = upgrade.us.fds[which];
+    /* it must not be taken twice */
+    upgrade.us.fds[which] = -1;
+
+    return fd;
+}
+
+/*
+ * upgrade_restore: Start the TPM with the state handed over by the previous
+ * process
+ *
+ * @mlp: the main loop parameters
+ *
+ * Returns TPM_SUCCESS on success, an error code otherwise.
+ */
+TPM_RESULT upgrade_restore(struct mainLoopParams *mlp)
+{
+    struct upgrade_state *us = &upgrade.us;
+    uint32_t minsize, maxsize;
+    TPM_RESULT res;
+
+    /* tpm state dir must be set */
+    SWTPM_NVRAM_Init();
+
+    mlp->storage_locked = false;
+    mlp->locking_retries = 0;
+    if (!mainloop_ensure_locked_storage(mlp) || !mlp->storage_locked) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not lock the storage for the live upgrade.\n");
+        return TPM_FAIL;
+    }
+
+    TPMLIB_SetBufferSize(us->buffersize, &minsize, &maxsize);
+
+    /* the volatile state resumes the TPM without TPM_Startup */
+    res = SWTPM_NVRAM_SetStateBundle(upgrade.bundle, us->bundle_length, 0);
+    SWTPM_G_FREE(upgrade.bundle);
+    if (res == TPM_SUCCESS)
+        res = tpmlib_start(0, mlp->tpmversion, false, NULL);
+    if (res != TPM_SUCCESS) {
+        logprintf(STDERR_FILENO,
+                  "Error: Could not restore the TPM after the live upgrade: "
+                  "0x%x\n", res);
+        return res;
+    }
+
+    mlp->startupType = _TPM_ST_NONE;
+    mlp->lastCommand = us->last_command;
+    /* a profile only applies to a new TPM */
+    SWTPM_G_FREE(mlp->json_profile);
+
+    mlp->ps.cseq = us->pcap_cseq;
+    mlp->ps.sseq = us->pcap_sseq;
+    mlp->ps.cport = us->pcap_cport;
+    mlp->ps.tpmport = us->pcap_tpmport;
+
+    ctrlchannel_set_client_fd(mlp->cc, us->ctrl_client_fd);
+
+    return TPM_SUCCESS;
+}
+
+/*
+ * upgrade_finish: Take over the data client connection and the locality and
+ * report the successful live upgrade to the control channel client
+ *
+ * @connection_fd: the connection to the data client to set up
+ * @command: the command buffer to receive the pending bytes
+ * @max_command_length: the size of the command buffer
+ * @locality: pointer to the global locality variable
+ * @ctrlclntfd: the control channel client that requested the live upgrade
+ */
+void upgrade_finish(TPM_CONNECTION_FD *connection_fd,
+                    unsigned char *command, uint32_t max_command_length,
+                    TPM_MODIFIER_INDICATOR *locality, int ctrlclntfd)
+{
+    struct upgrade_state *us = &upgrade.us;
+    ptm_res res = htobe32(TPM_SUCCESS);
+
+    if (!upgrade.loaded)
+        return;
+
+    *locality = us->locality;
+
+    connection_fd->fd = us->data_client_fd;
+    connection_fd->not_socket = us->data_client_not_socket;
+    if (us->pending_length > max_command_length) {
+        /* a smaller buffer cannot hold the command */
+        logprintf(STDERR_FILENO,
+                  "Dropping the data client since its pending command does "
+                  "not fit into the buffer.\n");
+        SWTPM_IO_Disconnect(connection_fd);
+    } else if (connection_fd->fd >= 0) {
+        memcpy(command, upgrade.pending, us->pending_length);
+        connection_fd->rx_len = us->pending_length;
+        connection_fd->rx_consumed = 0;
+    }
+    SWTPM_G_FREE(upgrade.pending);
+    upgrade.loaded = false;
+
+    logprintf(STDOUT_FILENO, "Live upgrade completed.\n");
+
+    if (ctrlclntfd >= 0 && write_full(ctrlclntfd, &res, sizeof(res)) < 0)
+        logprintf(STDERR_FILENO,
+                  "Error: Could not send response: %s\n", strerror(errno));
+}
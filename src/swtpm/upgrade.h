@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * upgrade.h -- Live upgrade of the swtpm binary
+ */
+
+#ifndef _SWTPM_UPGRADE_H_
+#define _SWTPM_UPGRADE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libtpms/tpm_library.h>
+
+#include "swtpm_io.h"
+
+struct mainLoopParams;
+
+/* the file descriptors that are handed to the new process */
+enum upgrade_fd {
+    UPGRADE_FD_CTRL = 0,      /* listening control channel socket */
+    UPGRADE_FD_SERVER,        /* listening server socket */
+    UPGRADE_FD_METRICS,       /* listening metrics socket */
+    UPGRADE_FD_LOG,           /* log file */
+    UPGRADE_FD_PCAP,          /* pcap file */
+    UPGRADE_FD_NUM
+};
+
+void upgrade_init(const char *prgname, int argc, char **argv);
+void upgrade_disable(const char *reason);
+TPM_RESULT upgrade_check(const struct mainLoopParams *mlp);
+void upgrade_exec(struct mainLoopParams *mlp,
+                  const TPM_CONNECTION_FD *connection_fd,
+                  const unsigned char *command,
+                  int ctrlclntfd);
+
+int upgrade_load(int fd);
+bool upgrade_in_progress(void);
+int upgrade_get_fd(enum upgrade_fd which);
+TPM_RESULT upgrade_restore(struct mainLoopParams *mlp);
+void upgrade_finish(TPM_CONNECTION_FD *connection_fd,
+                    unsigned char *command, uint32_t max_command_length,
+                    TPM_MODIFIER_INDICATOR *locality, int ctrlclntfd);
+
+#endif /* _SWTPM_UPGRADE_H_ */
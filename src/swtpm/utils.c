@@ -60,6 +60,8 @@
 #include "logging.h"
 #include "tpmlib.h"
 #include "swtpm_debug.h"
+#include "cmdstats.h"
+#include "metrics.h"
 
 /* sys/stat.h does not always define ACCESSPERMS */
 #ifndef ACCESSPERMS
@@ -352,27 +354,62 @@ ssize_t writev_full(int fd, const struct iovec *iov, int iovcnt)
 }
 
 /*
- * fsync_eintr: fsync and handle EINTR
+ * sync_eintr: fsync or fdatasync and handle EINTR
  *
- * @fd: file descriptor to fsync on
+ * @fd: file descriptor to sync
+ * @datasync: whether only the data and the metadata needed to read them
+ *            have to be synced
  *
  * Returns -1 in case an error occurred, 0 otherwise.
  */
-static int fsync_eintr(int fd)
+static int sync_eintr(int fd, bool datasync)
 {
+    struct timespec start;
     int n;
 
+    cmdstats_start(&start);
     while (true) {
+#if defined(HAVE_FDATASYNC)
+        n = datasync ? fdatasync(fd) : fsync(fd);
+#else
+        (void)datasync;
         n = fsync(fd);
+#endif
         if (n < 0) {
             if (errno == EINTR)
                 continue;
             return -1;
         }
+        metrics_sync_record(&start);
         return n;
     }
 }
 
+/*
+ * fsync_eintr: fsync and handle EINTR
+ *
+ * @fd: file descriptor to fsync on
+ *
+ * Returns -1 in case an error occurred, 0 otherwise.
+ */
+int fsync_eintr(int fd)
+{
+    return sync_eintr(fd, false);
+}
+
+/*
+ * fdatasync_eintr: fdatasync and handle EINTR; falls back to fsync where
+ *                  fdatasync is not available
+ *
+ * @fd: file descriptor to fdatasync on
+ *
+ * Returns -1 in case an error occurred, 0 otherwise.
+ */
+int fdatasync_eintr(int fd)
+{
+    return sync_eintr(fd, true);
+}
+
 /*
  * fsync_on_dir: Call fsync() on a directory
  *
@@ -398,6 +435,58 @@ static int fsync_on_dir(const char *fsync_dir)
     return res;
 }
 
+/*
+ * writev_file: Write all bytes of an iovec into a file and handle partial
+ *              writes on the way. Unlike writev_full the data are not
+ *              gathered into a single buffer, so this must not be used on
+ *              devices that expect a message in a single write().
+ * @fd: file descriptor to write to
+ * @iov: pointer to iov
+ * @iovcnt: length of iov array
+ *
+ * Returns -1 in case not all bytes could be transferred, number of
+ * bytes written otherwise.
+ */
+ssize_t writev_file(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t written = 0;
+    ssize_t n;
+    size_t left;
+    int i = 0;
+
+    while (true) {
+        /* skip the iovecs that were written completely */
+        while (i < iovcnt && iov[i].iov_len == 0)
+            i++;
+        if (i == iovcnt)
+            return written;
+
+        n = writev(fd, &iov[i], iovcnt - i);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += n;
+
+        while ((size_t)n >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            if (++i == iovcnt)
+                return written;
+        }
+        if (n > 0) {
+            /* finish a partially written iovec */
+            left = iov[i].iov_len - n;
+            if (write_full(fd, (const char *)iov[i].iov_base + n, left) < 0)
+                return -1;
+            written += left;
+            i++;
+        }
+    }
+}
+
 /*
  * file_write: Write a buffer to a file.
  *
@@ -415,10 +504,41 @@ static int fsync_on_dir(const char *fsync_dir)
 ssize_t file_write(const char *filename, int flags, mode_t mode,
                    bool clear_umask, const void *buffer, size_t buflen,
                    bool do_fsync, const char *fsync_dir)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buffer,
+        .iov_len = buflen,
+    };
+
+    return file_writev(filename, flags, mode, clear_umask, &iov, 1,
+                       do_fsync, fsync_dir);
+}
+
+/*
+ * file_writev: Write the data described by an iovec to a file.
+ *
+ * @filename: filename
+ * @flags: file open flags
+ * @mode: file mode bits
+ * @clear_umask: whether to clear the umask and restore it after
+ * @iov: pointer to iov
+ * @iovcnt: length of iov array
+ * @do_fsync: whether to call fsync on the file and directory
+ * @fsync_dir: the directory to call fsync on; may be NULL
+ *
+ * Returns -1 in case an error occurred, number of bytes written otherwise.
+ */
+ssize_t file_writev(const char *filename, int flags, mode_t mode,
+                    bool clear_umask, const struct iovec *iov, int iovcnt,
+                    bool do_fsync, const char *fsync_dir)
 {
     mode_t orig_umask = 0;
+    size_t buflen = 0;
     ssize_t res;
-    int fd;
+    int fd, i;
+
+    for (i = 0; i < iovcnt; i++)
+        buflen += iov[i].iov_len;
 
     if (clear_umask)
         orig_umask = umask(0);
@@ -432,7 +552,7 @@ ssize_t file_write(const char *filename, int flags, mode_t mode,
         return -1;
 
     res = buflen;
-    if (write_full(fd, buffer, buflen) != res)
+    if (writev_file(fd, iov, iovcnt) != res)
         res = -1;
 
     if (do_fsync && fsync_eintr(fd) < 0)
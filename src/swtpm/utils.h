@@ -72,9 +72,16 @@ char *fd_to_filename(int fd);
 
 ssize_t write_full(int fd, const void *buffer, size_t buflen);
 ssize_t writev_full(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev_file(int fd, const struct iovec *iov, int iovcnt);
+int fsync_eintr(int fd);
+int fdatasync_eintr(int fd);
+
 ssize_t file_write(const char *filename, int flags, mode_t mode,
                    bool clear_umask, const void *buffer, size_t buflen,
                    bool do_fsync, const char *fsync_dir);
+ssize_t file_writev(const char *filename, int flags, mode_t mode,
+                    bool clear_umask, const struct iovec *iov, int iovcnt,
+                    bool do_fsync, const char *fsync_dir);
 
 ssize_t read_eintr(int fd, void *buffer, size_t buflen);
 ssize_t file_read(const char *filename, void **buffer,
@@ -101,14 +101,17 @@ static unsigned long ioctl_to_cmd(unsigned long ioctlnum)
 }
 
 /*
- * ctrlcmd - send a control command
+ * ctrlcmd_fd - send a control command and pass a file descriptor with it
+ *
+ * A @data_fd of -1 passes no file descriptor. Passing a file descriptor
+ * is only possible over a UnixIO socket.
  *
  * This function returns -1 on on error with errno indicating the error.
  * In case an ioctl is used, it returns 0 on success; otherwise
  * it returns the number of bytes received in the response.
  */
-static int ctrlcmd(int fd, unsigned long cmd, void *msg, size_t msg_len_in,
-                   size_t msg_len_out)
+static int ctrlcmd_fd(int fd, unsigned long cmd, void *msg, size_t msg_len_in,
+                      size_t msg_len_out, int data_fd)
 {
     struct stat statbuf;
     int n;
@@ -132,8 +135,27 @@ static int ctrlcmd(int fd, unsigned long cmd, void *msg, size_t msg_len_in,
                 .iov_len = msg_len_in,
             },
         };
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr mh = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg;
 
-        n = writev(fd, iov, 2);
+        if (data_fd >= 0) {
+            memset(control, 0, sizeof(control));
+            cmsg = CMSG_FIRSTHDR(&mh);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &data_fd, sizeof(int));
+
+            n = sendmsg(fd, &mh, 0);
+        } else {
+            n = writev(fd, iov, 2);
+        }
         if (n > 0) {
             if (msg_len_out > 0) {
                 struct pollfd fds = {
@@ -156,6 +178,17 @@ static int ctrlcmd(int fd, unsigned long cmd, void *msg, size_t msg_len_in,
     return n;
 }
 
+/*
+ * ctrlcmd - send a control command
+ *
+ * See ctrlcmd_fd for the return value.
+ */
+static int ctrlcmd(int fd, unsigned long cmd, void *msg, size_t msg_len_in,
+                   size_t msg_len_out)
+{
+    return ctrlcmd_fd(fd, cmd, msg, msg_len_in, msg_len_out, -1);
+}
+
 /*
  * Do PTM_HASH_START, PTM_HASH_DATA, PTM_HASH_END on the
  * data.
@@ -660,6 +693,203 @@ static int do_load_state_blob(int fd, bool is_chardev, const char *blobtype,
     return 0;
 }
 
+/*
+ * do_save_state_bundle: Get all state blobs of the TPM as one bundle and
+ *                       store it into the given file
+ * @fd: file descriptor to talk to the TPM
+ * @is_chardev: whether @fd is a character device using ioctl
+ * @pass_fd: whether to pass the file to the TPM to write the bundle into
+ * @filename: name of the file to store the bundle into
+ */
+static int do_save_state_bundle(int fd, bool is_chardev, bool pass_fd,
+                                const char *filename)
+{
+    const size_t hdr_len = offsetof(ptm_getstate_bundle, u.resp.data);
+    ptm_getstate_bundle pgsb;
+    uint32_t length, recvd;
+    ssize_t numbytes;
+    int file_fd, n;
+    ptm_res res;
+    int ret = 1;
+
+    if (is_chardev) {
+        fprintf(stderr,
+                "State bundles are not supported by the CUSE TPM.\n");
+        return 1;
+    }
+
+    file_fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (file_fd < 0) {
+        fprintf(stderr,
+                "Could not open file '%s' for writing: %s\n",
+                filename, strerror(errno));
+        return 1;
+    }
+
+    memset(&pgsb, 0, sizeof(pgsb));
+    pgsb.u.req.state_flags = htobe32(PTM_STATE_FLAG_DECRYPTED);
+
+    n = ctrlcmd_fd(fd, PTM_GET_STATE_BUNDLE, &pgsb, sizeof(pgsb.u.req),
+                   sizeof(pgsb.u.resp), pass_fd ? file_fd : -1);
+    if (n < 0) {
+        fprintf(stderr,
+                "Could not execute PTM_GET_STATE_BUNDLE: %s\n",
+                strerror(errno));
+        goto exit;
+    }
+    if ((size_t)n < sizeof(pgsb.u.resp.tpm_result)) {
+        fprintf(stderr, "Too few bytes in response\n");
+        goto exit;
+    }
+    res = be32toh(pgsb.u.resp.tpm_result);
+    if (res != 0) {
+        fprintf(stderr,
+                "TPM result from PTM_GET_STATE_BUNDLE: 0x%x\n", res);
+        goto exit;
+    }
+    if ((size_t)n < hdr_len) {
+        fprintf(stderr, "Too few bytes in response\n");
+        goto exit;
+    }
+
+    /* the bundle follows unless the TPM wrote it into the file */
+    length = be32toh(pgsb.u.resp.length);
+    recvd = n - hdr_len;
+
+    while (true) {
+        if (recvd > length) {
+            fprintf(stderr, "Too many bytes in response\n");
+            goto exit;
+        }
+        numbytes = write(file_fd, pgsb.u.resp.data, n - hdr_len);
+        if (numbytes < 0 || (size_t)numbytes != n - hdr_len) {
+            fprintf(stderr,
+                    "Could not write to file '%s': %s\n",
+                    filename, strerror(errno));
+            goto exit;
+        }
+        if (recvd == length)
+            break;
+
+        n = read(fd, pgsb.u.resp.data,
+                 MIN(sizeof(pgsb.u.resp.data), length - recvd));
+        if (n <= 0) {
+            fprintf(stderr,
+                    "Could not read from TPM: %s\n",
+                    n < 0 ? strerror(errno) : "connection closed");
+            goto exit;
+        }
+        recvd += n;
+        n += hdr_len;
+    }
+
+    ret = 0;
+
+exit:
+    close(file_fd);
+
+    return ret;
+}
+
+/*
+ * do_load_state_bundle: Load a bundle of TPM state blobs from a file and set
+ *                       them in the TPM
+ * @fd: file descriptor to talk to the TPM
+ * @is_chardev: whether @fd is a character device using ioctl
+ * @pass_fd: whether to pass the file to the TPM to read the bundle from
+ * @filename: name of the file to read the bundle from
+ */
+static int do_load_state_bundle(int fd, bool is_chardev, bool pass_fd,
+                                const char *filename)
+{
+    const size_t hdr_len = offsetof(ptm_setstate_bundle, u.req.data);
+    ptm_setstate_bundle pssb;
+    struct stat statbuf;
+    off_t remain;
+    ssize_t numbytes;
+    int file_fd, n;
+    ptm_res res;
+    int ret = 1;
+
+    if (is_chardev) {
+        fprintf(stderr,
+                "State bundles are not supported by the CUSE TPM.\n");
+        return 1;
+    }
+
+    file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr,
+                "Could not open file '%s' for reading: %s\n",
+                filename, strerror(errno));
+        return 1;
+    }
+
+    if (fstat(file_fd, &statbuf) < 0) {
+        fprintf(stderr,
+                "Could not stat file '%s': %s\n",
+                filename, strerror(errno));
+        goto exit;
+    }
+    if (statbuf.st_size > UINT32_MAX) {
+        fprintf(stderr, "File '%s' is too large.\n", filename);
+        goto exit;
+    }
+
+    memset(&pssb, 0, sizeof(pssb));
+    pssb.u.req.length = htobe32(statbuf.st_size);
+
+    if (pass_fd) {
+        n = ctrlcmd_fd(fd, PTM_SET_STATE_BUNDLE, &pssb, hdr_len,
+                       sizeof(pssb.u.resp), file_fd);
+    } else {
+        /* the bundle follows the request */
+        n = ctrlcmd(fd, PTM_SET_STATE_BUNDLE, &pssb, hdr_len, 0);
+
+        for (remain = statbuf.st_size; n >= 0 && remain > 0; ) {
+            numbytes = read(file_fd, pssb.u.req.data,
+                            MIN((off_t)sizeof(pssb.u.req.data), remain));
+            if (numbytes <= 0) {
+                fprintf(stderr,
+                        "Could not read from file '%s': %s\n",
+                        filename,
+                        numbytes < 0 ? strerror(errno) : "file truncated");
+                goto exit;
+            }
+            if (write(fd, pssb.u.req.data, numbytes) != numbytes) {
+                n = -1;
+                break;
+            }
+            remain -= numbytes;
+        }
+        if (n >= 0)
+            n = read(fd, &pssb.u.resp, sizeof(pssb.u.resp));
+    }
+    if (n < 0) {
+        fprintf(stderr,
+                "Could not execute PTM_SET_STATE_BUNDLE: %s\n",
+                strerror(errno));
+        goto exit;
+    }
+    if ((size_t)n < sizeof(pssb.u.resp)) {
+        fprintf(stderr, "Too few bytes in response\n");
+        goto exit;
+    }
+    res = be32toh(pssb.u.resp.tpm_result);
+    if (res != 0) {
+        fprintf(stderr,
+                "TPM result from PTM_SET_STATE_BUNDLE: 0x%x\n", res);
+        goto exit;
+    }
+
+    ret = 0;
+
+exit:
+    close(file_fd);
+
+    return ret;
+}
+
 static int change_fd_flags(int fd, int flags_to_clear, int flags_to_set,
                            int *o_flags) {
     int n;
@@ -905,14 +1135,22 @@ static void usage(const char *prgname)
 "                        type may be one of volatile, permanent, or savestate\n"
 "--load <type> <file>  : load the TPM state blob of given type from a file;\n"
 "                        type may be one of volatile, permanent, or savestate\n"
+"--save-bundle <file>  : store all TPM state blobs taken at the same time in\n"
+"                        a file\n"
+"--load-bundle <file>  : load all TPM state blobs from a file created with\n"
+"                        --save-bundle\n"
 "-g                    : get configuration flags indicating which keys are in\n"
 "                        use\n"
 "-b <buffersize>       : set the buffer size of the TPM and get its current\n"
 "                        size; get minimum and maximum supported sizes\n"
 "--info <flags>        : get TPM implementation specific information;\n"
 "                        flags must be an integer value\n"
+"--stats               : get per-command statistics of the TPM in JSON format\n"
+"--stats-reset         : get per-command statistics and reset them\n"
 "--lock-storage <n>    : lock the storage after it was unlocked; retry\n"
 "                        n times with 10ms delay in between\n"
+"--live-upgrade        : have the TPM re-execute its binary and hand over its\n"
+"                        state and connections to it\n"
 "--version             : display version and exit\n"
 "--help                : display help screen and exit\n"
 "\n"
@@ -953,9 +1191,14 @@ int main(int argc, char *argv[])
         {"b", required_argument, NULL, 'b'},
         {"save", required_argument, NULL, 'S'},
         {"load", required_argument, NULL, 'L'},
+        {"save-bundle", required_argument, NULL, 'B'},
+        {"load-bundle", required_argument, NULL, 'E'},
         {"version", no_argument, NULL, 'V'},
         {"info", required_argument, NULL, 'I'},
+        {"stats", no_argument, NULL, 'x'},
+        {"stats-reset", no_argument, NULL, 'X'},
         {"lock-storage", required_argument, NULL, 'o'},
+        {"live-upgrade", no_argument, NULL, 'u'},
         {"help", no_argument, NULL, 'H'},
         {NULL, 0, NULL, 0},
     };
@@ -969,7 +1212,7 @@ int main(int argc, char *argv[])
     unsigned int tcp_port = 0;
     unsigned int retries;
     bool is_chardev;
-    unsigned long int info_flags = 0;
+    unsigned long long int info_flags = 0;
     char *endptr = NULL;
     int ret = EXIT_FAILURE;
 
@@ -1000,6 +1243,7 @@ int main(int argc, char *argv[])
         case 'v':
         case 'C':
         case 'g':
+        case 'u':
             command = argv[optind - 1];
             break;
         case 'h':
@@ -1043,6 +1287,11 @@ int main(int argc, char *argv[])
             blobfile = argv[optind];
             optind++;
             break;
+        case 'B':
+        case 'E':
+            command = argv[optind - 2];
+            blobfile = argv[optind - 1];
+            break;
         case 'b':
             command = argv[optind - 2];
             if (sscanf(argv[optind - 1], "%u", &tpmbuffersize) != 1) {
@@ -1054,12 +1303,20 @@ int main(int argc, char *argv[])
         case 'I':
             command = argv[optind - 2];
             errno = 0;
-            info_flags = strtoul(argv[optind - 1], &endptr, 0);
+            info_flags = strtoull(argv[optind - 1], &endptr, 0);
             if (errno || endptr[0] != '\0') {
                 fprintf(stderr, "Cannot parse info flags.\n");
                 goto exit;
             }
             break;
+        case 'x':
+            command = argv[optind - 1];
+            info_flags = SWTPM_INFO_CMD_STATS;
+            break;
+        case 'X':
+            command = argv[optind - 1];
+            info_flags = SWTPM_INFO_CMD_STATS | SWTPM_INFO_CMD_STATS_RESET;
+            break;
         case 'o':
             command = argv[optind - 2];
             if (sscanf(argv[optind - 1], "%u", &retries) != 1) {
@@ -1219,6 +1476,21 @@ int main(int argc, char *argv[])
             goto exit;
         }
 
+    } else if (!strcmp(command, "--live-upgrade")) {
+        n = ctrlcmd(fd, PTM_LIVE_UPGRADE, &res, 0, sizeof(res));
+        if (n < 0) {
+            fprintf(stderr,
+                    "Could not execute PTM_LIVE_UPGRADE: "
+                    "%s\n", strerror(errno));
+            goto exit;
+        }
+        if (devtoh32(is_chardev, res) != 0) {
+            fprintf(stderr,
+                    "TPM result from PTM_LIVE_UPGRADE: 0x%x\n",
+                    devtoh32(is_chardev, res));
+            goto exit;
+        }
+
     } else if (!strcmp(command, "-l")) {
         loc.u.req.loc = locality;
         n = ctrlcmd(fd, PTM_SET_LOCALITY, &loc, sizeof(loc.u.req),
@@ -1279,6 +1551,14 @@ int main(int argc, char *argv[])
         if (do_load_state_blob(fd, is_chardev, blobtype, blobfile, buffersize))
             goto exit;
 
+    } else if (!strcmp(command, "--save-bundle")) {
+        if (do_save_state_bundle(fd, is_chardev, unix_path != NULL, blobfile))
+            goto exit;
+
+    } else if (!strcmp(command, "--load-bundle")) {
+        if (do_load_state_bundle(fd, is_chardev, unix_path != NULL, blobfile))
+            goto exit;
+
     } else if (!strcmp(command, "-g")) {
         n = ctrlcmd(fd, PTM_GET_CONFIG, &cfg, 0, sizeof(cfg));
         if (n < 0) {
@@ -1318,7 +1598,9 @@ int main(int argc, char *argv[])
                devtoh32(is_chardev, psbs.u.resp.buffersize),
                devtoh32(is_chardev, psbs.u.resp.minsize),
                devtoh32(is_chardev, psbs.u.resp.maxsize));
-    } else if (!strcmp(command, "--info")) {
+    } else if (!strcmp(command, "--info") ||
+               !strcmp(command, "--stats") ||
+               !strcmp(command, "--stats-reset")) {
         char buffer[sizeof(pgi.u.resp.buffer) + 1];
         uint32_t bytes_read = 0;
         uint32_t len;
@@ -1358,7 +1640,7 @@ int main(int argc, char *argv[])
         printf("\n");
     } else if (!strcmp(command, "--lock-storage")) {
         memset(&pls, 0, sizeof(pls));
-        pls.u.req.retries = htodev32(is_chardev, 0);
+        pls.u.req.retries = htodev32(is_chardev, retries);
 
         n = ctrlcmd(fd, PTM_LOCK_STORAGE, &pls,
                     sizeof(pls.u.req), sizeof(pls.u.resp));
@@ -135,5 +135,8 @@ struct swtpm_backend_ops {
 
 extern struct swtpm_backend_ops swtpm_backend_dir;
 extern struct swtpm_backend_ops swtpm_backend_file;
+#if defined(WITH_SQLITE)
+extern struct swtpm_backend_ops swtpm_backend_sqlite;
+#endif
 
 #endif /* SWTPM_SETUP_SWTPM_H */
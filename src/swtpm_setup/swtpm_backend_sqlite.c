@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * swtpm_backend_sqlite.c: storage backend specific functions for sqlite://
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "swtpm.h"
+#include "swtpm_utils.h"
+
+struct sqlite_state {
+    gchar *path;
+    gchar *instance;
+};
+
+/* Parse a sqlite://<path>#<instance-id> URI into path and instance id. */
+static void *parse_sqlite_state(const gchar* uri) {
+    struct sqlite_state *ret;
+    const gchar *hash;
+
+    if (strncmp(uri, "sqlite://", 9) == 0) {
+        uri += 9;
+    }
+
+    ret = g_malloc(sizeof(struct sqlite_state));
+    hash = strrchr(uri, '#');
+    if (hash) {
+        ret->path = g_strndup(uri, hash - uri);
+        ret->instance = g_strdup(hash + 1);
+    } else {
+        ret->path = g_strdup(uri);
+        ret->instance = g_strdup("default");
+    }
+
+    return (void*)ret;
+}
+
+/* Check user access in 'mode' to the database and to its directory, in which
+ * SQLite creates the WAL files. */
+static int check_access(void *state, int mode, const struct passwd *curr_user) {
+    const gchar *path = ((struct sqlite_state*)state)->path;
+    g_autofree gchar *dir = g_path_get_dirname(path);
+
+    if (access(path, R_OK|W_OK) != 0 && errno != ENOENT) {
+        logerr(gl_LOGFILE, "User %s cannot read/write database %s.\n",
+               curr_user ? curr_user->pw_name : "<unknown>", path);
+        return 1;
+    }
+
+    return check_directory_access(dir, mode, curr_user);
+}
+
+/* Delete the rows of the instance; the database and the rows of all other
+ * instances are kept. */
+static int delete_state(void *state) {
+    const struct sqlite_state *sstate = (struct sqlite_state*)state;
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int ret = 1;
+
+    if (access(sstate->path, F_OK) != 0 && errno == ENOENT)
+        return 0;
+
+    if (sqlite3_open_v2(sstate->path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        logerr(gl_LOGFILE, "Couldn't open database %s: %s\n",
+               sstate->path, db ? sqlite3_errmsg(db) : "Out of memory");
+        goto cleanup;
+    }
+    sqlite3_busy_timeout(db, 10000);
+
+    if (sqlite3_prepare_v2(db, "DELETE FROM states WHERE instance = ?1;",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        /* a database without the table has no state */
+        if (strstr(sqlite3_errmsg(db), "no such table"))
+            ret = 0;
+        else
+            logerr(gl_LOGFILE, "Couldn't prepare clearing of %s: %s\n",
+                   sstate->path, sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    if (sqlite3_bind_text(stmt, 1, sstate->instance, -1, SQLITE_STATIC) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE) {
+        logerr(gl_LOGFILE, "Couldn't clear instance %s in %s: %s\n",
+               sstate->instance, sstate->path, sqlite3_errmsg(db));
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    return ret;
+}
+
+/* Free an instance of sqlite_state. */
+static void free_sqlite_state(void *state) {
+    if (state) {
+        struct sqlite_state *sstate = (struct sqlite_state*)state;
+        g_free(sstate->path);
+        g_free(sstate->instance);
+        g_free(sstate);
+    }
+}
+
+struct swtpm_backend_ops swtpm_backend_sqlite = {
+    .parse_backend = parse_sqlite_state,
+    .check_access = check_access,
+    .delete_state = delete_state,
+    .free_backend = free_sqlite_state,
+};
@@ -1177,7 +1177,9 @@ static void usage(const char *prgname, const char *default_config_file)
         "\n"
         "--tpm-state <dir>: Path where the TPM's state will be written to;\n"
         "                   this is a mandatory argument. Prefix with dir:// to\n"
-        "                   use directory backend, or file:// to use linear file.\n"
+        "                   use directory backend, or file:// to use linear file,\n"
+        "                   or sqlite://<db>#<instance-id> to use a SQLite database\n"
+        "                   if swtpm was built with it.\n"
         "\n"
         "--tpmstate <dir> : This is an alias for --tpm-state <dir>.\n"
         "\n"
@@ -1268,9 +1270,9 @@ static void usage(const char *prgname, const char *default_config_file)
         "--pwdfile-fd <fd>: Like --pwdfile but a file descriptor is given to to read\n"
         "                   the passphrase from.\n"
         "\n"
-        "--cipher <cipher>: The cipher to use; either aes-128-cbc or aes-256-cbc;\n"
-        "                   the default is aes-128-cbc; the same cipher must be\n"
-        "                   used on the swtpm command line\n"
+        "--cipher <cipher>: The cipher to use; either aes-128-cbc, aes-256-cbc, or\n"
+        "                   aes-256-gcm; the default is aes-128-cbc; the same\n"
+        "                   cipher must be used on the swtpm command line\n"
         "\n"
         "--overwrite      : Overwrite existing TPM state by re-initializing it; if this\n"
         "                   option is not given, this program will return an error if\n"
@@ -1839,6 +1841,11 @@ int main(int argc, char *argv[])
             } else if (strncmp(optarg, "file://", 7) == 0) {
                 tpm_state_path = g_strdup(optarg);
                 backend_ops = &swtpm_backend_file;
+#if defined(WITH_SQLITE)
+            } else if (strncmp(optarg, "sqlite://", 9) == 0) {
+                tpm_state_path = g_strdup(optarg);
+                backend_ops = &swtpm_backend_sqlite;
+#endif
             } else {
                 /* always prefix with dir:// so we can pass verbatim to swtpm */
                 tpm_state_path = g_strconcat("dir://", optarg, NULL);
@@ -2268,7 +2275,8 @@ int main(int argc, char *argv[])
     if (cipher != NULL) {
         if (strcmp(cipher, "aes-128-cbc") != 0 &&
             strcmp(cipher, "aes-cbc") != 0 &&
-            strcmp(cipher, "aes-256-cbc") != 0) {
+            strcmp(cipher, "aes-256-cbc") != 0 &&
+            strcmp(cipher, "aes-256-gcm") != 0) {
             logerr(gl_LOGFILE, "Unsupported cipher %s.\n", cipher);
             goto error;
         }
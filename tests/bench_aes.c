@@ -0,0 +1,283 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * bench_aes.c -- compare the throughput of the state encryption modes
+ *
+ * The TPM state is encrypted and authenticated, and then authenticated and
+ * decrypted again, as it is done when storing and loading a state blob:
+ *
+ *  aes-256-cbc: AES-256-CBC with PKCS#7 padding and an HMAC-SHA256 over the
+ *               encrypted data and the IV
+ *  aes-256-gcm: AES-256-GCM, which authenticates while encrypting
+ *
+ * Small blobs are then stored and loaded once with cipher contexts that are
+ * set up from scratch and once with contexts cloned from the ones kept with
+ * the key, to show the per-store cost of setting up the contexts.
+ *
+ * Usage: bench_aes
+ *
+ * Build with 'make -C tests bench_aes'.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "swtpm_aes.h"
+
+#define BENCH_BYTES  (256 * 1024 * 1024)
+#define SETUP_BYTES  4096
+#define SETUP_ITER   100000
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int store_cbc(const TPM_SYMMETRIC_KEY_DATA *key,
+                     const unsigned char *data, uint32_t length,
+                     unsigned char **out, uint32_t *out_length,
+                     const unsigned char *ivec, unsigned char *md)
+{
+    unsigned int md_len = SHA256_DIGEST_LENGTH;
+    unsigned char *buffer;
+
+    if (SWTPM_SymmetricKeyData_Encrypt(out, out_length, data, length, key,
+                                       ivec, key->userKeyLength) != 0)
+        return -1;
+
+    /* the HMAC covers the encrypted data followed by the IV */
+    buffer = malloc(*out_length + key->userKeyLength);
+    if (!buffer)
+        return -1;
+    memcpy(buffer, *out, *out_length);
+    memcpy(&buffer[*out_length], ivec, key->userKeyLength);
+    HMAC(EVP_sha256(), key->userKey, key->userKeyLength,
+         buffer, *out_length + key->userKeyLength, md, &md_len);
+    free(buffer);
+
+    return 0;
+}
+
+static int load_cbc(const TPM_SYMMETRIC_KEY_DATA *key,
+                    const unsigned char *data, uint32_t length,
+                    const unsigned char *ivec, const unsigned char *md)
+{
+    unsigned char md2[SHA256_DIGEST_LENGTH];
+    unsigned int md_len = sizeof(md2);
+    unsigned char *buffer, *plain;
+    uint32_t plain_length;
+    int ret;
+
+    buffer = malloc(length + key->userKeyLength);
+    if (!buffer)
+        return -1;
+    memcpy(buffer, data, length);
+    memcpy(&buffer[length], ivec, key->userKeyLength);
+    HMAC(EVP_sha256(), key->userKey, key->userKeyLength,
+         buffer, length + key->userKeyLength, md2, &md_len);
+    free(buffer);
+    if (CRYPTO_memcmp(md, md2, md_len))
+        return -1;
+
+    ret = SWTPM_SymmetricKeyData_Decrypt(&plain, &plain_length, data, length,
+                                         key, ivec, key->userKeyLength);
+    if (ret == 0)
+        free(plain);
+
+    return ret ? -1 : 0;
+}
+
+static int store_gcm(const TPM_SYMMETRIC_KEY_DATA *key,
+                     const unsigned char *data, uint32_t length,
+                     unsigned char **out, uint32_t *out_length,
+                     const unsigned char *nonce, unsigned char *tag)
+{
+    if (SWTPM_SymmetricKeyData_EncryptGCM(out, out_length, data, length, key,
+                                          nonce, SWTPM_AES_GCM_NONCE_SIZE,
+                                          tag, SWTPM_AES_GCM_TAG_SIZE) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int load_gcm(const TPM_SYMMETRIC_KEY_DATA *key,
+                    const unsigned char *data, uint32_t length,
+                    const unsigned char *nonce, const unsigned char *tag)
+{
+    unsigned char *plain;
+    uint32_t plain_length;
+
+    if (SWTPM_SymmetricKeyData_DecryptGCM(&plain, &plain_length, data, length,
+                                          key, nonce, SWTPM_AES_GCM_NONCE_SIZE,
+                                          tag, SWTPM_AES_GCM_TAG_SIZE) != 0)
+        return -1;
+    free(plain);
+
+    return 0;
+}
+
+/* Store and load a small blob SETUP_ITER times and return the average time
+ * of a store and load in microseconds or a negative value on error */
+static double bench_setup(const TPM_SYMMETRIC_KEY_DATA *key, bool gcm,
+                          const unsigned char *data,
+                          const unsigned char *ivec)
+{
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    unsigned char tag[SWTPM_AES_GCM_TAG_SIZE];
+    unsigned char *enc;
+    uint32_t enc_len;
+    double start;
+    unsigned int j;
+    int ret;
+
+    start = now();
+    for (j = 0; j < SETUP_ITER; j++) {
+        if (gcm)
+            ret = store_gcm(key, data, SETUP_BYTES, &enc, &enc_len, ivec, tag);
+        else
+            ret = store_cbc(key, data, SETUP_BYTES, &enc, &enc_len, ivec, md);
+        if (ret < 0)
+            return -1;
+        if (gcm)
+            ret = load_gcm(key, enc, enc_len, ivec, tag);
+        else
+            ret = load_cbc(key, enc, enc_len, ivec, md);
+        free(enc);
+        if (ret < 0)
+            return -1;
+    }
+
+    return (now() - start) * 1e6 / SETUP_ITER;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 16 * 1024, 256 * 1024, 2 * 1024 * 1024 };
+    TPM_SYMMETRIC_KEY_DATA key = {
+        .userKeyLength = SWTPM_AES256_BLOCK_SIZE,
+    };
+    unsigned char ivec[SWTPM_AES256_BLOCK_SIZE];
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    unsigned char tag[SWTPM_AES_GCM_TAG_SIZE];
+    unsigned char *data, *enc_cbc, *enc_gcm;
+    uint32_t enc_cbc_len, enc_gcm_len;
+    double start, t_store_cbc, t_load_cbc, t_store_gcm, t_load_gcm;
+    double t_new, t_cached;
+    unsigned int i, j, iterations;
+    int gcm;
+
+    memset(key.userKey, 0x11, sizeof(key.userKey));
+    memset(ivec, 0x22, sizeof(ivec));
+
+    printf("%-8s %17s %17s %17s %17s\n", "size",
+           "store cbc+hmac", "store gcm", "load cbc+hmac", "load gcm");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        data = malloc(sizes[i]);
+        if (!data) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        memset(data, 0x33, sizes[i]);
+
+        iterations = BENCH_BYTES / sizes[i];
+
+        /* warm up and get the data to load */
+        if (store_cbc(&key, data, sizes[i], &enc_cbc, &enc_cbc_len,
+                      ivec, md) < 0 ||
+            store_gcm(&key, data, sizes[i], &enc_gcm, &enc_gcm_len,
+                      ivec, tag) < 0)
+            goto err_crypt;
+        free(enc_cbc);
+        free(enc_gcm);
+
+        start = now();
+        for (j = 0; j < iterations; j++) {
+            if (store_cbc(&key, data, sizes[i], &enc_cbc, &enc_cbc_len,
+                          ivec, md) < 0)
+                goto err_crypt;
+            if (j + 1 < iterations)
+                free(enc_cbc);
+        }
+        t_store_cbc = now() - start;
+
+        start = now();
+        for (j = 0; j < iterations; j++)
+            if (load_cbc(&key, enc_cbc, enc_cbc_len, ivec, md) < 0)
+                goto err_crypt;
+        t_load_cbc = now() - start;
+
+        start = now();
+        for (j = 0; j < iterations; j++) {
+            if (store_gcm(&key, data, sizes[i], &enc_gcm, &enc_gcm_len,
+                          ivec, tag) < 0)
+                goto err_crypt;
+            if (j + 1 < iterations)
+                free(enc_gcm);
+        }
+        t_store_gcm = now() - start;
+
+        start = now();
+        for (j = 0; j < iterations; j++)
+            if (load_gcm(&key, enc_gcm, enc_gcm_len, ivec, tag) < 0)
+                goto err_crypt;
+        t_load_gcm = now() - start;
+
+        printf("%-8zu %12.0f MB/s %12.0f MB/s %12.0f MB/s %12.0f MB/s\n",
+               sizes[i],
+               BENCH_BYTES / t_store_cbc / 1e6,
+               BENCH_BYTES / t_store_gcm / 1e6,
+               BENCH_BYTES / t_load_cbc / 1e6,
+               BENCH_BYTES / t_load_gcm / 1e6);
+
+        free(enc_cbc);
+        free(enc_gcm);
+        free(data);
+    }
+
+    data = malloc(SETUP_BYTES);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(data, 0x33, SETUP_BYTES);
+
+    printf("\n%-8s %-8s %12s %12s\n", "size", "mode", "new ctx", "cached ctx");
+
+    for (gcm = 0; gcm <= 1; gcm++) {
+        SWTPM_SymmetricKeyData_FreeCtx(&key);
+        t_new = bench_setup(&key, gcm, data, ivec);
+        SWTPM_SymmetricKeyData_InitCtx(&key);
+        t_cached = bench_setup(&key, gcm, data, ivec);
+        if (t_new < 0 || t_cached < 0)
+            goto err_crypt;
+
+        printf("%-8u %-8s %9.2f us %9.2f us\n", SETUP_BYTES,
+               gcm ? "gcm" : "cbc+hmac", t_new, t_cached);
+    }
+
+    SWTPM_SymmetricKeyData_FreeCtx(&key);
+    free(data);
+
+    return 0;
+
+err_crypt:
+    fprintf(stderr, "Encrypting or decrypting the data failed\n");
+
+    return 1;
+}
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * bench_tlv.c -- compare the ways of serializing a state blob
+ *
+ * An encrypted state blob, that is a header followed by the encrypted data,
+ * the HMAC and the IV, is serialized in two ways and written to a buffer,
+ * as the linear backend does with its memory-mapped file, and to a file, as
+ * the directory backend does:
+ *
+ *  append: tlv_data_append() followed by prepending the header with a
+ *          new allocation and a copy
+ *  iovec:  tlv_iovec_init() followed by a single copy or a writev()
+ *
+ * Usage: bench_tlv [directory for the file]
+ *
+ * Build with 'make -C tests bench_tlv'.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libtpms/tpm_error.h>
+
+#include "tlv.h"
+#include "utils.h"
+
+#define BLOB_HEADER_SIZE  10
+#define BENCH_BYTES       (256 * 1024 * 1024)
+
+enum sink {
+    SINK_BUFFER,
+    SINK_FILE,
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int store_append(tlv_data *td, size_t td_len, unsigned char *target,
+                        int fd, enum sink sink)
+{
+    unsigned char hdr[BLOB_HEADER_SIZE] = { 0, };
+    unsigned char *buffer = NULL, *out;
+    uint32_t buffer_len = 0;
+    int ret = 0;
+
+    if (tlv_data_append(&buffer, &buffer_len, td, td_len) != TPM_SUCCESS)
+        return -1;
+
+    /* the way the header used to be prepended */
+    out = malloc(sizeof(hdr) + buffer_len);
+    if (!out) {
+        free(buffer);
+        return -1;
+    }
+    memcpy(out, hdr, sizeof(hdr));
+    memcpy(&out[sizeof(hdr)], buffer, buffer_len);
+    free(buffer);
+
+    switch (sink) {
+    case SINK_BUFFER:
+        memcpy(target, out, sizeof(hdr) + buffer_len);
+        break;
+    case SINK_FILE:
+        if (lseek(fd, 0, SEEK_SET) < 0 ||
+            write_full(fd, out, sizeof(hdr) + buffer_len) < 0)
+            ret = -1;
+        break;
+    }
+    free(out);
+
+    return ret;
+}
+
+static int store_iovec(tlv_data *td, size_t td_len, unsigned char *target,
+                       int fd, enum sink sink)
+{
+    unsigned char hdr[BLOB_HEADER_SIZE] = { 0, };
+    tlv_iovec tiov;
+
+    if (tlv_iovec_init(&tiov, hdr, sizeof(hdr), td, td_len) != TPM_SUCCESS)
+        return -1;
+
+    switch (sink) {
+    case SINK_BUFFER:
+        tlv_iovec_copy(&tiov, target);
+        break;
+    case SINK_FILE:
+        if (lseek(fd, 0, SEEK_SET) < 0 ||
+            writev_file(fd, tiov.iov, tiov.iovcnt) < 0)
+            return -1;
+        break;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 16 * 1024, 256 * 1024, 2 * 1024 * 1024 };
+    static const char *sink_names[] = { "buffer", "file" };
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    unsigned char hmac[32], ivec[16];
+    unsigned char *data, *target;
+    char filename[FILENAME_MAX];
+    double start, t_append, t_iovec;
+    unsigned int i, j, iterations;
+    enum sink sink;
+    tlv_data td[3];
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s/bench_tlv.XXXXXX", dir);
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create file in %s: %s\n",
+                dir, strerror(errno));
+        return 1;
+    }
+    unlink(filename);
+
+    memset(hmac, 0x11, sizeof(hmac));
+    memset(ivec, 0x22, sizeof(ivec));
+
+    printf("%-8s %-8s %12s %12s\n", "size", "target", "append", "iovec");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        data = malloc(sizes[i]);
+        target = malloc(sizes[i] + 1024);
+        if (!data || !target) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        memset(data, 0x33, sizes[i]);
+
+        td[0] = TLV_DATA_CONST(TAG_ENCRYPTED_DATA, sizes[i], data);
+        td[1] = TLV_DATA_CONST(TAG_HMAC, sizeof(hmac), hmac);
+        td[2] = TLV_DATA_CONST(TAG_IVEC_ENCRYPTED_DATA, sizeof(ivec), ivec);
+
+        iterations = BENCH_BYTES / sizes[i];
+
+        for (sink = SINK_BUFFER; sink <= SINK_FILE; sink++) {
+            /* warm up the page cache and the target buffer */
+            if (store_append(td, 3, target, fd, sink) < 0 ||
+                store_iovec(td, 3, target, fd, sink) < 0)
+                goto err_store;
+
+            start = now();
+            for (j = 0; j < iterations; j++)
+                if (store_append(td, 3, target, fd, sink) < 0)
+                    goto err_store;
+            t_append = now() - start;
+
+            start = now();
+            for (j = 0; j < iterations; j++)
+                if (store_iovec(td, 3, target, fd, sink) < 0)
+                    goto err_store;
+            t_iovec = now() - start;
+
+            printf("%-8zu %-8s %9.2f us %9.2f us\n",
+                   sizes[i], sink_names[sink],
+                   t_append * 1e6 / iterations, t_iovec * 1e6 / iterations);
+        }
+
+        free(data);
+        free(target);
+    }
+
+    close(fd);
+
+    return 0;
+
+err_store:
+    fprintf(stderr, "Storing the blob failed: %s\n", strerror(errno));
+    close(fd);
+
+    return 1;
+}
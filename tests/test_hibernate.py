@@ -0,0 +1,358 @@
+#!/usr/bin/env python3
+
+# Socket activation for the hibernation test: like a systemd socket unit it
+# holds the listening data and control channel sockets of TPMs and starts a
+# TPM once a client connects to one of them while the TPM is not running.
+# Like a systemd service with a file descriptor store it keeps the connected
+# clients that a TPM passes with FDSTORE=1 and starts the TPM once one of them
+# sends a command. The TPMs hibernate when they have been idle; a PCR extended
+# before the hibernation must still hold its value after the TPM resumed, also
+# for clients that stayed connected. The resume latency and the memory that
+# the idle TPMs used are printed.
+#
+# Usage:
+#   test_hibernate.py <swtpm> <directory> <number of TPMs> <idle seconds>
+
+import os
+import select
+import shlex
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+TPM2_CC_PCR_EXTEND = 0x182
+TPM2_CC_PCR_READ = 0x17e
+TPM2_ALG_SHA256 = 0x000b
+TPM2_RS_PW = 0x40000009
+PCR = 23
+CMD_GET_CAPABILITY = 1
+
+
+class Instance:
+    def __init__(self, swtpm, directory, idle):
+        self.swtpm = swtpm
+        self.directory = directory
+        self.idle = idle
+        self.statedir = os.path.join(directory, "state")
+        os.makedirs(self.statedir)
+
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.bind(("127.0.0.1", 0))
+        self.server.listen()
+        self.port = self.server.getsockname()[1]
+
+        self.ctrl = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.ctrl.bind(os.path.join(directory, "ctrl.sock"))
+        self.ctrl.listen()
+
+        self.notify_path = os.path.join(directory, "notify.sock")
+        self.notify = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        self.notify.bind(self.notify_path)
+        self.notify.setblocking(False)
+        # the file descriptor store: name -> file descriptor
+        self.fdstore = {}
+
+        self.proc = None
+        self.returncodes = []
+
+    def _listen_fds(self):
+        return [self.server.fileno(), self.ctrl.fileno()] + \
+            list(self.fdstore.values())
+
+    def _pass_fds(self):
+        # the passed sockets start at file descriptor 3
+        fds = self._listen_fds()
+        for i, fd in enumerate(fds):
+            os.dup2(fd, 100 + i)
+        for i in range(len(fds)):
+            os.dup2(100 + i, 3 + i)
+
+    def receive_notifications(self):
+        while True:
+            try:
+                msg, fds, _, _ = socket.recv_fds(self.notify, 4096, 4)
+            except BlockingIOError:
+                return
+            fields = dict(line.split("=", 1)
+                          for line in msg.decode().splitlines() if "=" in line)
+            name = fields.get("FDNAME", "stored")
+            if fields.get("FDSTORE") == "1" and len(fds) == 1:
+                self.remove_fd(name)
+                self.fdstore[name] = fds.pop()
+            elif fields.get("FDSTOREREMOVE") == "1":
+                self.remove_fd(name)
+            for fd in fds:
+                os.close(fd)
+
+    def remove_fd(self, name):
+        fd = self.fdstore.pop(name, None)
+        if fd is not None:
+            os.close(fd)
+
+    def start(self):
+        cmd = self.swtpm + [
+            "socket", "--tpm2",
+            "--server", "type=tcp,fd=3",
+            "--ctrl", "type=unixio,fd=4",
+            "--tpmstate", "dir=%s" % self.statedir,
+            "--flags", "not-need-init,startup-clear",
+            "--hibernate", "idle=%u" % self.idle,
+            "--log", "file=%s" % os.path.join(self.directory, "swtpm.log"),
+        ] + shlex.split(os.environ.get("SWTPM_TEST_SECCOMP_OPT", ""))
+        # the shell's PID becomes the TPM's PID
+        names = ["data", "ctrl"] + list(self.fdstore)
+        self.proc = subprocess.Popen(
+            ["sh", "-c", 'LISTEN_PID=$$ exec "$0" "$@"'] + cmd,
+            env=dict(os.environ, LISTEN_FDS=str(len(names)),
+                     LISTEN_FDNAMES=":".join(names),
+                     NOTIFY_SOCKET=self.notify_path),
+            pass_fds=range(3, 3 + len(names)), preexec_fn=self._pass_fds)
+
+    def reap(self):
+        if self.proc and self.proc.poll() is not None:
+            self.returncodes.append(self.proc.returncode)
+            self.proc = None
+
+    def stop(self):
+        if self.proc:
+            self.proc.terminate()
+            self.proc.wait()
+            self.proc = None
+
+    def volatile_state_exists(self):
+        return os.path.exists(os.path.join(self.statedir,
+                                           "tpm2-00.volatilestate"))
+
+
+class Activator(threading.Thread):
+    def __init__(self, instances):
+        super().__init__(daemon=True)
+        self.instances = instances
+        self.lock = threading.Lock()
+        self.terminate = False
+
+    def run(self):
+        while not self.terminate:
+            with self.lock:
+                waiting = {}
+                for inst in self.instances:
+                    inst.reap()
+                    # a TPM stored its clients before it terminated
+                    inst.receive_notifications()
+                    if not inst.proc:
+                        waiting[inst.server] = inst
+                        waiting[inst.ctrl] = inst
+                        for fd in inst.fdstore.values():
+                            waiting[fd] = inst
+            ready = select.select(list(waiting), [], [], 0.01)[0]
+            with self.lock:
+                for sock in ready:
+                    inst = waiting[sock]
+                    if not inst.proc:
+                        inst.start()
+
+
+def recv_all(sock, length):
+    buf = b""
+    while len(buf) < length:
+        data = sock.recv(length - len(buf))
+        if not data:
+            raise Exception("Connection closed")
+        buf += data
+    return buf
+
+
+def transfer_on(sock, tag, cc, body):
+    sock.sendall(struct.pack(">HII", tag, 10 + len(body), cc) + body)
+    _, length, res = struct.unpack(">HII", recv_all(sock, 10))
+    resp = recv_all(sock, length - 10)
+    if res != 0:
+        raise Exception("TPM command 0x%x failed: 0x%x" % (cc, res))
+    return resp
+
+
+def transfer(inst, tag, cc, body, sock=None):
+    if sock:
+        return transfer_on(sock, tag, cc, body)
+    with socket.create_connection(("127.0.0.1", inst.port), timeout=10) as sock:
+        return transfer_on(sock, tag, cc, body)
+
+
+def pcr_extend(inst, digest, sock=None):
+    auth = struct.pack(">IHBH", TPM2_RS_PW, 0, 0, 0)
+    body = struct.pack(">II", PCR, len(auth)) + auth + \
+        struct.pack(">IH", 1, TPM2_ALG_SHA256) + digest
+    transfer(inst, 0x8002, TPM2_CC_PCR_EXTEND, body, sock)
+
+
+def pcr_read(inst, sock=None):
+    body = struct.pack(">IHB3s", 1, TPM2_ALG_SHA256, 3, b"\x00\x00\x80")
+    return transfer(inst, 0x8001, TPM2_CC_PCR_READ, body, sock)[-32:]
+
+
+def ctrl_get_capability(sock):
+    sock.sendall(struct.pack(">I", CMD_GET_CAPABILITY))
+    res, _ = struct.unpack(">II", recv_all(sock, 8))
+    return res
+
+
+def timed_pcr_read(inst):
+    start = time.monotonic()
+    digest = pcr_read(inst)
+    return digest, time.monotonic() - start
+
+
+def wait_hibernated(activator, instances, timeout):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        with activator.lock:
+            if all(inst.proc is None and inst.returncodes
+                   for inst in instances):
+                return all(inst.returncodes[-1] == 0 for inst in instances)
+        time.sleep(0.05)
+    return False
+
+
+def memory_kib(instances):
+    total = 0
+    for inst in instances:
+        if not inst.proc:
+            continue
+        try:
+            with open("/proc/%u/smaps_rollup" % inst.proc.pid) as f:
+                key = "Pss:"
+                lines = f.readlines()
+        except OSError:
+            with open("/proc/%u/status" % inst.proc.pid) as f:
+                key = "VmRSS:"
+                lines = f.readlines()
+        for line in lines:
+            if line.startswith(key):
+                total += int(line.split()[1])
+    return total
+
+
+def test_connected(activator, inst, idle):
+    """ The clients stay connected while the TPM hibernates """
+    data = socket.create_connection(("127.0.0.1", inst.port), timeout=10)
+    ctrl = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    ctrl.settimeout(10)
+    ctrl.connect(os.path.join(inst.directory, "ctrl.sock"))
+    try:
+        pcr_extend(inst, b"\x02" * 32, data)
+        digest = pcr_read(inst, data)
+        if ctrl_get_capability(ctrl) != 0:
+            print("Error: CMD_GET_CAPABILITY failed.")
+            return 1
+        restarts = len(inst.returncodes)
+
+        if not wait_hibernated(activator, [inst], idle + 5) or \
+           len(inst.returncodes) != restarts + 1:
+            print("Error: The TPM did not hibernate with connected clients.")
+            return 1
+        with activator.lock:
+            stored = sorted(inst.fdstore)
+        if stored != ["ctrl-client", "data-client"]:
+            print("Error: The TPM stored the clients %s." % stored)
+            return 1
+
+        # the command on the stored connection starts the TPM
+        if pcr_read(inst, data) != digest:
+            print("Error: The TPM did not resume for the connected client.")
+            return 1
+        if ctrl_get_capability(ctrl) != 0:
+            print("Error: The control channel client was not taken over.")
+            return 1
+        with activator.lock:
+            if inst.fdstore:
+                print("Error: The clients were not removed from the store.")
+                return 1
+    finally:
+        data.close()
+        ctrl.close()
+
+    return 0
+
+
+def test(activator, instances, idle):
+    count = len(instances)
+    inst = instances[0]
+
+    # the PCR value is part of the volatile state
+    pcr_extend(inst, b"\x01" * 32)
+    digest = pcr_read(inst)
+    if digest == b"\x00" * 32:
+        print("Error: The PCR was not extended.")
+        return 1
+
+    if not wait_hibernated(activator, [inst], idle + 5):
+        print("Error: The TPM did not hibernate.")
+        return 1
+    if not inst.volatile_state_exists():
+        print("Error: The TPM did not store its volatile state.")
+        return 1
+
+    resumed, resume_latency = timed_pcr_read(inst)
+    _, latency = timed_pcr_read(inst)
+    if resumed != digest:
+        print("Error: The TPM did not resume from its volatile state.")
+        return 1
+    if inst.volatile_state_exists():
+        print("Error: The volatile state should have been removed.")
+        return 1
+    if len(inst.returncodes) != 1 or not inst.proc:
+        print("Error: The TPM should have been restarted once.")
+        return 1
+
+    print("Resume latency: %.1f ms; %.1f ms while running"
+          % (resume_latency * 1e3, latency * 1e3))
+
+    if test_connected(activator, inst, idle):
+        return 1
+
+    # all TPMs are running and idle
+    for inst in instances:
+        pcr_read(inst)
+    running = memory_kib(instances)
+
+    if not wait_hibernated(activator, instances, idle + 10):
+        print("Error: Not all TPMs hibernated.")
+        return 1
+    hibernated = memory_kib(instances)
+
+    latencies = sorted(timed_pcr_read(inst)[1] for inst in instances)
+    print("%u idle TPMs: %u KiB while running, %u KiB after hibernating; "
+          "median resume latency %.1f ms"
+          % (count, running, hibernated, latencies[count // 2] * 1e3))
+
+    return 0
+
+
+def main(argv):
+    if len(argv) != 5:
+        print("Usage: %s <swtpm> <directory> <number of TPMs> <idle seconds>"
+              % argv[0])
+        return 2
+
+    swtpm = shlex.split(argv[1])
+    idle = int(argv[4])
+    instances = [Instance(swtpm, os.path.join(argv[2], "tpm%u" % i), idle)
+                 for i in range(int(argv[3]))]
+    activator = Activator(instances)
+    activator.start()
+    try:
+        return test(activator, instances, idle)
+    finally:
+        activator.terminate = True
+        activator.join()
+        for inst in instances:
+            inst.stop()
+            for name in list(inst.fdstore):
+                inst.remove_fd(name)
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+
+# Live upgrade test: a client keeps extending a PCR over one TCP connection,
+# sending two commands at a time, while the TPM is made to re-execute its
+# binary. The connection must survive, no command may get lost, and the
+# control channel connection that requested the upgrade must get its result
+# from the new process. The longest time a command took is printed.
+#
+# Usage:
+#   test_live_upgrade.py <swtpm> <directory>
+
+import hashlib
+import os
+import shlex
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+TPM2_CC_PCR_EXTEND = 0x182
+TPM2_CC_PCR_READ = 0x17e
+TPM2_ALG_SHA256 = 0x000b
+TPM2_RS_PW = 0x40000009
+PCR = 23
+
+CMD_GET_CAPABILITY = 0x01
+CMD_SHUTDOWN = 0x03
+CMD_LIVE_UPGRADE = 0x18
+PTM_CAP_LIVE_UPGRADE = 1 << 20
+
+NUM_UPGRADES = 3
+
+
+def recv_all(sock, length):
+    buf = b""
+    while len(buf) < length:
+        data = sock.recv(length - len(buf))
+        if not data:
+            raise Exception("Connection closed")
+        buf += data
+    return buf
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+        sock.bind(("127.0.0.1", 0))
+        return sock.getsockname()[1]
+
+
+def pcr_extend_cmd(digest):
+    auth = struct.pack(">IHBH", TPM2_RS_PW, 0, 0, 0)
+    body = struct.pack(">II", PCR, len(auth)) + auth + \
+        struct.pack(">IH", 1, TPM2_ALG_SHA256) + digest
+    return struct.pack(">HII", 0x8002, 10 + len(body),
+                       TPM2_CC_PCR_EXTEND) + body
+
+
+def pcr_read(sock):
+    body = struct.pack(">IHB3s", 1, TPM2_ALG_SHA256, 3, b"\x00\x00\x80")
+    sock.sendall(struct.pack(">HII", 0x8001, 10 + len(body),
+                             TPM2_CC_PCR_READ) + body)
+    _, length, res = struct.unpack(">HII", recv_all(sock, 10))
+    resp = recv_all(sock, length - 10)
+    if res != 0:
+        raise Exception("TPM2_PCR_Read failed: 0x%x" % res)
+    return resp[-32:]
+
+
+def ctrl_cmd(sock, cmd, resp_len=4):
+    sock.sendall(struct.pack(">I", cmd))
+    return recv_all(sock, resp_len)
+
+
+class Client(threading.Thread):
+    """Extends the PCR until stopped and keeps track of its value"""
+
+    def __init__(self, port):
+        super().__init__(daemon=True)
+        self.sock = socket.create_connection(("127.0.0.1", port), timeout=30)
+        self.terminate = False
+        self.pcr = b"\x00" * 32
+        self.count = 0
+        self.max_latency = 0
+        self.error = None
+
+    def run(self):
+        try:
+            while not self.terminate:
+                digests = [hashlib.sha256(b"%u" % (self.count + i)).digest()
+                           for i in range(2)]
+                start = time.monotonic()
+                # the second command may be received along with the first
+                self.sock.sendall(b"".join(pcr_extend_cmd(d)
+                                           for d in digests))
+                for digest in digests:
+                    _, length, res = struct.unpack(">HII",
+                                                   recv_all(self.sock, 10))
+                    recv_all(self.sock, length - 10)
+                    if res != 0:
+                        raise Exception("TPM2_PCR_Extend failed: 0x%x" % res)
+                    self.pcr = hashlib.sha256(self.pcr + digest).digest()
+                    self.count += 1
+                self.max_latency = max(self.max_latency,
+                                       time.monotonic() - start)
+        except Exception as e:
+            self.error = e
+
+
+def wait_for(cond, timeout):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        if cond():
+            return True
+        time.sleep(0.01)
+    return False
+
+
+def test(proc, port, ctrl_path, logfile):
+    if not wait_for(lambda: os.path.exists(ctrl_path), 10):
+        print("Error: The control channel socket was not created.")
+        return 1
+
+    ctrl = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    ctrl.settimeout(30)
+    ctrl.connect(ctrl_path)
+
+    _, caps = struct.unpack(">II", ctrl_cmd(ctrl, CMD_GET_CAPABILITY, 8))
+    if not caps & PTM_CAP_LIVE_UPGRADE:
+        print("Error: The TPM does not support the live upgrade.")
+        return 1
+
+    client = Client(port)
+    client.start()
+
+    for i in range(NUM_UPGRADES):
+        count = client.count
+        if not wait_for(lambda: client.count >= count + 100 or client.error,
+                        10):
+            print("Error: The client does not make progress.")
+            return 1
+
+        start = time.monotonic()
+        res, = struct.unpack(">I", ctrl_cmd(ctrl, CMD_LIVE_UPGRADE))
+        duration = time.monotonic() - start
+        if res != 0:
+            print("Error: The live upgrade failed: 0x%x" % res)
+            return 1
+        if proc.poll() is not None:
+            print("Error: The TPM terminated.")
+            return 1
+        print("Live upgrade %u took %.1f ms" % (i + 1, duration * 1e3))
+
+    count = client.count
+    wait_for(lambda: client.count >= count + 100 or client.error, 10)
+    client.terminate = True
+    client.join()
+    if client.error:
+        print("Error: The client failed: %s" % client.error)
+        return 1
+
+    if pcr_read(client.sock) != client.pcr:
+        print("Error: The PCR does not hold the value of all extensions.")
+        return 1
+
+    # the new process has the control channel connection
+    res, _ = struct.unpack(">II", ctrl_cmd(ctrl, CMD_GET_CAPABILITY, 8))
+    if res != 0:
+        print("Error: The control channel connection was lost: 0x%x" % res)
+        return 1
+
+    with open("/proc/%u/cmdline" % proc.pid, "rb") as f:
+        args = f.read().split(b"\0")
+    if args.count(b"--live-upgrade") != 1:
+        print("Error: Unexpected arguments of the new process: %s" % args)
+        return 1
+
+    with open(logfile) as f:
+        completed = f.read().count("Live upgrade completed.")
+    if completed != NUM_UPGRADES:
+        print("Error: Expected %u completed live upgrades in the log, got %u."
+              % (NUM_UPGRADES, completed))
+        return 1
+
+    print("%u PCR extensions; longest round trip of two commands %.1f ms"
+          % (client.count, client.max_latency * 1e3))
+
+    res, = struct.unpack(">I", ctrl_cmd(ctrl, CMD_SHUTDOWN))
+    if res != 0:
+        print("Error: Could not shut down the TPM: 0x%x" % res)
+        return 1
+    client.sock.close()
+    ctrl.close()
+
+    return 0
+
+
+def main(argv):
+    if len(argv) != 3:
+        print("Usage: %s <swtpm> <directory>" % argv[0])
+        return 2
+
+    swtpm = shlex.split(argv[1])
+    directory = argv[2]
+    statedir = os.path.join(directory, "state")
+    os.makedirs(statedir)
+    ctrl_path = os.path.join(directory, "ctrl.sock")
+    logfile = os.path.join(directory, "swtpm.log")
+    port = free_port()
+
+    cmd = swtpm + [
+        "socket", "--tpm2",
+        "--server", "type=tcp,port=%u" % port,
+        "--ctrl", "type=unixio,path=%s" % ctrl_path,
+        "--tpmstate", "dir=%s" % statedir,
+        "--flags", "not-need-init,startup-clear",
+        "--log", "file=%s,truncate" % logfile,
+    ]
+    # the seccomp profile must allow the binary to be executed
+    caps = subprocess.run(swtpm + ["socket", "--print-capabilities"],
+                          stdout=subprocess.PIPE, check=True).stdout
+    if b'"cmdarg-seccomp"' in caps:
+        cmd += ["--seccomp", "action=none"]
+
+    proc = subprocess.Popen(cmd)
+    try:
+        return test(proc, port, ctrl_path, logfile)
+    finally:
+        try:
+            proc.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+# Test client for the pre-copy of the permanent state blob: it gets the
+# blob with CMD_GET_STATEBLOB_PRECOPY and stages and commits it with
+# CMD_SET_STATEBLOB.
+#
+# Usage:
+#   test_precopy.py get <ctrl path> <generation> <file>
+#       Get the permanent state blob unless the TPM still has the given
+#       generation; print the generation and whether the blob was unchanged
+#       and write the blob to the file otherwise
+#   test_precopy.py stage <ctrl path> <file>
+#       Stage the permanent state blob from the file
+#   test_precopy.py commit <ctrl path>
+#       Set the staged permanent state blob
+
+import socket
+import struct
+import sys
+import time
+
+CMD_SET_STATEBLOB = 0x0d
+CMD_GET_STATEBLOB_PRECOPY = 0x15
+
+PTM_BLOB_TYPE_PERMANENT = 1
+
+PTM_STATE_FLAG_UNCHANGED = 4
+PTM_STATE_FLAG_STAGE = 8
+PTM_STATE_FLAG_COMMIT_STAGED = 16
+
+
+def recv_all(sock, length):
+    buf = b""
+    while len(buf) < length:
+        data = sock.recv(length - len(buf))
+        if not data:
+            raise Exception("Control channel closed")
+        buf += data
+    return buf
+
+
+def connect(path):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(path)
+    return sock
+
+
+def get(path, generation, filename):
+    sock = connect(path)
+    start = time.monotonic()
+    sock.sendall(struct.pack(">IIIQ", CMD_GET_STATEBLOB_PRECOPY,
+                             0, 0, generation))
+    # tpm_result, state_flags, generation, totlength, length
+    res, flags, generation, totlength, _ = \
+        struct.unpack(">IIQII", recv_all(sock, 24))
+    if res != 0:
+        raise Exception("CMD_GET_STATEBLOB_PRECOPY failed: 0x%x" % res)
+    blob = recv_all(sock, totlength)
+    duration = time.monotonic() - start
+    sock.close()
+
+    if flags & PTM_STATE_FLAG_UNCHANGED:
+        if totlength != 0:
+            raise Exception("Got %u bytes for an unchanged state" % totlength)
+        print("generation %u unchanged %.0f us" % (generation, duration * 1e6))
+    else:
+        with open(filename, "wb") as f:
+            f.write(blob)
+        print("generation %u length %u %.0f us"
+              % (generation, totlength, duration * 1e6))
+
+
+def set_state(path, flags, blob):
+    sock = connect(path)
+    sock.sendall(struct.pack(">IIII", CMD_SET_STATEBLOB, flags,
+                             PTM_BLOB_TYPE_PERMANENT, len(blob)) + blob)
+    res = struct.unpack(">I", recv_all(sock, 4))[0]
+    sock.close()
+    return res
+
+
+def main(argv):
+    if len(argv) == 5 and argv[1] == "get":
+        get(argv[2], int(argv[3]), argv[4])
+        return 0
+    if len(argv) == 4 and argv[1] == "stage":
+        with open(argv[3], "rb") as f:
+            res = set_state(argv[2], PTM_STATE_FLAG_STAGE, f.read())
+    elif len(argv) == 3 and argv[1] == "commit":
+        res = set_state(argv[2], PTM_STATE_FLAG_COMMIT_STAGED, b"")
+    else:
+        print("Unknown command")
+        return 2
+    print("result 0x%x" % res)
+    return 0 if res == 0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+
+# Test client for CMD_SET_DATAFD_SHM that compares the round-trip latency
+# of TPM commands sent over the UnixIO data socket with the latency of
+# the same commands sent over the shared memory ring.
+#
+# Environment variables:
+#   CTRL_PATH: path to the UnixIO control channel socket
+#   DATA_PATH: path to the UnixIO data channel socket
+#   ITERATIONS: number of commands to send over each channel; default 2000
+
+import mmap
+import os
+import socket
+import struct
+import sys
+import time
+
+from array import array
+
+CMD_SET_DATAFD_SHM = 0x14
+
+PTM_SHMRING_MAGIC = 0x72696e67
+PTM_SHMRING_VERSION = 1
+
+# struct ptm_shmring_hdr; indices live on separate 64 byte cache lines
+REQ_HEAD = 64
+REQ_TAIL = 128
+RESP_HEAD = 192
+RESP_TAIL = 256
+
+RING_SIZE = 64 * 1024
+REQ_OFFSET = 4096
+RESP_OFFSET = REQ_OFFSET + RING_SIZE
+SHM_SIZE = RESP_OFFSET + RING_SIZE
+
+# TPM2_GetRandom(8)
+GETRANDOM = bytes([0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+                   0x00, 0x00, 0x01, 0x7b, 0x00, 0x08])
+GETRANDOM_RESP_LEN = 10 + 2 + 8
+
+
+def check_response(resp):
+    if len(resp) != GETRANDOM_RESP_LEN:
+        raise Exception("Unexpected response length %d" % len(resp))
+    rc = struct.unpack(">I", resp[6:10])[0]
+    if rc != 0:
+        raise Exception("TPM2_GetRandom failed with rc=0x%x" % rc)
+
+
+class SocketChannel:
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+
+    def transfer(self, cmd):
+        self.sock.sendall(cmd)
+        resp = b""
+        while len(resp) < 10 or len(resp) < struct.unpack(">I", resp[2:6])[0]:
+            buf = self.sock.recv(4096)
+            if not buf:
+                raise Exception("Data socket closed")
+            resp += buf
+        return resp
+
+    def close(self):
+        self.sock.close()
+
+
+class ShmChannel:
+    def __init__(self, ctrl_path):
+        self.memfd = os.memfd_create("swtpm-shmring")
+        os.ftruncate(self.memfd, SHM_SIZE)
+        self.mm = mmap.mmap(self.memfd, SHM_SIZE)
+        struct.pack_into("=6I", self.mm, 0,
+                         PTM_SHMRING_MAGIC, PTM_SHMRING_VERSION,
+                         REQ_OFFSET, RING_SIZE, RESP_OFFSET, RING_SIZE)
+        self.req_evfd = os.eventfd(0)
+        self.resp_evfd = os.eventfd(0)
+
+        ctrl = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        ctrl.connect(ctrl_path)
+        fds = array("i", [self.memfd, self.req_evfd, self.resp_evfd])
+        ctrl.sendmsg([struct.pack(">I", CMD_SET_DATAFD_SHM)],
+                     [(socket.SOL_SOCKET, socket.SCM_RIGHTS, fds)])
+        res = ctrl.recv(4)
+        ctrl.close()
+        if res != b"\x00\x00\x00\x00":
+            raise Exception("CMD_SET_DATAFD_SHM failed: %s" % res.hex())
+
+    def _get(self, offset):
+        return struct.unpack_from("=I", self.mm, offset)[0]
+
+    def _set(self, offset, val):
+        struct.pack_into("=I", self.mm, offset, val & 0xffffffff)
+
+    def _copy_in(self, ring_offset, idx, data):
+        off = idx & (RING_SIZE - 1)
+        first = min(RING_SIZE - off, len(data))
+        self.mm[ring_offset + off:ring_offset + off + first] = data[:first]
+        rest = len(data) - first
+        self.mm[ring_offset:ring_offset + rest] = data[first:]
+
+    def _copy_out(self, ring_offset, idx, length):
+        off = idx & (RING_SIZE - 1)
+        first = min(RING_SIZE - off, length)
+        data = self.mm[ring_offset + off:ring_offset + off + first]
+        return data + self.mm[ring_offset:ring_offset + length - first]
+
+    def transfer(self, cmd):
+        head = self._get(REQ_HEAD)
+        self._copy_in(REQ_OFFSET, head, struct.pack("=I", len(cmd)) + cmd)
+        self._set(REQ_HEAD, head + 4 + len(cmd))
+        os.eventfd_write(self.req_evfd, 1)
+
+        tail = self._get(RESP_TAIL)
+        while self._get(RESP_HEAD) == tail:
+            os.eventfd_read(self.resp_evfd)
+
+        length = struct.unpack("=I", self._copy_out(RESP_OFFSET, tail, 4))[0]
+        resp = self._copy_out(RESP_OFFSET, tail + 4, length)
+        self._set(RESP_TAIL, tail + 4 + length)
+        return resp
+
+    def close(self):
+        self.mm.close()
+        for fd in [self.memfd, self.req_evfd, self.resp_evfd]:
+            os.close(fd)
+
+
+def measure(channel, iterations):
+    lat = []
+    for _ in range(iterations):
+        start = time.perf_counter_ns()
+        resp = channel.transfer(GETRANDOM)
+        lat.append(time.perf_counter_ns() - start)
+        check_response(resp)
+    lat.sort()
+    return (lat[0] / 1000, lat[len(lat) // 2] / 1000,
+            lat[len(lat) * 99 // 100] / 1000)
+
+
+def main():
+    if not hasattr(os, "memfd_create") or not hasattr(os, "eventfd"):
+        print("Python lacks os.memfd_create or os.eventfd")
+        return 77
+
+    ctrl_path = os.getenv("CTRL_PATH")
+    data_path = os.getenv("DATA_PATH")
+    iterations = int(os.getenv("ITERATIONS", "2000"))
+
+    channel = SocketChannel(data_path)
+    sock_lat = measure(channel, iterations)
+    channel.close()
+
+    channel = ShmChannel(ctrl_path)
+    shm_lat = measure(channel, iterations)
+    channel.close()
+
+    print("Round-trip latency of TPM2_GetRandom over %d iterations [us]:"
+          % iterations)
+    print("          min    median     p99")
+    print("unixio %7.1f %9.1f %7.1f" % sock_lat)
+    print("shm    %7.1f %9.1f %7.1f" % shm_lat)
+    return 0
+
+
+if __name__ == "__main__":
+    try:
+        res = main()
+    except Exception as e:
+        print("Error: %s" % e)
+        res = 1
+    sys.exit(res)